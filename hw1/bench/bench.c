@@ -0,0 +1,529 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gentree.h"
+
+/*
+ * Benchmark harness for transplant (make bench).
+ *
+ * For each profile of gentree.h, the tree is generated (or found from an
+ * earlier run) and three pipelines are timed: serialize to an archive
+ * file, deserialize that archive, and serialize piped into deserialize.
+ * Each pipeline is run several times and the fastest run is kept; its
+ * throughput, the peak resident set of its processes and, from one more
+ * run under ptrace, the number of system calls it makes per entry are
+ * reported as tab-separated lines.  Given a baseline written by an
+ * earlier run, each line is compared with it and regressions are flagged.
+ */
+
+#define BENCH_USAGE \
+"USAGE: %s [-t TRANSPLANT] [-w DIR] [-n SCALE] [-r RUNS] [-P PROFILES]\n" \
+"          [-s FLAGS] [-d FLAGS] [-B BASELINE] [-x PERCENT] [-o OUT] [-q]\n" \
+"   -t TRANSPLANT  Binary to measure (default bin/transplant).\n" \
+"   -w DIR         Directory for the trees and archives (default\n" \
+"                  $TMPDIR/transplant_bench); trees are kept between runs.\n" \
+"   -n SCALE       Multiply the size of every tree by SCALE (default 1);\n" \
+"                  -n 50 gives the tiny profile a million files.\n" \
+"   -r RUNS        Runs of each pipeline, the fastest is kept (default 3).\n" \
+"   -P PROFILES    Comma-separated profiles (tiny,huge,deep,wide,sparse).\n" \
+"   -s FLAGS       Extra options for the serializer, e.g. \"-j 4 -z\".\n" \
+"   -d FLAGS       Extra options for the deserializer.\n" \
+"   -B BASELINE    Compare with the results in BASELINE.\n" \
+"   -x PERCENT     Tolerance before a difference is a regression (default 10).\n" \
+"   -o OUT         Write the results to OUT instead of stdout.\n" \
+"   -q             Skip the system call count (no ptrace run).\n"
+
+#define MAX_ARGS 64
+
+/* One process of a pipeline. */
+struct stage {
+    char **argv;
+    int in;    /* descriptor for stdin, or -1 to chain from the previous stage */
+    int out;   /* descriptor for stdout, or -1 to chain into the next stage */
+};
+
+/* What a run of a pipeline cost. */
+struct measure {
+    uint64_t ns;         /* wall-clock time */
+    uint64_t rss_kb;     /* largest peak resident set among the processes */
+    int64_t syscalls;    /* system calls of all the threads, -1 if unknown */
+};
+
+struct result {
+    char profile[32];
+    char pipeline[32];
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t ns;
+    uint64_t rss_kb;
+    int64_t syscalls;
+};
+
+static char *transplant = "bin/transplant";
+static int trace_ok = 1;   /* cleared once ptrace turns out to be unavailable */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Split a string of options on spaces into argv, from index *argc on. */
+static void split_flags(char *flags, char **argv, int *argc) {
+    char *p = flags;
+    while (*p != '\0' && *argc < MAX_ARGS - 1) {
+        while (*p == ' ') {
+            *p++ = '\0';
+        }
+        if (*p == '\0') {
+            break;
+        }
+        argv[(*argc)++] = p;
+        while (*p != '\0' && *p != ' ') {
+            p++;
+        }
+    }
+    argv[*argc] = NULL;
+}
+
+/*
+ * Follow the traced processes of a pipeline until all have exited,
+ * counting their system calls.  Each call stops a thread twice, on entry
+ * and on exit, except exit_group(), which does not return.
+ */
+static int64_t trace_pipeline(uint64_t *rss_kb) {
+    int64_t stops = 0;
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, __WALL, &ru)) != -1) {
+        if (!WIFSTOPPED(status)) {
+            if ((uint64_t)ru.ru_maxrss > *rss_kb) {
+                *rss_kb = ru.ru_maxrss;
+            }
+            continue;
+        }
+        int sig = WSTOPSIG(status);
+        if (sig == (SIGTRAP | 0x80)) {
+            stops++;
+            sig = 0;
+        } else if (sig == SIGTRAP || sig == SIGSTOP) {
+            sig = 0;  // Event stops, and the initial stop of new threads
+        }
+        ptrace(PTRACE_SYSCALL, pid, 0, sig);
+    }
+    return (stops + 1) / 2;
+}
+
+/*
+ * @brief  Run a pipeline of processes and measure it.
+ * @param stages  The processes, connected by pipes where their descriptors
+ * are -1.
+ * @param n  The number of processes.
+ * @param traced  Nonzero to count the system calls under ptrace.
+ * @param m  Receives the measurements.
+ * @return 0 if every process exited with status 0, -1 otherwise.
+ */
+static int run_pipeline(struct stage *stages, int n, int traced, struct measure *m) {
+    pid_t pids[4];
+    int in = -1;
+    int ret = 0;
+
+    m->rss_kb = 0;
+    m->syscalls = -1;
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) {
+        int fds[2] = {-1, -1};
+        if (stages[i].out == -1 && pipe(fds) == -1) {
+            fprintf(stderr, "Error: Failed to create a pipe.\n");
+            return -1;
+        }
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            dup2(stages[i].in != -1 ? stages[i].in : in, STDIN_FILENO);
+            dup2(stages[i].out != -1 ? stages[i].out : fds[1], STDOUT_FILENO);
+            if (fds[0] != -1) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            if (traced) {
+                if (ptrace(PTRACE_TRACEME, 0, 0, 0) == -1) {
+                    _exit(126);
+                }
+                raise(SIGSTOP);
+            }
+            execv(stages[i].argv[0], stages[i].argv);
+            _exit(127);
+        }
+        if (in != -1) {
+            close(in);
+        }
+        if (fds[0] != -1) {
+            close(fds[1]);
+            in = fds[0];
+        }
+    }
+
+    if (traced) {
+        for (int i = 0; i < n; i++) {
+            int status;
+            if (waitpid(pids[i], &status, 0) == -1 || !WIFSTOPPED(status)) {
+                trace_ok = 0;  // The child could not be traced
+                continue;
+            }
+            ptrace(PTRACE_SETOPTIONS, pids[i], 0,
+                   PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL);
+            ptrace(PTRACE_SYSCALL, pids[i], 0, 0);
+        }
+        if (!trace_ok) {
+            for (int i = 0; i < n; i++) {
+                kill(pids[i], SIGKILL);
+            }
+        }
+        m->syscalls = trace_pipeline(&m->rss_kb);
+        m->ns = now_ns() - start;
+        return trace_ok ? 0 : -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        int status;
+        struct rusage ru;
+        if (wait4(pids[i], &status, 0, &ru) == -1 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            ret = -1;
+        }
+        if ((uint64_t)ru.ru_maxrss > m->rss_kb) {
+            m->rss_kb = ru.ru_maxrss;
+        }
+    }
+    m->ns = now_ns() - start;
+    return ret;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/* Remove a tree, if it exists. */
+static void remove_tree(char *dir) {
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/*
+ * Run a pipeline of a profile runs times plus, unless disabled, once more
+ * under ptrace, and keep the fastest run.
+ */
+static int measure_pipeline(char *pipeline, char *src, char *dst, char *archive,
+                            char *sflags, char *dflags, int runs, struct measure *best) {
+    char sbuf[1024], dbuf[1024];
+    char *sargv[MAX_ARGS], *dargv[MAX_ARGS];
+    int sargc = 0, dargc = 0;
+
+    snprintf(sbuf, sizeof(sbuf), "%s", sflags);
+    snprintf(dbuf, sizeof(dbuf), "%s", dflags);
+    sargv[sargc++] = transplant;
+    sargv[sargc++] = "-s";
+    sargv[sargc++] = "-p";
+    sargv[sargc++] = src;
+    split_flags(sbuf, sargv, &sargc);
+    dargv[dargc++] = transplant;
+    dargv[dargc++] = "-d";
+    dargv[dargc++] = "-p";
+    dargv[dargc++] = dst;
+    split_flags(dbuf, dargv, &dargc);
+
+    best->ns = UINT64_MAX;
+    best->rss_kb = 0;
+    best->syscalls = -1;
+    for (int run = 0; run <= runs; run++) {
+        int traced = run == runs;
+        if (traced && !trace_ok) {
+            break;
+        }
+        struct stage stages[2];
+        int n = 0;
+        int afd = -1;
+        int null = open("/dev/null", O_RDWR);
+        if (strcmp(pipeline, "serialize") == 0) {
+            afd = open(archive, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            stages[n++] = (struct stage){sargv, null, afd};
+        } else if (strcmp(pipeline, "deserialize") == 0) {
+            remove_tree(dst);
+            afd = open(archive, O_RDONLY);
+            stages[n++] = (struct stage){dargv, afd, null};
+        } else {
+            remove_tree(dst);
+            stages[n++] = (struct stage){sargv, null, -1};
+            stages[n++] = (struct stage){dargv, -1, null};
+        }
+
+        struct measure m;
+        int ret = (null == -1 || (n == 1 && afd == -1)) ? -1 : run_pipeline(stages, n, traced, &m);
+        if (afd != -1) {
+            close(afd);
+        }
+        if (null != -1) {
+            close(null);
+        }
+        if (ret == -1) {
+            if (traced) {
+                fprintf(stderr, "Warning: System calls cannot be counted here (ptrace failed).\n");
+                break;
+            }
+            fprintf(stderr, "Error: The %s pipeline failed.\n", pipeline);
+            return -1;
+        }
+        if (traced) {
+            best->syscalls = m.syscalls;
+        } else {
+            if (m.ns < best->ns) {
+                best->ns = m.ns;
+            }
+            if (m.rss_kb > best->rss_kb) {
+                best->rss_kb = m.rss_kb;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Print a result line, with its verdict if it was compared with a baseline. */
+static void print_result(FILE *out, struct result *r, char *verdict) {
+    uint64_t ns = r->ns > 0 ? r->ns : 1;
+    fprintf(out, "%s\t%s\t%llu\t%llu\t%llu\t%llu\t%llu\t", r->profile, r->pipeline,
+            (unsigned long long)r->bytes, (unsigned long long)r->entries,
+            (unsigned long long)r->ns, (unsigned long long)(r->bytes * 1000 / ns),
+            (unsigned long long)(r->entries * 1000000000ULL / ns));
+    if (r->syscalls >= 0) {
+        uint64_t per = r->syscalls * 100 / r->entries;
+        fprintf(out, "%llu.%02llu", (unsigned long long)(per / 100), (unsigned long long)(per % 100));
+    } else {
+        fprintf(out, "-");
+    }
+    fprintf(out, "\t%llu\t%s\n", (unsigned long long)r->rss_kb, verdict);
+}
+
+/*
+ * Find the line of a baseline for the same profile, pipeline and tree; its
+ * system calls are returned per entry, in hundredths.  Returns 1 if found,
+ * 0 if not.
+ */
+static int find_baseline(FILE *base, struct result *r, struct result *b) {
+    char line[512];
+    rewind(base);
+    while (fgets(line, sizeof(line), base) != NULL) {
+        char spe[32];
+        unsigned long long bytes, entries, ns, rss, whole, hundredths;
+        if (line[0] == '#' ||
+            sscanf(line, "%31s %31s %llu %llu %llu %*u %*u %31s %llu", b->profile, b->pipeline,
+                   &bytes, &entries, &ns, spe, &rss) != 7) {
+            continue;
+        }
+        if (strcmp(b->profile, r->profile) != 0 || strcmp(b->pipeline, r->pipeline) != 0 ||
+            bytes != r->bytes || entries != r->entries) {
+            continue;
+        }
+        b->bytes = bytes;
+        b->entries = entries;
+        b->ns = ns;
+        b->rss_kb = rss;
+        // Kept in hundredths of a call per entry, as printed
+        b->syscalls = sscanf(spe, "%llu.%2llu", &whole, &hundredths) == 2 ?
+                      (int64_t)(whole * 100 + hundredths) : -1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Whether value exceeds base by more than percent. */
+static int worse(uint64_t value, uint64_t base, int percent) {
+    return value * 100 > base * (100 + percent);
+}
+
+/*
+ * Compare a result with the baseline and describe the regressions, if any,
+ * in verdict.  Returns 1 for a regression, 0 otherwise.
+ */
+static int compare(FILE *base, struct result *r, int percent, char *verdict, size_t size) {
+    struct result b;
+    if (base == NULL) {
+        snprintf(verdict, size, "-");
+        return 0;
+    }
+    if (!find_baseline(base, r, &b)) {
+        snprintf(verdict, size, "new");
+        return 0;
+    }
+    int slower = worse(r->ns, b.ns, percent);
+    int rss = worse(r->rss_kb, b.rss_kb, percent);
+    int sys = r->syscalls >= 0 && b.syscalls >= 0 &&
+              worse(r->syscalls * 100 / r->entries, b.syscalls, percent);
+    if (!slower && !rss && !sys) {
+        snprintf(verdict, size, "ok");
+        return 0;
+    }
+    snprintf(verdict, size, "REGRESSION:%s%s%s", slower ? "time," : "", rss ? "rss," : "",
+             sys ? "syscalls," : "");
+    verdict[strlen(verdict) - 1] = '\0';
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    char *workdir = NULL;
+    char *selected = NULL;
+    char *sflags = "";
+    char *dflags = "";
+    char *baseline = NULL;
+    char *output = NULL;
+    unsigned long scale = 1;
+    int runs = 3;
+    int percent = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:n:r:P:s:d:B:x:o:qh")) != -1) {
+        switch (opt) {
+            case 't': transplant = optarg; break;
+            case 'w': workdir = optarg; break;
+            case 'n': scale = strtoul(optarg, NULL, 10); break;
+            case 'r': runs = atoi(optarg); break;
+            case 'P': selected = optarg; break;
+            case 's': sflags = optarg; break;
+            case 'd': dflags = optarg; break;
+            case 'B': baseline = optarg; break;
+            case 'x': percent = atoi(optarg); break;
+            case 'o': output = optarg; break;
+            case 'q': trace_ok = 0; break;
+            default:
+                fprintf(stderr, BENCH_USAGE, argv[0]);
+                return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (scale < 1 || runs < 1 || percent < 0 || optind != argc) {
+        fprintf(stderr, BENCH_USAGE, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[PATH_MAX];
+    if (realpath(transplant, path) == NULL || access(path, X_OK) == -1) {
+        fprintf(stderr, "Error: Cannot run '%s'.\n", transplant);
+        return EXIT_FAILURE;
+    }
+    transplant = strdup(path);
+
+    char wbuf[PATH_MAX];
+    if (workdir == NULL) {
+        char *tmp = getenv("TMPDIR");
+        snprintf(wbuf, sizeof(wbuf), "%s/transplant_bench", tmp != NULL ? tmp : "/tmp");
+        workdir = wbuf;
+    }
+    if (mkdir(workdir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "Error: Cannot create '%s'.\n", workdir);
+        return EXIT_FAILURE;
+    }
+
+    // The first line identifies the setup; only results of the same setup compare
+    char setup[2560], line[2560];
+    snprintf(setup, sizeof(setup), "# transplant benchmark: scale %lu, serializer flags \"%s\", "
+             "deserializer flags \"%s\"\n", scale, sflags, dflags);
+    FILE *base = NULL;
+    if (baseline != NULL && (base = fopen(baseline, "r")) == NULL) {
+        fprintf(stderr, "Warning: No baseline at '%s'; run 'make bench-baseline' to record one.\n",
+                baseline);
+    } else if (base != NULL && (fgets(line, sizeof(line), base) == NULL || strcmp(line, setup) != 0)) {
+        fprintf(stderr, "Warning: The baseline at '%s' was recorded with another scale or other "
+                "flags; not comparing.\n", baseline);
+        fclose(base);
+        base = NULL;
+    }
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        fprintf(stderr, "Error: Cannot write '%s'.\n", output);
+        return EXIT_FAILURE;
+    }
+
+    fputs(setup, out);
+    fprintf(out, "# profile\tpipeline\tbytes\tentries\tns\tmb_s\tentries_s\t"
+            "syscalls_per_entry\tpeak_rss_kb\tverdict\n");
+
+    int regressions = 0;
+    int failures = 0;
+    for (struct profile *p = gentree_profiles(); p->name != NULL; p++) {
+        if (selected != NULL) {
+            // Look for the name as a whole item of the comma-separated list
+            char *at = strstr(selected, p->name);
+            size_t len = strlen(p->name);
+            while (at != NULL && ((at != selected && *(at - 1) != ',') ||
+                                  (at[len] != '\0' && at[len] != ','))) {
+                at = strstr(at + 1, p->name);
+            }
+            if (at == NULL) {
+                continue;
+            }
+        }
+
+        char src[PATH_MAX], dst[PATH_MAX], archive[PATH_MAX], flags[1024];
+        struct tree_stats stats;
+        if (snprintf(src, sizeof(src), "%s/%s-%lu", workdir, p->name, scale) >= (int)sizeof(src) ||
+            snprintf(dst, sizeof(dst), "%s/%s.out", workdir, p->name) >= (int)sizeof(dst) ||
+            snprintf(archive, sizeof(archive), "%s/%s.bin", workdir, p->name) >= (int)sizeof(archive) ||
+            snprintf(flags, sizeof(flags), "%s %s", p->flags, sflags) >= (int)sizeof(flags)) {
+            fprintf(stderr, "Error: Pathname or options too long.\n");
+            return EXIT_FAILURE;
+        }
+        if (gentree(p, scale, src, &stats) == -1) {
+            failures++;
+            continue;
+        }
+
+        char *pipelines[] = {"serialize", "deserialize", "roundtrip"};
+        for (int i = 0; i < 3; i++) {
+            struct measure m;
+            fprintf(stderr, "Running %s %s\n", p->name, pipelines[i]);
+            if (measure_pipeline(pipelines[i], src, dst, archive, flags, dflags, runs, &m) == -1) {
+                failures++;
+                if (i == 0) {
+                    break;  // No archive to deserialize
+                }
+                continue;
+            }
+            struct result r;
+            snprintf(r.profile, sizeof(r.profile), "%s", p->name);
+            snprintf(r.pipeline, sizeof(r.pipeline), "%s", pipelines[i]);
+            r.bytes = stats.bytes;
+            r.entries = stats.files + stats.dirs;
+            r.ns = m.ns;
+            r.rss_kb = m.rss_kb;
+            r.syscalls = m.syscalls;
+
+            char verdict[64];
+            regressions += compare(base, &r, percent, verdict, sizeof(verdict));
+            print_result(out, &r, verdict);
+            fflush(out);
+        }
+        remove_tree(dst);
+        unlink(archive);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    if (base != NULL) {
+        fclose(base);
+        fprintf(stderr, "%d regression%s against %s (tolerance %d%%)\n", regressions,
+                regressions == 1 ? "" : "s", baseline, percent);
+    }
+    return regressions > 0 || failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gentree.h"
+
+/* Bump when a profile changes, so that cached trees are regenerated. */
+#define GENTREE_VERSION 1
+
+#define BLOCK 4096
+#define MIB (1024 * 1024)
+
+static uint64_t rng_state;
+static char *block;   /* one block of file content */
+
+/* xorshift64*: small, fast and the same everywhere. */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Fill the content block: random bytes, or a short pattern repeated. */
+static void fill_block(void) {
+    if (rng_next() & 1) {
+        for (int i = 0; i < BLOCK; i += 8) {
+            uint64_t r = rng_next();
+            memcpy(block + i, &r, 8);
+        }
+    } else {
+        int period = 16 + rng_next() % 48;
+        for (int i = 0; i < BLOCK; i++) {
+            block[i] = i < period ? 'a' + rng_next() % 26 : block[i - period];
+        }
+    }
+}
+
+/* Write len bytes of generated content at offset in fd. */
+static int write_content(int fd, off_t offset, uint64_t len) {
+    while (len > 0) {
+        size_t n = len < BLOCK ? len : BLOCK;
+        fill_block();
+        if (pwrite(fd, block, n, offset) != (ssize_t)n) {
+            return -1;
+        }
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Create a file of the given size filled with generated content. */
+static int make_file(int dirfd, char *name, uint64_t size, struct tree_stats *stats) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write_content(fd, 0, size) == -1) {
+        fprintf(stderr, "Error: Failed to create file '%s'.\n", name);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    close(fd);
+    stats->files++;
+    stats->bytes += size;
+    return 0;
+}
+
+/* Create a directory and open it. */
+static int make_dir(int dirfd, char *name, struct tree_stats *stats) {
+    if (mkdirat(dirfd, name, 0755) == -1) {
+        fprintf(stderr, "Error: Failed to create directory '%s'.\n", name);
+        return -1;
+    }
+    stats->dirs++;
+    return openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+}
+
+static int gen_tiny(int dirfd, uint64_t scale, struct tree_stats *stats) {
+    char name[32];
+    uint64_t count = 20000 * scale;
+    for (uint64_t d = 0; d * 200 < count; d++) {
+        snprintf(name, sizeof(name), "d%05llu", (unsigned long long)d);
+        int sub = make_dir(dirfd, name, stats);
+        if (sub == -1) {
+            return -1;
+        }
+        for (uint64_t f = d * 200; f < count && f < (d + 1) * 200; f++) {
+            snprintf(name, sizeof(name), "f%07llu", (unsigned long long)f);
+            if (make_file(sub, name, rng_next() % 512, stats) == -1) {
+                close(sub);
+                return -1;
+            }
+        }
+        close(sub);
+    }
+    return 0;
+}
+
+static int gen_huge(int dirfd, uint64_t scale, struct tree_stats *stats) {
+    if (make_file(dirfd, "huge0", 64 * MIB * scale, stats) == -1 ||
+        make_file(dirfd, "huge1", 64 * MIB * scale, stats) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+static int gen_deep(int dirfd, uint64_t scale, struct tree_stats *stats) {
+    char name[32];
+    for (uint64_t c = 0; c < 8 * scale; c++) {
+        snprintf(name, sizeof(name), "c%llu", (unsigned long long)c);
+        int fd = make_dir(dirfd, name, stats);
+        for (int level = 0; fd != -1 && level < 256; level++) {
+            int sub = -1;
+            if (make_file(fd, "a", rng_next() % 2048, stats) == 0 &&
+                make_file(fd, "b", rng_next() % 2048, stats) == 0) {
+                sub = level < 255 ? make_dir(fd, "d", stats) : -2;
+            }
+            close(fd);
+            fd = sub;
+        }
+        if (fd == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int gen_wide(int dirfd, uint64_t scale, struct tree_stats *stats) {
+    char name[32];
+    for (uint64_t f = 0; f < 50000 * scale; f++) {
+        snprintf(name, sizeof(name), "w%08llx", (unsigned long long)rng_next() & 0xFFFFFFFFULL);
+        if (faccessat(dirfd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            f--;  // Name already drawn
+            continue;
+        }
+        if (make_file(dirfd, name, 64, stats) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int gen_sparse(int dirfd, uint64_t scale, struct tree_stats *stats) {
+    char name[32];
+    for (uint64_t f = 0; f < 16 * scale; f++) {
+        snprintf(name, sizeof(name), "s%03llu", (unsigned long long)f);
+        int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "Error: Failed to create file '%s'.\n", name);
+            return -1;
+        }
+        int ret = ftruncate(fd, 64 * MIB);
+        for (off_t at = 0; ret == 0 && at < 64 * MIB; at += 4 * MIB) {
+            ret = write_content(fd, at + (rng_next() % 64) * BLOCK, 64 * 1024);
+        }
+        close(fd);
+        if (ret == -1) {
+            fprintf(stderr, "Error: Failed to write file '%s'.\n", name);
+            return -1;
+        }
+        stats->files++;
+        stats->bytes += 64 * MIB;
+    }
+    return 0;
+}
+
+static struct profile profiles[] = {
+    {"tiny", "", gen_tiny},
+    {"huge", "", gen_huge},
+    {"deep", "", gen_deep},
+    {"wide", "", gen_wide},
+    {"sparse", "-S", gen_sparse},
+    {NULL, NULL, NULL}
+};
+
+/* The table of profiles, ended by an entry without a name. */
+struct profile *gentree_profiles(void) {
+    return profiles;
+}
+
+/* The profile of the given name, or NULL. */
+struct profile *gentree_profile(char *name) {
+    for (struct profile *p = profiles; p->name != NULL; p++) {
+        if (strcmp(p->name, name) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/*
+ * @brief  Make sure that the tree of a profile at a scale exists.
+ * @details  The tree is generated in dir unless a stamp file next to it,
+ * written once generation has completed, shows that it is already there;
+ * an incomplete tree left by an interrupted run is removed first.  The
+ * pseudo-random sequence is reseeded for each tree.
+ *
+ * @param profile  The profile.
+ * @param scale  The scale, at least 1.
+ * @param dir  Pathname of the top directory of the tree.
+ * @param stats  Receives the counts of the tree.
+ * @return 0 on success, -1 on failure.
+ */
+int gentree(struct profile *profile, uint64_t scale, char *dir, struct tree_stats *stats) {
+    char stamp[4096];
+    snprintf(stamp, sizeof(stamp), "%s.done", dir);
+
+    FILE *f = fopen(stamp, "r");
+    if (f != NULL) {
+        int version = 0;
+        unsigned long long files, dirs, bytes;
+        int n = fscanf(f, "%d %llu %llu %llu", &version, &files, &dirs, &bytes);
+        fclose(f);
+        if (n == 4 && version == GENTREE_VERSION) {
+            stats->files = files;
+            stats->dirs = dirs;
+            stats->bytes = bytes;
+            return 0;
+        }
+    }
+
+    unlink(stamp);
+    nftw(dir, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    if (block == NULL && (block = malloc(BLOCK)) == NULL) {
+        fprintf(stderr, "Error: Failed to allocate memory.\n");
+        return -1;
+    }
+    rng_state = 0x9E3779B97F4A7C15ULL;
+    stats->files = stats->dirs = stats->bytes = 0;
+
+    fprintf(stderr, "Generating %s tree (scale %llu) in %s\n", profile->name,
+            (unsigned long long)scale, dir);
+    int dirfd = make_dir(AT_FDCWD, dir, stats);
+    if (dirfd == -1) {
+        return -1;
+    }
+    int ret = profile->generate(dirfd, scale, stats);
+    close(dirfd);
+    if (ret == -1) {
+        return -1;
+    }
+
+    if ((f = fopen(stamp, "w")) == NULL) {
+        fprintf(stderr, "Error: Failed to write '%s'.\n", stamp);
+        return -1;
+    }
+    fprintf(f, "%d %llu %llu %llu\n", GENTREE_VERSION, (unsigned long long)stats->files,
+            (unsigned long long)stats->dirs, (unsigned long long)stats->bytes);
+    fclose(f);
+    return 0;
+}
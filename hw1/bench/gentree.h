@@ -0,0 +1,38 @@
+#ifndef GENTREE_H
+#define GENTREE_H
+
+#include <stdint.h>
+
+/*
+ * Generator of the synthetic trees used by the benchmarks.  A tree is a
+ * function of its profile and scale only: the names, sizes and contents of
+ * its files come from a fixed-seed pseudo-random sequence, so two runs, on
+ * any machine, measure the same input.
+ *
+ * The profiles, at scale 1 (scale N multiplies the counts or the sizes):
+ *   tiny    20000 files of 0 to 511 bytes, 200 to a directory
+ *   huge    2 files of 64 MiB
+ *   deep    8 chains of 256 nested directories, with 2 small files in each
+ *   wide    50000 files of 64 bytes in a single directory
+ *   sparse  16 files of 64 MiB holding a 64 KiB extent every 4 MiB
+ * File contents alternate between random and repetitive 4 KiB blocks, so
+ * that compression has something to do without being trivial.
+ */
+
+struct tree_stats {
+    uint64_t files;   /* regular files */
+    uint64_t dirs;    /* directories, including the top one */
+    uint64_t bytes;   /* sum of the sizes of the files */
+};
+
+struct profile {
+    char *name;
+    char *flags;      /* serializer options the profile is meant for */
+    int (*generate)(int dirfd, uint64_t scale, struct tree_stats *stats);
+};
+
+struct profile *gentree_profile(char *name);
+struct profile *gentree_profiles(void);
+int gentree(struct profile *profile, uint64_t scale, char *dir, struct tree_stats *stats);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Stack-like allocator for variable amounts of bookkeeping data.  A large
+ * range of address space is reserved up front and pages are only committed
+ * as they are touched, so the arena never moves and pointers into it stay
+ * valid until the space is released with arena_reset() or arena_free().
+ */
+struct arena {
+    char *base;
+    size_t reserved;
+    size_t used;
+};
+
+#define ARENA_DEFAULT_RESERVE (1UL << 34)
+#define ARENA_MIN_RESERVE     (1UL << 26)
+
+int arena_init(struct arena *a, size_t reserve);
+void *arena_alloc(struct arena *a, size_t len);
+char *arena_strdup(struct arena *a, char *str);
+size_t arena_mark(struct arena *a);
+void arena_reset(struct arena *a, size_t mark);
+void arena_free(struct arena *a);
+
+#endif
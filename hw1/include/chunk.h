@@ -0,0 +1,28 @@
+#ifndef CHUNK_H
+#define CHUNK_H
+
+#include <sys/types.h>
+
+#include "record.h"
+#include "source.h"
+
+/*
+ * Chunked file data (-K).  Instead of a single FILE_DATA record, whose
+ * size has to be declared before the file is read, the data of a file is
+ * carried by a series of FILE_CHUNK records (see record.h) of at most one
+ * copy block each, ended by an empty chunk.  The file is read until it
+ * reports end of file, so a file that grows or shrinks while it is being
+ * serialized still yields a well-formed stream, holding the bytes that
+ * were read, and no more than one block of a file is ever held in memory.
+ * Each chunk carries the offset of its bytes within the file, so that the
+ * deserializer can hand the chunks of a file to the worker threads and have
+ * them written in parallel.
+ */
+
+#define CHUNK_META_SIZE 8  /* offset of the chunk in the file */
+
+int chunk_file(int fd, int depth, char *head, size_t head_len);
+int chunk_restore(struct source *in, struct record_header *hdr, int depth, int fd);
+int chunk_skip(struct source *in, struct record_header *hdr, int depth);
+
+#endif
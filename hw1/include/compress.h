@@ -0,0 +1,30 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <sys/types.h>
+
+#include "lz.h"
+#include "record.h"
+#include "source.h"
+
+/*
+ * Compression of file data (-z).  The data of a file is cut into blocks
+ * of COMPRESS_BLOCK_SIZE bytes, each of which is compressed on its own
+ * with the codec of lz.h and carried by a COMPRESSED_DATA record (see
+ * record.h); a block that does not shrink is stored as is.  When the
+ * worker pool has threads and its slots are large enough, the blocks of a
+ * file are compressed, or decompressed and written, by the workers in
+ * parallel, while the records are still emitted in order.
+ */
+
+#define COMPRESS_BLOCK_SIZE  (256 * 1024)
+
+/* Work area of a block: hash table, data and compressed data. */
+#define COMPRESS_WORK_SIZE   (LZ_TABLE_SIZE + 2 * COMPRESS_BLOCK_SIZE)
+
+int compress_file(int fd, int depth, off_t size);
+int decompress_file(struct source *in, struct record_header *hdr, int depth, int fd);
+int compress_skip(struct source *in, struct record_header *hdr, int depth);
+void compress_release(void);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stdio.h>
+
+#include "global.h"
+
+/*
+ * The transplant being run by the calling thread.
+ *
+ * global.h declares the options and the pathname buffers of a run as
+ * process-wide variables, which would keep two runs from sharing a process.
+ * Every source file therefore reaches them through the context of the
+ * thread instead: the names of global.h are redefined below to the fields
+ * of that context.  The context of a thread is, by default, one that holds
+ * the variables of global.h themselves, so that the program and its unit
+ * tests see them as before; a transplant run through libtransplant.h gets a
+ * context of its own for the duration of the run.  The other state of a
+ * run is kept in thread-local variables of the modules, except what the
+ * worker threads of the run share with it (the pool and the statistics),
+ * which hangs off the context; a worker adopts the context of the thread
+ * that started it.
+ *
+ * The context also holds the streams of the run: the serialized data is
+ * written to context_out() and read from context_in(), which are stdout
+ * and stdin unless the run was given streams of its own, or read in place
+ * from the source of the context when the run was given it in memory.
+ * Messages go to context_err(), which stderr is redefined to below: it is
+ * the stderr of the process unless the run was given a stream for them.
+ */
+
+struct pool;
+struct stats;
+struct source;
+
+struct context {
+    int *options;          /* global_options */
+    char *path;            /* path_buf, PATH_MAX bytes */
+    int *length;           /* path_length */
+    char *name;            /* name_buf, NAME_MAX bytes */
+    FILE *in;              /* stream to deserialize, or NULL for stdin */
+    struct source *source; /* input to deserialize in place of in, or NULL */
+    FILE *out;             /* stream to serialize to, or NULL for stdout */
+    struct pool *pool;     /* worker pool of the run, or NULL */
+    struct stats *stats;   /* statistics of the run (--stats), or NULL */
+    FILE *err;             /* stream for messages, or NULL for stderr */
+    int pool_jobs;         /* slots of the pool held by the run */
+    int pool_limit;        /* most slots the run may hold at once */
+    int pool_failed;       /* nonzero once a detached job of the run failed */
+};
+
+extern __thread struct context *ctx;
+
+#define global_options  (*ctx->options)
+#define path_buf        (ctx->path)
+#define path_length     (*ctx->length)
+#define name_buf        (ctx->name)
+
+#undef stderr
+#define stderr          (context_err())
+
+FILE *context_in(void);
+FILE *context_out(void);
+FILE *context_err(void);
+
+#endif
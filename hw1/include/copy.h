@@ -0,0 +1,33 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "source.h"
+
+/*
+ * Bulk copy engine used to move FILE_DATA payloads between files and the
+ * serialized stream.  Data is moved in page-aligned blocks of
+ * copy_block_size bytes rather than one byte at a time.
+ */
+
+#define COPY_BLOCK_DEFAULT  (1UL << 20)
+#define COPY_BLOCK_MAX      (1UL << 30)
+
+/* Size of the blocks used by the copy engine. */
+extern __thread size_t copy_block_size;
+
+int copy_set_block_size(char *arg);
+void copy_setup_pipe(int fd);
+int copy_to_stream(int fd, FILE *out, off_t size);
+int copy_from_stream(struct source *in, int fd, off_t size);
+int copy_skip_stream(struct source *in, off_t size);
+int copy_file(int in_fd, int out_fd, off_t size);
+int copy_next_extent(int fd, off_t pos, off_t size, off_t *start, off_t *end);
+char *copy_buffer(void);
+void copy_release(void);
+int write_full(int fd, char *buf, size_t len);
+int pwrite_full(int fd, void *buf, size_t len, off_t offset);
+
+#endif
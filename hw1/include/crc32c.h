@@ -0,0 +1,19 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli polynomial), used by the CHECKSUM records of the
+ * serialized stream (see record.h).
+ *
+ * On x86-64 processors with SSE4.2 the crc32 instruction is used; when
+ * PCLMULQDQ is available as well, large buffers are split into three
+ * streams whose crc32 chains run in parallel and are then combined by
+ * carry-less multiplication.  Other processors use a slicing-by-8 table.
+ */
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
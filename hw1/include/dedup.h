@@ -0,0 +1,44 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "record.h"
+#include "source.h"
+
+/*
+ * Deduplication of file content within a stream (-D).  The serializer
+ * remembers every regular file it emits.  When a file turns out to have the
+ * same content as one of these, a FILE_REFERENCE record naming the earlier
+ * file (see record.h) is emitted instead of its data, and the deserializer
+ * recreates it from the copy it has already made.
+ *
+ * Candidates are found by size first; only files whose size has been seen
+ * before are hashed, with a fast 64-bit hash, and so is the earlier file
+ * the first time it is compared.  Hard links to an earlier file match
+ * without any reading.  With -E, files with equal hashes are also compared
+ * byte by byte before one is taken for a copy of the other.
+ */
+
+/* Earlier file with the same content as the file looked up. */
+struct dedup_ref {
+    uint64_t offset;  /* offset of its DIRECTORY_ENTRY record */
+    char *path;       /* pathname relative to the serialized directory */
+    uint32_t len;     /* length of the pathname */
+};
+
+int dedup_begin(char *root);
+int dedup_enter(char *name);
+void dedup_leave(void);
+int dedup_lookup(char *name, int fd, struct stat *st, uint64_t offset, struct dedup_ref *ref);
+int dedup_write(FILE *out, uint32_t depth, struct dedup_ref *ref);
+void dedup_end(void);
+int dedup_hash(int fd, uint64_t size, uint64_t *hash);
+
+int dedup_restore(struct source *in, struct record_header *hdr, char *root, size_t root_len, int fd);
+int dedup_skip(struct source *in, struct record_header *hdr);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/*
+ * Selection of the entries to be extracted by the deserializer (-f).
+ * Patterns are shell wildcard patterns (see fnmatch(3)) matched against
+ * pathnames relative to the target directory, in which '*' and '?' do not
+ * match '/'.  An entry is extracted if its pathname, or the pathname of
+ * one of the directories above it, matches a pattern.  A directory that
+ * does not match is still created and entered if a pattern may match
+ * something below it; otherwise the whole subtree is skipped.  When every
+ * pattern names a pathname literally, the entries can be looked up in the
+ * index of an archive instead (filter_literal()).
+ */
+
+#define FILTER_SKIP     0  /* entry (and subtree) not selected */
+#define FILTER_DESCEND  1  /* directory to be entered, entries filtered */
+#define FILTER_ALL      2  /* entry (and subtree) selected */
+
+int filter_add(char *pattern);
+void filter_clear(void);
+int filter_active(void);
+int filter_match(char *path, int is_dir);
+int filter_literal(void);
+char *filter_pattern(int n);
+
+#endif
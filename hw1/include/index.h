@@ -0,0 +1,69 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Trailing index of a serialized archive.  With -i, the serializer records
+ * each entry it emits and, just before END_OF_TRANSMISSION, writes an
+ * ARCHIVE_INDEX record at depth 0 whose payload consists of:
+ *
+ *   - a table of INDEX_ENTRY_SIZE-byte entries, sorted by pathname:
+ *     8-byte offset of the DIRECTORY_ENTRY record of the entry,
+ *     8-byte size, 4-byte mode, 4-byte pathname length and 8-byte offset
+ *     of the pathname within the string table;
+ *   - the string table: the pathnames, relative to the serialized
+ *     directory, with components separated by '/' and not null-terminated;
+ *   - a footer of INDEX_FOOTER_SIZE bytes: 8-byte offset of the
+ *     ARCHIVE_INDEX record, 8-byte number of entries and the 8-byte
+ *     INDEX_MAGIC.
+ *
+ * All integers are big-endian and offsets count from the start of the
+ * archive.  The footer is directly followed by the END_OF_TRANSMISSION
+ * record, so a reader of a seekable archive finds it at a fixed distance
+ * from the end, and can then look any pathname up by binary search.  The
+ * data of a file (its FILE_DATA or FILE_REFERENCE record, or the first of
+ * its COMPRESSED_DATA records) directly follows its DIRECTORY_ENTRY record.
+ * The deserializer looks up the entries named by -f in the index of an
+ * archive given with -a (see deserialize_indexed() in transplant.c).
+ *
+ * In an archive written with -C, the offsets are those of the CHECKSUM
+ * records in front of the records, and END_OF_TRANSMISSION is preceded by
+ * its CHECKSUM record, which therefore sits between it and the footer.
+ */
+
+#define INDEX_ENTRY_SIZE   32
+#define INDEX_FOOTER_SIZE  24
+#define INDEX_MAGIC        0x5450494e44455831ULL  /* "TPINDEX1" */
+
+/* Entry found in an index. */
+struct index_entry {
+    uint64_t offset;  /* offset of the DIRECTORY_ENTRY record */
+    uint64_t size;
+    uint32_t mode;
+};
+
+/* Index of an archive that is mapped into memory. */
+struct index_view {
+    unsigned char *archive;  /* start of the archive */
+    unsigned char *table;    /* first entry of the table */
+    unsigned char *strings;  /* start of the string table */
+    unsigned char *end;      /* end of the string table */
+    uint64_t count;          /* number of entries */
+    uint64_t record;         /* offset of the ARCHIVE_INDEX record, or of
+                                the CHECKSUM record in front of it */
+};
+
+int index_begin(void);
+int index_enter(char *name);
+void index_leave(void);
+int index_add(char *name, uint32_t mode, uint64_t size, uint64_t offset);
+int index_write(FILE *out);
+void index_end(void);
+
+int index_open(struct index_view *view, unsigned char *archive, size_t len);
+int index_find(struct index_view *view, char *path, struct index_entry *entry);
+
+#endif
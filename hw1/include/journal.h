@@ -0,0 +1,56 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+/*
+ * Progress journal of a deserialization (-J), so that a restore that was
+ * interrupted can be resumed instead of being started over.
+ *
+ * Every so often, between two entries, the deserializer waits for the files
+ * still being written, flushes the target filesystem (syncfs()) and appends
+ * a checkpoint to the journal: the offset in the stream of the next record,
+ * the depth of that record, the pathname (relative to the target) of the
+ * directory being restored and the number of entries restored so far.  All
+ * the entries before that offset are then on disk.  The journal is removed
+ * once the restore has completed.
+ *
+ * When the journal already holds a checkpoint, the run resumes from the
+ * last one.  A mapped archive (-a) is entered at the offset of the
+ * checkpoint straight away, within the directory that was being restored.
+ * A stream that cannot seek (a pipe) is read from the start, but the
+ * entries before the offset that still exist are passed over without
+ * writing anything (one that has gone missing is restored again).  Either
+ * way, the record at that offset must be one at which the deserializer
+ * stops between two entries, at the same depth, or the journal is taken to
+ * belong to another stream.  A journal without a checkpoint, left by a run
+ * interrupted before its first one, restarts the restore from the start.
+ * In every case, directories created after the checkpoint may already
+ * exist, and are entered as they are; files are rewritten.
+ *
+ * A checkpoint is a JOURNAL_RECORD_SIZE-byte header (4-byte JOURNAL_MAGIC,
+ * 4-byte depth, 8-byte offset, 8-byte number of entries, 4-byte pathname
+ * length and 4-byte CRC-32C of the rest of the checkpoint) followed by the
+ * pathname.  All integers are big-endian.  A checkpoint that was cut short
+ * or does not match its CRC ends the journal, and is overwritten.
+ */
+
+#define JOURNAL_RECORD_SIZE 32
+#define JOURNAL_MAGIC 0x54504a31  /* "TPJ1" */
+
+/* A checkpoint is taken once either this much input or this many entries
+ * have been restored since the last one. */
+#define JOURNAL_INTERVAL_BYTES   (256ULL << 20)
+#define JOURNAL_INTERVAL_ENTRIES 16384
+
+/* Journal given with -J, or NULL. */
+extern __thread char *journal_path;
+
+int journal_open(void);
+int journal_resumed(void);
+int journal_resume(uint64_t *offset, int *depth, char **dir);
+int journal_at(uint64_t offset, int depth, char *dir);
+void journal_entry(void);
+int journal_close(int ret);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef LIBTRANSPLANT_H
+#define LIBTRANSPLANT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Library interface to transplant (make lib builds lib/libtransplant.a and
+ * lib/libtransplant.so).
+ *
+ * A transplant run is described by a struct transplant: its options, as
+ * they would be given on the command line, the directory to serialize or
+ * to restore into and where the serialized data is read or written.  Each run has
+ * a context of its own (context.h) for the options and pathname buffers
+ * that the program keeps in global.h, so runs may proceed at the same time
+ * on different threads of one process, each with its own worker threads
+ * (-j) or ring (-u).  The program itself is a wrapper around
+ * transplant_run().
+ *
+ * The options that act on the process rather than on a run are refused:
+ * -h, -L, -R and -o, which fork or serve other processes.  Messages are
+ * printed to the stderr of the process, as is the summary of --stats,
+ * unless the run is given a stream of its own for them.  The current
+ * directory, to which relative pathnames refer, and the umask are those of
+ * the process.
+ *
+ * The serialized data may be read from and written to a descriptor, a
+ * stdio stream, a buffer in memory or functions of the caller (struct
+ * transplant_stream).  A tree serialized into a buffer can be deserialized
+ * from it straight away, without a pipe or a file: the buffer is then read
+ * in place, like an archive given with -a.
+ */
+
+/*
+ * Serialized data in memory.  A buffer that is written to must start out
+ * empty (all fields 0): its memory is mapped and grown by the library, the
+ * data is appended to it and it is released with transplant_buffer_free().
+ * A buffer that is only read may point anywhere, with size 0.
+ */
+struct transplant_buffer {
+    char *data;      /* the serialized data */
+    size_t len;      /* number of bytes of data */
+    size_t size;     /* size of the memory mapped at data, 0 if not mapped */
+};
+
+void transplant_buffer_free(struct transplant_buffer *buf);
+
+/* Kinds of struct transplant_stream. */
+#define TRANSPLANT_STREAM_FD        0
+#define TRANSPLANT_STREAM_FILE      1
+#define TRANSPLANT_STREAM_BUFFER    2
+#define TRANSPLANT_STREAM_CALLBACK  3
+
+/*
+ * Where the serialized data of a run is read from or written to.  A
+ * descriptor is left open and a stdio stream is flushed but not closed.
+ * The functions of a TRANSPLANT_STREAM_CALLBACK stream behave like read()
+ * and write(), with arg as their first argument; read returns 0 at the end
+ * of the data and either returns -1 on an error.
+ */
+struct transplant_stream {
+    int type;                          /* TRANSPLANT_STREAM_* */
+    int fd;                            /* TRANSPLANT_STREAM_FD */
+    FILE *fp;                          /* TRANSPLANT_STREAM_FILE */
+    struct transplant_buffer *buffer;  /* TRANSPLANT_STREAM_BUFFER */
+    /* TRANSPLANT_STREAM_CALLBACK, for input and output respectively */
+    ssize_t (*read)(void *arg, char *buf, size_t len);
+    ssize_t (*write)(void *arg, const char *buf, size_t len);
+    void *arg;
+};
+
+struct transplant {
+    char **options;  /* options, NULL-terminated, or NULL for none */
+    char *root;      /* directory, replacing the one given with -p, or NULL */
+    int in_fd;       /* serialized data to read, or -1 for the standard input */
+    int out_fd;      /* where serialized data and listings are written, or -1
+                        for the standard output */
+    struct transplant_stream *input;   /* replaces in_fd, or NULL */
+    struct transplant_stream *output;  /* replaces out_fd, or NULL */
+    FILE *err;       /* stream for messages, or NULL for stderr */
+};
+
+int transplant_run(struct transplant *t);
+int transplant_serialize(struct transplant *t);
+int transplant_deserialize(struct transplant *t);
+
+#endif
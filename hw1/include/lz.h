@@ -0,0 +1,32 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Small LZ77 block codec in the spirit of LZ4.  A compressed block is a
+ * sequence of sequences, each made of:
+ *
+ *   - a token byte: the high nibble is the number of literals and the low
+ *     nibble the match length minus LZ_MIN_MATCH; a nibble of 15 is
+ *     continued by bytes that are added to it, up to a byte other than 255;
+ *   - the literal bytes;
+ *   - a 2-byte little-endian match offset (1 to 65535) and the
+ *     continuation of the match length, except in the last sequence,
+ *     which holds only literals.
+ *
+ * Blocks are independent of each other, so they can be compressed and
+ * decompressed in parallel.
+ */
+
+#define LZ_MIN_MATCH   4
+#define LZ_HASH_LOG    12
+
+/* Size of the hash table to be provided to lz_compress(). */
+#define LZ_TABLE_SIZE  ((1 << LZ_HASH_LOG) * sizeof(uint32_t))
+
+size_t lz_compress(unsigned char *in, size_t len, unsigned char *out, size_t cap, uint32_t *table);
+long lz_decompress(unsigned char *in, size_t len, unsigned char *out, size_t cap);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Incremental serialization.  With -M FILE, the serializer writes a
+ * manifest of every entry of the tree to FILE.  With -m FILE, it reads the
+ * manifest of a previous run and leaves out the files that have not
+ * changed since: only new and changed files are emitted, every directory
+ * is still emitted (so that the records keep describing a tree), and an
+ * ENTRY_REMOVED record (see record.h) is emitted for each entry of the
+ * previous run that no longer exists.  Such a delta is applied onto the
+ * previous copy of the tree with -d -c.
+ *
+ * A regular file is unchanged if its mode, size, modification time and
+ * inode number are those recorded.  If only the modification time or the
+ * inode number differ and the manifest holds a hash of the file, the file
+ * is hashed and is unchanged if the hash matches.  Hashes are computed for
+ * the files emitted by an incremental run, which are few, and carried over
+ * for the files that are unchanged.
+ *
+ * A manifest consists of a MANIFEST_HEADER_SIZE-byte header (the 8-byte
+ * MANIFEST_MAGIC and the 8-byte number of entries), a table of
+ * MANIFEST_ENTRY_SIZE-byte entries sorted by pathname (8-byte size, 8-byte
+ * modification time in nanoseconds, 8-byte inode number, 8-byte hash or 0,
+ * 8-byte offset of the pathname in the string table, 4-byte mode and
+ * 4-byte pathname length), and the string table, as for the index of an
+ * archive (see index.h).  All integers are big-endian.
+ */
+
+#define MANIFEST_HEADER_SIZE  16
+#define MANIFEST_ENTRY_SIZE   48
+#define MANIFEST_MAGIC        0x54504d414e494631ULL  /* "TPMANIF1" */
+
+#define MANIFEST_SAME     0  /* entry unchanged since the previous run */
+#define MANIFEST_CHANGED  1  /* entry new, or changed */
+#define MANIFEST_RETYPED  2  /* entry of another type in the previous run */
+
+/* Manifest of the previous run (-m) and manifest to be written (-M), or NULL. */
+extern __thread char *manifest_in;
+extern __thread char *manifest_out;
+
+int manifest_active(void);
+int manifest_begin(void);
+int manifest_enter(char *name);
+void manifest_leave(void);
+int manifest_check(int dirfd, char *name, struct stat *st, mode_t *old_mode);
+int manifest_removed(FILE *out, uint32_t depth);
+int manifest_save(void);
+void manifest_end(void);
+
+#endif
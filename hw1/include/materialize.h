@@ -0,0 +1,22 @@
+#ifndef MATERIALIZE_H
+#define MATERIALIZE_H
+
+#include <sys/types.h>
+
+#include "pool.h"
+#include "source.h"
+
+/*
+ * Creation of deserialized files by the worker pool.  The parser hands
+ * over the payload of each FILE_DATA record together with the pathname and
+ * permissions of the file, and goes on decoding while a worker creates,
+ * writes and closes the file.  Since the payload has to be staged in a pool
+ * slot, the parser waits when all slots are in use.
+ */
+
+/* Number of slots per worker thread when deserializing. */
+#define MATERIALIZE_SLOTS_PER_WORKER 8
+
+int materialize_submit(struct source *in, char *path, off_t size, mode_t mode);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef ORDER_H
+#define ORDER_H
+
+#include <stdint.h>
+
+/*
+ * On-disk order (-O).  The entries of a directory come from getdents64() in
+ * the order of its hash or b-tree, which has nothing to do with where the
+ * data of the files lies, so reading the files in that order sends a disk
+ * head back and forth across the platter.  With -O, the regular files of a
+ * directory are emitted in the order of the physical offset of their first
+ * extent, as reported by the FIEMAP ioctl, or in the order of their inode
+ * numbers on a file system that does not support FIEMAP (inodes are
+ * allocated close to their data by most file systems).  The subdirectories
+ * follow the files, in the order of their inode numbers.
+ *
+ * To keep the memory used by a very large directory bounded, the directory
+ * is listed, ordered and emitted in batches of at most ORDER_BATCH entries,
+ * each batch resuming the listing where the previous one stopped.  The
+ * order holds within each batch.
+ */
+
+/* Most entries of a directory listed and ordered at once with -O. */
+#define ORDER_BATCH 16384
+
+int order_extent(int dirfd, char *name, uint64_t *physical);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <sys/types.h>
+
+struct context;
+
+/*
+ * Pool of worker threads with a fixed set of job slots.  Each slot carries
+ * a pathname and a bounded data buffer, so the slots also serve to cap the
+ * memory that jobs in flight can hold: a producer that finds no free slot
+ * either does the work itself or waits for one (back-pressure).
+ *
+ * When the io_uring backend is active (see uring.h) no threads are
+ * started: jobs are queued on the ring instead, and whoever waits on the
+ * pool reaps the completions.
+ *
+ * Runs on several threads may also share one pool (pool_share()), as the
+ * sessions of the server do (see server.h).
+ */
+
+struct pool_slot {
+    struct pool_slot *next;   /* link in the work queue or free list */
+    int state;                /* SLOT_FREE, SLOT_QUEUED or SLOT_DONE */
+    int detached;             /* slot is released by the worker when done */
+    int error;                /* nonzero if the job failed */
+    int fd;                   /* descriptor used by the job, or -1 */
+    mode_t mode;              /* permissions for a file being created */
+    off_t size;               /* size of the file, or of a block of it */
+    off_t offset;             /* position of the block within the file */
+    size_t filled;            /* number of bytes of data in payload */
+    int dirfd;                /* directory path is relative to, or AT_FDCWD */
+    char *path;               /* pathname of the file (PATH_MAX bytes) */
+    char *data;               /* buffer of pool_slot_size() bytes */
+    char *payload;            /* data of the job: data or memory elsewhere */
+    void (*run)(struct pool_slot *slot);
+    int index;                /* position of the slot in the pool */
+    int pending;              /* requests of the job still in the ring */
+    struct pool_slot *chain;  /* producer's own list of jobs in flight */
+    struct context *owner;    /* run that holds the slot, NULL if free */
+};
+
+/*
+ * Jobs in flight of a single producer, linked through their chain field in
+ * the order they were submitted, so that the producer can collect them in
+ * that order and reuse its own slots first.
+ */
+struct pool_chain {
+    struct pool_slot *head;   /* oldest job, or NULL */
+    struct pool_slot *tail;   /* newest job, or NULL */
+};
+
+#define SLOT_FREE    0
+#define SLOT_QUEUED  1
+#define SLOT_DONE    2
+
+struct pool;
+
+int pool_start(int workers, int slots_per_worker, size_t slot_size);
+void pool_stop(void);
+void pool_share(struct pool *pool, int workers);
+int pool_running(void);
+int pool_workers(void);
+size_t pool_slot_size(void);
+struct pool_slot *pool_acquire(int wait);
+void pool_set_path(struct pool_slot *slot, char *path);
+void pool_submit(struct pool_slot *slot, void (*run)(struct pool_slot *), int detached);
+int pool_wait(struct pool_slot *slot);
+void pool_release(struct pool_slot *slot);
+int pool_drain(void);
+int pool_failed(void);
+void pool_complete(struct pool_slot *slot);
+void pool_chain_submit(struct pool_chain *chain, struct pool_slot *slot, void (*run)(struct pool_slot *));
+struct pool_slot *pool_chain_pop(struct pool_chain *chain);
+struct pool_slot *pool_chain_acquire(struct pool_chain *chain, int *failed);
+int pool_chain_collect(struct pool_chain *chain);
+
+#endif
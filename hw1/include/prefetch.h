@@ -0,0 +1,21 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <sys/types.h>
+
+#include "pool.h"
+
+/*
+ * Reading of files ahead of the serializer by the worker pool.  The
+ * serializer submits the files it is about to emit; each one is read into
+ * the buffer of a pool slot by a worker, and the serializer, which remains
+ * the only writer of the output stream, picks the data up in its own order
+ * with pool_wait() and gives the slot back with pool_release().
+ */
+
+/* Number of slots per worker thread when serializing. */
+#define PREFETCH_SLOTS_PER_WORKER 4
+
+struct pool_slot *prefetch_submit(int dirfd, char *path, off_t size);
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "source.h"
+
+/*
+ * Codec for the records of the serialized stream.
+ *
+ * Every record begins with a 16-byte header: the three magic bytes, a type
+ * byte, a 4-byte depth and an 8-byte record size (which includes the header),
+ * all multi-byte fields being big-endian.  A DIRECTORY_ENTRY record continues
+ * with a 4-byte mode, an 8-byte size and the entry name (not null-terminated).
+ * An optional ARCHIVE_INDEX record (see index.h) may precede
+ * END_OF_TRANSMISSION.
+ *
+ * With compression (see compress.h), the data of a file is carried by a
+ * series of COMPRESSED_DATA records instead of a FILE_DATA record.  Each one
+ * holds a block of the file: a 4-byte word with the length of the data in
+ * the block and the BLOCK_* flags, followed by the compressed bytes.
+ *
+ * With deduplication (see dedup.h), a file whose content is identical to
+ * that of a file emitted earlier in the stream is carried by a
+ * FILE_REFERENCE record: the 8-byte offset of the DIRECTORY_ENTRY record of
+ * the earlier file, followed by its pathname relative to the serialized
+ * directory (not null-terminated).
+ *
+ * An incremental stream (see manifest.h) may also contain ENTRY_REMOVED
+ * records among the entries of a directory.  They are laid out like
+ * DIRECTORY_ENTRY records, with the mode of the entry as last serialized
+ * and a size of 0, and name an entry to be removed, with all its contents.
+ *
+ * With -S, a file with holes is carried by a SPARSE_DATA record instead of
+ * a FILE_DATA record: the 8-byte size of the file, then for each data
+ * extent, in increasing order, its 8-byte offset, its 8-byte length and its
+ * bytes.  The ranges between the extents are holes.
+ *
+ * With -K (see chunk.h), the data of a file is carried by a series of
+ * FILE_CHUNK records instead of a FILE_DATA record: each holds the 8-byte
+ * offset of its bytes within the file followed by the bytes, the chunks
+ * following each other without gaps, and a chunk without bytes, whose
+ * offset is the size of the file, ends the series.
+ *
+ * With -C, every record is preceded by a CHECKSUM record at depth 0 whose
+ * payload holds two 4-byte CRC-32C values (see crc32c.h): that of the
+ * payload of the previous record (0 before START_OF_TRANSMISSION) and that
+ * of the header of the next record.  The reader checks a header before it
+ * interprets it, and the payload of a record on reaching the CHECKSUM
+ * record that follows it, which is as soon as the payload of a file has
+ * been written.  A stream that starts with a CHECKSUM record must carry
+ * one before each of its records.
+ */
+
+#define MAGIC0 0x0C
+#define MAGIC1 0x0D
+#define MAGIC2 0xED
+
+#define HEADER_SIZE      16
+#define ENTRY_META_SIZE  12
+
+#define START_OF_TRANSMISSION  0
+#define END_OF_TRANSMISSION    1
+#define START_OF_DIRECTORY     2
+#define END_OF_DIRECTORY       3
+#define DIRECTORY_ENTRY        4
+#define FILE_DATA              5
+#define ARCHIVE_INDEX          6
+#define COMPRESSED_DATA        7
+#define FILE_REFERENCE         8
+#define ENTRY_REMOVED          9
+#define SPARSE_DATA            10
+#define CHECKSUM               11
+#define FILE_CHUNK             12
+
+#define CHECKSUM_SIZE  (HEADER_SIZE + 8)
+
+#define BLOCK_META_SIZE  4
+#define BLOCK_STORED     0x80000000U  /* the bytes are not compressed */
+#define BLOCK_LAST       0x40000000U  /* last block of the file */
+#define BLOCK_LENGTH     0x3FFFFFFFU  /* mask of the length of the data */
+
+struct record_header {
+    unsigned char type;
+    uint32_t depth;
+    uint64_t size;
+};
+
+struct entry_meta {
+    uint32_t mode;
+    uint64_t size;
+};
+
+/* Number of bytes of records written so far by record_write() and entry_write(). */
+extern __thread uint64_t record_offset;
+
+void record_reset(void);
+void record_release(void);
+
+void put_be(unsigned char *buf, uint64_t value, int nbytes);
+uint64_t get_be(unsigned char *buf, int nbytes);
+void record_encode(unsigned char *buf, unsigned char type, uint32_t depth, uint64_t size);
+int record_decode(unsigned char *buf, struct record_header *hdr);
+size_t entry_encode(unsigned char *buf, uint32_t depth, struct entry_meta *meta, char *name);
+void entry_decode_meta(unsigned char *buf, struct entry_meta *meta);
+
+int record_read(struct source *in, struct record_header *hdr);
+int record_check(struct source *in);
+uint64_t record_next(struct source *in);
+int record_expect(struct source *in, unsigned char type, uint32_t depth);
+int entry_read(struct source *in, struct record_header *hdr, struct entry_meta *meta, char *name);
+int record_write(FILE *out, unsigned char type, uint32_t depth, uint64_t size);
+int entry_write(FILE *out, uint32_t depth, struct entry_meta *meta, char *name);
+int removal_write(FILE *out, uint32_t depth, struct entry_meta *meta, char *name);
+int block_write(FILE *out, uint32_t depth, uint32_t word, unsigned char *data, size_t len);
+int payload_write(FILE *out, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef RELPATH_H
+#define RELPATH_H
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/*
+ * Pathnames relative to the directory being serialized, for the modules
+ * that record the entries met during a traversal (the index, the
+ * deduplication table and the manifest).  A relpath holds the pathname of
+ * the directory being traversed, with components separated by single
+ * slashes; it is empty at the top.
+ */
+struct relpath {
+    char *buf;   /* PATH_MAX bytes */
+    size_t len;
+};
+
+int relpath_init(struct relpath *rp, struct arena *a);
+int relpath_enter(struct relpath *rp, char *name);
+void relpath_leave(struct relpath *rp);
+char *relpath_join(struct relpath *rp, struct arena *a, char *name, size_t *len);
+int relpath_cmp(char *a, size_t alen, char *b, size_t blen);
+void **relpath_sort(void **vec, void **tmp, size_t n, char *(*key)(void *item, size_t *len));
+
+#endif
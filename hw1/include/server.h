@@ -0,0 +1,53 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * Server mode (-L) and its client (-R).
+ *
+ * The server listens on a Unix domain socket and runs one session per
+ * connection.  A session is an ordinary -s or -d run.  The client opens it
+ * with a request: a 4-byte big-endian length followed by that many bytes of
+ * arguments, each ended by a null byte, as they would be given on the
+ * command line (without the program name, -L or -R).  With the first bytes
+ * of the request the client may pass four descriptors (SCM_RIGHTS): its
+ * standard input, output and error and its current directory.  The session
+ * then uses them as its own, so that the stream and any messages or listing
+ * go to the client directly and relative pathnames are those of the client.
+ *
+ * Without descriptors, the connection itself carries the stream, in the
+ * record format of record.h: a -d session reads it from the connection
+ * (unless -a is given) and a -s session writes it there.  Messages then go
+ * to the stderr of the server, and -t and -T are refused.
+ *
+ * When a session ends, the server writes a 4-byte big-endian status on the
+ * connection, 0 for success and 1 for failure, except after a -s session
+ * that wrote its stream there, whose failure shows as a stream that lacks
+ * END_OF_TRANSMISSION.
+ *
+ * Each connection is served by a thread of its own, so the accept loop
+ * only accepts: the request is read on that thread, and a client that is
+ * slow to send it holds up no one else.  The session is a transplant_run() of the library on that thread,
+ * with a context of its own; the thread unshares its filesystem attributes
+ * (CLONE_FS), so its current directory and umask are private to the
+ * session, and messages go to the stderr passed by the client.  As with the
+ * library, -o and a repeated -a are refused.
+ *
+ * The worker threads given to the server with -j (by default, one per
+ * online processor) form one pool shared by the sessions (pool_share()).
+ * A session is granted as many of them as its own -j asks for and are
+ * free when it starts, and one that would get fewer than two runs without
+ * workers rather than wait: the sessions on either side of a pipe could
+ * otherwise each hold the threads the other waits for.
+ */
+
+/* Largest request accepted by the server. */
+#define SERVER_REQUEST_MAX (64 * 1024)
+
+/* Socket to listen on (-L) or to run the session through (-R), or NULL. */
+extern __thread char *listen_path;
+extern __thread char *remote_path;
+
+int server_run(void);
+int server_remote(int argc, char **argv);
+
+#endif
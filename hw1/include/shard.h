@@ -0,0 +1,45 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+
+/*
+ * Sharded serialization (-o) and parallel restore of the shards (-a).
+ *
+ * With -o given once or more, the tree is split across that many streams
+ * (files, or pipes such as /dev/fd/N), each a complete transmission that
+ * holds every directory of the tree and a share of the other entries.  The
+ * entries are dealt out before anything is written: the tree is walked
+ * once for the size of each entry, and the entries are given, largest
+ * first, to the shard with the fewest bytes so far.  One child process per
+ * shard then serializes the tree, leaving out the entries of the other
+ * shards, so that the shards are read, encoded and written in parallel.
+ *
+ * An entry is known by the inode number that getdents64() reports for it,
+ * so the hard links to a file stay in one shard, and an entry created after
+ * the first walk still goes to exactly one shard (by its inode number
+ * modulo the number of shards).  Options that need the whole tree in one
+ * stream (-m, -M) cannot be combined with -o.
+ *
+ * With -a given more than once, the shards are restored at the same time,
+ * into the target directory, by one child process each.  Every shard
+ * carries the directories, so whichever shard gets to a directory first
+ * creates it and the others go into it; the files, each in one shard, are
+ * subject to -c as usual.  A shard that is not a regular file (a pipe) is
+ * read as a stream rather than mapped.
+ */
+
+/* Most streams that the tree can be split across. */
+#define SHARDS_MAX 256
+
+/* The shard handled by this process, or -1 outside of a sharded run. */
+extern __thread int shard_index;
+
+int shard_add(char *path);
+void shard_clear(void);
+int shard_count(void);
+int shard_active(void);
+int shard_selected(uint64_t ino);
+int shard_run(void);
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Input from which the deserializer reads records.  Either a file descriptor
+ * (normally the standard input), read through a buffer of the source's own,
+ * or a serialized archive that has been mapped into memory, in which case
+ * records are decoded and file data is written directly from the mapping.
+ * Serialized data that a caller of libtransplant.h holds in memory is read
+ * in place like a mapped archive, and a stdio stream of the caller, which
+ * may hold input already, is read through the buffer with fread().  Since the buffer
+ * belongs to the source, the copy engine knows how much of the input has
+ * been read ahead (source_buffered()) before it lets the kernel move the
+ * rest of a payload from the descriptor.  Whatever reads the input,
+ * source_consumed() is told about the bytes, so that the payload of a
+ * record can be checked against the CHECKSUM record that follows it (see
+ * record.h).
+ */
+struct source {
+    int fd;                    /* descriptor read directly, or -1 */
+    FILE *fp;                  /* stdio stream read instead, or NULL */
+    unsigned char *buffer;     /* read buffer for fd or fp */
+    unsigned char *pending;    /* first byte in the buffer not yet consumed */
+    unsigned char *filled;     /* end of the bytes read into the buffer */
+    unsigned char *base;       /* start of the mapping, NULL if not mapped */
+    int mapped;                /* base was mapped here, rather than lent */
+    unsigned char *cur;        /* read cursor within the mapping */
+    unsigned char *end;        /* end of the mapping */
+    unsigned char *advised;    /* end of the region advised as needed soon */
+    uint64_t offset;           /* number of bytes consumed */
+    uint64_t record;           /* offset of the header read last */
+    uint32_t crc;              /* CRC-32C of the payload consumed since that header */
+    int crc_known;             /* 0 if crc does not cover that whole payload */
+    int checksums;             /* 1 once a CHECKSUM record has been read */
+    int sum_pending;           /* 1 if the CHECKSUM record of the next header was read */
+    uint32_t header_sum;       /* then, the checksum it holds for that header */
+    uint64_t sum_offset;       /* and its offset */
+};
+
+/* Size of the read buffer, and largest request that source_next() accepts
+   for a source that is not mapped. */
+#define SOURCE_BUFFER_SIZE (64 * 1024)
+
+/* Serialized archive to be read by deserialize() instead of stdin, or NULL. */
+extern __thread char *archive_path;
+
+void source_init_fd(struct source *src, int fd);
+void source_init_stdio(struct source *src, FILE *fp);
+struct source *source_input(void);
+void source_set_input(struct source *src);
+void source_release(void);
+int source_open_map(struct source *src, char *path);
+void source_open_memory(struct source *src, void *data, size_t len);
+void source_close(struct source *src);
+unsigned char *source_next(struct source *src, size_t len);
+int source_read(struct source *src, void *buf, size_t len);
+int source_skip(struct source *src, uint64_t len);
+size_t source_buffered(struct source *src);
+void source_consumed(struct source *src, void *buf, size_t len);
+void source_reposition(struct source *src, uint64_t offset);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <sys/types.h>
+
+#include "record.h"
+#include "source.h"
+
+/*
+ * Sparse files (-S).  A regular file that occupies fewer blocks than its
+ * size calls for is probed with SEEK_DATA and SEEK_HOLE.  If it does have
+ * holes, it is carried by a SPARSE_DATA record (see record.h) that holds
+ * only its data extents, and the deserializer recreates the holes by
+ * seeking over them and setting the size of the file at the end.
+ */
+
+#define SPARSE_SIZE_BYTES    8   /* size of the file */
+#define SPARSE_EXTENT_BYTES  16  /* offset and length of an extent */
+
+int sparse_file(int fd, int depth, off_t size);
+int sparse_restore(struct source *in, struct record_header *hdr, int fd);
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+#include "context.h"
+
+/*
+ * Runtime statistics (--stats).  When the option is given, the time spent
+ * in each phase below and the number of times it was entered are counted,
+ * along with the entries and bytes processed and the largest and slowest
+ * files, and a JSON summary is printed to stderr when the program ends.
+ *
+ * Time is charged to the innermost phase only, per thread: the time of a
+ * serialize_file phase does not include the read and stream_write phases
+ * within it.  The phases of the worker threads are added in as well, so
+ * with -j the times may add up to more than the wall-clock time.  The
+ * time of a file counted for the slowest files is that spent on it by the
+ * main thread, including its inner phases.
+ *
+ * Like the debug() macros of debug.h, the counters compile out entirely
+ * unless STATS is defined (make STATS=0 leaves them out); when they are
+ * built in, each counted point costs a test of stats_enabled while the
+ * option is not given.  The statistics belong to the context of the run
+ * (context.h), which the worker threads of the run share.
+ */
+
+#define STAT_NONE                   0
+#define STAT_SERIALIZE_DIRECTORY    1
+#define STAT_SERIALIZE_FILE         2
+#define STAT_DESERIALIZE_DIRECTORY  3
+#define STAT_DESERIALIZE_FILE       4
+#define STAT_HEADER_ENCODE          5
+#define STAT_HEADER_DECODE          6
+#define STAT_STAT                   7
+#define STAT_OPEN                   8
+#define STAT_READ                   9   /* reading the data of files */
+#define STAT_WRITE                  10  /* writing the data of files */
+#define STAT_MKDIR                  11
+#define STAT_CHMOD                  12
+#define STAT_STREAM_READ            13  /* reading the serialized stream */
+#define STAT_STREAM_WRITE           14  /* writing the serialized stream */
+#define STAT_PHASES                 15
+
+#ifdef STATS
+
+#define stats_enabled (ctx->stats != NULL)
+
+int stats_start(void);
+void stats_report(int ret);
+uint64_t stats_clock(void);
+int stats_begin(int phase);
+void stats_end(int outer);
+void stats_enter(char *name);
+void stats_leave(void);
+char *stats_path(char *name);
+void stats_entry(int type, uint64_t size);
+void stats_file(char *path, uint64_t size, uint64_t start);
+void stats_stream(uint64_t bytes);
+
+/* Evaluate expr, a call that returns a value, as a phase. */
+#define STATS_TIME(phase, expr) __extension__ ({                         \
+    int stats_outer_ = stats_enabled ? stats_begin(phase) : STAT_NONE;   \
+    __typeof__(expr) stats_ret_ = (expr);                                \
+    if (stats_enabled) {                                                 \
+        stats_end(stats_outer_);                                         \
+    }                                                                    \
+    stats_ret_; })
+
+/* Bracket the rest of a block as a phase; STATS_END() must be reached. */
+#define STATS_BEGIN(phase) \
+    int stats_outer_ = stats_enabled ? stats_begin(phase) : STAT_NONE
+#define STATS_END()                  \
+    do {                             \
+        if (stats_enabled) {         \
+            stats_end(stats_outer_); \
+        }                            \
+    } while (0)
+
+/* Evaluate call only while statistics are being gathered. */
+#define STATS_DO(call)          \
+    do {                     \
+        if (stats_enabled) { \
+            call;            \
+        }                    \
+    } while (0)
+
+#define STATS_CLOCK() (stats_enabled ? stats_clock() : 0)
+
+#else
+
+#define stats_start() 0
+#define stats_report(ret)
+#define STATS_TIME(phase, expr) (expr)
+#define STATS_BEGIN(phase)
+#define STATS_END()
+#define STATS_DO(call)
+#define STATS_CLOCK() 0
+
+#endif
+
+/* Kinds of entries for stats_entry(). */
+#define STAT_ENTRY_FILE       0
+#define STAT_ENTRY_DIRECTORY  1
+#define STAT_ENTRY_REMOVED    2
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#include "libtransplant.h"
+
+/*
+ * Backends of the serialized data of a run through libtransplant.h.
+ *
+ * The record layer writes records and payloads to a stdio stream and reads
+ * them through a struct source (source.h), so a backend only has to provide
+ * one of these.  A descriptor gets a stdio stream of its own on a duplicate
+ * of it, and a stream of the caller is used as it is.  A buffer to be
+ * written and the functions of the caller are turned into a stdio stream
+ * with fopencookie(): stdio batches the small writes of headers, while
+ * payloads larger than its buffer reach the backend directly from the
+ * buffer of the copy engine.  A buffer or a descriptor to be read needs no
+ * stream: the source reads the buffer in place (source_open_memory()) and
+ * the descriptor through a buffer of its own (source_init_fd()).
+ *
+ * A buffer that is written to grows by doubling, in an anonymous mapping
+ * that mremap() enlarges by moving its pages rather than copying the data.
+ */
+
+/* Smallest mapping of a buffer that is written to. */
+#define STREAM_BUFFER_MIN (64 * 1024)
+
+FILE *stream_open(struct transplant_stream *s, int output);
+int stream_close(struct transplant_stream *s, FILE *fp);
+
+#endif
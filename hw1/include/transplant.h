@@ -0,0 +1,124 @@
+#ifndef TRANSPLANT_H
+#define TRANSPLANT_H
+
+#include "context.h"
+
+/*
+ * Bits of global_options.  The first four are the ones set by the
+ * original validargs(); the rest select optional behavior.
+ */
+#define OPT_HELP         0x1
+#define OPT_SERIALIZE    0x2
+#define OPT_DESERIALIZE  0x4
+#define OPT_CLOBBER      0x8
+#define OPT_ZEROCOPY     0x10
+#define OPT_URING        0x20
+#define OPT_INDEX        0x40
+#define OPT_COMPRESS     0x80
+#define OPT_DEDUP        0x100
+#define OPT_VERIFY       0x200
+#define OPT_SPARSE       0x400
+#define OPT_CHECKSUM     0x800
+#define OPT_CHECK        0x1000
+#define OPT_LIST         0x2000
+#define OPT_MACHINE      0x4000
+#define OPT_CHUNK        0x8000
+#define OPT_STATS        0x10000
+#define OPT_LISTEN       0x20000
+#define OPT_ORDER        0x40000
+
+/* Number of worker threads to use, as set by -j. */
+extern __thread int worker_count;
+#define WORKERS_MAX 256
+
+int mkdir_error_ok(int err);
+void transplant_release(void);
+
+/*
+ * Full usage message, including the options that are not covered by
+ * USAGE() in global.h (which must not be modified).
+ */
+#define TRANSPLANT_USAGE(program_name, retcode) do { \
+fprintf(stderr, "USAGE: %s %s\n", program_name, \
+"[-h] -s|-d|-L SOCKET [-c] [-a ARCHIVE] [-p DIR] [-b SIZE] [-k] [-j N] [-u] [-i] [-z] [-S] [-O] [-K] [-D|-E] [-C] [-m OLD] [-M NEW] [-o SHARD]... [-J JOURNAL] [-v] [-t|-T] [-f PATTERN]... [--stats] [-R SOCKET]\n" \
+"   -h       Help: displays this help menu.\n" \
+"   -s       Serialize: traverse tree of files, output serialized data.\n" \
+"   -d       Deserialize: read serialized data, reconstruct tree of files.\n" \
+"   -L SOCKET  Listen: serve -s and -d sessions on the Unix domain socket SOCKET\n" \
+"            until SIGINT or SIGTERM, with the -j N worker threads (by default,\n" \
+"            one per processor) shared among the sessions.\n" \
+"            Optional additional parameters for both -s and -d:\n" \
+"               -p DIR       DIR is a pathname that specifies the source directory\n" \
+"                            for serialization or the target directory for deserialization.\n" \
+"                            If this parameter is not present, the pathname `.`\n" \
+"                            (referring to the current working directory) is assumed.\n" \
+"               -b SIZE      Block size used to copy file data (default 1M).  SIZE may\n" \
+"                            carry a K, M or G suffix and is rounded up to a whole page.\n" \
+"               -k           Zero-copy: let the kernel move file data between files\n" \
+"                            and the stream (splice, sendfile, copy_file_range) and\n" \
+"                            enlarge the pipe buffer when the stream is a pipe.\n" \
+"               -j N         Use N worker threads.  When serializing, files are opened\n" \
+"                            and read ahead of the output by these threads; when\n" \
+"                            deserializing, they create and write the files.\n" \
+"               -u           Queue file I/O on an io_uring instead of using worker\n" \
+"                            threads (falls back to blocking I/O if unavailable).\n" \
+"               --stats      Print a JSON summary of the entries and bytes processed,\n" \
+"                            the time spent in each phase and the largest and slowest\n" \
+"                            files to stderr at exit.\n" \
+"               -R SOCKET    Run the operation in a session of the server listening\n" \
+"                            on SOCKET (see -L), with the standard input, output and\n" \
+"                            error and the current directory of this process.\n" \
+"            Optional additional parameters for -s:\n" \
+"               -i           Append an index of all entries, sorted by pathname, so\n" \
+"                            that a seekable archive can be searched without a scan.\n" \
+"               -z           Compress file data in blocks of 256K, using the worker\n" \
+"                            threads given with -j to compress blocks in parallel.\n" \
+"               -S           Sparse: send only the data extents of files with holes\n" \
+"                            (SEEK_DATA/SEEK_HOLE); the holes are recreated on -d.\n" \
+"               -O           On-disk order: read the files of each directory in the\n" \
+"                            order of their data on disk (FIEMAP), or of their inode\n" \
+"                            numbers, in batches of at most 16384 entries.\n" \
+"               -K           Chunked: send the data of each file as chunks of at most\n" \
+"                            one block (-b), read until end of file, so that files\n" \
+"                            that change while being read are sent consistently.\n" \
+"                            Not with -z.\n" \
+"               -D           Deduplicate: emit a reference to an earlier file with the\n" \
+"                            same size and content hash instead of the data of a file.\n" \
+"               -E           As -D, but also compare the bytes of the two files.\n" \
+"               -C           Put a CRC-32C of the header and of the payload of every\n" \
+"                            record in the stream; they are checked by -d (file data\n" \
+"                            then goes through the copy buffer even with -k).\n" \
+"               -m OLD       Incremental: only send the files that are new or changed\n" \
+"                            since the run that wrote the manifest OLD, and the\n" \
+"                            removal of the entries that are gone (apply with -d -c).\n" \
+"               -M NEW       Write a manifest of the tree to NEW, for a later -m.\n" \
+"               -o SHARD     Write the tree to SHARD instead of the standard output.\n" \
+"                            Given N times, split the tree across the N streams,\n" \
+"                            balanced by size, each written by a process of its own.\n" \
+"            Optional additional parameter for -d:\n" \
+"               -c           ``clobber'': the program will overwrite existing files,\n" \
+"                            rather than terminating with an error, and it will ignore\n" \
+"                            errors that result when attempts is made to create directories\n" \
+"                            that already exist.\n" \
+"               -a ARCHIVE   Read the serialized data from the file ARCHIVE, which is\n" \
+"                            mapped into memory, instead of from the standard input.\n" \
+"                            Given N times, restore the N shards written by -o in\n" \
+"                            parallel; a shard may then also be a pipe.\n" \
+"               -J JOURNAL   Record the progress of the restore in the file JOURNAL,\n" \
+"                            and if it holds progress from an interrupted run, resume\n" \
+"                            from there (seeking into ARCHIVE, or passing over the\n" \
+"                            files already restored from a pipe).  Removed once done.\n" \
+"               -v           Verify only: check the structure of the serialized data\n" \
+"                            and its checksums, if any, without creating anything.\n" \
+"               -t           List the entries (type and permissions, size and path)\n" \
+"                            instead of creating them; file data is skipped.\n" \
+"               -T           As -t, but print tab-separated fields: mode in octal,\n" \
+"                            size, how the data is stored, and the path (with \\, tab\n" \
+"                            and newline escaped as \\\\, \\t and \\n).\n" \
+"               -f PATTERN   Only extract the entries whose pathname (relative to DIR),\n" \
+"                            or that of a directory above them, matches the shell\n" \
+"                            wildcard PATTERN.  May be repeated.\n"); \
+exit(retcode); \
+} while(0)
+
+#endif
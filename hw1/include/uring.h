@@ -0,0 +1,41 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "pool.h"
+
+/*
+ * Optional io_uring backend.  Instead of one blocking system call per
+ * open, read, write, close, mkdir or stat, these operations are queued on
+ * a submission ring and handed to the kernel in batches, with the open,
+ * data transfer and close of a file linked into a single chain that runs on
+ * a registered (fixed) file slot.  No threads are involved: completions are
+ * reaped whenever the caller has to wait for something.
+ *
+ * The backend is compiled in when the Makefile is run with URING=1 (the
+ * default) and is selected at run time with -u.  When it is not compiled in
+ * or the kernel does not support it, uring_init() fails and the blocking
+ * path is used.
+ */
+
+/* Number of files that can be in flight at once. */
+#define URING_SLOTS 32
+
+/* Space to be provided for the result of uring_statx(). */
+#define URING_STATX_SIZE 256
+
+int uring_init(int nfiles);
+void uring_exit(void);
+int uring_active(void);
+int uring_reap(int wait);
+int uring_wait_all(void);
+
+int uring_read_slot(struct pool_slot *slot);
+int uring_write_slot(struct pool_slot *slot);
+int uring_mkdir(struct pool_slot *slot);
+int uring_statx(int dirfd, char *name, void *statxbuf, long *res);
+void uring_statx_decode(void *statxbuf, struct stat *st);
+
+#endif
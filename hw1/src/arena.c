@@ -0,0 +1,113 @@
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+#define ARENA_ALIGN 8
+
+/*
+ * @brief  Reserve address space for an arena.
+ * @param a  The arena to be initialized.
+ * @param reserve  The most bytes the arena will ever hold.  If that much
+ * address space is not available, the arena is made smaller.
+ * @return 0 on success, -1 if the address space could not be reserved.
+ */
+int arena_init(struct arena *a, size_t reserve) {
+    void *p = MAP_FAILED;
+    // Settle for less address space if the system will not reserve that much
+    while (p == MAP_FAILED && reserve >= ARENA_MIN_RESERVE) {
+        p = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            reserve >>= 1;
+        }
+    }
+    if (p == MAP_FAILED) {
+        a->base = NULL;
+        return -1;
+    }
+    a->base = p;
+    a->reserved = reserve;
+    a->used = 0;
+    return 0;
+}
+
+/*
+ * @brief  Allocate len bytes, aligned for any scalar type.
+ * @return Pointer to zero-filled storage, or NULL if the arena is full.
+ */
+void *arena_alloc(struct arena *a, size_t len) {
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (a->base == NULL || start + len > a->reserved) {
+        return NULL;
+    }
+    a->used = start + len;
+    char *p = a->base + start;
+    for (char *cp = p; cp < p + len; cp++) {
+        *cp = 0;
+    }
+    return p;
+}
+
+/*
+ * @brief  Copy a null-terminated string into the arena.
+ * @return Pointer to the copy, or NULL if the arena is full.
+ */
+char *arena_strdup(struct arena *a, char *str) {
+    char *end = str;
+    while (*end != '\0') {
+        end++;
+    }
+    char *copy = arena_alloc(a, end - str + 1);
+    if (copy != NULL) {
+        char *dst = copy;
+        while ((*dst++ = *str++) != '\0')
+            ;
+    }
+    return copy;
+}
+
+/*
+ * @brief  Remember the current top of the arena, for a later arena_reset().
+ */
+size_t arena_mark(struct arena *a) {
+    return a->used;
+}
+
+/*
+ * @brief  Release everything allocated since arena_mark() returned mark.
+ * @details  Pages that fall entirely above the new top are returned to the
+ * system, so that a large transient allocation does not stay resident.
+ */
+void arena_reset(struct arena *a, size_t mark) {
+    size_t page = 4096;
+    size_t keep = (mark + page - 1) & ~(page - 1);
+    size_t top = (a->used + page - 1) & ~(page - 1);
+    if (top > keep + 64 * page) {
+        madvise(a->base + keep, top - keep, MADV_DONTNEED);
+    }
+    a->used = mark;
+}
+
+/*
+ * @brief  Release the address space of an arena.
+ */
+void arena_free(struct arena *a) {
+    if (a->base != NULL) {
+        munmap(a->base, a->reserved);
+        a->base = NULL;
+    }
+    a->used = 0;
+}
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "context.h"
+#include "copy.h"
+#include "pool.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* Emit a FILE_CHUNK record holding len bytes of data at the given offset. */
+static int emit_chunk(int depth, uint64_t offset, char *data, size_t len) {
+    struct { uint64_t word; } meta;  // Room for the encoded offset
+    unsigned char *mp = (unsigned char *)&meta;
+    FILE *out = context_out();
+    put_be(mp, offset, CHUNK_META_SIZE);
+    if (record_write(out, FILE_CHUNK, depth, HEADER_SIZE + CHUNK_META_SIZE + len) == -1 ||
+        payload_write(out, mp, CHUNK_META_SIZE) == -1 ||
+        (len > 0 && payload_write(out, data, len) == -1)) {
+        fprintf(stderr, "Error: Failed to write file data.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read up to len bytes of a file into buf.  Returns the number of bytes
+ * read, which is less than len only at end of file, or -1 on an error.
+ */
+static ssize_t read_block(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = STATS_TIME(STAT_READ, read(fd, buf + got, len - got));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * @brief  Emit the data of a file as a series of FILE_CHUNK records.
+ * @details  The data that the prefetch pool may already have read from the
+ * start of the file comes first; the rest is read from the descriptor, a
+ * copy block at a time, until end of file.  The series is ended by an empty
+ * chunk whatever the size of the file has become in the meantime.
+ *
+ * @param fd  Descriptor of the file, at the offset just past head, which is
+ * left open; or -1 if head holds the whole file.
+ * @param depth  The value of the depth field of the records.
+ * @param head  Data already read from the start of the file, or NULL.
+ * @param head_len  The number of bytes in head.
+ * @return 0 on success, -1 if the file could not be read or an I/O error
+ * occurred on the output.
+ */
+int chunk_file(int fd, int depth, char *head, size_t head_len) {
+    uint64_t offset = 0;
+    while (head_len > 0) {
+        size_t len = head_len < copy_block_size ? head_len : copy_block_size;
+        if (emit_chunk(depth, offset, head, len) == -1) {
+            return -1;
+        }
+        head += len;
+        head_len -= len;
+        offset += len;
+    }
+
+    if (fd != -1) {
+        char *buf = copy_buffer();
+        if (buf == NULL) {
+            fprintf(stderr, "Error: Failed to allocate copy buffer.\n");
+            return -1;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ssize_t n;
+        while ((n = read_block(fd, buf, copy_block_size)) > 0) {
+            if (emit_chunk(depth, offset, buf, n) == -1) {
+                return -1;
+            }
+            offset += n;
+        }
+        if (n == -1) {
+            fprintf(stderr, "Error: Failed to read file data.\n");
+            return -1;
+        }
+    }
+    return emit_chunk(depth, offset, NULL, 0);
+}
+
+/* Job of a worker: write a chunk at its offset in the file. */
+static void write_chunk(struct pool_slot *slot) {
+    if (pwrite_full(slot->fd, slot->payload, slot->filled, slot->offset) == -1) {
+        fprintf(stderr, "Error: Failed to write file data.\n");
+        slot->error = 1;
+    }
+}
+
+/*
+ * Read the offset that follows the header of a FILE_CHUNK record and check
+ * the record against the depth and the offset that are expected.  Returns
+ * the number of bytes of data in the record, or -1 if it is not valid.
+ */
+static ssize_t read_chunk_meta(struct source *in, struct record_header *hdr, int depth, uint64_t offset) {
+    if (hdr->type != FILE_CHUNK || hdr->depth != (uint32_t)depth ||
+        hdr->size < HEADER_SIZE + CHUNK_META_SIZE ||
+        hdr->size - HEADER_SIZE - CHUNK_META_SIZE > COPY_BLOCK_MAX) {
+        return -1;
+    }
+    unsigned char *mp = source_next(in, CHUNK_META_SIZE);
+    if (mp == NULL || get_be(mp, CHUNK_META_SIZE) != offset) {
+        return -1;
+    }
+    return hdr->size - HEADER_SIZE - CHUNK_META_SIZE;
+}
+
+/*
+ * @brief  Recreate the data of a file from a series of FILE_CHUNK records.
+ * @details  When the worker pool has threads, each chunk is handed to a
+ * worker that writes it at its offset, so the chunks of a file are written
+ * in parallel; from a mapped archive the workers write straight from the
+ * mapping.  Otherwise, or if a chunk does not fit in a slot, it is written
+ * here.
+ *
+ * @param in  The source, positioned after the header of the first record.
+ * @param hdr  The header of the first record; it is overwritten.
+ * @param depth  The expected value of the depth field of the records.
+ * @param fd  Descriptor of the file, which is left open.
+ * @return 0 on success, -1 if the records are invalid or the file could
+ * not be written.
+ */
+int chunk_restore(struct source *in, struct record_header *hdr, int depth, int fd) {
+    struct pool_chain chain = {NULL, NULL};
+    uint64_t offset = 0;
+    int ret = 0;
+
+    while (ret == 0) {
+        ssize_t len = read_chunk_meta(in, hdr, depth, offset);
+        if (len == -1) {
+            fprintf(stderr, "Error: Invalid file chunk record.\n");
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            break;  // The empty chunk ends the file
+        }
+
+        struct pool_slot *slot = NULL;
+        if (pool_workers() > 0 && (in->base != NULL || (size_t)len <= pool_slot_size())) {
+            // Make room by collecting our own oldest jobs first
+            slot = pool_chain_acquire(&chain, &ret);
+        }
+
+        if (slot != NULL) {
+            slot->payload = in->base != NULL ? (char *)source_next(in, len) :
+                (source_read(in, slot->data, len) == 0 ? slot->data : NULL);
+            if (slot->payload == NULL) {
+                fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+                pool_release(slot);
+                ret = -1;
+                break;
+            }
+            if (record_check(in) == -1) {
+                pool_release(slot);
+                ret = -1;
+                break;
+            }
+            slot->filled = len;
+            slot->offset = offset;
+            slot->fd = fd;
+            pool_chain_submit(&chain, slot, write_chunk);
+        } else if (lseek(fd, offset, SEEK_SET) == -1 || copy_from_stream(in, fd, len) == -1 ||
+                   record_check(in) == -1) {
+            ret = -1;
+            break;
+        }
+
+        offset += len;
+        if (record_read(in, hdr) == -1) {
+            fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+            ret = -1;
+        }
+    }
+
+    // Wait for the chunks still being written
+    if (pool_chain_collect(&chain) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * @brief  Consume a series of FILE_CHUNK records without writing it.
+ * @param in  The source, positioned after the header of the first record.
+ * @param hdr  The header of the first record; it is overwritten.
+ * @param depth  The expected value of the depth field of the records.
+ * @return 0 on success, -1 if the records are invalid.
+ */
+int chunk_skip(struct source *in, struct record_header *hdr, int depth) {
+    uint64_t offset = 0;
+    while (1) {
+        ssize_t len = read_chunk_meta(in, hdr, depth, offset);
+        if (len == -1 || copy_skip_stream(in, len) == -1) {
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+        offset += len;
+        if (record_read(in, hdr) == -1) {
+            return -1;
+        }
+    }
+}
@@ -0,0 +1,332 @@
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "compress.h"
+#include "context.h"
+#include "copy.h"
+#include "pool.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * A work area holds the hash table of the compressor, followed by the data
+ * of a block and then by its compressed form.  Jobs run by the pool use the
+ * buffer of their slot; otherwise the work is done here, in a work area
+ * that is mapped on first use.
+ */
+static __thread char *local_work;
+
+#define WORK_TABLE(w)  ((uint32_t *)(w))
+#define WORK_DATA(w)   ((unsigned char *)(w) + LZ_TABLE_SIZE)
+#define WORK_PACKED(w) (WORK_DATA(w) + COMPRESS_BLOCK_SIZE)
+
+static char *work_area(void) {
+    if (local_work == NULL) {
+        void *p = mmap(NULL, COMPRESS_WORK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to allocate compression buffer.\n");
+            return NULL;
+        }
+        local_work = p;
+    }
+    return local_work;
+}
+
+/*
+ * @brief  Release the local work area, at the end of a transplant run
+ * through libtransplant.h.
+ */
+void compress_release(void) {
+    if (local_work != NULL) {
+        munmap(local_work, COMPRESS_WORK_SIZE);
+        local_work = NULL;
+    }
+}
+
+/* Return nonzero if blocks are to be handed to the worker threads. */
+static int parallel(void) {
+    return pool_workers() > 0 && pool_slot_size() >= COMPRESS_WORK_SIZE;
+}
+
+static int pread_full(int fd, unsigned char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = STATS_TIME(STAT_READ, pread(fd, buf, len, offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/*
+ * Compress the len bytes of data in a work area.  *payload is set to the
+ * bytes to be emitted and the length of these is returned.
+ */
+static size_t pack_block(char *work, size_t len, unsigned char **payload) {
+    size_t n = lz_compress(WORK_DATA(work), len, WORK_PACKED(work), COMPRESS_BLOCK_SIZE,
+                           WORK_TABLE(work));
+    if (n == 0) {
+        *payload = WORK_DATA(work);
+        return len;
+    }
+    *payload = WORK_PACKED(work);
+    return n;
+}
+
+/* Job of a worker: read a block of the file and compress it. */
+static void compress_slot(struct pool_slot *slot) {
+    unsigned char *payload;
+    if (pread_full(slot->fd, WORK_DATA(slot->data), slot->size, slot->offset) == -1) {
+        slot->error = 1;
+        return;
+    }
+    slot->filled = pack_block(slot->data, slot->size, &payload);
+    slot->payload = (char *)payload;
+}
+
+/* Emit the COMPRESSED_DATA record of a block. */
+static int emit_block(int depth, size_t len, int last, unsigned char *payload,
+                      size_t plen, int stored) {
+    uint32_t word = len | (stored ? BLOCK_STORED : 0) | (last ? BLOCK_LAST : 0);
+    return block_write(context_out(), depth, word, payload, plen);
+}
+
+/* Emit the block of a finished job and give the slot back. */
+static int emit_slot(struct pool_slot *slot, int depth, off_t size) {
+    int ret = -1;
+    if (pool_wait(slot) == 0 &&
+        emit_block(depth, slot->size, slot->offset + slot->size == size,
+                   (unsigned char *)slot->payload, slot->filled,
+                   (unsigned char *)slot->payload == WORK_DATA(slot->data)) == 0) {
+        ret = 0;
+    }
+    slot->fd = -1;  // The descriptor belongs to the caller
+    pool_release(slot);
+    return ret;
+}
+
+/*
+ * @brief  Emit the data of a file as a series of COMPRESSED_DATA records.
+ * @param fd  Descriptor of the file, which is left open.
+ * @param depth  The value of the depth field of the records.
+ * @param size  The number of bytes of data in the file (at least one).
+ * @return 0 on success, -1 if the file could not be read or an I/O error
+ * occurred on the output.
+ */
+int compress_file(int fd, int depth, off_t size) {
+    struct pool_chain chain = {NULL, NULL};
+    off_t next = 0;  // Offset of the next block to be compressed
+    int ret = 0;
+
+    while (ret == 0 && (next < size || chain.head != NULL)) {
+        size_t len = size - next < COMPRESS_BLOCK_SIZE ? (size_t)(size - next) : COMPRESS_BLOCK_SIZE;
+        struct pool_slot *slot = NULL;
+        if (next < size && parallel()) {
+            // Keep handing out blocks while slots are free
+            slot = pool_acquire(chain.head == NULL);
+        }
+        if (slot != NULL) {
+            slot->fd = fd;
+            slot->offset = next;
+            slot->size = len;
+            pool_chain_submit(&chain, slot, compress_slot);
+            next += len;
+        } else if (chain.head != NULL) {
+            // Emit the oldest block, in file order
+            ret = emit_slot(pool_chain_pop(&chain), depth, size);
+        } else {
+            // No workers: compress the block here
+            char *work = work_area();
+            unsigned char *payload;
+            if (work == NULL || pread_full(fd, WORK_DATA(work), len, next) == -1) {
+                ret = -1;
+                break;
+            }
+            size_t plen = pack_block(work, len, &payload);
+            ret = emit_block(depth, len, next + len == size, payload, plen,
+                             payload == WORK_DATA(work));
+            next += len;
+        }
+    }
+
+    // After a failure, collect the jobs still in flight
+    pool_chain_collect(&chain);
+    return ret;
+}
+
+/* Job of a worker: decompress a block and write it to the file. */
+static void decompress_slot(struct pool_slot *slot) {
+    unsigned char *data = (unsigned char *)slot->payload;
+    if (!slot->mode) {
+        long n = lz_decompress(data, slot->filled, WORK_PACKED(slot->data), COMPRESS_BLOCK_SIZE);
+        if (n != slot->size) {
+            fprintf(stderr, "Error: Corrupt compressed block.\n");
+            slot->error = 1;
+            return;
+        }
+        data = WORK_PACKED(slot->data);
+    }
+    if (pwrite_full(slot->fd, data, slot->size, slot->offset) == -1) {
+        fprintf(stderr, "Error: Failed to write file data.\n");
+        slot->error = 1;
+    }
+}
+
+/*
+ * Read the block word that follows the header of a COMPRESSED_DATA record
+ * and check it.  Returns the word, and the number of bytes in the record
+ * in *plen, or 0 if the record is not valid.
+ */
+static uint32_t read_block_word(struct source *in, struct record_header *hdr, int depth, size_t *plen) {
+    if (hdr->type != COMPRESSED_DATA || hdr->depth != (uint32_t)depth ||
+        hdr->size < HEADER_SIZE + BLOCK_META_SIZE ||
+        hdr->size - HEADER_SIZE - BLOCK_META_SIZE > COMPRESS_BLOCK_SIZE) {
+        return 0;
+    }
+    unsigned char *wp = source_next(in, BLOCK_META_SIZE);
+    if (wp == NULL) {
+        return 0;
+    }
+    uint32_t word = get_be(wp, BLOCK_META_SIZE);
+    size_t len = word & BLOCK_LENGTH;
+    *plen = hdr->size - HEADER_SIZE - BLOCK_META_SIZE;
+    if (len == 0 || len > COMPRESS_BLOCK_SIZE || ((word & BLOCK_STORED) && *plen != len)) {
+        return 0;
+    }
+    return word;
+}
+
+/*
+ * @brief  Recreate the data of a file from a series of COMPRESSED_DATA
+ * records.
+ * @param in  The source, positioned after the header of the first record.
+ * @param hdr  The header of the first record; it is overwritten.
+ * @param depth  The expected value of the depth field of the records.
+ * @param fd  Descriptor of the file, which is left open.
+ * @return 0 on success, -1 if the records are invalid or the file could
+ * not be written.
+ */
+int decompress_file(struct source *in, struct record_header *hdr, int depth, int fd) {
+    struct pool_chain chain = {NULL, NULL};
+    off_t offset = 0;
+    int ret = 0;
+
+    while (ret == 0) {
+        size_t plen;
+        uint32_t word = read_block_word(in, hdr, depth, &plen);
+        if (word == 0) {
+            fprintf(stderr, "Error: Invalid compressed data record.\n");
+            ret = -1;
+            break;
+        }
+        size_t len = word & BLOCK_LENGTH;
+
+        struct pool_slot *slot = NULL;
+        if (parallel()) {
+            // Make room by collecting our own oldest jobs first
+            slot = pool_chain_acquire(&chain, &ret);
+        }
+
+        if (slot != NULL) {
+            unsigned char *src = in->base != NULL ? source_next(in, plen) :
+                (source_read(in, WORK_DATA(slot->data), plen) == 0 ? WORK_DATA(slot->data) : NULL);
+            if (src == NULL) {
+                fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+                pool_release(slot);
+                ret = -1;
+                break;
+            }
+            slot->payload = (char *)src;
+            slot->filled = plen;
+            slot->size = len;
+            slot->offset = offset;
+            slot->mode = word & BLOCK_STORED ? 1 : 0;
+            slot->fd = fd;
+            pool_chain_submit(&chain, slot, decompress_slot);
+        } else {
+            // No workers: decompress the block here
+            char *work = work_area();
+            unsigned char *src = NULL;
+            if (work != NULL) {
+                src = in->base != NULL ? source_next(in, plen) :
+                    (source_read(in, WORK_DATA(work), plen) == 0 ? WORK_DATA(work) : NULL);
+            }
+            if (src == NULL) {
+                fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+                ret = -1;
+                break;
+            }
+            if (!(word & BLOCK_STORED)) {
+                if (lz_decompress(src, plen, WORK_PACKED(work), COMPRESS_BLOCK_SIZE) != (long)len) {
+                    fprintf(stderr, "Error: Corrupt compressed block.\n");
+                    ret = -1;
+                    break;
+                }
+                src = WORK_PACKED(work);
+            }
+            if (pwrite_full(fd, src, len, offset) == -1) {
+                fprintf(stderr, "Error: Failed to write file data.\n");
+                ret = -1;
+                break;
+            }
+        }
+
+        offset += len;
+        if (word & BLOCK_LAST) {
+            break;
+        }
+        if (record_read(in, hdr) == -1) {
+            fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+            ret = -1;
+        }
+    }
+
+    // Wait for the blocks still being written
+    if (pool_chain_collect(&chain) == -1) {
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * @brief  Consume a series of COMPRESSED_DATA records without decoding it.
+ * @param in  The source, positioned after the header of the first record.
+ * @param hdr  The header of the first record; it is overwritten.
+ * @param depth  The expected value of the depth field of the records.
+ * @return 0 on success, -1 if the records are invalid.
+ */
+int compress_skip(struct source *in, struct record_header *hdr, int depth) {
+    while (1) {
+        size_t plen;
+        uint32_t word = read_block_word(in, hdr, depth, &plen);
+        if (word == 0 || copy_skip_stream(in, plen) == -1) {
+            return -1;
+        }
+        if (word & BLOCK_LAST) {
+            return 0;
+        }
+        if (record_read(in, hdr) == -1) {
+            return -1;
+        }
+    }
+}
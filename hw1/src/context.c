@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+#include "context.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+// The default context holds the variables of global.h themselves
+#undef global_options
+#undef path_buf
+#undef path_length
+#undef name_buf
+#undef stderr
+
+static struct context process_context = {
+    &global_options, path_buf, &path_length, name_buf, NULL, NULL, NULL, NULL, NULL
+};
+
+__thread struct context *ctx = &process_context;
+
+/*
+ * @brief  Return the stream from which the run of the calling thread reads
+ * its serialized data.
+ */
+FILE *context_in(void) {
+    return ctx->in != NULL ? ctx->in : stdin;
+}
+
+/*
+ * @brief  Return the stream to which the run of the calling thread writes
+ * its serialized data and listings.
+ */
+FILE *context_out(void) {
+    return ctx->out != NULL ? ctx->out : stdout;
+}
+
+/*
+ * @brief  Return the stream to which the run of the calling thread writes
+ * its messages.
+ */
+FILE *context_err(void) {
+    return ctx->err != NULL ? ctx->err : stderr;
+}
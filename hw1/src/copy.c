@@ -0,0 +1,503 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+#include "copy.h"
+#include "record.h"
+#include "stats.h"
+#include "debug.h"
+#include "transplant.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * The copy buffer is obtained with mmap() rather than malloc(), which
+ * also guarantees that it is page aligned.  It is allocated on first use
+ * and kept until copy_release() is called.
+ */
+
+__thread size_t copy_block_size = COPY_BLOCK_DEFAULT;
+
+static __thread char *copy_buf;
+static __thread size_t copy_buf_size;
+
+static size_t page_size(void) {
+    long ps = sysconf(_SC_PAGESIZE);
+    return ps > 0 ? (size_t)ps : 4096;
+}
+
+/*
+ * @brief  Set the block size used by the copy engine.
+ * @details  The argument is a decimal number of bytes, optionally followed by
+ * one of the suffixes K, M or G (case insensitive).  The result is rounded up
+ * to a whole number of pages.
+ *
+ * @param arg  The string to be parsed.
+ * @return 0 on success, -1 if the string is not a valid block size.
+ */
+int copy_set_block_size(char *arg) {
+    size_t size = 0;
+    char *cp = arg;
+
+    if (*cp < '0' || *cp > '9') {
+        return -1;
+    }
+    while (*cp >= '0' && *cp <= '9') {
+        size = size * 10 + (*cp - '0');
+        if (size > COPY_BLOCK_MAX) {
+            return -1;
+        }
+        cp++;
+    }
+    switch (*cp) {
+        case 'g': case 'G': size <<= 30; cp++; break;
+        case 'm': case 'M': size <<= 20; cp++; break;
+        case 'k': case 'K': size <<= 10; cp++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*cp != '\0' || size == 0 || size > COPY_BLOCK_MAX) {
+        return -1;
+    }
+
+    size_t ps = page_size();
+    copy_block_size = (size + ps - 1) / ps * ps;
+    return 0;
+}
+
+/*
+ * @brief  Return the copy buffer, of copy_block_size bytes, (re)allocating
+ * it if the block size has changed since it was last allocated.
+ * @return The buffer, or NULL if it could not be allocated.
+ */
+char *copy_buffer(void) {
+    if (copy_buf != NULL && copy_buf_size == copy_block_size) {
+        return copy_buf;
+    }
+    copy_release();
+    void *p = mmap(NULL, copy_block_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    copy_buf = p;
+    copy_buf_size = copy_block_size;
+    return copy_buf;
+}
+
+/*
+ * @brief  Release the buffer used by the copy engine.
+ */
+void copy_release(void) {
+    if (copy_buf != NULL) {
+        munmap(copy_buf, copy_buf_size);
+        copy_buf = NULL;
+        copy_buf_size = 0;
+    }
+}
+
+/*
+ * @brief  Write exactly len bytes to fd, retrying after partial writes and
+ * interrupted system calls.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int write_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = STATS_TIME(STAT_WRITE, write(fd, buf, len));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write exactly len bytes to fd at the given offset, retrying after
+ * partial writes and interrupted system calls.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int pwrite_full(int fd, void *buf, size_t len, off_t offset) {
+    char *bp = buf;
+    while (len > 0) {
+        ssize_t n = STATS_TIME(STAT_WRITE, pwrite(fd, bp, len, offset));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        bp += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/* Whether an errno value just means that the kernel won't do this copy. */
+static int kernel_refused(int err) {
+    return err == EINVAL || err == ENOSYS || err == EXDEV || err == EOPNOTSUPP ||
+           err == EBADF || err == ESPIPE || err == EAGAIN || err == EPERM;
+}
+
+/*
+ * @brief  Move data between two file descriptors without copying it through
+ * user space.
+ * @details  The mechanism is chosen by the types of the descriptors: splice()
+ * when either end is a pipe, copy_file_range() between two regular files,
+ * and sendfile() otherwise.  If the kernel refuses the transfer, the caller
+ * is expected to finish the copy with the buffered path; *size is kept up to
+ * date so that it can pick up where the kernel left off.
+ *
+ * @param in_fd  Descriptor to read from, at its current offset.
+ * @param out_fd  Descriptor to write to, at its current offset.
+ * @param size  Number of bytes still to be moved; updated as data is moved.
+ * @return 0 if all the data was moved, 1 if the caller should fall back to
+ * the buffered path for the rest, -1 on an I/O error or premature end of input.
+ */
+static int kernel_copy(int in_fd, int out_fd, off_t *size) {
+    struct stat in_st, out_st;
+    if (fstat(in_fd, &in_st) == -1 || fstat(out_fd, &out_st) == -1) {
+        return 1;
+    }
+    int use_splice = S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode);
+    int use_range = S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode);
+
+    while (*size > 0) {
+        size_t want = *size > (off_t)COPY_BLOCK_MAX ? COPY_BLOCK_MAX : (size_t)*size;
+        ssize_t n;
+        if (use_splice) {
+            n = splice(in_fd, NULL, out_fd, NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else if (use_range) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, want, 0);
+        } else {
+            n = sendfile(out_fd, in_fd, NULL, want);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (use_range && kernel_refused(errno)) {
+                use_range = 0;  // Try sendfile() before giving up
+                continue;
+            }
+            if (kernel_refused(errno)) {
+                debug("kernel copy refused (errno %d), falling back", errno);
+                return 1;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        *size -= n;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Enlarge the kernel buffer of a pipe.
+ * @details  If fd refers to a pipe, its capacity is raised to the copy block
+ * size (at least 1M), or to the largest size the system permits below that,
+ * so that fewer context switches are needed when transplant runs in a
+ * pipeline.  Nothing is done for other kinds of descriptor.
+ *
+ * @param fd  The descriptor of the stream that may be a pipe.
+ */
+void copy_setup_pipe(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        return;
+    }
+    int size = copy_block_size > COPY_BLOCK_DEFAULT ? (int)copy_block_size
+                                                    : (int)COPY_BLOCK_DEFAULT;
+    while (size >= 65536) {
+        if (fcntl(fd, F_SETPIPE_SZ, size) != -1) {
+            debug("pipe buffer on fd %d raised to %d bytes", fd, size);
+            return;
+        }
+        size >>= 1;
+    }
+}
+
+/*
+ * @brief  Copy the contents of a file to the serialized stream.
+ * @details  Exactly size bytes are read from fd, starting at its current
+ * offset, and written to out.  The size is the one that was declared in the
+ * FILE_DATA header, so a file that turns out to be shorter than that is an
+ * error, since the stream would otherwise be left inconsistent with its header.
+ * Bytes beyond size (a file that grew after it was stat'ed) are not copied.
+ *
+ * @param fd  File descriptor open for reading on the file.
+ * @param out  The stream to which the file data is written.
+ * @param size  The number of bytes declared in the FILE_DATA header.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int copy_to_stream(int fd, FILE *out, off_t size) {
+    char *buf = copy_buffer();
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Failed to allocate copy buffer.\n");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // With zero-copy enabled, let the kernel move the data after flushing
+    // whatever headers are still sitting in the stdio buffer.  Data that
+    // has to be checksummed must pass through the buffer.
+    if ((global_options & OPT_ZEROCOPY) && !(global_options & OPT_CHECKSUM) && size > 0 &&
+        fflush(out) == 0) {
+        int ret = STATS_TIME(STAT_STREAM_WRITE, kernel_copy(fd, fileno(out), &size));
+        if (ret == -1) {
+            fprintf(stderr, "Error: File is shorter than its declared size.\n");
+            return -1;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
+    while (size > 0) {
+        size_t want = (off_t)copy_block_size < size ? copy_block_size : (size_t)size;
+        ssize_t n = STATS_TIME(STAT_READ, read(fd, buf, want));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to read file data.\n");
+            return -1;
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: File is shorter than its declared size.\n");
+            return -1;
+        }
+        if (payload_write(out, buf, n) == -1) {
+            fprintf(stderr, "Error: Failed to write file data.\n");
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Copy file data from the serialized stream into a file.
+ * @details  Exactly size bytes are read from in and written to fd.  Running
+ * out of input before size bytes have been read is an error.  When the input
+ * is a mapped archive, the data is written straight from the mapping.
+ *
+ * @param in  The stream from which the file data is read.
+ * @param fd  File descriptor open for writing on the file being re-created.
+ * @param size  The number of data bytes in the FILE_DATA record.
+ * @return 0 in case of success, -1 otherwise.
+ */
+int copy_from_stream(struct source *in, int fd, off_t size) {
+    if (in->base != NULL) {
+        while (size > 0) {
+            size_t want = (off_t)copy_block_size < size ? copy_block_size : (size_t)size;
+            unsigned char *p = source_next(in, want);
+            if (p == NULL) {
+                fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+                return -1;
+            }
+            if (write_full(fd, (char *)p, want) == -1) {
+                fprintf(stderr, "Error: Failed to write file data.\n");
+                return -1;
+            }
+            size -= want;
+        }
+        return 0;
+    }
+
+    // With zero-copy enabled, the part of the payload that the source has
+    // already buffered is written out and the kernel moves the rest from its
+    // descriptor, unless the payload has to be checked against a checksum.
+    if ((global_options & OPT_ZEROCOPY) && !in->checksums && in->fd != -1 && size > 0) {
+        size_t have = source_buffered(in);
+        if ((off_t)have > size) {
+            have = size;
+        }
+        if (have > 0 && write_full(fd, (char *)source_next(in, have), have) == -1) {
+            fprintf(stderr, "Error: Failed to write file data.\n");
+            return -1;
+        }
+        size -= have;
+        off_t left = size;
+        int ret = STATS_TIME(STAT_STREAM_READ, kernel_copy(in->fd, fd, &size));
+        in->offset += left - size;
+        if (ret == -1) {
+            fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+            return -1;
+        }
+        if (ret == 0) {
+            return 0;
+        }
+    }
+
+    char *buf = copy_buffer();
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Failed to allocate copy buffer.\n");
+        return -1;
+    }
+    while (size > 0) {
+        size_t want = (off_t)copy_block_size < size ? copy_block_size : (size_t)size;
+        if (source_read(in, buf, want) == -1) {
+            fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+            return -1;
+        }
+        if (write_full(fd, buf, want) == -1) {
+            fprintf(stderr, "Error: Failed to write file data.\n");
+            return -1;
+        }
+        size -= want;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Discard the next size bytes of payload from the input.
+ * @details  A mapped archive only has its cursor moved.  From a stream,
+ * the part of the payload that the source has already buffered is dropped
+ * and, if its descriptor can seek, the descriptor is moved past the rest with
+ * lseek(), so it is never read; from a pipe, or when the payload has to
+ * be checked against a checksum, the rest is read and dropped a block at a
+ * time.
+ * @return 0 on success, -1 if the input ends early or cannot be read.
+ */
+int copy_skip_stream(struct source *in, off_t size) {
+    return source_skip(in, size);
+}
+
+/*
+ * @brief  Find the next data extent of a file, skipping any hole.
+ * @param fd  Descriptor of the file; its offset is changed.
+ * @param pos  Offset from which to look.
+ * @param size  Size of the file; extents are cut off there.
+ * @param start  Receives the offset of the extent.
+ * @param end  Receives the offset just past the extent.
+ * @return 1 if an extent was found, 0 if only a hole is left, or -1 if the
+ * file system cannot tell.
+ */
+int copy_next_extent(int fd, off_t pos, off_t size, off_t *start, off_t *end) {
+    if (pos >= size) {
+        return 0;
+    }
+    off_t data = lseek(fd, pos, SEEK_DATA);
+    if (data == -1) {
+        return errno == ENXIO ? 0 : -1;
+    }
+    if (data >= size) {
+        return 0;
+    }
+    off_t hole = lseek(fd, data, SEEK_HOLE);
+    if (hole == -1) {
+        return -1;
+    }
+    *start = data;
+    *end = hole < size ? hole : size;
+    return 1;
+}
+
+/*
+ * Copy the data extents of a sparse file and leave holes in between.
+ * Returns 0 on success, 1 if the holes cannot be found, -1 on an I/O error.
+ */
+static int copy_extents(int in_fd, int out_fd, off_t size) {
+    char *buf = copy_buffer();
+    off_t pos = 0, start, end;
+    int found;
+    if (buf == NULL) {
+        return -1;
+    }
+    while ((found = copy_next_extent(in_fd, pos, size, &start, &end)) == 1) {
+        for (off_t off = start; off < end; ) {
+            size_t want = end - off < (off_t)copy_block_size ? (size_t)(end - off) : copy_block_size;
+            ssize_t n = pread(in_fd, buf, want, off);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || lseek(out_fd, off, SEEK_SET) == -1 || write_full(out_fd, buf, n) == -1) {
+                return -1;
+            }
+            off += n;
+        }
+        pos = end;
+    }
+    if (found == -1) {
+        return 1;
+    }
+    return ftruncate(out_fd, size);
+}
+
+/*
+ * @brief  Copy the first size bytes of one regular file into another.
+ * @details  The destination is first made to share the extents of the
+ * source (a reflink), where the file system supports it.  Otherwise the
+ * data is moved by the kernel with copy_file_range() or sendfile(), or
+ * through the copy buffer as a last resort; only the data extents of a
+ * sparse source are copied, so that the holes are kept.  Both descriptors must be at
+ * offset 0.
+ *
+ * @param in_fd  Descriptor of the file to copy.
+ * @param out_fd  Descriptor of the (empty) file to write.
+ * @param size  Number of bytes to copy.
+ * @return 0 on success, -1 on an I/O error or if the source is shorter
+ * than size.
+ */
+int copy_file(int in_fd, int out_fd, off_t size) {
+    struct stat st;
+    if (fstat(in_fd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size == size && ioctl(out_fd, FICLONE, in_fd) == 0) {
+        return 0;
+    }
+    if (st.st_blocks * 512 < st.st_size) {
+        int ret = copy_extents(in_fd, out_fd, size);
+        if (ret != 1) {
+            return ret;
+        }
+        if (lseek(in_fd, 0, SEEK_SET) == -1 || lseek(out_fd, 0, SEEK_SET) == -1) {
+            return -1;
+        }
+    }
+    int ret = kernel_copy(in_fd, out_fd, &size);
+    if (ret != 1) {
+        return ret;
+    }
+    char *buf = copy_buffer();
+    if (buf == NULL) {
+        return -1;
+    }
+    while (size > 0) {
+        size_t want = size > (off_t)copy_block_size ? copy_block_size : (size_t)size;
+        ssize_t n = read(in_fd, buf, want);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || write_full(out_fd, buf, n) == -1) {
+            return -1;
+        }
+        size -= n;
+    }
+    return 0;
+}
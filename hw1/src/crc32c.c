@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "crc32c.h"
+#include "debug.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* The Castagnoli polynomial, bit-reflected. */
+#define CRC32C_POLY 0x82F63B78U
+
+/*
+ * Bytes given to each of the three streams of the interleaved hardware
+ * path per round.  The chains of crc32 instructions are independent, so
+ * their latency overlaps; the cost of combining them is paid once a round.
+ */
+#define STRIDE 2048
+
+/* Slicing-by-8 tables: TABLE(k, b) is the CRC of byte b followed by k zero bytes. */
+#define TABLE(k, b) (*(table + (k) * 256 + (b)))
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static uint32_t *table;
+static int hardware;    /* 0: table, 1: crc32 instruction, 2: also PCLMULQDQ */
+static uint32_t stride_key;
+
+/* 64-bit word that may be loaded from any buffer. */
+typedef uint64_t __attribute__((may_alias)) word64;
+
+/*
+ * x^n modulo the polynomial, bit-reflected (x^0 is the top bit).
+ */
+static uint32_t xpow_mod(uint64_t n) {
+    uint32_t v = 0x80000000U;
+    while (n--) {
+        v = (v & 1) ? (v >> 1) ^ CRC32C_POLY : v >> 1;
+    }
+    return v;
+}
+
+static void crc32c_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        hardware = __builtin_cpu_supports("pclmul") ? 2 : 1;
+        // The product of the carry-less multiply is reduced by a crc32
+        // instruction, which multiplies it by x^33 on the way
+        stride_key = xpow_mod(8 * STRIDE - 33);
+        debug("crc32c: hardware path %d", hardware);
+        return;
+    }
+#endif
+    void *p = mmap(NULL, 8 * 256 * sizeof(uint32_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return;  // crc32c_update() falls back to bitwise computation
+    }
+    table = p;
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t c = b;
+        for (int i = 0; i < 8; i++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        TABLE(0, b) = c;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = TABLE(k - 1, b);
+            TABLE(k, b) = (c >> 8) ^ TABLE(0, c & 0xFF);
+        }
+    }
+}
+
+/* Portable update of the (inverted) register, a byte at a time or by eight. */
+static uint32_t crc_table(uint32_t crc, const unsigned char *p, size_t len) {
+    if (table == NULL) {
+        while (len--) {
+            crc ^= *p++;
+            for (int i = 0; i < 8; i++) {
+                crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+            }
+        }
+        return crc;
+    }
+    while (len >= 8) {
+        uint32_t lo = crc ^ (*p | (uint32_t)*(p + 1) << 8 | (uint32_t)*(p + 2) << 16 |
+                             (uint32_t)*(p + 3) << 24);
+        uint32_t hi = *(p + 4) | (uint32_t)*(p + 5) << 8 | (uint32_t)*(p + 6) << 16 |
+                      (uint32_t)*(p + 7) << 24;
+        crc = TABLE(7, lo & 0xFF) ^ TABLE(6, (lo >> 8) & 0xFF) ^
+              TABLE(5, (lo >> 16) & 0xFF) ^ TABLE(4, lo >> 24) ^
+              TABLE(3, hi & 0xFF) ^ TABLE(2, (hi >> 8) & 0xFF) ^
+              TABLE(1, (hi >> 16) & 0xFF) ^ TABLE(0, hi >> 24);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = TABLE(0, (crc ^ *p++) & 0xFF) ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* Update of the register with the crc32 instruction, one chain. */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, *(const word64 *)p);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = _mm_crc32_u8(c, *p++);
+    }
+    return c;
+}
+
+/* Advance a register over STRIDE zero bytes: multiply it by x^(8 * STRIDE). */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_stride(uint32_t crc) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(stride_key), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+/*
+ * Update of the register over three interleaved chains: each round covers
+ * three consecutive strides, the last two chains starting from zero, and
+ * the results are folded together as (a * x^S + b) * x^S + c.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc_pclmul(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    while (len >= 3 * STRIDE) {
+        uint64_t a = crc, b = 0, c = 0;
+        const unsigned char *end = p + STRIDE;
+        while (p < end) {
+            a = _mm_crc32_u64(a, *(const word64 *)p);
+            b = _mm_crc32_u64(b, *(const word64 *)(p + STRIDE));
+            c = _mm_crc32_u64(c, *(const word64 *)(p + 2 * STRIDE));
+            p += 8;
+        }
+        crc = shift_stride(shift_stride(a) ^ b) ^ c;
+        p += 2 * STRIDE;
+        len -= 3 * STRIDE;
+    }
+    return crc_sse42(crc, p, len);
+}
+#endif
+
+/*
+ * @brief  Extend a CRC-32C over more bytes.
+ * @details  The CRC of a buffer may be computed in pieces: start with 0 and
+ * feed the result of each call to the next.  The CRC of no bytes is 0, and
+ * that of the ASCII string "123456789" is 0xE3069283.
+ *
+ * @param crc  The CRC of the bytes that precede buf.
+ * @param buf  The bytes.
+ * @param len  The number of bytes.
+ * @return The CRC of the bytes that precede buf followed by those of buf.
+ */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (hardware == 2) {
+        return ~crc_pclmul(crc, buf, len);
+    }
+    if (hardware == 1) {
+        return ~crc_sse42(crc, buf, len);
+    }
+#endif
+    return ~crc_table(crc, buf, len);
+}
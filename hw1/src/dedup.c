@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "dedup.h"
+#include "arena.h"
+#include "relpath.h"
+#include "sparse.h"
+#include "compress.h"
+#include "chunk.h"
+#include "copy.h"
+#include "transplant.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * The files emitted so far are kept in an arena, in a hash table keyed by
+ * size, together with their pathnames relative to the serialized
+ * directory.  The pathname of the directory being serialized is kept in
+ * prefix, and earlier files are reopened relative to root_fd.
+ */
+struct dedup_item {
+    struct dedup_item *next;  /* next item in the same bucket */
+    uint64_t size;
+    uint64_t hash;
+    int hashed;               /* nonzero once hash is known */
+    dev_t dev;
+    ino_t ino;
+    struct dedup_ref ref;
+};
+
+#define DEDUP_BUCKETS      65536
+#define DEDUP_BUFFER_SIZE  (1UL << 20)
+#define REF_META_SIZE      8
+
+static __thread struct arena dedup_arena;
+static __thread struct dedup_item **buckets;
+static __thread struct relpath prefix;
+static __thread int root_fd = -1;
+static __thread unsigned char *buf_a;  /* for hashing and for comparisons */
+static __thread unsigned char *buf_b;  /* for comparisons */
+static __thread char *ref_path;        /* for pathnames built when restoring */
+
+static int dedup_init(void) {
+    if (dedup_arena.base == NULL) {
+        if (arena_init(&dedup_arena, ARENA_DEFAULT_RESERVE) == -1 ||
+            (buf_a = arena_alloc(&dedup_arena, DEDUP_BUFFER_SIZE)) == NULL ||
+            (buf_b = arena_alloc(&dedup_arena, DEDUP_BUFFER_SIZE)) == NULL ||
+            (ref_path = arena_alloc(&dedup_arena, PATH_MAX)) == NULL ||
+            relpath_init(&prefix, &dedup_arena) == -1) {
+            fprintf(stderr, "Error: Failed to allocate deduplication table.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  Start recording the files emitted in a stream.
+ * @param root  Pathname of the directory being serialized.
+ * @return 0 on success, -1 if memory could not be reserved or the
+ * directory could not be opened.
+ */
+int dedup_begin(char *root) {
+    if (dedup_init() == -1) {
+        return -1;
+    }
+    arena_reset(&dedup_arena, 2 * DEDUP_BUFFER_SIZE + 2 * PATH_MAX);
+    buckets = arena_alloc(&dedup_arena, DEDUP_BUCKETS * sizeof(struct dedup_item *));
+    if (buckets == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < DEDUP_BUCKETS; i++) {
+        *(buckets + i) = NULL;
+    }
+    if ((root_fd = open(root, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "Error: Failed to open directory.\n");
+        return -1;
+    }
+    prefix.len = 0;
+    *prefix.buf = '\0';
+    return 0;
+}
+
+/*
+ * @brief  Descend into the subdirectory name of the current directory.
+ * @return 0 on success, -1 if the pathname would be too long.
+ */
+int dedup_enter(char *name) {
+    if (relpath_enter(&prefix, name) == -1) {
+        fprintf(stderr, "Error: Pathname too long for deduplication.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Go back up from the directory entered last.
+ */
+void dedup_leave(void) {
+    relpath_leave(&prefix);
+}
+
+/*
+ * Read up to len bytes at offset, as many as the file has.  Returns the
+ * number of bytes read, or -1 on an I/O error.
+ */
+static ssize_t read_at(int fd, unsigned char *buf, size_t len, off_t offset) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* Mix a 64-bit word into a hash value. */
+static uint64_t mix(uint64_t h, uint64_t w) {
+    h ^= w * 0x9E3779B97F4A7C15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xC2B2AE3D27D4EB4FULL;
+}
+
+/*
+ * @brief  Hash the content of a file with the hash used to find duplicates.
+ * @param fd  Descriptor of the file, at any offset.
+ * @param size  Number of bytes to hash, from the start of the file.
+ * @param hash  Receives the hash.
+ * @return 0 on success, -1 if the file could not be read or is shorter
+ * than size.
+ */
+int dedup_hash(int fd, uint64_t size, uint64_t *hash) {
+    if (dedup_init() == -1) {
+        return -1;
+    }
+    uint64_t h = mix(0x27D4EB2F165667C5ULL, size);
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t want = size - offset < DEDUP_BUFFER_SIZE ? size - offset : DEDUP_BUFFER_SIZE;
+        if (read_at(fd, buf_a, want, offset) != (ssize_t)want) {
+            return -1;
+        }
+        uint64_t *wp = (uint64_t *)buf_a;
+        size_t nwords = want / 8;
+        for (size_t i = 0; i < nwords; i++) {
+            h = mix(h, *(wp + i));
+        }
+        uint64_t tail = 0;
+        for (size_t i = nwords * 8; i < want; i++) {
+            tail = (tail << 8) | *(buf_a + i);
+        }
+        h = mix(h, tail);
+        offset += want;
+    }
+    h ^= h >> 29;
+    *hash = h;
+    return 0;
+}
+
+/* Compare the first size bytes of two files.  Returns 1 if they are equal. */
+static int same_bytes(int fd1, int fd2, uint64_t size) {
+    uint64_t offset = 0;
+    while (offset < size) {
+        size_t want = size - offset < DEDUP_BUFFER_SIZE ? size - offset : DEDUP_BUFFER_SIZE;
+        if (read_at(fd1, buf_a, want, offset) != (ssize_t)want ||
+            read_at(fd2, buf_b, want, offset) != (ssize_t)want) {
+            return 0;
+        }
+        for (size_t i = 0; i < want; i++) {
+            if (*(buf_a + i) != *(buf_b + i)) {
+                return 0;
+            }
+        }
+        offset += want;
+    }
+    return 1;
+}
+
+/*
+ * Check an earlier file with the same size as the file open on fd, whose
+ * hash is given.  Returns 1 if it has the same content.
+ */
+static int same_content(struct dedup_item *item, int fd, uint64_t hash) {
+    int efd = -1;
+    if (!item->hashed) {
+        if ((efd = openat(root_fd, item->ref.path, O_RDONLY)) == -1 ||
+            dedup_hash(efd, item->size, &item->hash) == -1) {
+            debug("dedup: cannot rehash %s", item->ref.path);
+            if (efd != -1) {
+                close(efd);
+            }
+            item->size = UINT64_MAX;  // Never a candidate again
+            return 0;
+        }
+        item->hashed = 1;
+    }
+    int ret = item->hash == hash;
+    if (ret && (global_options & OPT_VERIFY)) {
+        if (efd == -1 && (efd = openat(root_fd, item->ref.path, O_RDONLY)) == -1) {
+            return 0;
+        }
+        ret = same_bytes(fd, efd, item->size);
+    }
+    if (efd != -1) {
+        close(efd);
+    }
+    return ret;
+}
+
+/*
+ * @brief  Look up a regular file among the files emitted earlier.
+ * @details  If no earlier file has the same content, the file is recorded,
+ * so that later files can refer to it.
+ *
+ * @param name  Name of the file in the current directory.
+ * @param fd  Descriptor of the file, at any offset.
+ * @param st  Status of the file.
+ * @param offset  Offset of the DIRECTORY_ENTRY record of the file.
+ * @param ref  Receives the earlier file, if one is found.
+ * @return 1 if an earlier file has the same content, 0 if not, -1 on an
+ * I/O error or if memory is exhausted.
+ */
+int dedup_lookup(char *name, int fd, struct stat *st, uint64_t offset, struct dedup_ref *ref) {
+    uint64_t size = st->st_size;
+    struct dedup_item **bucket = buckets + (size * 0x9E3779B1U >> 7) % DEDUP_BUCKETS;
+    uint64_t hash = 0;
+    int hashed = 0;
+
+    for (struct dedup_item *item = *bucket; item != NULL; item = item->next) {
+        if (item->size != size) {
+            continue;
+        }
+        if (item->dev == st->st_dev && item->ino == st->st_ino) {
+            *ref = item->ref;  // Hard link to a file already emitted
+            return 1;
+        }
+        if (!hashed) {
+            if (dedup_hash(fd, size, &hash) == -1) {
+                fprintf(stderr, "Error: Failed to read file for deduplication.\n");
+                return -1;
+            }
+            hashed = 1;
+        }
+        if (same_content(item, fd, hash)) {
+            *ref = item->ref;
+            return 1;
+        }
+    }
+
+    // Record the file
+    size_t len;
+    struct dedup_item *item = arena_alloc(&dedup_arena, sizeof(struct dedup_item));
+    char *path = relpath_join(&prefix, &dedup_arena, name, &len);
+    if (item == NULL || path == NULL) {
+        fprintf(stderr, "Error: Deduplication table too large.\n");
+        return -1;
+    }
+    item->size = size;
+    item->hash = hash;
+    item->hashed = hashed;
+    item->dev = st->st_dev;
+    item->ino = st->st_ino;
+    item->ref.offset = offset;
+    item->ref.path = path;
+    item->ref.len = len;
+    item->next = *bucket;
+    *bucket = item;
+    return 0;
+}
+
+/*
+ * @brief  Emit the FILE_REFERENCE record for an earlier file.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int dedup_write(FILE *out, uint32_t depth, struct dedup_ref *ref) {
+    unsigned char *meta = buf_a;
+    put_be(meta, ref->offset, REF_META_SIZE);
+    if (record_write(out, FILE_REFERENCE, depth, HEADER_SIZE + REF_META_SIZE + ref->len) == -1 ||
+        payload_write(out, meta, REF_META_SIZE) == -1 ||
+        payload_write(out, ref->path, ref->len) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Forget the files recorded for the stream.
+ */
+void dedup_end(void) {
+    if (root_fd != -1) {
+        close(root_fd);
+        root_fd = -1;
+    }
+    if (dedup_arena.base != NULL) {
+        arena_free(&dedup_arena);
+    }
+    buckets = NULL;
+}
+
+/*
+ * Check that a pathname from a FILE_REFERENCE record stays within the
+ * target directory: it must be relative and have no empty, "." or ".."
+ * component.
+ */
+static int safe_path(char *path) {
+    char *comp = path;
+    for (char *cp = path; ; cp++) {
+        if (*cp == '/' || *cp == '\0') {
+            size_t n = cp - comp;
+            if (n == 0 || (n == 1 && *comp == '.') ||
+                (n == 2 && *comp == '.' && *(comp + 1) == '.')) {
+                return 0;
+            }
+            if (*cp == '\0') {
+                return 1;
+            }
+            comp = cp + 1;
+        }
+    }
+}
+
+/*
+ * Recreate the data of a file from the records of the earlier file at the
+ * given offset of an archive that is mapped into memory.
+ */
+static int replay(struct source *in, uint64_t offset, int fd) {
+    struct source sub = *in;
+    struct record_header hdr;
+    if (offset >= (uint64_t)(in->cur - in->base)) {
+        return -1;
+    }
+    source_reposition(&sub, offset);
+    if (record_read(&sub, &hdr) == -1 || hdr.type != DIRECTORY_ENTRY ||
+        source_skip(&sub, hdr.size - HEADER_SIZE) == -1 || record_read(&sub, &hdr) == -1) {
+        return -1;
+    }
+    if (hdr.type == COMPRESSED_DATA) {
+        return decompress_file(&sub, &hdr, hdr.depth, fd);
+    }
+    if (hdr.type == SPARSE_DATA) {
+        return sparse_restore(&sub, &hdr, fd);
+    }
+    if (hdr.type == FILE_CHUNK) {
+        return chunk_restore(&sub, &hdr, hdr.depth, fd);
+    }
+    if (hdr.type != FILE_DATA) {
+        return -1;
+    }
+    return copy_from_stream(&sub, fd, hdr.size - HEADER_SIZE);
+}
+
+/*
+ * @brief  Recreate a file from the earlier file named by a FILE_REFERENCE
+ * record.
+ * @details  The earlier file is copied (or reflinked) from where it was
+ * extracted below the target directory, so every pending write must have
+ * completed.  If it cannot be copied for any reason (it was not extracted,
+ * was replaced by something other than a regular file, or cannot be read)
+ * and the archive is mapped into memory, its data is decoded once more from
+ * the archive instead.
+ *
+ * @param in  The source, positioned after the header of the record.
+ * @param hdr  The header of the record.
+ * @param root  Pathname of the target directory.
+ * @param root_len  Length of that pathname.
+ * @param fd  Descriptor of the file to be written, at offset 0.
+ * @return 0 on success, -1 if the record is invalid or the data could not
+ * be copied.
+ */
+int dedup_restore(struct source *in, struct record_header *hdr, char *root, size_t root_len, int fd) {
+    if (dedup_init() == -1) {
+        return -1;
+    }
+    if (hdr->size <= HEADER_SIZE + REF_META_SIZE || hdr->size - HEADER_SIZE - REF_META_SIZE >= PATH_MAX) {
+        fprintf(stderr, "Error: Invalid file reference record.\n");
+        return -1;
+    }
+    size_t len = hdr->size - HEADER_SIZE - REF_META_SIZE;
+    unsigned char *meta = source_next(in, REF_META_SIZE);
+    if (meta == NULL) {
+        return -1;
+    }
+    uint64_t offset = get_be(meta, REF_META_SIZE);
+
+    // Build root/path in ref_path
+    char *dst = ref_path;
+    if (root_len + 1 + len > PATH_MAX - 1) {
+        fprintf(stderr, "Error: Pathname too long.\n");
+        return -1;
+    }
+    for (char *src = root; src < root + root_len; ) {
+        *dst++ = *src++;
+    }
+    if (root_len > 0) {
+        *dst++ = '/';
+    }
+    char *rel = dst;
+    if (source_read(in, rel, len) == -1) {
+        return -1;
+    }
+    *(rel + len) = '\0';
+    for (char *cp = rel; cp < rel + len; cp++) {
+        if (*cp == '\0') {
+            rel = "";  // Rejected below
+            break;
+        }
+    }
+    if (!safe_path(rel)) {
+        fprintf(stderr, "Error: Invalid pathname in file reference record.\n");
+        return -1;
+    }
+
+    int efd = open(ref_path, O_RDONLY | O_NOFOLLOW);
+    int ret = -1;
+    if (efd != -1) {
+        struct stat st;
+        if (fstat(efd, &st) == 0 && S_ISREG(st.st_mode)) {
+            ret = copy_file(efd, fd, st.st_size);
+        }
+        close(efd);
+    }
+    if (ret == 0) {
+        return 0;
+    }
+    // Whatever kept the earlier file from being copied, decode it again
+    if (in->base != NULL && ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0 &&
+        replay(in, offset, fd) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "Error: Referenced file %s could not be copied.\n", rel);
+    return -1;
+}
+
+/*
+ * @brief  Consume the payload of a FILE_REFERENCE record.
+ * @return 0 on success, -1 if the record is invalid.
+ */
+int dedup_skip(struct source *in, struct record_header *hdr) {
+    if (hdr->size <= HEADER_SIZE + REF_META_SIZE) {
+        return -1;
+    }
+    return copy_skip_stream(in, hdr->size - HEADER_SIZE);
+}
@@ -0,0 +1,161 @@
+#include <fnmatch.h>
+#include <limits.h>
+
+#include "filter.h"
+#include "context.h"
+#include "arena.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * The patterns are kept in a list in a small arena, along with two
+ * PATH_MAX buffers into which pathname components are copied so that they
+ * can be handed to fnmatch() one at a time.
+ */
+struct filter {
+    struct filter *next;
+    char *pattern;
+};
+
+static __thread struct arena filter_arena;
+static __thread struct filter *filters;
+static __thread char *pattern_part;
+static __thread char *path_part;
+
+/*
+ * @brief  Add a pattern to the selection.
+ * @param pattern  The pattern; it must remain valid.  A leading "./" or
+ * "/" is ignored.
+ * @return 0 on success, -1 if memory could not be allocated.
+ */
+int filter_add(char *pattern) {
+    if (filter_arena.base == NULL) {
+        if (arena_init(&filter_arena, ARENA_MIN_RESERVE) == -1 ||
+            (pattern_part = arena_alloc(&filter_arena, PATH_MAX)) == NULL ||
+            (path_part = arena_alloc(&filter_arena, PATH_MAX)) == NULL) {
+            fprintf(stderr, "Error: Failed to allocate filter patterns.\n");
+            return -1;
+        }
+    }
+    struct filter *f = arena_alloc(&filter_arena, sizeof(struct filter));
+    if (f == NULL) {
+        return -1;
+    }
+    while (*pattern == '/' || (*pattern == '.' && *(pattern + 1) == '/')) {
+        pattern += *pattern == '/' ? 1 : 2;
+    }
+    f->pattern = pattern;
+    f->next = filters;
+    filters = f;
+    return 0;
+}
+
+/*
+ * @brief  Remove all the patterns, so that every entry is selected.
+ */
+void filter_clear(void) {
+    if (filter_arena.base != NULL) {
+        arena_free(&filter_arena);
+    }
+    filters = NULL;
+}
+
+/*
+ * @brief  Return nonzero if any pattern has been given.
+ */
+int filter_active(void) {
+    return filters != NULL;
+}
+
+/* Copy the component of str that starts at *cp into buf; advance *cp past it. */
+static void next_part(char **cp, char *buf) {
+    char *src = *cp;
+    char *end = buf + PATH_MAX - 1;
+    while (*src != '\0' && *src != '/' && buf < end) {
+        *buf++ = *src++;
+    }
+    *buf = '\0';
+    if (*src == '/') {
+        src++;
+    }
+    *cp = src;
+}
+
+/*
+ * Return nonzero if the leading components of pattern match all the
+ * components of path and pattern has more components left, so that it may
+ * match an entry below the directory path.
+ */
+static int may_match_below(char *pattern, char *path) {
+    while (*path != '\0') {
+        if (*pattern == '\0') {
+            return 0;
+        }
+        next_part(&pattern, pattern_part);
+        next_part(&path, path_part);
+        if (fnmatch(pattern_part, path_part, 0) != 0) {
+            return 0;
+        }
+    }
+    return *pattern != '\0';
+}
+
+/*
+ * @brief  Return nonzero if patterns have been given and none of them has
+ * any wildcard character, so that each names at most one entry.
+ */
+int filter_literal(void) {
+    for (struct filter *f = filters; f != NULL; f = f->next) {
+        for (char *cp = f->pattern; *cp != '\0'; cp++) {
+            if (*cp == '*' || *cp == '?' || *cp == '[' || *cp == '\\') {
+                return 0;
+            }
+        }
+    }
+    return filters != NULL;
+}
+
+/*
+ * @brief  Return the pattern at position n in the list of patterns, or
+ * NULL if there are no more than n patterns.
+ */
+char *filter_pattern(int n) {
+    struct filter *f = filters;
+    while (f != NULL && n-- > 0) {
+        f = f->next;
+    }
+    return f != NULL ? f->pattern : NULL;
+}
+
+/*
+ * @brief  Decide whether an entry is to be extracted.
+ * @details  The caller is expected not to ask about entries below a
+ * directory for which FILTER_ALL was returned, since they are all selected.
+ *
+ * @param path  Pathname of the entry relative to the target directory.
+ * @param is_dir  Nonzero if the entry is a directory.
+ * @return FILTER_ALL, FILTER_DESCEND (only for a directory) or FILTER_SKIP.
+ */
+int filter_match(char *path, int is_dir) {
+    int verdict = FILTER_SKIP;
+    for (struct filter *f = filters; f != NULL; f = f->next) {
+        if (fnmatch(f->pattern, path, FNM_PATHNAME) == 0) {
+            return FILTER_ALL;
+        }
+        if (is_dir && may_match_below(f->pattern, path)) {
+            verdict = FILTER_DESCEND;
+        }
+    }
+    return verdict;
+}
@@ -0,0 +1,271 @@
+#include "index.h"
+#include "context.h"
+#include "record.h"
+#include "arena.h"
+#include "relpath.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * While serializing, the entries are kept in a list in an arena, together
+ * with their pathnames, and sorted only when the index is written.  The
+ * pathname of the directory being serialized is kept in prefix.
+ */
+struct index_item {
+    struct index_item *next;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t mode;
+    uint32_t len;
+    char *path;
+};
+
+static __thread struct arena index_arena;
+static __thread struct index_item *items;
+static __thread uint64_t count;
+static __thread uint64_t string_bytes;
+static __thread struct relpath prefix;
+
+/*
+ * @brief  Start recording the entries of an archive.
+ * @return 0 on success, -1 if memory could not be reserved.
+ */
+int index_begin(void) {
+    if (index_arena.base == NULL && arena_init(&index_arena, ARENA_DEFAULT_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate archive index.\n");
+        return -1;
+    }
+    arena_reset(&index_arena, 0);
+    if (relpath_init(&prefix, &index_arena) == -1) {
+        return -1;
+    }
+    items = NULL;
+    count = 0;
+    string_bytes = 0;
+    return 0;
+}
+
+/*
+ * @brief  Descend into the subdirectory name of the current directory.
+ * @return 0 on success, -1 if the pathname would be too long.
+ */
+int index_enter(char *name) {
+    if (relpath_enter(&prefix, name) == -1) {
+        fprintf(stderr, "Error: Pathname too long for the archive index.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Go back up from the directory entered last.
+ */
+void index_leave(void) {
+    relpath_leave(&prefix);
+}
+
+/*
+ * @brief  Record an entry of the current directory.
+ * @param name  Name of the entry.
+ * @param mode  Mode, as in its DIRECTORY_ENTRY record.
+ * @param size  Size, as in its DIRECTORY_ENTRY record.
+ * @param offset  Offset of its DIRECTORY_ENTRY record in the archive.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int index_add(char *name, uint32_t mode, uint64_t size, uint64_t offset) {
+    size_t len;
+    struct index_item *item = arena_alloc(&index_arena, sizeof(struct index_item));
+    char *path = relpath_join(&prefix, &index_arena, name, &len);
+    if (item == NULL || path == NULL) {
+        fprintf(stderr, "Error: Archive index too large.\n");
+        return -1;
+    }
+    item->path = path;
+    item->len = len;
+    item->offset = offset;
+    item->size = size;
+    item->mode = mode;
+    item->next = items;
+    items = item;
+    count++;
+    string_bytes += len;
+    return 0;
+}
+
+/* Pathname of an item, for relpath_sort(). */
+static char *item_path(void *item, size_t *len) {
+    *len = ((struct index_item *)item)->len;
+    return ((struct index_item *)item)->path;
+}
+
+/*
+ * @brief  Write the ARCHIVE_INDEX record for the entries recorded so far.
+ * @details  The record starts at record_offset, which must be the offset
+ * in the archive at which the record is written.
+ * @return 0 on success, -1 on an I/O error or if memory is exhausted.
+ */
+int index_write(FILE *out) {
+    uint64_t offset = record_offset;
+    struct index_item **vec = arena_alloc(&index_arena, count * sizeof(struct index_item *));
+    struct index_item **tmp = arena_alloc(&index_arena, count * sizeof(struct index_item *));
+    if (count > 0 && (vec == NULL || tmp == NULL)) {
+        fprintf(stderr, "Error: Archive index too large.\n");
+        return -1;
+    }
+    struct index_item **vp = vec;
+    for (struct index_item *item = items; item != NULL; item = item->next) {
+        *vp++ = item;
+    }
+    vec = (struct index_item **)relpath_sort((void **)vec, (void **)tmp, count, item_path);
+
+    uint64_t size = HEADER_SIZE + count * INDEX_ENTRY_SIZE + string_bytes + INDEX_FOOTER_SIZE;
+    if (record_write(out, ARCHIVE_INDEX, 0, size) == -1) {
+        return -1;
+    }
+    unsigned char *buf = arena_alloc(&index_arena, INDEX_ENTRY_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+    uint64_t string_off = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        struct index_item *item = *(vec + i);
+        put_be(buf, item->offset, 8);
+        put_be(buf + 8, item->size, 8);
+        put_be(buf + 16, item->mode, 4);
+        put_be(buf + 20, item->len, 4);
+        put_be(buf + 24, string_off, 8);
+        if (payload_write(out, buf, INDEX_ENTRY_SIZE) == -1) {
+            return -1;
+        }
+        string_off += item->len;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        struct index_item *item = *(vec + i);
+        if (payload_write(out, item->path, item->len) == -1) {
+            return -1;
+        }
+    }
+    put_be(buf, offset, 8);
+    put_be(buf + 8, count, 8);
+    put_be(buf + 16, INDEX_MAGIC, 8);
+    if (payload_write(out, buf, INDEX_FOOTER_SIZE) == -1) {
+        return -1;
+    }
+    debug("index: %lu entries at offset %lu", (unsigned long)count, (unsigned long)offset);
+    return 0;
+}
+
+/*
+ * @brief  Release the entries recorded for the index.
+ */
+void index_end(void) {
+    if (index_arena.base != NULL) {
+        arena_free(&index_arena);
+    }
+    items = NULL;
+    count = 0;
+}
+
+/*
+ * @brief  Locate the index of an archive that is mapped into memory.
+ * @param view  Receives the location of the index.
+ * @param archive  Start of the archive.
+ * @param len  Length of the archive.
+ * @return 0 on success, -1 if the archive does not end with an index.
+ */
+int index_open(struct index_view *view, unsigned char *archive, size_t len) {
+    struct record_header hdr;
+    if (len < 2 * HEADER_SIZE + INDEX_FOOTER_SIZE) {
+        return -1;
+    }
+    unsigned char *end = archive + len - HEADER_SIZE;
+    if (record_decode(end, &hdr) == -1 || hdr.type != END_OF_TRANSMISSION) {
+        return -1;
+    }
+    // With -C, the CHECKSUM record of END_OF_TRANSMISSION follows the footer
+    if (end - archive >= CHECKSUM_SIZE + HEADER_SIZE + INDEX_FOOTER_SIZE &&
+        record_decode(end - CHECKSUM_SIZE, &hdr) == 0 && hdr.type == CHECKSUM) {
+        end -= CHECKSUM_SIZE;
+    }
+    unsigned char *footer = end - INDEX_FOOTER_SIZE;
+    if (get_be(footer + 16, 8) != INDEX_MAGIC) {
+        return -1;
+    }
+    uint64_t offset = get_be(footer, 8);
+    uint64_t n = get_be(footer + 8, 8);
+    view->record = offset;
+    if (offset > (uint64_t)(end - archive) - HEADER_SIZE || record_decode(archive + offset, &hdr) == -1) {
+        return -1;
+    }
+    if (hdr.type == CHECKSUM) {
+        offset += CHECKSUM_SIZE;
+        if (offset > (uint64_t)(end - archive) - HEADER_SIZE || record_decode(archive + offset, &hdr) == -1) {
+            return -1;
+        }
+    }
+    if (hdr.type != ARCHIVE_INDEX || hdr.size != (uint64_t)(end - (archive + offset)) ||
+        hdr.size < HEADER_SIZE + INDEX_FOOTER_SIZE ||
+        n > (hdr.size - HEADER_SIZE - INDEX_FOOTER_SIZE) / INDEX_ENTRY_SIZE) {
+        return -1;
+    }
+    view->archive = archive;
+    view->table = archive + offset + HEADER_SIZE;
+    view->strings = view->table + n * INDEX_ENTRY_SIZE;
+    view->end = footer;
+    view->count = n;
+    if (view->strings > footer) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Look a pathname up in the index of an archive.
+ * @param view  The index, as located by index_open().
+ * @param path  Pathname relative to the serialized directory, with
+ * components separated by single slashes.
+ * @param entry  Receives the entry, if found.
+ * @return 0 if the pathname was found, -1 otherwise.
+ */
+int index_find(struct index_view *view, char *path, struct index_entry *entry) {
+    size_t len = 0;
+    while (*(path + len) != '\0') {
+        len++;
+    }
+    uint64_t lo = 0, hi = view->count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        unsigned char *ep = view->table + mid * INDEX_ENTRY_SIZE;
+        uint64_t elen = get_be(ep + 20, 4);
+        uint64_t eoff = get_be(ep + 24, 8);
+        if (eoff > (uint64_t)(view->end - view->strings) ||
+            elen > (uint64_t)(view->end - view->strings) - eoff) {
+            return -1;  // Corrupt index
+        }
+        char *epath = (char *)view->strings + eoff;
+        int cmp = relpath_cmp(path, len, epath, elen);
+        if (cmp == 0) {
+            entry->offset = get_be(ep, 8);
+            entry->size = get_be(ep + 8, 8);
+            entry->mode = get_be(ep + 16, 4);
+            return 0;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "context.h"
+#include "arena.h"
+#include "crc32c.h"
+#include "pool.h"
+#include "record.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+__thread char *journal_path;
+
+static __thread int journal_fd = -1;
+static __thread int target_fd = -1;     /* target directory, for syncfs() */
+static __thread struct arena journal_arena;
+static __thread unsigned char *record;  /* JOURNAL_RECORD_SIZE + PATH_MAX bytes */
+static __thread char *resume_dir;       /* PATH_MAX bytes */
+static __thread uint64_t resume_offset;
+static __thread int resume_depth;
+static __thread int resumed;            /* the journal was left by an earlier run */
+static __thread int resuming;           /* its checkpoint has not been reached yet */
+static __thread uint64_t entries;       /* entries restored, including earlier runs */
+static __thread uint64_t last_offset, last_entries;  /* at the last checkpoint */
+
+/* Read up to len bytes, stopping early only at end of file. */
+static ssize_t read_full(int fd, unsigned char *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, buf + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int streq(char *a, char *b) {
+    while (*a != '\0' && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+/*
+ * Read the checkpoints of the journal, keeping the last one, and cut off
+ * whatever follows it.  Set resuming if there is one.
+ */
+static int read_checkpoints(void) {
+    off_t end = 0;
+    while (1) {
+        ssize_t n = read_full(journal_fd, record, JOURNAL_RECORD_SIZE);
+        if (n == -1) {
+            return -1;
+        }
+        if (n < JOURNAL_RECORD_SIZE || get_be(record, 4) != JOURNAL_MAGIC) {
+            break;
+        }
+        uint32_t len = get_be(record + 24, 4);
+        if (len >= PATH_MAX || (n = read_full(journal_fd, record + JOURNAL_RECORD_SIZE, len)) == -1) {
+            return -1;
+        }
+        if ((size_t)n < len || get_be(record + 28, 4) !=
+            crc32c_update(crc32c_update(0, record, 28), record + JOURNAL_RECORD_SIZE, len)) {
+            break;
+        }
+        resume_depth = get_be(record + 4, 4);
+        resume_offset = get_be(record + 8, 8);
+        entries = get_be(record + 16, 8);
+        char *dst = resume_dir;
+        for (unsigned char *src = record + JOURNAL_RECORD_SIZE; src < record + JOURNAL_RECORD_SIZE + len; ) {
+            *dst++ = *src++;
+        }
+        *dst = '\0';
+        resuming = 1;
+        end += JOURNAL_RECORD_SIZE + len;
+    }
+    // A checkpoint cut short by the interruption is dropped
+    return ftruncate(journal_fd, end);
+}
+
+/*
+ * @brief  Open the journal given with -J, if any, for a deserialization
+ * into the directory named by path_buf, and read the checkpoint to resume
+ * from.  The journal is created if it does not exist; if it does, the run
+ * resumes an interrupted one, even if that one was stopped before its
+ * first checkpoint.
+ * @return 0 on success, -1 if the journal cannot be opened or read.
+ */
+int journal_open(void) {
+    if (journal_path == NULL) {
+        return 0;
+    }
+    resumed = resuming = 0;
+    entries = 0;
+    if (arena_init(&journal_arena, ARENA_MIN_RESERVE) == -1 ||
+        (record = arena_alloc(&journal_arena, JOURNAL_RECORD_SIZE + PATH_MAX)) == NULL ||
+        (resume_dir = arena_alloc(&journal_arena, PATH_MAX)) == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the journal.\n");
+        return -1;
+    }
+    if ((target_fd = open(path_buf, O_RDONLY | O_DIRECTORY)) == -1) {
+        fprintf(stderr, "Error: Failed to open the target directory.\n");
+        arena_free(&journal_arena);
+        return -1;
+    }
+    if ((journal_fd = open(journal_path, O_RDWR | O_APPEND)) != -1) {
+        resumed = 1;
+    } else if (errno == ENOENT) {
+        journal_fd = open(journal_path, O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0666);
+    }
+    if (journal_fd == -1 || read_checkpoints() == -1) {
+        fprintf(stderr, "Error: Failed to read the journal '%s'.\n", journal_path);
+        journal_close(-1);
+        return -1;
+    }
+    last_offset = resume_offset;
+    last_entries = entries;
+    debug("journal: %s at offset %lu", resuming ? "resuming" : resumed ? "restarting" : "starting",
+          (unsigned long)resume_offset);
+    return 0;
+}
+
+/*
+ * @brief  Tell whether this run resumes an interrupted one, with or without
+ * a checkpoint, so that the directories it finds already created are to be
+ * entered as they are.
+ */
+int journal_resumed(void) {
+    return resumed;
+}
+
+/*
+ * @brief  Get the checkpoint to resume from, if its offset has not been
+ * reached yet.
+ * @param offset  Set to the offset of the next record to be read.
+ * @param depth  Set to the depth of that record.
+ * @param dir  Set to the pathname, relative to the target directory, of the
+ * directory being restored, "" for the target directory itself.
+ * @return 1 if there is such a checkpoint, 0 otherwise.
+ */
+int journal_resume(uint64_t *offset, int *depth, char **dir) {
+    if (!resuming) {
+        return 0;
+    }
+    *offset = resume_offset;
+    *depth = resume_depth;
+    *dir = resume_dir;
+    return 1;
+}
+
+/* Append a checkpoint, once every entry before offset is on disk. */
+static int checkpoint(uint64_t offset, int depth, char *dir) {
+    if (pool_drain() == -1) {
+        return -1;
+    }
+    if (syncfs(target_fd) == -1) {
+        fprintf(stderr, "Error: Failed to flush the target directory.\n");
+        return -1;
+    }
+    uint32_t len = 0;
+    for (unsigned char *dst = record + JOURNAL_RECORD_SIZE; *dir != '\0'; len++) {
+        *dst++ = *dir++;
+    }
+    put_be(record, JOURNAL_MAGIC, 4);
+    put_be(record + 4, depth, 4);
+    put_be(record + 8, offset, 8);
+    put_be(record + 16, entries, 8);
+    put_be(record + 24, len, 4);
+    put_be(record + 28, crc32c_update(crc32c_update(0, record, 28), record + JOURNAL_RECORD_SIZE, len), 4);
+    size_t size = JOURNAL_RECORD_SIZE + len;
+    for (size_t done = 0; done < size; ) {
+        ssize_t n = write(journal_fd, record + done, size - done);
+        if (n == -1 && errno != EINTR) {
+            fprintf(stderr, "Error: Failed to write the journal.\n");
+            return -1;
+        }
+        done += n > 0 ? n : 0;
+    }
+    if (fdatasync(journal_fd) == -1) {
+        fprintf(stderr, "Error: Failed to write the journal.\n");
+        return -1;
+    }
+    last_offset = offset;
+    last_entries = entries;
+    return 0;
+}
+
+/*
+ * @brief  Called by the deserializer between two entries, before it reads
+ * the next record.
+ * @param offset  Offset of that record in the input.
+ * @param depth  Depth of the directory being restored.
+ * @param dir  Pathname of that directory relative to the target directory.
+ * @return 1 if the record comes before the checkpoint being resumed from,
+ * so that its entry is already on disk, 0 if it is to be restored, and -1
+ * if a checkpoint could not be taken or the input does not match the one
+ * the journal was written for.
+ */
+int journal_at(uint64_t offset, int depth, char *dir) {
+    if (journal_fd == -1) {
+        return 0;
+    }
+    if (resuming) {
+        if (offset < resume_offset) {
+            return 1;
+        }
+        if (offset > resume_offset || depth != resume_depth || !streq(dir, resume_dir)) {
+            fprintf(stderr, "Error: The journal does not match the serialized data.\n");
+            return -1;
+        }
+        resuming = 0;
+        return 0;
+    }
+    if (offset - last_offset < JOURNAL_INTERVAL_BYTES && entries - last_entries < JOURNAL_INTERVAL_ENTRIES) {
+        return 0;
+    }
+    return checkpoint(offset, depth, dir);
+}
+
+/*
+ * @brief  Count an entry restored by this run.
+ */
+void journal_entry(void) {
+    entries++;
+}
+
+/*
+ * @brief  Close the journal at the end of the deserialization, removing it
+ * if the deserialization has succeeded.
+ * @param ret  The result of the deserialization, 0 or -1.
+ * @return ret, or -1 if the journal could not be removed or its checkpoint
+ * was never reached.
+ */
+int journal_close(int ret) {
+    if (target_fd == -1) {
+        return ret;
+    }
+    if (ret == 0 && resuming) {
+        fprintf(stderr, "Error: The journal does not match the serialized data.\n");
+        ret = -1;
+    }
+    if (journal_fd != -1) {
+        close(journal_fd);
+        if (ret == 0 && unlink(journal_path) == -1) {
+            fprintf(stderr, "Error: Failed to remove the journal '%s'.\n", journal_path);
+            ret = -1;
+        }
+    }
+    close(target_fd);
+    journal_fd = target_fd = -1;
+    resumed = resuming = 0;
+    arena_free(&journal_arena);
+    return ret;
+}
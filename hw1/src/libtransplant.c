@@ -0,0 +1,178 @@
+#include <limits.h>
+#include <stdio.h>
+
+#include "libtransplant.h"
+#include "context.h"
+#include "transplant.h"
+#include "arena.h"
+#include "source.h"
+#include "stream.h"
+#include "stats.h"
+#include "server.h"
+#include "shard.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* The backends of the serialized data of a run. */
+struct run_streams {
+    struct transplant_stream *input;   /* or NULL for the standard input */
+    struct transplant_stream *output;  /* or NULL for the standard output */
+    struct transplant_stream in_fd;    /* for the in_fd of the run */
+    struct transplant_stream out_fd;   /* for the out_fd of the run */
+    struct source source;              /* reads a buffer in place or a descriptor */
+};
+
+/* Open the input and output of the run in the current context. */
+static int open_streams(struct run_streams *rs) {
+    struct transplant_stream *in = rs->input;
+    if (in != NULL && in->type == TRANSPLANT_STREAM_BUFFER) {
+        source_open_memory(&rs->source, in->buffer->data, in->buffer->len);
+        ctx->source = &rs->source;
+    } else if (in != NULL && in->type == TRANSPLANT_STREAM_FD) {
+        source_init_fd(&rs->source, in->fd);
+        ctx->source = &rs->source;
+    } else if (in != NULL && (ctx->in = stream_open(in, 0)) == NULL) {
+        return -1;
+    }
+    if (rs->output != NULL && (ctx->out = stream_open(rs->output, 1)) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the input and output of the run in the current context. */
+static int close_streams(struct run_streams *rs) {
+    int ret = 0;
+    if (ctx->in != NULL) {
+        stream_close(rs->input, ctx->in);
+    }
+    if (ctx->source != NULL) {
+        source_close(ctx->source);
+    }
+    if (ctx->out != NULL && stream_close(rs->output, ctx->out) == -1) {
+        fprintf(stderr, "Error: Failed to write the stream.\n");
+        ret = -1;
+    }
+    ctx->in = ctx->out = NULL;
+    ctx->source = NULL;
+    return ret;
+}
+
+/* Run the operation selected by global_options in the current context. */
+static int run_operation(struct transplant *t, struct run_streams *rs) {
+    if ((global_options & (OPT_HELP | OPT_LISTEN)) || remote_path != NULL || shard_active()) {
+        fprintf(stderr, "Error: -h, -L, -R and -o are not available through the library.\n");
+        return -1;
+    }
+    if (t->root != NULL && path_init(t->root) == -1) {
+        fprintf(stderr, "Error: Pathname too long.\n");
+        return -1;
+    }
+    if (open_streams(rs) == -1) {
+        fprintf(stderr, "Error: Failed to open the stream.\n");
+        return -1;
+    }
+    if (stats_start() == -1) {
+        return -1;
+    }
+    int ret = -1;
+    if (global_options & OPT_SERIALIZE) {
+        ret = serialize();
+    } else if (global_options & OPT_DESERIALIZE) {
+        ret = deserialize();
+    }
+    stats_report(ret);
+    return ret;
+}
+
+/*
+ * Build the arguments of validargs() from the options of t, preceded by
+ * op if it is not NULL, and run them in a context of their own.
+ */
+static int run(struct transplant *t, char *op) {
+    struct arena arena;
+    if (arena_init(&arena, ARENA_MIN_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate the transplant context.\n");
+        return -1;
+    }
+    int argc = op != NULL ? 2 : 1;
+    for (char **opt = t->options; opt != NULL && *opt != NULL; opt++) {
+        argc++;
+    }
+    char **argv = arena_alloc(&arena, (argc + 1) * sizeof(char *));
+    struct context *session = arena_alloc(&arena, sizeof(struct context));
+    int *vars = arena_alloc(&arena, 2 * sizeof(int));
+    char *path = arena_alloc(&arena, PATH_MAX);
+    char *name = arena_alloc(&arena, NAME_MAX);
+    struct run_streams *rs = arena_alloc(&arena, sizeof(struct run_streams));
+    if (argv == NULL || session == NULL || vars == NULL || path == NULL || name == NULL || rs == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the transplant context.\n");
+        arena_free(&arena);
+        return -1;
+    }
+    char **arg = argv;
+    *arg++ = "transplant";
+    if (op != NULL) {
+        *arg++ = op;
+    }
+    for (char **opt = t->options; opt != NULL && *opt != NULL; opt++) {
+        *arg++ = *opt;
+    }
+    *arg = NULL;
+    *session = (struct context){vars, path, vars + 1, name, NULL, NULL, NULL, NULL, NULL, t->err};
+    rs->in_fd = (struct transplant_stream){TRANSPLANT_STREAM_FD, t->in_fd, NULL, NULL, NULL, NULL, NULL};
+    rs->out_fd = (struct transplant_stream){TRANSPLANT_STREAM_FD, t->out_fd, NULL, NULL, NULL, NULL, NULL};
+    rs->input = t->input != NULL ? t->input : t->in_fd != -1 ? &rs->in_fd : NULL;
+    rs->output = t->output != NULL ? t->output : t->out_fd != -1 ? &rs->out_fd : NULL;
+
+    struct context *outer = ctx;
+    ctx = session;
+    int ret = validargs(argc, argv) == -1 ? -1 : run_operation(t, rs);
+    if (close_streams(rs) == -1) {
+        ret = -1;
+    }
+    transplant_release();
+    shard_clear();
+    ctx = outer;
+    arena_free(&arena);
+    return ret;
+}
+
+/*
+ * @brief  Run a transplant as the program would with the given options.
+ * @details  The options must select the operation (-s or -d).  The run
+ * takes place on the calling thread, in a context of its own.
+ *
+ * @param t  The description of the run.
+ * @return 0 if the run succeeded, -1 if the options are invalid or the
+ * operation failed.
+ */
+int transplant_run(struct transplant *t) {
+    return run(t, NULL);
+}
+
+/*
+ * @brief  Serialize the tree of files under the directory of t to its
+ * output, as transplant_run() with -s followed by the options of t.
+ */
+int transplant_serialize(struct transplant *t) {
+    return run(t, "-s");
+}
+
+/*
+ * @brief  Restore a tree of files from the input of t into its directory,
+ * as transplant_run() with -d followed by the options of t.
+ */
+int transplant_deserialize(struct transplant *t) {
+    return run(t, "-d");
+}
@@ -0,0 +1,180 @@
+#include "lz.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* No match starts within this many bytes of the end of a block... */
+#define MATCH_LIMIT  12
+/* ...and the last bytes of a block are always literals. */
+#define LAST_LITERALS 5
+#define MAX_OFFSET   65535
+
+static uint32_t read32(unsigned char *p) {
+    return (uint32_t)*p | (uint32_t)*(p + 1) << 8 | (uint32_t)*(p + 2) << 16 | (uint32_t)*(p + 3) << 24;
+}
+
+static uint32_t hash32(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+/* Store the continuation of a length whose nibble is 15. */
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* Emit a sequence; return NULL if it does not fit before oend. */
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, unsigned char *lit,
+                                   size_t nlit, size_t offset, size_t mlen, int last) {
+    if ((size_t)(oend - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1) {
+        return NULL;
+    }
+    unsigned char *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15) {
+        op = put_length(op, nlit - 15);
+    }
+    for (size_t i = 0; i < nlit; i++) {
+        *op++ = *(lit + i);
+    }
+    if (last) {
+        return op;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15) {
+        op = put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+/*
+ * @brief  Compress a block.
+ * @param in  The data to be compressed.
+ * @param len  Number of bytes of data.
+ * @param out  Buffer that receives the compressed block.
+ * @param cap  Size of out.
+ * @param table  Work area of LZ_TABLE_SIZE bytes.
+ * @return The size of the compressed block, or 0 if it would not be
+ * smaller than the data (which is then better stored as is).
+ */
+size_t lz_compress(unsigned char *in, size_t len, unsigned char *out, size_t cap, uint32_t *table) {
+    unsigned char *ip = in;
+    unsigned char *anchor = in;
+    unsigned char *end = in + len;
+    unsigned char *mflimit = len > MATCH_LIMIT ? end - MATCH_LIMIT : in;
+    unsigned char *mlimit = end - LAST_LITERALS;
+    unsigned char *op = out;
+    unsigned char *oend = out + (cap < len ? cap : len);
+
+    for (uint32_t *tp = table; tp < table + (1 << LZ_HASH_LOG); tp++) {
+        *tp = 0;
+    }
+    while (ip < mflimit) {
+        uint32_t seq = read32(ip);
+        uint32_t *slot = table + hash32(seq);
+        unsigned char *ref = in + *slot;
+        *slot = ip - in;
+        if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+            // Skip faster through data that does not compress
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        unsigned char *mp = ip + LZ_MIN_MATCH;
+        unsigned char *rp = ref + LZ_MIN_MATCH;
+        while (mp < mlimit && *mp == *rp) {
+            mp++;
+            rp++;
+        }
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, (mp - ip) - LZ_MIN_MATCH, 0);
+        if (op == NULL) {
+            return 0;
+        }
+        ip = anchor = mp;
+    }
+    op = put_sequence(op, oend, anchor, end - anchor, 0, 0, 1);
+    if (op == NULL || (size_t)(op - out) >= len) {
+        return 0;
+    }
+    return op - out;
+}
+
+/* Read the continuation of a length; return -1 if the input ends first. */
+static int get_length(unsigned char **ipp, unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ipp >= iend) {
+            return -1;
+        }
+        b = *(*ipp)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/*
+ * @brief  Decompress a block.
+ * @details  The input is fully validated: a corrupt block cannot make the
+ * decoder read or write out of bounds.
+ * @param in  The compressed block.
+ * @param len  Size of the compressed block.
+ * @param out  Buffer that receives the data.
+ * @param cap  Size of out.
+ * @return The number of bytes of data, or -1 if the block is corrupt or
+ * the data does not fit in out.
+ */
+long lz_decompress(unsigned char *in, size_t len, unsigned char *out, size_t cap) {
+    unsigned char *ip = in;
+    unsigned char *iend = in + len;
+    unsigned char *op = out;
+    unsigned char *oend = out + cap;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && get_length(&ip, iend, &nlit) == -1) {
+            return -1;
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op)) {
+            return -1;
+        }
+        while (nlit-- > 0) {
+            *op++ = *ip++;
+        }
+        if (ip == iend) {
+            break;  // The last sequence has no match
+        }
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = *ip | (size_t)*(ip + 1) << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) == -1) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - out) || mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+        unsigned char *ref = op - offset;
+        while (mlen-- > 0) {
+            *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
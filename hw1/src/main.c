@@ -3,6 +3,10 @@
 
 #include "global.h"
 #include "debug.h"
+#include "transplant.h"
+#include "libtransplant.h"
+#include "server.h"
+#include "shard.h"
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -29,26 +33,24 @@ int main(int argc, char **argv)
     int ret = validargs(argc, argv);
 
     if (ret == -1) {
-        USAGE(*argv, EXIT_FAILURE);  // Print usage message and exit with failure status
+        TRANSPLANT_USAGE(*argv, EXIT_FAILURE);  // Print usage message and exit with failure status
         return EXIT_FAILURE;         // This line will not be reached but ensures proper exit status
-    } else if (global_options & 0x1) {
-        USAGE(*argv, EXIT_SUCCESS);  // Print usage message and exit with success status for -h flag
+    } else if (global_options & OPT_HELP) {
+        TRANSPLANT_USAGE(*argv, EXIT_SUCCESS);  // Print usage message and exit with success status for -h flag
         return EXIT_SUCCESS;         // This line will not be reached but ensures proper exit status
+    } else if (global_options & OPT_LISTEN) {
+        // Serve sessions on the socket until told to stop
+        return server_run() ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if (remote_path != NULL) {
+        // Have the server run the operation
+        return server_remote(argc, argv) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if (shard_active()) {
+        // Run the operation on each shard in a process of its own
+        return shard_run() ? EXIT_FAILURE : EXIT_SUCCESS;
     } else {
-        // Perform serialization or deserialization
-        if (global_options & 0x2) {
-            // Perform serialization
-            if (serialize()) {
-                return EXIT_FAILURE;  // Return failure status if serialization fails
-            }
-        } else if (global_options & 0x4) {
-            // Perform deserialization
-            if (deserialize()) {
-                return EXIT_FAILURE;  // Return failure status if deserialization fails
-            }
-        }
-        // If you reach this point, the operation was successful
-        return EXIT_SUCCESS;
+        // Perform serialization or deserialization, in a run of its own
+        struct transplant run = {argv + 1, NULL, -1, -1};
+        return transplant_run(&run) ? EXIT_FAILURE : EXIT_SUCCESS;
     }
 }
 
@@ -0,0 +1,436 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "manifest.h"
+#include "context.h"
+#include "arena.h"
+#include "dedup.h"
+#include "record.h"
+#include "relpath.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+__thread char *manifest_in;
+__thread char *manifest_out;
+
+/*
+ * The manifest of the previous run is mapped into memory, with a byte per
+ * entry in seen to tell which entries have been met again.  The entries of
+ * the manifest to be written are kept in a list in an arena, with their
+ * pathnames, and sorted when it is saved.
+ */
+struct manifest_item {
+    struct manifest_item *next;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t ino;
+    uint64_t hash;
+    uint32_t mode;
+    char *path;
+    size_t len;
+};
+
+static __thread struct arena manifest_arena;
+static __thread struct relpath prefix;
+static __thread struct manifest_item *items;
+static __thread uint64_t count;
+static __thread uint64_t string_bytes;
+
+static __thread unsigned char *old_map;
+static __thread size_t old_map_len;
+static __thread unsigned char *old_table;
+static __thread unsigned char *old_strings;
+static __thread uint64_t old_count;
+static __thread unsigned char *seen;
+
+/* Pathname of entry i of the previous manifest, and its length. */
+static char *old_path(uint64_t i, size_t *len) {
+    unsigned char *ep = old_table + i * MANIFEST_ENTRY_SIZE;
+    *len = get_be(ep + 44, 4);
+    return (char *)old_strings + get_be(ep + 32, 8);
+}
+
+/*
+ * Map the manifest of the previous run and check that all its pathnames
+ * lie within it.  A manifest that does not exist yet is taken as empty.
+ */
+static int load_previous(void) {
+    int fd = open(manifest_in, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Error: Failed to open manifest.\n");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < MANIFEST_HEADER_SIZE) {
+        fprintf(stderr, "Error: Invalid manifest.\n");
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map manifest.\n");
+        return -1;
+    }
+    old_map = p;
+    old_map_len = st.st_size;
+    old_count = get_be(old_map + 8, 8);
+    old_table = old_map + MANIFEST_HEADER_SIZE;
+    size_t room = old_map_len - MANIFEST_HEADER_SIZE;
+    if (get_be(old_map, 8) != MANIFEST_MAGIC || old_count > room / MANIFEST_ENTRY_SIZE) {
+        fprintf(stderr, "Error: Invalid manifest.\n");
+        return -1;
+    }
+    old_strings = old_table + old_count * MANIFEST_ENTRY_SIZE;
+    uint64_t string_room = old_map + old_map_len - old_strings;
+    for (uint64_t i = 0; i < old_count; i++) {
+        unsigned char *ep = old_table + i * MANIFEST_ENTRY_SIZE;
+        uint64_t off = get_be(ep + 32, 8);
+        uint64_t len = get_be(ep + 44, 4);
+        if (off > string_room || len > string_room - off) {
+            fprintf(stderr, "Error: Invalid manifest.\n");
+            return -1;
+        }
+    }
+    if ((seen = arena_alloc(&manifest_arena, old_count + 1)) == NULL) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < old_count; i++) {
+        *(seen + i) = 0;
+    }
+    debug("manifest: %lu entries in %s", (unsigned long)old_count, manifest_in);
+    return 0;
+}
+
+/*
+ * @brief  Return nonzero if a manifest is read or written in this run.
+ */
+int manifest_active(void) {
+    return manifest_in != NULL || manifest_out != NULL;
+}
+
+/*
+ * @brief  Start an incremental run: load the manifest of the previous run
+ * given with -m, if any, and start recording the manifest given with -M.
+ * @return 0 on success, -1 if the previous manifest is invalid or memory
+ * could not be reserved.
+ */
+int manifest_begin(void) {
+    if (manifest_arena.base == NULL && arena_init(&manifest_arena, ARENA_DEFAULT_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate manifest.\n");
+        return -1;
+    }
+    arena_reset(&manifest_arena, 0);
+    if (relpath_init(&prefix, &manifest_arena) == -1) {
+        return -1;
+    }
+    items = NULL;
+    count = 0;
+    string_bytes = 0;
+    old_count = 0;
+    if (manifest_in != NULL && load_previous() == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Descend into the subdirectory name of the current directory.
+ * @return 0 on success, -1 if the pathname would be too long.
+ */
+int manifest_enter(char *name) {
+    if (relpath_enter(&prefix, name) == -1) {
+        fprintf(stderr, "Error: Pathname too long for the manifest.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Go back up from the directory entered last.
+ */
+void manifest_leave(void) {
+    relpath_leave(&prefix);
+}
+
+/*
+ * Find the first entry of the previous manifest whose pathname does not
+ * sort before the given one.
+ */
+static uint64_t lower_bound(char *path, size_t len) {
+    uint64_t lo = 0, hi = old_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        size_t elen;
+        char *epath = old_path(mid, &elen);
+        if (relpath_cmp(epath, elen, path, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Hash the regular file name of the directory open on dirfd. */
+static int hash_entry(int dirfd, char *name, uint64_t size, uint64_t *hash) {
+    int fd = openat(dirfd, name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    int ret = dedup_hash(fd, size, hash);
+    close(fd);
+    if (*hash == 0) {
+        *hash = 1;  // 0 means that no hash is recorded
+    }
+    return ret;
+}
+
+/*
+ * @brief  Compare an entry of the current directory with the previous run,
+ * and record it for the manifest to be written.
+ *
+ * @param dirfd  Descriptor of the current directory.
+ * @param name  Name of the entry.
+ * @param st  Status of the entry.
+ * @param old_mode  Receives the mode recorded in the previous run, if the
+ * entry was of another type then.
+ * @return MANIFEST_SAME, MANIFEST_CHANGED or MANIFEST_RETYPED, or -1 if a
+ * file could not be hashed or memory is exhausted.
+ */
+int manifest_check(int dirfd, char *name, struct stat *st, mode_t *old_mode) {
+    size_t len;
+    size_t mark = arena_mark(&manifest_arena);
+    char *path = relpath_join(&prefix, &manifest_arena, name, &len);
+    if (path == NULL) {
+        fprintf(stderr, "Error: Manifest too large.\n");
+        return -1;
+    }
+    uint64_t mtime = (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+    uint64_t hash = 0;
+    int status = MANIFEST_CHANGED;
+
+    uint64_t i = lower_bound(path, len);
+    size_t elen;
+    char *epath = i < old_count ? old_path(i, &elen) : NULL;
+    if (epath != NULL && relpath_cmp(epath, elen, path, len) == 0) {
+        unsigned char *ep = old_table + i * MANIFEST_ENTRY_SIZE;
+        uint32_t mode = get_be(ep + 40, 4);
+        uint64_t size = get_be(ep, 8);
+        *(seen + i) = 1;
+        if ((mode & S_IFMT) != (st->st_mode & S_IFMT)) {
+            *old_mode = mode;
+            status = MANIFEST_RETYPED;
+        } else if (mode == st->st_mode && (S_ISDIR(mode) || size == (uint64_t)st->st_size)) {
+            hash = get_be(ep + 24, 8);
+            if (S_ISDIR(mode) || (get_be(ep + 8, 8) == mtime && get_be(ep + 16, 8) == st->st_ino)) {
+                status = MANIFEST_SAME;
+            } else if (hash != 0) {
+                // Touched or replaced: look at the content
+                uint64_t now;
+                if (hash_entry(dirfd, name, size, &now) == -1) {
+                    fprintf(stderr, "Error: Failed to read file for the manifest.\n");
+                    return -1;
+                }
+                status = now == hash ? MANIFEST_SAME : MANIFEST_CHANGED;
+                hash = now;
+            }
+        }
+    }
+
+    if (manifest_out == NULL) {
+        arena_reset(&manifest_arena, mark);
+        return status;
+    }
+
+    // Hash the files sent by an incremental run
+    if (hash == 0 && status != MANIFEST_SAME && manifest_in != NULL && S_ISREG(st->st_mode) &&
+        hash_entry(dirfd, name, st->st_size, &hash) == -1) {
+        fprintf(stderr, "Error: Failed to read file for the manifest.\n");
+        return -1;
+    }
+    struct manifest_item *item = arena_alloc(&manifest_arena, sizeof(struct manifest_item));
+    if (item == NULL) {
+        fprintf(stderr, "Error: Manifest too large.\n");
+        return -1;
+    }
+    item->size = S_ISREG(st->st_mode) ? (uint64_t)st->st_size : 0;
+    item->mtime = mtime;
+    item->ino = st->st_ino;
+    item->hash = hash;
+    item->mode = st->st_mode;
+    item->path = path;
+    item->len = len;
+    item->next = items;
+    items = item;
+    count++;
+    string_bytes += len;
+    return status;
+}
+
+/*
+ * @brief  Emit an ENTRY_REMOVED record for each entry of the current
+ * directory in the previous run that has not been met in this one.
+ * @details  To be called once all the entries of the directory have been
+ * checked with manifest_check().
+ *
+ * @param out  The stream the records are written to.
+ * @param depth  The depth of the entries of the directory.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int manifest_removed(FILE *out, uint32_t depth) {
+    if (old_count == 0) {
+        return 0;
+    }
+    // The entries below the directory sort together, from its pathname
+    // followed by a slash
+    size_t plen = prefix.len;
+    if (plen > 0) {
+        *(prefix.buf + plen++) = '/';
+    }
+    uint64_t i = plen > 0 ? lower_bound(prefix.buf, plen) : 0;
+    int ret = 0;
+    for (; i < old_count && ret == 0; i++) {
+        size_t elen;
+        char *epath = old_path(i, &elen);
+        if (elen < plen || relpath_cmp(epath, plen, prefix.buf, plen) != 0) {
+            break;
+        }
+        if (*(seen + i)) {
+            continue;
+        }
+        // Only the direct children are removed; their subtrees go with them
+        char *name = epath + plen;
+        size_t nlen = elen - plen;
+        int child = nlen > 0 && nlen < NAME_MAX;
+        for (size_t k = 0; k < nlen && child; k++) {
+            child = *(name + k) != '/' && *(name + k) != '\0';
+        }
+        if (!child) {
+            continue;
+        }
+        char *copy = arena_alloc(&manifest_arena, nlen + 1);
+        if (copy == NULL) {
+            ret = -1;
+            break;
+        }
+        for (size_t k = 0; k < nlen; k++) {
+            *(copy + k) = *(name + k);
+        }
+        *(copy + nlen) = '\0';
+        unsigned char *ep = old_table + i * MANIFEST_ENTRY_SIZE;
+        struct entry_meta meta = { get_be(ep + 40, 4), 0 };
+        ret = removal_write(out, depth, &meta, copy);
+    }
+    *(prefix.buf + prefix.len) = '\0';
+    return ret;
+}
+
+/* Pathname of an item, for relpath_sort(). */
+static char *item_path(void *item, size_t *len) {
+    *len = ((struct manifest_item *)item)->len;
+    return ((struct manifest_item *)item)->path;
+}
+
+/*
+ * @brief  Write the manifest of the entries recorded to the file given
+ * with -M.
+ * @details  The manifest is written to a temporary file next to it, which
+ * then replaces it, so that an interrupted run leaves the previous
+ * manifest in place.
+ * @return 0 on success, -1 on an I/O error or if memory is exhausted.
+ */
+int manifest_save(void) {
+    struct manifest_item **vec = arena_alloc(&manifest_arena, count * sizeof(struct manifest_item *));
+    struct manifest_item **tmp = arena_alloc(&manifest_arena, count * sizeof(struct manifest_item *));
+    unsigned char *buf = arena_alloc(&manifest_arena, MANIFEST_ENTRY_SIZE);
+    size_t out_len = 0;
+    while (*(manifest_out + out_len) != '\0') {
+        out_len++;
+    }
+    char *tmp_path = arena_alloc(&manifest_arena, out_len + 5);
+    if ((count > 0 && (vec == NULL || tmp == NULL)) || buf == NULL || tmp_path == NULL) {
+        fprintf(stderr, "Error: Manifest too large.\n");
+        return -1;
+    }
+    struct manifest_item **vp = vec;
+    for (struct manifest_item *item = items; item != NULL; item = item->next) {
+        *vp++ = item;
+    }
+    vec = (struct manifest_item **)relpath_sort((void **)vec, (void **)tmp, count, item_path);
+
+    char *dst = tmp_path;
+    for (char *src = manifest_out; *src != '\0'; ) {
+        *dst++ = *src++;
+    }
+    for (char *src = ".new"; *src != '\0'; ) {
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+    FILE *f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error: Failed to create manifest.\n");
+        return -1;
+    }
+    put_be(buf, MANIFEST_MAGIC, 8);
+    put_be(buf + 8, count, 8);
+    int ok = fwrite(buf, 1, MANIFEST_HEADER_SIZE, f) == MANIFEST_HEADER_SIZE;
+    uint64_t string_off = 0;
+    for (uint64_t i = 0; i < count && ok; i++) {
+        struct manifest_item *item = *(vec + i);
+        put_be(buf, item->size, 8);
+        put_be(buf + 8, item->mtime, 8);
+        put_be(buf + 16, item->ino, 8);
+        put_be(buf + 24, item->hash, 8);
+        put_be(buf + 32, string_off, 8);
+        put_be(buf + 40, item->mode, 4);
+        put_be(buf + 44, item->len, 4);
+        ok = fwrite(buf, 1, MANIFEST_ENTRY_SIZE, f) == MANIFEST_ENTRY_SIZE;
+        string_off += item->len;
+    }
+    for (uint64_t i = 0; i < count && ok; i++) {
+        struct manifest_item *item = *(vec + i);
+        ok = fwrite(item->path, 1, item->len, f) == item->len;
+    }
+    if (fclose(f) != 0 || !ok || rename(tmp_path, manifest_out) == -1) {
+        fprintf(stderr, "Error: Failed to write manifest.\n");
+        unlink(tmp_path);
+        return -1;
+    }
+    debug("manifest: %lu entries written to %s", (unsigned long)count, manifest_out);
+    return 0;
+}
+
+/*
+ * @brief  Release the manifests.
+ */
+void manifest_end(void) {
+    if (old_map != NULL) {
+        munmap(old_map, old_map_len);
+        old_map = NULL;
+    }
+    old_count = 0;
+    if (manifest_arena.base != NULL) {
+        arena_free(&manifest_arena);
+    }
+    items = NULL;
+    count = 0;
+}
@@ -0,0 +1,96 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "materialize.h"
+#include "copy.h"
+#include "record.h"
+#include "uring.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * Create the file of a slot, write its payload and set its permissions.
+ */
+static void write_slot(struct pool_slot *slot) {
+    int fd = STATS_TIME(STAT_OPEN, open(slot->path, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to create file '%s'.\n", slot->path);
+        slot->error = 1;
+        return;
+    }
+    if (write_full(fd, slot->payload, slot->filled) == -1) {
+        fprintf(stderr, "Error: Failed to write file '%s'.\n", slot->path);
+        slot->error = 1;
+    }
+    if (close(fd) == -1 || STATS_TIME(STAT_CHMOD, chmod(slot->path, slot->mode & 0777)) == -1) {
+        fprintf(stderr, "Error: Failed to finish file '%s'.\n", slot->path);
+        slot->error = 1;
+    }
+}
+
+/*
+ * @brief  Hand the payload of a FILE_DATA record to the worker pool.
+ * @details  The header of the record has already been read from in.  When
+ * the input is a mapped archive the worker writes straight from the
+ * mapping, so any file can be handed over; otherwise the payload is read
+ * into a slot buffer, and a payload that does not fit is left for the
+ * caller.  Failures of the worker are reported by pool_drain().  With
+ * the io_uring backend the file is created in the ring, with its final
+ * permissions, so the umask must be cleared while deserializing.
+ *
+ * @param in  The source positioned at the start of the payload.
+ * @param path  Pathname of the file to be created; it is copied.
+ * @param size  Number of bytes of payload.
+ * @param mode  Permissions to be given to the file.
+ * @return 0 if the file was handed over, 1 if the caller has to create the
+ * file itself (the pool is not running or the payload is too large), -1 if
+ * the payload could not be read.
+ */
+int materialize_submit(struct source *in, char *path, off_t size, mode_t mode) {
+    if (!pool_running() || (in->base == NULL && size > (off_t)pool_slot_size())) {
+        return 1;
+    }
+    struct pool_slot *slot = pool_acquire(1);
+    if (slot == NULL) {
+        return 1;
+    }
+    pool_set_path(slot, path);
+    slot->mode = mode;
+    slot->size = size;
+    slot->filled = size;
+    if (in->base != NULL) {
+        slot->payload = (char *)source_next(in, size);
+    } else if (source_read(in, slot->data, size) == -1) {
+        slot->payload = NULL;
+    }
+    if (slot->payload == NULL) {
+        fprintf(stderr, "Error: Unexpected end of input in file data.\n");
+        pool_release(slot);
+        return -1;
+    }
+    // The file is not created if its data is damaged
+    if (record_check(in) == -1) {
+        pool_release(slot);
+        return -1;
+    }
+    if (!uring_active()) {
+        pool_submit(slot, write_slot, 1);
+    } else if (uring_write_slot(slot) == -1) {
+        pool_release(slot);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "order.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* Request for the first extent of a file. */
+struct first_extent {
+    struct fiemap map;
+    struct fiemap_extent extent;  // fm_extents of map
+};
+
+/*
+ * @brief  Find where the data of a regular file starts on its device.
+ * @details  The extents are not synced first: the data of a file that has
+ * not been written back yet has no place on the device, and such a file is
+ * in the page cache anyway.
+ *
+ * @param dirfd  Descriptor of the directory holding the file.
+ * @param name  Name of the file in that directory.
+ * @param physical  Set to the physical offset of the first extent of the
+ * file, or 0 if it has none.
+ * @return 0 on success, 1 if the extents of the file cannot be had (the
+ * file system does not support FIEMAP), -1 if the file cannot be opened.
+ */
+int order_extent(int dirfd, char *name, uint64_t *physical) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1) {
+        return -1;
+    }
+    struct first_extent req = {0};
+    req.map.fm_start = 0;
+    req.map.fm_length = FIEMAP_MAX_OFFSET;
+    req.map.fm_extent_count = 1;
+    int ret = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, &req.map) == -1) {
+        ret = 1;
+    } else {
+        *physical = req.map.fm_mapped_extents > 0 ? req.extent.fe_physical : 0;
+    }
+    close(fd);
+    return ret;
+}
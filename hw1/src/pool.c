@@ -0,0 +1,528 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "context.h"
+#include "uring.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * All the memory of the pool (its state, thread handles, slots, pathnames
+ * and data buffers) comes from a single mapping.  The state is reached
+ * through the context of the run (see context.h), so that each run in the
+ * process has a pool of its own, or a share of one that is handed to it
+ * with pool_share().  A slot belongs to the run that acquired it, whose
+ * context the worker adopts for the job, and the slots a run holds and
+ * the failures of its detached jobs are counted in its context.
+ */
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;
+    pthread_cond_t done_cv;
+    pthread_cond_t free_cv;
+
+    size_t size;              /* size of the mapping */
+    size_t slot_size;         /* size of the data buffer of each slot */
+    int nworkers;
+    int nslots;
+    int nfree;
+    int stopping;
+    pthread_t *threads;
+    struct pool_slot *slots;
+
+    struct pool_slot *free_slots;
+    struct pool_slot *queue_head;
+    struct pool_slot *queue_tail;
+};
+
+/* Pool shared by the runs of the calling thread, or NULL, and the number
+ * of its workers that those runs may use. */
+static __thread struct pool *shared_pool;
+static __thread int shared_workers;
+
+/* Put a slot back on the free list.  Called with the lock held. */
+static void put_free(struct pool *pool, struct pool_slot *slot) {
+    if (slot->owner != NULL) {
+        slot->owner->pool_jobs--;
+        slot->owner = NULL;
+    }
+    slot->state = SLOT_FREE;
+    slot->next = pool->free_slots;
+    pool->free_slots = slot;
+    pool->nfree++;
+    pthread_cond_broadcast(&pool->free_cv);
+}
+
+static void *worker_main(void *arg) {
+    ctx = arg;
+    struct pool *pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->queue_head == NULL && !pool->stopping) {
+            pthread_cond_wait(&pool->work_cv, &pool->lock);
+        }
+        if (pool->queue_head == NULL) {
+            break;
+        }
+        struct pool_slot *slot = pool->queue_head;
+        pool->queue_head = slot->next;
+        if (pool->queue_head == NULL) {
+            pool->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        ctx = slot->owner;
+        slot->run(slot);
+        pool_complete(slot);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * @brief  Mark the job of a slot as done.
+ * @details  A detached slot is released, recording a failure for
+ * pool_drain(); otherwise the slot is handed back to pool_wait().
+ */
+void pool_complete(struct pool_slot *slot) {
+    struct pool *pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    if (slot->detached) {
+        if (slot->error) {
+            slot->owner->pool_failed = 1;
+        }
+        put_free(pool, slot);
+    } else {
+        slot->state = SLOT_DONE;
+    }
+    pthread_cond_broadcast(&pool->done_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * @brief  Start the worker pool.
+ * @details  Nothing is started if workers is less than 2, in which case
+ * pool_acquire() always fails and callers do the work themselves.  If the
+ * io_uring backend is active, URING_SLOTS slots are set up regardless of
+ * workers, and no threads are started.  Otherwise, if a pool has been
+ * handed to the calling thread with pool_share(), the run takes a share of
+ * it, of slots_per_worker slots for each of the workers it may use, and
+ * slot_size is that of the shared pool; a run that may use fewer than two
+ * runs without a pool.
+ *
+ * @param workers  Number of worker threads.
+ * @param slots_per_worker  Number of job slots per worker thread.
+ * @param slot_size  Size of the data buffer of each slot.
+ * @return 0 on success, -1 if the pool could not be set up.
+ */
+int pool_start(int workers, int slots_per_worker, size_t slot_size) {
+    int nslots;
+    if (ctx->pool != NULL) {
+        return 0;
+    }
+    ctx->pool_jobs = 0;
+    ctx->pool_failed = 0;
+    if (shared_pool != NULL && !uring_active()) {
+        int share = workers < shared_workers ? workers : shared_workers;
+        share = share < shared_pool->nworkers ? share : shared_pool->nworkers;
+        if (share >= 2) {
+            ctx->pool_limit = share * slots_per_worker;
+            ctx->pool = shared_pool;
+        }
+        return 0;
+    }
+    if (uring_active()) {
+        workers = 0;
+        nslots = URING_SLOTS;
+    } else if (workers < 2) {
+        return 0;
+    } else {
+        nslots = workers * slots_per_worker;
+    }
+    size_t ps = sysconf(_SC_PAGESIZE);
+    size_t head = sizeof(struct pool) + workers * sizeof(pthread_t) + nslots * sizeof(struct pool_slot)
+                  + (size_t)nslots * PATH_MAX;
+    head = (head + ps - 1) / ps * ps;
+    slot_size = (slot_size + ps - 1) / ps * ps;
+    size_t size = head + nslots * slot_size;
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to allocate worker buffers.\n");
+        return -1;
+    }
+    struct pool *pool = p;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cv, NULL);
+    pthread_cond_init(&pool->done_cv, NULL);
+    pthread_cond_init(&pool->free_cv, NULL);
+    pool->size = size;
+    pool->slot_size = slot_size;
+    pool->nslots = nslots;
+    pool->threads = (pthread_t *)(pool + 1);
+    pool->slots = (struct pool_slot *)(pool->threads + workers);
+    char *paths = (char *)(pool->slots + nslots);
+    char *data = (char *)p + head;
+
+    for (int i = nslots - 1; i >= 0; i--) {
+        struct pool_slot *slot = pool->slots + i;
+        slot->path = paths + (size_t)i * PATH_MAX;
+        slot->data = data + i * slot_size;
+        slot->index = i;
+        put_free(pool, slot);
+    }
+
+    ctx->pool = pool;
+    ctx->pool_limit = nslots;
+    for (pool->nworkers = 0; pool->nworkers < workers; pool->nworkers++) {
+        if (pthread_create(pool->threads + pool->nworkers, NULL, worker_main, ctx) != 0) {
+            fprintf(stderr, "Error: Failed to start worker thread.\n");
+            pool_stop();
+            return -1;
+        }
+    }
+    debug("pool: %d workers, %d slots of %zu bytes", workers, nslots, slot_size);
+    return 0;
+}
+
+/*
+ * Leave a shared pool: wait for the jobs of the run still queued and take
+ * back the slots that it has not released.
+ */
+static void pool_leave(struct pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    struct pool_slot *slot = pool->slots;
+    while (slot < pool->slots + pool->nslots) {
+        if (slot->owner == ctx && slot->state == SLOT_QUEUED) {
+            pthread_cond_wait(&pool->done_cv, &pool->lock);
+            slot = pool->slots;
+        } else {
+            slot++;
+        }
+    }
+    for (slot = pool->slots; slot < pool->slots + pool->nslots; slot++) {
+        if (slot->owner == ctx) {
+            if (slot->fd != -1) {
+                close(slot->fd);
+                slot->fd = -1;
+            }
+            put_free(pool, slot);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    ctx->pool = NULL;
+}
+
+/*
+ * @brief  Stop the worker threads and release the memory of the pool.
+ * @details  Any work still queued is finished first.  A run that has a
+ * share of a pool handed to it with pool_share() leaves the pool instead,
+ * once its own jobs are finished.
+ */
+void pool_stop(void) {
+    struct pool *pool = ctx->pool;
+    if (pool == NULL) {
+        return;
+    }
+    if (pool == shared_pool) {
+        pool_leave(pool);
+        return;
+    }
+    if (pool->nworkers == 0) {
+        uring_wait_all();
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nworkers; i++) {
+        pthread_join(*(pool->threads + i), NULL);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cv);
+    pthread_cond_destroy(&pool->done_cv);
+    pthread_cond_destroy(&pool->free_cv);
+    ctx->pool = NULL;
+    munmap(pool, pool->size);
+}
+
+/*
+ * @brief  Have the runs of the calling thread share the pool of another
+ * run instead of starting pools of their own.
+ * @param pool  The pool, which must outlive those runs, or NULL to stop
+ * sharing.
+ * @param workers  Number of its workers that a run may use at most.
+ */
+void pool_share(struct pool *pool, int workers) {
+    shared_pool = pool;
+    shared_workers = workers;
+}
+
+/*
+ * @brief  Return nonzero if the pool has been started.
+ */
+int pool_running(void) {
+    return ctx->pool != NULL;
+}
+
+/*
+ * @brief  Return the number of worker threads, which is 0 if the pool is
+ * not running or the io_uring backend is in use.
+ */
+int pool_workers(void) {
+    return ctx->pool != NULL ? ctx->pool->nworkers : 0;
+}
+
+/*
+ * @brief  Return the size of the data buffer of each slot, or 0 if the
+ * pool is not running.
+ */
+size_t pool_slot_size(void) {
+    return ctx->pool != NULL ? ctx->pool->slot_size : 0;
+}
+
+/*
+ * @brief  Obtain a free slot.
+ * @details  The slot belongs to the run of the calling thread until it is
+ * released.  A run that holds as many slots as it may is treated as if no
+ * slot were free.
+ * @param wait  If nonzero, wait for a slot to become free; otherwise fail
+ * immediately when none is.
+ * @return A slot, or NULL if the pool is not running or (when not waiting)
+ * all slots are in use.
+ */
+struct pool_slot *pool_acquire(int wait) {
+    struct pool *pool = ctx->pool;
+    if (pool == NULL) {
+        return NULL;
+    }
+    if (pool->nworkers == 0) {
+        // Ring mode: slots come free as completions are reaped
+        while (pool->free_slots == NULL && uring_reap(wait) > 0) {
+            continue;
+        }
+    }
+    pthread_mutex_lock(&pool->lock);
+    while ((pool->free_slots == NULL || ctx->pool_jobs >= ctx->pool_limit) && wait && pool->nworkers > 0) {
+        pthread_cond_wait(&pool->free_cv, &pool->lock);
+    }
+    struct pool_slot *slot = ctx->pool_jobs < ctx->pool_limit ? pool->free_slots : NULL;
+    if (slot != NULL) {
+        pool->free_slots = slot->next;
+        pool->nfree--;
+        slot->owner = ctx;
+        ctx->pool_jobs++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (slot != NULL) {
+        slot->next = NULL;
+        slot->detached = 0;
+        slot->error = 0;
+        slot->fd = -1;
+        slot->dirfd = AT_FDCWD;
+        slot->mode = 0;
+        slot->size = 0;
+        slot->filled = 0;
+        slot->payload = slot->data;
+        *slot->path = '\0';
+    }
+    return slot;
+}
+
+/*
+ * @brief  Copy a pathname into a slot.
+ */
+void pool_set_path(struct pool_slot *slot, char *path) {
+    char *dst = slot->path;
+    char *end = slot->path + PATH_MAX - 1;
+    while (*path != '\0' && dst < end) {
+        *dst++ = *path++;
+    }
+    *dst = '\0';
+}
+
+/*
+ * @brief  Queue a job to be run by a worker thread.
+ * @param slot  A slot obtained from pool_acquire() and filled in.
+ * @param run  The function that does the job.  It reports failure by
+ * setting the error field of the slot.
+ * @param detached  If nonzero, the slot is released as soon as the job is
+ * done and a failure is reported by pool_drain(); otherwise the producer
+ * collects the result with pool_wait() and pool_release().
+ */
+void pool_submit(struct pool_slot *slot, void (*run)(struct pool_slot *), int detached) {
+    struct pool *pool = ctx->pool;
+    slot->run = run;
+    slot->detached = detached;
+    pthread_mutex_lock(&pool->lock);
+    slot->state = SLOT_QUEUED;
+    if (pool->queue_tail != NULL) {
+        pool->queue_tail->next = slot;
+    } else {
+        pool->queue_head = slot;
+    }
+    pool->queue_tail = slot;
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * @brief  Wait until a (non-detached) job is done.
+ * @return 0 if the job succeeded, -1 if it failed.
+ */
+int pool_wait(struct pool_slot *slot) {
+    struct pool *pool = ctx->pool;
+    while (pool->nworkers == 0 && slot->state != SLOT_DONE) {
+        if (uring_reap(1) == -1) {
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (slot->state != SLOT_DONE) {
+        pthread_cond_wait(&pool->done_cv, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot->error ? -1 : 0;
+}
+
+/*
+ * @brief  Return a slot to the pool once its result has been consumed.
+ * @details  A descriptor left open in the slot is closed.
+ */
+void pool_release(struct pool_slot *slot) {
+    struct pool *pool = ctx->pool;
+    if (slot->fd != -1) {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    put_free(pool, slot);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * @brief  Wait until every slot of the run of the calling thread is free
+ * again.
+ * @return 0 if all detached jobs of the run succeeded, -1 if any of them
+ * failed.
+ */
+int pool_drain(void) {
+    struct pool *pool = ctx->pool;
+    if (pool == NULL) {
+        return 0;
+    }
+    if (pool->nworkers == 0 && uring_wait_all() == -1) {
+        ctx->pool_failed = 1;
+    }
+    pthread_mutex_lock(&pool->lock);
+    while (ctx->pool_jobs > 0) {
+        pthread_cond_wait(&pool->free_cv, &pool->lock);
+    }
+    int ret = ctx->pool_failed ? -1 : 0;
+    ctx->pool_failed = 0;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/*
+ * @brief  Return nonzero if a detached job of the run of the calling
+ * thread has failed since the last pool_drain().
+ */
+int pool_failed(void) {
+    struct pool *pool = ctx->pool;
+    pthread_mutex_lock(&pool->lock);
+    int ret = ctx->pool_failed;
+    pthread_mutex_unlock(&pool->lock);
+    return ret;
+}
+
+/*
+ * @brief  Queue a job and append its slot to the jobs in flight of a
+ * producer, which it collects in the order they were submitted.
+ */
+void pool_chain_submit(struct pool_chain *chain, struct pool_slot *slot, void (*run)(struct pool_slot *)) {
+    slot->chain = NULL;
+    if (chain->tail != NULL) {
+        chain->tail->chain = slot;
+    } else {
+        chain->head = slot;
+    }
+    chain->tail = slot;
+    pool_submit(slot, run, 0);
+}
+
+/*
+ * @brief  Take the oldest job in flight off a chain.
+ * @return The slot of the job, which may not be done yet, or NULL if the
+ * chain is empty.
+ */
+struct pool_slot *pool_chain_pop(struct pool_chain *chain) {
+    struct pool_slot *slot = chain->head;
+    if (slot != NULL) {
+        chain->head = slot->chain;
+        if (chain->head == NULL) {
+            chain->tail = NULL;
+        }
+    }
+    return slot;
+}
+
+/* Wait for the job of a slot and give the slot back. */
+static int collect_slot(struct pool_slot *slot) {
+    int ret = pool_wait(slot);
+    slot->fd = -1;  // The descriptor belongs to the producer
+    pool_release(slot);
+    return ret;
+}
+
+/*
+ * @brief  Obtain a free slot for a producer with a chain of jobs in flight.
+ * @details  While no slot is free, the oldest job of the chain is waited
+ * for and its slot taken back, so that a producer never waits on slots
+ * held by others while its own jobs could make room.  With an empty chain,
+ * this waits for a slot.
+ * @param failed  Set to -1 if a job collected here failed.
+ * @return A slot, or NULL if the pool is not running.
+ */
+struct pool_slot *pool_chain_acquire(struct pool_chain *chain, int *failed) {
+    struct pool_slot *slot;
+    while ((slot = pool_acquire(chain->head == NULL)) == NULL && chain->head != NULL) {
+        if (collect_slot(pool_chain_pop(chain)) == -1) {
+            *failed = -1;
+        }
+    }
+    return slot;
+}
+
+/*
+ * @brief  Wait for all the jobs of a chain and take their slots back.
+ * @return 0 if all of them succeeded, -1 if any failed.
+ */
+int pool_chain_collect(struct pool_chain *chain) {
+    int ret = 0;
+    struct pool_slot *slot;
+    while ((slot = pool_chain_pop(chain)) != NULL) {
+        if (collect_slot(slot) == -1) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
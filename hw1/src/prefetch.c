@@ -0,0 +1,91 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "prefetch.h"
+#include "uring.h"
+#include "transplant.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * Open the file of a slot and read as much of it as fits in the slot
+ * buffer.  If the file is larger than that, or with -K, the descriptor
+ * is left open so that the serializer can copy the rest.
+ */
+static void fill_slot(struct pool_slot *slot) {
+    size_t want = (off_t)pool_slot_size() < slot->size ? pool_slot_size() : (size_t)slot->size;
+
+    slot->fd = STATS_TIME(STAT_OPEN, openat(slot->dirfd, slot->path, O_RDONLY));
+    if (slot->fd == -1) {
+        slot->error = 1;
+        return;
+    }
+    posix_fadvise(slot->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (slot->filled < want) {
+        ssize_t n = STATS_TIME(STAT_READ, read(slot->fd, slot->data + slot->filled, want - slot->filled));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n == 0 && (global_options & OPT_CHUNK)) {
+            break;  // The file has shrunk; chunk_file() sends what there is
+        }
+        if (n <= 0) {
+            slot->error = 1;
+            break;
+        }
+        slot->filled += n;
+    }
+    // With -K the file is read on until end of file, so it stays open
+    if (slot->error || ((off_t)slot->filled == slot->size && !(global_options & OPT_CHUNK))) {
+        close(slot->fd);
+        slot->fd = -1;
+    }
+}
+
+/*
+ * @brief  Queue a file to be read ahead.
+ * @details  This never blocks: if the pool is not running or all its
+ * slots are in use, the request is declined and the caller reads the
+ * file itself.  With the io_uring backend, files larger than a slot are
+ * declined as well, since the ring closes each file after a single read,
+ * and so is every file with -K, which must be read until end of file.
+ *
+ * @param dirfd  Descriptor of the directory that path is relative to; it
+ * must stay open until the slot has been released.
+ * @param path  Pathname of the file; it is copied.
+ * @param size  The size of the file, as will be declared in its FILE_DATA
+ * header.  Reading stops after this many bytes.
+ * @return The slot that will receive the data, or NULL if declined.
+ */
+struct pool_slot *prefetch_submit(int dirfd, char *path, off_t size) {
+    if (uring_active() && (size > (off_t)pool_slot_size() || (global_options & OPT_CHUNK))) {
+        return NULL;
+    }
+    struct pool_slot *slot = pool_acquire(0);
+    if (slot == NULL) {
+        return NULL;
+    }
+    pool_set_path(slot, path);
+    slot->dirfd = dirfd;
+    slot->size = size;
+    if (!uring_active()) {
+        pool_submit(slot, fill_slot, 0);
+    } else if (uring_read_slot(slot) == -1) {
+        pool_release(slot);
+        return NULL;
+    }
+    return slot;
+}
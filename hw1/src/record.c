@@ -0,0 +1,470 @@
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "record.h"
+#include "crc32c.h"
+#include "transplant.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * Records are assembled in a scratch page, so that a whole record prefix
+ * costs a single fwrite() on the stream.  The page is large enough for a
+ * header, the DIRECTORY_ENTRY metadata and any name of up to NAME_MAX bytes,
+ * and a CHECKSUM record is assembled at its end.  On input, source_next()
+ * hands out a record prefix in one piece.
+ */
+#define SCRATCH_SIZE 4096
+
+static __thread unsigned char *scratch;
+
+static unsigned char *scratch_page(void) {
+    if (scratch == NULL) {
+        void *p = mmap(NULL, SCRATCH_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+        scratch = p;
+    }
+    return scratch;
+}
+
+/*
+ * @brief  Release the scratch page, at the end of a transplant run through
+ * libtransplant.h.
+ */
+void record_release(void) {
+    if (scratch != NULL) {
+        munmap(scratch, SCRATCH_SIZE);
+        scratch = NULL;
+    }
+}
+
+__thread uint64_t record_offset;
+
+/* Write len bytes to the stream.  Returns 0 on success, -1 on an I/O error. */
+static int stream_write(FILE *out, void *buf, size_t len) {
+    return STATS_TIME(STAT_STREAM_WRITE, fwrite(buf, 1, len, out)) == len ? 0 : -1;
+}
+
+/* With -C, the CRC-32C of the payload written since the last header. */
+static __thread uint32_t payload_crc;
+
+/*
+ * @brief  Start writing a new stream: reset record_offset and the checksum
+ * of the payload.
+ */
+void record_reset(void) {
+    record_offset = 0;
+    payload_crc = 0;
+}
+
+/*
+ * With -C, write the CHECKSUM record that goes before the header encoded at
+ * the start of the scratch page, and start the checksum of its payload.
+ */
+static int checksum_write(FILE *out) {
+    if (!(global_options & OPT_CHECKSUM)) {
+        return 0;
+    }
+    unsigned char *buf = scratch + SCRATCH_SIZE - CHECKSUM_SIZE;
+    record_encode(buf, CHECKSUM, 0, CHECKSUM_SIZE);
+    put_be(buf + HEADER_SIZE, payload_crc, 4);
+    put_be(buf + HEADER_SIZE + 4, crc32c_update(0, scratch, HEADER_SIZE), 4);
+    payload_crc = 0;
+    record_offset += CHECKSUM_SIZE;
+    return stream_write(out, buf, CHECKSUM_SIZE);
+}
+
+/* With -C, add bytes of payload to its checksum. */
+static void checksum_payload(void *buf, size_t len) {
+    if (global_options & OPT_CHECKSUM) {
+        payload_crc = crc32c_update(payload_crc, buf, len);
+    }
+}
+
+/*
+ * @brief  Store value as an nbytes-long big-endian integer.
+ */
+void put_be(unsigned char *buf, uint64_t value, int nbytes) {
+    unsigned char *bp = buf + nbytes;
+    while (bp > buf) {
+        *--bp = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/*
+ * @brief  Load an nbytes-long big-endian integer.
+ */
+uint64_t get_be(unsigned char *buf, int nbytes) {
+    uint64_t value = 0;
+    unsigned char *end = buf + nbytes;
+    while (buf < end) {
+        value = (value << 8) | *buf++;
+    }
+    return value;
+}
+
+/*
+ * @brief  Encode a record header.
+ * @param buf  Buffer of at least HEADER_SIZE bytes that receives the header.
+ * @param type  The record type.
+ * @param depth  The value of the depth field.
+ * @param size  The total size of the record, including the header.
+ */
+void record_encode(unsigned char *buf, unsigned char type, uint32_t depth, uint64_t size) {
+    STATS_BEGIN(STAT_HEADER_ENCODE);
+    *buf = MAGIC0;
+    *(buf + 1) = MAGIC1;
+    *(buf + 2) = MAGIC2;
+    *(buf + 3) = type;
+    put_be(buf + 4, depth, 4);
+    put_be(buf + 8, size, 8);
+    STATS_END();
+}
+
+/*
+ * @brief  Decode a record header.
+ * @param buf  Buffer holding HEADER_SIZE bytes of encoded header.
+ * @param hdr  Structure that receives the decoded fields.
+ * @return 0 if the header is well-formed, -1 if the magic bytes are wrong
+ * or the record size is smaller than the header itself.
+ */
+int record_decode(unsigned char *buf, struct record_header *hdr) {
+    if (*buf != MAGIC0 || *(buf + 1) != MAGIC1 || *(buf + 2) != MAGIC2) {
+        return -1;
+    }
+    STATS_BEGIN(STAT_HEADER_DECODE);
+    hdr->type = *(buf + 3);
+    hdr->depth = get_be(buf + 4, 4);
+    hdr->size = get_be(buf + 8, 8);
+    STATS_END();
+    if (hdr->size < HEADER_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Encode a complete DIRECTORY_ENTRY record.
+ * @param buf  Buffer that receives the record; it must have room for
+ * HEADER_SIZE + ENTRY_META_SIZE bytes plus the length of the name.
+ * @param depth  The value of the depth field.
+ * @param meta  The mode and size of the entry.
+ * @param name  The null-terminated name of the entry.
+ * @return The number of bytes in the encoded record.
+ */
+size_t entry_encode(unsigned char *buf, uint32_t depth, struct entry_meta *meta, char *name) {
+    unsigned char *bp = buf + HEADER_SIZE;
+    put_be(bp, meta->mode, 4);
+    put_be(bp + 4, meta->size, 8);
+    bp += ENTRY_META_SIZE;
+    while (*name != '\0') {
+        *bp++ = *name++;
+    }
+    size_t len = bp - buf;
+    record_encode(buf, DIRECTORY_ENTRY, depth, len);
+    return len;
+}
+
+/*
+ * @brief  Decode the metadata that follows a DIRECTORY_ENTRY header.
+ * @param buf  Buffer holding ENTRY_META_SIZE bytes of encoded metadata.
+ * @param meta  Structure that receives the mode and size.
+ */
+void entry_decode_meta(unsigned char *buf, struct entry_meta *meta) {
+    meta->mode = get_be(buf, 4);
+    meta->size = get_be(buf + 4, 8);
+}
+
+/*
+ * Read the payload of a CHECKSUM record whose header is in hdr and check
+ * the payload of the previous record, whose checksum is crc, against it.
+ * The checksum of the header that follows is left in header_sum.
+ */
+static int checksum_read(struct source *in, struct record_header *hdr, uint64_t offset,
+                         uint32_t crc, uint32_t *header_sum) {
+    unsigned char *buf;
+    if (hdr->size != CHECKSUM_SIZE || (buf = source_next(in, CHECKSUM_SIZE - HEADER_SIZE)) == NULL) {
+        fprintf(stderr, "Error: Invalid CHECKSUM record at offset %lu.\n", (unsigned long)offset);
+        return -1;
+    }
+    uint32_t payload_sum = get_be(buf, 4);
+    *header_sum = get_be(buf + 4, 4);
+    if (in->checksums && in->crc_known && payload_sum != crc) {
+        fprintf(stderr, "Error: Checksum mismatch in the payload of the record at offset %lu.\n",
+                (unsigned long)in->record);
+        return -1;
+    }
+    in->checksums = 1;
+    return 0;
+}
+
+/*
+ * @brief  Read and decode one record header from a stream.
+ * @details  A CHECKSUM record in front of the header is consumed as well:
+ * the payload of the previous record and the header are checked against
+ * it, and the checksum of the payload that follows is started.  Once a
+ * stream has been found to carry CHECKSUM records, a header without one
+ * is an error.  If record_check() has already consumed the CHECKSUM
+ * record, only the header is read.
+ * @return 0 on success, -1 on end of input, a malformed header or a
+ * checksum mismatch.
+ */
+int record_read(struct source *in, struct record_header *hdr) {
+    uint32_t crc = in->crc;
+    uint64_t offset = in->offset;
+    uint32_t header_sum;
+    unsigned char *buf;
+    if (in->sum_pending) {
+        in->sum_pending = 0;
+        header_sum = in->header_sum;
+    } else {
+        if ((buf = source_next(in, HEADER_SIZE)) == NULL) {
+            return -1;
+        }
+        if (record_decode(buf, hdr) == -1) {
+            fprintf(stderr, "Error: Invalid magic bytes.\n");
+            return -1;
+        }
+        if (hdr->type != CHECKSUM) {
+            if (in->checksums) {
+                fprintf(stderr, "Error: Missing CHECKSUM record at offset %lu.\n", (unsigned long)offset);
+                return -1;
+            }
+            in->record = offset;
+            in->crc = 0;
+            in->crc_known = 1;
+            return 0;
+        }
+        if (checksum_read(in, hdr, offset, crc, &header_sum) == -1) {
+            return -1;
+        }
+        offset = in->offset;
+    }
+    if ((buf = source_next(in, HEADER_SIZE)) == NULL) {
+        return -1;
+    }
+    if (crc32c_update(0, buf, HEADER_SIZE) != header_sum) {
+        fprintf(stderr, "Error: Checksum mismatch in the record header at offset %lu.\n",
+                (unsigned long)offset);
+        return -1;
+    }
+    if (record_decode(buf, hdr) == -1 || hdr->type == CHECKSUM) {
+        fprintf(stderr, "Error: Invalid record header at offset %lu.\n", (unsigned long)offset);
+        return -1;
+    }
+    in->record = offset;
+    in->crc = 0;
+    in->crc_known = 1;
+    return 0;
+}
+
+/*
+ * @brief  Check the payload of the record read last, once it has all been
+ * consumed.
+ * @details  The CHECKSUM record that follows the payload is read at once,
+ * rather than by the next record_read(), so that a damaged payload is
+ * reported before the data read from it is put to use.  Nothing is read
+ * from a stream without CHECKSUM records.
+ * @return 0 if the payload is intact or cannot be checked, -1 on a
+ * mismatch or if the CHECKSUM record is missing or malformed.
+ */
+int record_check(struct source *in) {
+    if (!in->checksums || !in->crc_known || in->sum_pending) {
+        return 0;
+    }
+    uint32_t crc = in->crc;
+    uint64_t offset = in->offset;
+    struct record_header hdr;
+    unsigned char *buf = source_next(in, HEADER_SIZE);
+    if (buf == NULL || record_decode(buf, &hdr) == -1 || hdr.type != CHECKSUM) {
+        fprintf(stderr, "Error: Missing CHECKSUM record at offset %lu.\n", (unsigned long)offset);
+        return -1;
+    }
+    if (checksum_read(in, &hdr, offset, crc, &in->header_sum) == -1) {
+        return -1;
+    }
+    in->sum_offset = offset;
+    in->sum_pending = 1;
+    return 0;
+}
+
+/*
+ * @brief  Get the offset of the next record to be read.
+ * @details  That is the offset of the CHECKSUM record in front of it, if
+ * record_check() has already consumed that.
+ */
+uint64_t record_next(struct source *in) {
+    return in->sum_pending ? in->sum_offset : in->offset;
+}
+
+/*
+ * @brief  Read a header-only record of a given type and depth.
+ * @details  This is used for the START/END_OF_TRANSMISSION and
+ * START/END_OF_DIRECTORY records, which consist of nothing but a header.
+ * @return 0 if a record of the expected type, depth and size was read,
+ * -1 otherwise.
+ */
+int record_expect(struct source *in, unsigned char type, uint32_t depth) {
+    struct record_header hdr;
+    if (record_read(in, &hdr) == -1) {
+        return -1;
+    }
+    if (hdr.type != type || hdr.depth != depth || hdr.size != HEADER_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Read the remainder of a DIRECTORY_ENTRY record.
+ * @details  The header, given by hdr, has already been read.  The metadata
+ * and the name are consumed in one piece and the name is stored,
+ * null-terminated, in the buffer pointed to by name, which must have room
+ * for NAME_MAX bytes.
+ * @return 0 on success, -1 on end of input or if the name is too long.
+ */
+int entry_read(struct source *in, struct record_header *hdr, struct entry_meta *meta, char *name) {
+    if (hdr->size < HEADER_SIZE + ENTRY_META_SIZE) {
+        fprintf(stderr, "Error: DIRECTORY_ENTRY record is too short.\n");
+        return -1;
+    }
+    size_t len = hdr->size - HEADER_SIZE;
+    size_t name_len = len - ENTRY_META_SIZE;
+    if (name_len >= NAME_MAX) {
+        fprintf(stderr, "Error: File name size exceeds NAME_MAX.\n");
+        return -1;
+    }
+    unsigned char *buf = source_next(in, len);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: Unexpected EOF while reading directory entry.\n");
+        return -1;
+    }
+    entry_decode_meta(buf, meta);
+    unsigned char *np = buf + ENTRY_META_SIZE;
+    while (name_len--) {
+        *name++ = *np++;
+    }
+    *name = '\0';
+    return 0;
+}
+
+/*
+ * @brief  Write a header-only record, or the header of a longer record,
+ * with a single fwrite().
+ * @details  record_offset is advanced by the whole size of the record (and
+ * that of the CHECKSUM record in front of it with -C), so the caller is
+ * expected to write the rest of the record next, with payload_write().
+ * @return 0 on success, -1 on an I/O error.
+ */
+int record_write(FILE *out, unsigned char type, uint32_t depth, uint64_t size) {
+    unsigned char *buf = scratch_page();
+    if (buf == NULL) {
+        return -1;
+    }
+    record_encode(buf, type, depth, size);
+    if (checksum_write(out) == -1) {
+        return -1;
+    }
+    record_offset += size;
+    return stream_write(out, buf, HEADER_SIZE);
+}
+
+/*
+ * @brief  Write a complete DIRECTORY_ENTRY record with a single fwrite().
+ * @return 0 on success, -1 on an I/O error or if the name is too long.
+ */
+int entry_write(FILE *out, uint32_t depth, struct entry_meta *meta, char *name) {
+    unsigned char *buf = scratch_page();
+    char *np = name;
+    while (*np != '\0') {
+        np++;
+    }
+    if (buf == NULL || np - name >= NAME_MAX) {
+        return -1;
+    }
+    size_t len = entry_encode(buf, depth, meta, name);
+    if (checksum_write(out) == -1) {
+        return -1;
+    }
+    checksum_payload(buf + HEADER_SIZE, len - HEADER_SIZE);
+    record_offset += len;
+    return stream_write(out, buf, len);
+}
+
+/*
+ * @brief  Write a complete ENTRY_REMOVED record with a single fwrite().
+ * @return 0 on success, -1 on an I/O error or if the name is too long.
+ */
+int removal_write(FILE *out, uint32_t depth, struct entry_meta *meta, char *name) {
+    unsigned char *buf = scratch_page();
+    char *np = name;
+    while (*np != '\0') {
+        np++;
+    }
+    if (buf == NULL || np - name >= NAME_MAX) {
+        return -1;
+    }
+    size_t len = entry_encode(buf, depth, meta, name);
+    record_encode(buf, ENTRY_REMOVED, depth, len);
+    if (checksum_write(out) == -1) {
+        return -1;
+    }
+    checksum_payload(buf + HEADER_SIZE, len - HEADER_SIZE);
+    record_offset += len;
+    return stream_write(out, buf, len);
+}
+
+/*
+ * @brief  Write a complete COMPRESSED_DATA record.
+ * @param out  The stream to write to.
+ * @param depth  The value of the depth field.
+ * @param word  The length of the data in the block, with the BLOCK_* flags.
+ * @param data  The bytes of the block.
+ * @param len  The number of bytes of the block.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int block_write(FILE *out, uint32_t depth, uint32_t word, unsigned char *data, size_t len) {
+    unsigned char *buf = scratch_page();
+    if (buf == NULL) {
+        return -1;
+    }
+    uint64_t size = HEADER_SIZE + BLOCK_META_SIZE + len;
+    record_encode(buf, COMPRESSED_DATA, depth, size);
+    put_be(buf + HEADER_SIZE, word, BLOCK_META_SIZE);
+    if (checksum_write(out) == -1) {
+        return -1;
+    }
+    checksum_payload(buf + HEADER_SIZE, BLOCK_META_SIZE);
+    record_offset += size;
+    if (stream_write(out, buf, HEADER_SIZE + BLOCK_META_SIZE) == -1 ||
+        payload_write(out, data, len) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Write bytes of the payload of the record whose header was written
+ * last, adding them to its checksum with -C.
+ * @return 0 on success, -1 on an I/O error.
+ */
+int payload_write(FILE *out, void *buf, size_t len) {
+    checksum_payload(buf, len);
+    return stream_write(out, buf, len);
+}
@@ -0,0 +1,149 @@
+#include <limits.h>
+
+#include "relpath.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Set up an empty relative pathname.
+ * @param rp  The pathname to set up.
+ * @param a  Arena from which its buffer is allocated.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int relpath_init(struct relpath *rp, struct arena *a) {
+    if ((rp->buf = arena_alloc(a, PATH_MAX)) == NULL) {
+        return -1;
+    }
+    *rp->buf = '\0';
+    rp->len = 0;
+    return 0;
+}
+
+/*
+ * @brief  Descend into the subdirectory name of the current directory.
+ * @return 0 on success, -1 if the pathname would be too long.
+ */
+int relpath_enter(struct relpath *rp, char *name) {
+    char *dst = rp->buf + rp->len;
+    char *end = rp->buf + PATH_MAX - 1;
+    if (rp->len > 0 && dst < end) {
+        *dst++ = '/';
+    }
+    while (*name != '\0' && dst < end) {
+        *dst++ = *name++;
+    }
+    if (*name != '\0') {
+        *(rp->buf + rp->len) = '\0';
+        return -1;
+    }
+    *dst = '\0';
+    rp->len = dst - rp->buf;
+    return 0;
+}
+
+/*
+ * @brief  Go back up from the directory entered last.
+ */
+void relpath_leave(struct relpath *rp) {
+    while (rp->len > 0 && *(rp->buf + rp->len - 1) != '/') {
+        rp->len--;
+    }
+    if (rp->len > 0) {
+        rp->len--;
+    }
+    *(rp->buf + rp->len) = '\0';
+}
+
+/*
+ * @brief  Build the pathname of an entry of the current directory.
+ * @param rp  The pathname of the current directory.
+ * @param a  Arena in which the pathname is built.
+ * @param name  Name of the entry.
+ * @param len  Receives the length of the pathname.
+ * @return The null-terminated pathname, or NULL if memory is exhausted.
+ */
+char *relpath_join(struct relpath *rp, struct arena *a, char *name, size_t *len) {
+    size_t name_len = 0;
+    while (*(name + name_len) != '\0') {
+        name_len++;
+    }
+    *len = rp->len + (rp->len > 0) + name_len;
+    char *path = arena_alloc(a, *len + 1);
+    if (path == NULL) {
+        return NULL;
+    }
+    char *dst = path;
+    for (char *src = rp->buf; src < rp->buf + rp->len; ) {
+        *dst++ = *src++;
+    }
+    if (rp->len > 0) {
+        *dst++ = '/';
+    }
+    while (*name != '\0') {
+        *dst++ = *name++;
+    }
+    *dst = '\0';
+    return path;
+}
+
+/*
+ * @brief  Compare two pathnames bytewise; a proper prefix sorts first.
+ * @return A negative value, 0 or a positive value as a sorts before, with
+ * or after b.
+ */
+int relpath_cmp(char *a, size_t alen, char *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; i++) {
+        unsigned char ca = *(a + i), cb = *(b + i);
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+/*
+ * @brief  Sort items by pathname, with a stable bottom-up merge sort.
+ * @param vec  The n items to be sorted.
+ * @param tmp  Space for n more items.
+ * @param key  Returns the pathname of an item and its length.
+ * @return vec or tmp, whichever holds the sorted items.
+ */
+void **relpath_sort(void **vec, void **tmp, size_t n, char *(*key)(void *item, size_t *len)) {
+    for (size_t width = 1; width < n; width *= 2) {
+        for (size_t lo = 0; lo < n; lo += 2 * width) {
+            size_t mid = lo + width < n ? lo + width : n;
+            size_t hi = lo + 2 * width < n ? lo + 2 * width : n;
+            size_t i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                size_t alen, blen;
+                char *a = key(*(vec + i), &alen), *b = key(*(vec + j), &blen);
+                if (relpath_cmp(b, blen, a, alen) < 0) {
+                    *(tmp + k++) = *(vec + j++);
+                } else {
+                    *(tmp + k++) = *(vec + i++);
+                }
+            }
+            while (i < mid) {
+                *(tmp + k++) = *(vec + i++);
+            }
+            while (j < hi) {
+                *(tmp + k++) = *(vec + j++);
+            }
+        }
+        void **swap = vec;
+        vec = tmp;
+        tmp = swap;
+    }
+    return vec;
+}
@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <linux/un.h>   /* <sys/un.h> includes <string.h> */
+
+#include "server.h"
+#include "arena.h"
+#include "compress.h"
+#include "copy.h"
+#include "libtransplant.h"
+#include "materialize.h"
+#include "pool.h"
+#include "record.h"
+#include "transplant.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* Number of descriptors passed with a request. */
+#define SESSION_FDS 4
+
+/* Time allowed to a client to send the whole of its request, in seconds. */
+#define REQUEST_TIMEOUT 10
+
+/* The descriptors of a client, in the order in which they are passed. */
+struct client_fds {
+    int in;
+    int out;
+    int err;
+    int cwd;     /* -1 if no descriptors were passed */
+};
+
+/* Room for a control message carrying SESSION_FDS descriptors. */
+struct fd_control {
+    struct cmsghdr header;
+    uint64_t fds01;
+    uint64_t fds23;
+};
+
+/* A connection being served, on a thread of its own. */
+struct connection {
+    int conn;
+    int reading;                /* its request is still being read */
+    struct connection *next;    /* link in the list of connections */
+};
+
+__thread char *listen_path;
+__thread char *remote_path;
+
+/* State shared by the accept loop and the connections, under lock. */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;  /* a connection is done */
+static struct connection *connections;
+static int active;                 /* connections not yet done */
+static int budget;                 /* worker threads shared by the sessions */
+static int free_workers;           /* of the budget, not granted to a session */
+static int closed;                 /* the accept loop has ended */
+
+static struct pool *shared;        /* pool of the server, or NULL */
+static int listen_fd = -1;
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+    stopping = 1;
+}
+
+/* Read exactly len bytes; return -1 on error or end of file. */
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Write the status of a session on its connection. */
+static void send_status(int conn, int ret) {
+    uint64_t word = 0;
+    put_be((unsigned char *)&word, ret == 0 ? 0 : 1, 4);
+    write_full(conn, (char *)&word, 4);
+}
+
+static void close_fds(struct client_fds *fds) {
+    if (fds->cwd != -1) {
+        close(fds->in);
+        close(fds->out);
+        if (fds->err != -1) {
+            close(fds->err);
+        }
+        close(fds->cwd);
+        fds->cwd = -1;
+    }
+}
+
+/*
+ * @brief  Fill in the address of a Unix domain socket.
+ * @return 0 on success, -1 if the pathname does not fit.
+ */
+static int make_address(struct sockaddr_un *addr, char *path) {
+    char *dst = addr->sun_path;
+    char *end = addr->sun_path + sizeof(addr->sun_path) - 1;
+    addr->sun_family = AF_UNIX;
+    for (char *src = path; *src != '\0'; ) {
+        if (dst == end) {
+            fprintf(stderr, "Error: Socket pathname '%s' is too long.\n", path);
+            return -1;
+        }
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+    return 0;
+}
+
+/* Whether the socket at addr was left behind by a server that is gone. */
+static int stale_socket(struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return 0;
+    }
+    int gone = connect(fd, (struct sockaddr *)addr, sizeof(*addr)) == -1 && errno == ECONNREFUSED;
+    close(fd);
+    return gone;
+}
+
+/*
+ * @brief  Create the listening socket, accessible to its owner only.
+ * @details  A socket left at the pathname by a server that has not removed
+ * it is replaced; one on which a server is still listening is not.
+ * @return The descriptor of the socket, or -1 on failure.
+ */
+static int open_listener(char *path) {
+    struct sockaddr_un addr = {0};
+    if (make_address(&addr, path) == -1) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to create a socket.\n");
+        return -1;
+    }
+    mode_t mask = umask(0077);
+    int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret == -1 && errno == EADDRINUSE && stale_socket(&addr)) {
+        unlink(path);
+        ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    umask(mask);
+    if (ret == -1 || listen(fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Error: Failed to listen on socket '%s'.\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * @brief  Read the request that opens a session.
+ * @param conn  The connection.
+ * @param fds  Receives the descriptors passed with the request, if any.
+ * @param argvp  Receives the arguments, allocated in the arena and preceded
+ * by a program name, as for validargs().
+ * @param arena  The arena of the connection.
+ * @return The number of arguments, program name included, or -1 if the
+ * request is malformed.
+ */
+static int read_request(int conn, struct client_fds *fds, char ***argvp, struct arena *arena) {
+    uint64_t word = 0;
+    unsigned char *len_buf = (unsigned char *)&word;
+    struct fd_control control;
+    struct iovec iov = {len_buf, 4};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n == 0) {
+        return -1;  // Closed without a request
+    }
+    if (n == -1) {
+        fprintf(stderr, "Error: Failed to read a request.\n");
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int *passed = (int *)CMSG_DATA(cmsg);
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count != SESSION_FDS) {
+            for (int *fd = passed; fd < passed + count; fd++) {
+                close(*fd);
+            }
+            fprintf(stderr, "Error: A request carries %d descriptors instead of %d.\n", count, SESSION_FDS);
+            return -1;
+        }
+        fds->in = *passed;
+        fds->out = *(passed + 1);
+        fds->err = *(passed + 2);
+        fds->cwd = *(passed + 3);
+    }
+    if ((msg.msg_flags & MSG_CTRUNC) || read_full(conn, len_buf + n, 4 - n) == -1) {
+        fprintf(stderr, "Error: Failed to read a request.\n");
+        return -1;
+    }
+
+    size_t len = get_be(len_buf, 4);
+    char *args;
+    if (len == 0 || len > SERVER_REQUEST_MAX || (args = arena_alloc(arena, len)) == NULL ||
+        read_full(conn, args, len) == -1 || *(args + len - 1) != '\0') {
+        fprintf(stderr, "Error: Failed to read a request.\n");
+        return -1;
+    }
+    int argc = 1;
+    for (char *cp = args; cp < args + len; cp++) {
+        argc += *cp == '\0';
+    }
+    char **argv = arena_alloc(arena, (argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        fprintf(stderr, "Error: Failed to read a request.\n");
+        return -1;
+    }
+    *argv = "transplant";
+    char **arg = argv + 1;
+    for (char *cp = args; cp < args + len; cp++) {
+        if (cp == args || *(cp - 1) == '\0') {
+            *arg++ = cp;
+        }
+    }
+    *arg = NULL;
+    *argvp = argv;
+    return argc;
+}
+
+/*
+ * @brief  The number of worker threads a session asks for with -j, limited
+ * to the budget of the server.  The arguments are checked by the session
+ * itself; an invalid count only makes it fail there.
+ */
+static int requested_workers(int argc, char **argv) {
+    int workers = 1;
+    for (char **arg = argv + 1; arg + 1 < argv + argc; arg++) {
+        if (**arg == '-' && *(*arg + 1) == 'j' && *(*arg + 2) == '\0') {
+            workers = 0;
+            for (char *cp = *(arg + 1); *cp >= '0' && *cp <= '9' && workers <= budget; cp++) {
+                workers = workers * 10 + (*cp - '0');
+            }
+        }
+    }
+    return workers < 1 ? 1 : workers > budget ? budget : workers;
+}
+
+/* Whether the option -opt (a single letter) is among the arguments. */
+static int has_option(int argc, char **argv, char opt) {
+    for (char **arg = argv + 1; arg < argv + argc; arg++) {
+        if (**arg == '-' && *(*arg + 1) == opt && *(*arg + 2) == '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief  The absolute pathname of the directory that a session works on
+ * (-p, or else the current directory of the session).
+ * @details  The jobs of the session run on the threads of the shared pool,
+ * which do not share its current directory, so the pathnames that they
+ * are given must not be relative.
+ * @return The pathname, allocated in the arena, or NULL if it is too long.
+ */
+static char *session_root(int argc, char **argv, struct arena *arena) {
+    char *dir = ".";
+    for (char **arg = argv + 1; arg + 1 < argv + argc; arg++) {
+        if (**arg == '-' && *(*arg + 1) == 'p' && *(*arg + 2) == '\0') {
+            dir = *++arg;
+        }
+    }
+    if (*dir == '/') {
+        return dir;
+    }
+    char *root = arena_alloc(arena, PATH_MAX);
+    if (root == NULL || getcwd(root, PATH_MAX) == NULL) {
+        return NULL;
+    }
+    char *dst = root;
+    while (*dst != '\0') {
+        dst++;
+    }
+    if (!(*dir == '.' && *(dir + 1) == '\0')) {
+        *dst++ = '/';
+        for (char *src = dir; *src != '\0'; ) {
+            if (dst == root + PATH_MAX - 1) {
+                return NULL;
+            }
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    return root;
+}
+
+/*
+ * @brief  Run a session as a transplant run of the calling thread.
+ * @details  The thread takes the current directory of the client, if it
+ * passed it, and an umask of its own, and the run gets the descriptors of
+ * the client, or else the connection, as its input and output, and a share
+ * of the pool of the server.
+ *
+ * @param conn  The connection of the session.
+ * @param fds  The descriptors of the client, if it passed them.
+ * @param workers  Number of worker threads of the pool granted to it.
+ * @param arena  The arena of the connection.
+ * @param stream_out  Set to 1 if the stream of the session is written on
+ * the connection.
+ * @return 0 if the session succeeded, -1 otherwise.
+ */
+static int run_session(int conn, struct client_fds *fds, int workers, int argc, char **argv,
+                       struct arena *arena, int *stream_out) {
+    int passed = fds->cwd != -1;
+    if (unshare(CLONE_FS) == -1 || (passed && fchdir(fds->cwd) == -1)) {
+        fprintf(stderr, "Error: Failed to set up a session.\n");
+        return -1;
+    }
+    struct transplant t = {argv + 1, NULL, -1, -1, NULL, NULL, NULL};
+    if (passed) {
+        t.in_fd = fds->in;
+        t.out_fd = fds->out;
+        if ((t.err = fdopen(fds->err, "w")) != NULL) {
+            setvbuf(t.err, NULL, _IONBF, 0);
+            fds->err = -1;
+        }
+    } else if (has_option(argc, argv, 't') || has_option(argc, argv, 'T')) {
+        fprintf(stderr, "Error: The '-t' and '-T' options need the descriptors of the client.\n");
+        return -1;
+    } else {
+        // Without the descriptors of the client, the stream goes through the connection
+        t.in_fd = t.out_fd = conn;
+        *stream_out = has_option(argc, argv, 's');
+    }
+
+    int ret = -1;
+    if ((t.root = session_root(argc, argv, arena)) == NULL) {
+        fprintf(t.err != NULL ? t.err : stderr, "Error: Pathname too long.\n");
+    } else {
+        pool_share(shared, workers);
+        ret = transplant_run(&t);
+    }
+    if (t.err != NULL) {
+        fclose(t.err);
+    }
+    return ret;
+}
+
+/*
+ * @brief  Serve a connection: read its request and run its session.
+ * @details  The session is granted as many of the worker threads it asks
+ * for as are free when its request has been read, and runs at once even if
+ * that is fewer than two, without workers then.  Waiting for them instead
+ * could deadlock, as the sessions on either side of a pipe may each hold
+ * the threads that the other waits for.
+ * @param arg  The descriptor of the connection.
+ */
+static void *serve(void *arg) {
+    struct connection self = {(int)(intptr_t)arg, 1, NULL};
+    struct client_fds fds = {-1, -1, -1, -1};
+    struct arena arena;
+    pthread_mutex_lock(&lock);
+    self.next = connections;
+    connections = &self;
+    pthread_mutex_unlock(&lock);
+
+    struct timeval timeout = {REQUEST_TIMEOUT, 0};
+    setsockopt(self.conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char **argv;
+    int argc = -1;
+    int allocated = arena_init(&arena, ARENA_MIN_RESERVE) == 0;
+    if (!allocated) {
+        fprintf(stderr, "Error: Failed to allocate a request.\n");
+    } else {
+        argc = read_request(self.conn, &fds, &argv, &arena);
+    }
+    struct timeval none = {0, 0};
+    setsockopt(self.conn, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+
+    int ret = -1;
+    int stream_out = 0;
+    int workers = argc == -1 ? 0 : requested_workers(argc, argv);
+    pthread_mutex_lock(&lock);
+    self.reading = 0;
+    int admit = argc != -1 && !closed;
+    workers = workers < free_workers ? workers : free_workers;
+    workers = admit && workers >= 2 ? workers : 0;
+    free_workers -= workers;
+    pthread_mutex_unlock(&lock);
+
+    if (admit) {
+        debug("Session on connection %d started with %d workers", self.conn, workers);
+        ret = run_session(self.conn, &fds, workers, argc, argv, &arena, &stream_out);
+        pthread_mutex_lock(&lock);
+        free_workers += workers;
+        pthread_mutex_unlock(&lock);
+    }
+    close_fds(&fds);
+    if (!stream_out) {
+        send_status(self.conn, ret);
+    }
+    close(self.conn);
+    if (allocated) {
+        arena_free(&arena);
+    }
+
+    pthread_mutex_lock(&lock);
+    struct connection **link = &connections;
+    while (*link != &self) {
+        link = &(*link)->next;
+    }
+    *link = self.next;
+    active--;
+    pthread_cond_signal(&done_cv);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/*
+ * @brief  Start a thread with SIGINT and SIGTERM blocked, so that they are
+ * delivered to the accept loop.
+ */
+static int start_thread(void *(*run)(void *), void *arg) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int ret = pthread_create(&thread, &attr, run, arg) == 0 ? 0 : -1;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/*
+ * @brief  Start the worker threads shared by the sessions, with SIGINT and
+ * SIGTERM blocked.
+ */
+static int start_pool(void) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    size_t slot_size = copy_block_size < COMPRESS_WORK_SIZE ? COMPRESS_WORK_SIZE : copy_block_size;
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    int ret = pool_start(budget, MATERIALIZE_SLOTS_PER_WORKER, slot_size);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    shared = ctx->pool;
+    return ret;
+}
+
+/*
+ * @brief  Serve sessions on the socket given with -L until SIGINT or
+ * SIGTERM is received.
+ * @details  The accept loop only accepts: each connection is served by a
+ * thread of its own, which reads the request and runs the session.  On
+ * stopping, connections whose request is still being read are shut down,
+ * requests read afterwards are refused and the sessions running are waited
+ * for, and the socket is removed.
+ * @return 0 on success, -1 on failure.
+ */
+int server_run(void) {
+    budget = worker_count > 0 ? worker_count : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    budget = budget < 1 ? 1 : budget > WORKERS_MAX ? WORKERS_MAX : budget;
+    free_workers = budget;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (start_pool() == -1) {
+        return -1;
+    }
+    if ((listen_fd = open_listener(listen_path)) == -1) {
+        pool_stop();
+        return -1;
+    }
+
+    int ret = 0;
+    while (!stopping) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            fprintf(stderr, "Error: Failed to accept a connection.\n");
+            ret = -1;
+            break;
+        }
+        pthread_mutex_lock(&lock);
+        active++;
+        pthread_mutex_unlock(&lock);
+        if (start_thread(serve, (void *)(intptr_t)conn) == -1) {
+            fprintf(stderr, "Error: Failed to start a session.\n");
+            send_status(conn, -1);
+            close(conn);
+            pthread_mutex_lock(&lock);
+            active--;
+            pthread_mutex_unlock(&lock);
+        }
+    }
+
+    close(listen_fd);
+    unlink(listen_path);
+    pthread_mutex_lock(&lock);
+    closed = 1;
+    for (struct connection *c = connections; c != NULL; c = c->next) {
+        if (c->reading) {
+            shutdown(c->conn, SHUT_RDWR);
+        }
+    }
+    while (active > 0) {
+        pthread_cond_wait(&done_cv, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    pool_stop();
+    return ret;
+}
+
+/*
+ * @brief  Run a session through the server listening on the socket given
+ * with -R, passing it the other arguments and the standard descriptors and
+ * current directory of this process.
+ * @return 0 if the session succeeded, -1 otherwise.
+ */
+int server_remote(int argc, char **argv) {
+    struct sockaddr_un addr = {0};
+    if (make_address(&addr, remote_path) == -1) {
+        return -1;
+    }
+    struct arena request;
+    unsigned char *buf = NULL;
+    if (arena_init(&request, ARENA_MIN_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate the request.\n");
+        return -1;
+    }
+
+    // The request holds every argument but the program name and -R SOCKET
+    size_t len = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        char *dst = pass == 0 ? NULL : (char *)buf + 4;
+        for (char **arg = argv + 1; arg < argv + argc; arg++) {
+            if (arg + 1 < argv + argc && *(arg + 1) == remote_path) {
+                arg++;
+                continue;
+            }
+            char *src = *arg;
+            do {
+                if (pass == 0) {
+                    len++;
+                } else {
+                    *dst++ = *src;
+                }
+            } while (*src++ != '\0');
+        }
+        if (pass == 0 && (len > SERVER_REQUEST_MAX || (buf = arena_alloc(&request, 4 + len)) == NULL)) {
+            fprintf(stderr, "Error: The arguments are too long for a request.\n");
+            arena_free(&request);
+            return -1;
+        }
+    }
+    put_be(buf, len, 4);
+
+    int ret = -1;
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cwd == -1 || conn == -1 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "Error: Failed to connect to socket '%s'.\n", remote_path);
+    } else {
+        struct fd_control control = {0};
+        struct iovec iov = {buf, 4 + len};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control;
+        msg.msg_controllen = CMSG_SPACE(SESSION_FDS * sizeof(int));
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(SESSION_FDS * sizeof(int));
+        int *fd = (int *)CMSG_DATA(cmsg);
+        *fd = STDIN_FILENO;
+        *(fd + 1) = STDOUT_FILENO;
+        *(fd + 2) = STDERR_FILENO;
+        *(fd + 3) = cwd;
+
+        uint64_t word = 0;
+        ssize_t n = sendmsg(conn, &msg, MSG_NOSIGNAL);
+        if (n == -1 || write_full(conn, (char *)buf + n, 4 + len - n) == -1) {
+            fprintf(stderr, "Error: Failed to send the request.\n");
+        } else if (read_full(conn, &word, 4) == -1) {
+            fprintf(stderr, "Error: The session ended without a status.\n");
+        } else {
+            ret = get_be((unsigned char *)&word, 4) == 0 ? 0 : -1;
+        }
+    }
+    if (conn != -1) {
+        close(conn);
+    }
+    if (cwd != -1) {
+        close(cwd);
+    }
+    arena_free(&request);
+    return ret;
+}
@@ -0,0 +1,405 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "shard.h"
+#include "arena.h"
+#include "record.h"
+#include "source.h"
+#include "transplant.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* Initial number of buckets of the table of entries; a power of two. */
+#define SHARD_BUCKETS_MIN 4096
+
+/*
+ * The shards are kept in a list, in the order of the options that named
+ * them.  The entries met by the walk are kept in a hash table by inode
+ * number, and in a list that is sorted by decreasing size to deal them out.
+ */
+struct shard {
+    struct shard *next;
+    char *path;
+};
+
+struct shard_item {
+    struct shard_item *next;    /* in the list of all entries */
+    struct shard_item *chain;   /* in its bucket */
+    uint64_t ino;
+    uint64_t bytes;             /* bytes of its records, for each link met */
+    int shard;
+};
+
+__thread int shard_index = -1;
+
+static __thread struct arena shard_arena;
+static __thread struct shard *shards;
+static __thread struct shard *last_shard;
+static __thread int count;
+static __thread struct shard_item **buckets;
+static __thread uint64_t nbuckets;
+static __thread uint64_t nitems;
+static __thread struct shard_item *items;
+
+/*
+ * @brief  Add a shard: a stream to serialize to, or to restore from.
+ * @param path  Pathname of the shard; it must remain valid.
+ * @return 0 on success, -1 if there are too many shards.
+ */
+int shard_add(char *path) {
+    if (shard_arena.base == NULL && arena_init(&shard_arena, ARENA_DEFAULT_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate the list of shards.\n");
+        return -1;
+    }
+    struct shard *s = arena_alloc(&shard_arena, sizeof(struct shard));
+    if (count == SHARDS_MAX || s == NULL) {
+        fprintf(stderr, "Error: At most %d shards can be given.\n", SHARDS_MAX);
+        return -1;
+    }
+    s->path = path;
+    if (last_shard != NULL) {
+        last_shard->next = s;
+    } else {
+        shards = s;
+    }
+    last_shard = s;
+    count++;
+    return 0;
+}
+
+/*
+ * @brief  Forget the shards and the assignment of the entries to them.
+ */
+void shard_clear(void) {
+    if (shard_arena.base != NULL) {
+        arena_free(&shard_arena);
+    }
+    shards = last_shard = NULL;
+    count = 0;
+    buckets = NULL;
+    nbuckets = nitems = 0;
+    items = NULL;
+    shard_index = -1;
+}
+
+/*
+ * @brief  Return the number of shards given.
+ */
+int shard_count(void) {
+    return count;
+}
+
+/*
+ * @brief  Return nonzero if the operation is to be run on shards: when
+ * serializing to any -o stream, or when restoring more than one archive.
+ */
+int shard_active(void) {
+    return count > 0 && ((global_options & OPT_SERIALIZE) || count > 1);
+}
+
+static uint64_t bucket_of(uint64_t ino) {
+    return ((ino * 0x9E3779B97F4A7C15ULL) >> 32) & (nbuckets - 1);
+}
+
+static struct shard_item *lookup(uint64_t ino) {
+    if (buckets == NULL) {
+        return NULL;
+    }
+    for (struct shard_item *item = *(buckets + bucket_of(ino)); item != NULL; item = item->chain) {
+        if (item->ino == ino) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/* Double the number of buckets (the old ones are left in the arena). */
+static int grow(void) {
+    uint64_t n = nbuckets == 0 ? SHARD_BUCKETS_MIN : 2 * nbuckets;
+    struct shard_item **b = arena_alloc(&shard_arena, n * sizeof(struct shard_item *));
+    if (b == NULL) {
+        return -1;
+    }
+    buckets = b;
+    nbuckets = n;
+    for (struct shard_item *item = items; item != NULL; item = item->next) {
+        item->chain = *(buckets + bucket_of(item->ino));
+        *(buckets + bucket_of(item->ino)) = item;
+    }
+    return 0;
+}
+
+/* Count an entry of the tree, met under a name of the given length. */
+static int add_entry(uint64_t ino, uint64_t size, size_t name_len) {
+    uint64_t bytes = 2 * HEADER_SIZE + ENTRY_META_SIZE + name_len + size;
+    struct shard_item *item = lookup(ino);
+    if (item != NULL) {
+        item->bytes += bytes;  // Another link to the file, sent again
+        return 0;
+    }
+    if ((nitems >= nbuckets && grow() == -1) ||
+        (item = arena_alloc(&shard_arena, sizeof(struct shard_item))) == NULL) {
+        fprintf(stderr, "Error: Failed to allocate the table of shards.\n");
+        return -1;
+    }
+    item->ino = ino;
+    item->bytes = bytes;
+    item->next = items;
+    items = item;
+    item->chain = *(buckets + bucket_of(ino));
+    *(buckets + bucket_of(ino)) = item;
+    nitems++;
+    return 0;
+}
+
+/*
+ * Walk the directory open on dirfd, as the serializer would, counting
+ * every entry that is not a directory, then close it.
+ */
+static int walk(int dirfd) {
+    DIR *dir = fdopendir(dirfd);
+    if (dir == NULL) {
+        fprintf(stderr, "Error: Failed to open directory.\n");
+        close(dirfd);
+        return -1;
+    }
+    int ret = 0;
+    struct dirent *de;
+    errno = 0;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        char *name = de->d_name;
+        if (*name == '.' && (*(name + 1) == '\0' || (*(name + 1) == '.' && *(name + 2) == '\0'))) {
+            continue;
+        }
+        struct stat st;
+        if (de->d_type != DT_DIR && fstatat(dirfd, name, &st, 0) == -1) {
+            fprintf(stderr, "Error: Failed to stat path.\n");
+            ret = -1;
+        } else if (de->d_type == DT_DIR || S_ISDIR(st.st_mode)) {
+            int sub = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+            if (sub == -1) {
+                fprintf(stderr, "Error: Failed to open directory.\n");
+                ret = -1;
+            } else {
+                ret = walk(sub);
+            }
+        } else {
+            size_t len = 0;
+            while (*(name + len) != '\0') {
+                len++;
+            }
+            ret = add_entry(de->d_ino, st.st_size, len);
+        }
+        errno = 0;
+    }
+    if (ret == 0 && errno != 0) {
+        fprintf(stderr, "Error: Failed to read directory.\n");
+        ret = -1;
+    }
+    closedir(dir);
+    return ret;
+}
+
+/* Sort a list of n entries by decreasing size. */
+static struct shard_item *sort_items(struct shard_item *list, uint64_t n) {
+    if (n < 2) {
+        return list;
+    }
+    struct shard_item *mid = list;
+    for (uint64_t i = 1; i < n / 2; i++) {
+        mid = mid->next;
+    }
+    struct shard_item *right = mid->next;
+    mid->next = NULL;
+    struct shard_item *left = sort_items(list, n / 2);
+    right = sort_items(right, n - n / 2);
+
+    struct shard_item *head = NULL;
+    struct shard_item **tail = &head;
+    while (left != NULL && right != NULL) {
+        struct shard_item **from = left->bytes >= right->bytes ? &left : &right;
+        *tail = *from;
+        tail = &(*from)->next;
+        *from = (*from)->next;
+    }
+    *tail = left != NULL ? left : right;
+    return head;
+}
+
+/*
+ * Walk the tree named by path_buf and give each of its entries, largest
+ * first, to the shard that holds the fewest bytes so far.
+ */
+static int plan(void) {
+    int top = open(path_buf, O_RDONLY | O_DIRECTORY);
+    if (top == -1) {
+        fprintf(stderr, "Error: Failed to open directory.\n");
+        return -1;
+    }
+    uint64_t *loads;
+    if (walk(top) == -1 || (loads = arena_alloc(&shard_arena, count * sizeof(uint64_t))) == NULL) {
+        return -1;
+    }
+    items = sort_items(items, nitems);
+    for (struct shard_item *item = items; item != NULL; item = item->next) {
+        uint64_t *least = loads;
+        for (uint64_t *load = loads + 1; load < loads + count; load++) {
+            if (*load < *least) {
+                least = load;
+            }
+        }
+        item->shard = least - loads;
+        *least += item->bytes;
+    }
+    debug("%lu entries dealt out to %d shards", (unsigned long)nitems, count);
+    return 0;
+}
+
+/*
+ * @brief  Return nonzero if the entry with the given inode number is to be
+ * serialized by this process.  Directories are in every shard and are not
+ * to be looked up.
+ */
+int shard_selected(uint64_t ino) {
+    if (shard_index < 0) {
+        return 1;
+    }
+    struct shard_item *item = lookup(ino);
+    return (item != NULL ? item->shard : (int)(ino % count)) == shard_index;
+}
+
+/*
+ * Serialize to, or restore from, one shard in the child process forked
+ * for it, and exit with the status of the operation.
+ */
+static void run_shard(int index, char *path) {
+    int ret = 0;
+    shard_index = index;
+    if (global_options & OPT_SERIALIZE) {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1 || dup2(fd, STDOUT_FILENO) == -1) {
+            fprintf(stderr, "Error: Failed to open shard '%s'.\n", path);
+            ret = -1;
+        }
+        if (fd > STDOUT_FILENO) {
+            close(fd);
+        }
+    } else {
+        // A shard that cannot be mapped is read from stdin instead
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "Error: Failed to open shard '%s'.\n", path);
+            ret = -1;
+        } else if (S_ISREG(st.st_mode)) {
+            archive_path = path;
+        } else if (dup2(fd, STDIN_FILENO) == -1) {
+            ret = -1;
+        } else {
+            archive_path = NULL;
+        }
+        if (fd > STDIN_FILENO) {
+            close(fd);
+        }
+    }
+
+    // Keep the summary of each shard in one piece
+    if (global_options & OPT_STATS) {
+        setvbuf(stderr, NULL, _IOFBF, 1 << 16);
+    }
+    if (ret == 0 && (ret = stats_start()) == 0) {
+        ret = (global_options & OPT_SERIALIZE) ? serialize() : deserialize();
+        stats_report(ret);
+    }
+    if (fflush(stdout) == EOF) {
+        ret = -1;
+    }
+    fflush(stderr);
+    _exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Return nonzero if the directory named by path_buf exists and has entries.
+ * Without -c, the shards are only restored into a new or empty directory:
+ * since they all create the directories, they could not tell one that was
+ * there before from one that another shard has just created.
+ */
+static int target_used(void) {
+    DIR *dir = opendir(path_buf);
+    if (dir == NULL) {
+        return 0;
+    }
+    int used = 0;
+    struct dirent *de;
+    while (!used && (de = readdir(dir)) != NULL) {
+        char *name = de->d_name;
+        used = !(*name == '.' && (*(name + 1) == '\0' || (*(name + 1) == '.' && *(name + 2) == '\0')));
+    }
+    closedir(dir);
+    return used;
+}
+
+/*
+ * @brief  Serialize the tree named by path_buf to the shards, or restore
+ * the shards into it, with one child process per shard.
+ * @return 0 if every shard succeeded, -1 otherwise.
+ */
+int shard_run(void) {
+    if ((global_options & OPT_DESERIALIZE) && !(global_options & OPT_CLOBBER) && target_used()) {
+        fprintf(stderr, "Error: Shards are only restored into an empty directory without '-c'.\n");
+        return -1;
+    }
+    pid_t *pids;
+    if (((global_options & OPT_SERIALIZE) && plan() == -1) ||
+        (pids = arena_alloc(&shard_arena, count * sizeof(pid_t))) == NULL) {
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    int ret = 0;
+    int started = 0;
+    for (struct shard *s = shards; s != NULL; s = s->next) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_shard(started, s->path);
+        }
+        if (pid == -1) {
+            fprintf(stderr, "Error: Failed to start the process of shard '%s'.\n", s->path);
+            ret = -1;
+            break;
+        }
+        *(pids + started++) = pid;
+    }
+
+    struct shard *s = shards;
+    for (pid_t *pid = pids; pid < pids + started; pid++, s = s->next) {
+        int status;
+        while (waitpid(*pid, &status, 0) == -1) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+        if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Error: Shard '%s' failed.\n", s->path);
+            ret = -1;
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,377 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "source.h"
+#include "context.h"
+#include "copy.h"
+#include "crc32c.h"
+#include "stats.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * How far ahead of the read cursor of a mapped archive the kernel is asked
+ * to start reading, as a multiple of the copy block size.
+ */
+#define READAHEAD_BLOCKS 8
+
+__thread char *archive_path;
+
+/* The source that deserialization is currently reading from. */
+static __thread struct source *input;
+static __thread struct source stdin_source;
+
+/*
+ * @brief  Initialize a source that reads from a file descriptor.
+ * @details  The descriptor is read through the buffer of the source and is
+ * not closed with it.  Nothing must have been read from it through stdio.
+ *
+ * @param src  The source to be initialized.
+ * @param fd  The descriptor to read from.
+ */
+void source_init_fd(struct source *src, int fd) {
+    source_init_stdio(src, NULL);
+    src->fd = fd;
+}
+
+/*
+ * @brief  Initialize a source that reads from a stdio stream.
+ * @details  Only for a stream that has no descriptor of its own, or that
+ * may already have buffered input: the kernel cannot move data from it.
+ *
+ * @param src  The source to be initialized.
+ * @param fp  The stream to read from.
+ */
+void source_init_stdio(struct source *src, FILE *fp) {
+    src->fd = -1;
+    src->fp = fp;
+    src->buffer = src->pending = src->filled = NULL;
+    src->base = src->cur = src->end = src->advised = NULL;
+    src->mapped = 0;
+    src->offset = src->record = 0;
+    src->crc = 0;
+    src->crc_known = 0;
+    src->checksums = 0;
+    src->sum_pending = 0;
+}
+
+/*
+ * @brief  Return the source that deserialization reads from.
+ * @details  Unless some other source has been installed with
+ * source_set_input(), this is the source of the context of the run, if it
+ * has one, or else a source that reads from the stream of the context or
+ * from the standard input.
+ */
+struct source *source_input(void) {
+    if (input == NULL && ctx->source != NULL) {
+        input = ctx->source;
+    } else if (input == NULL) {
+        if (stdin_source.buffer == NULL && ctx->in != NULL) {
+            source_init_stdio(&stdin_source, ctx->in);
+        } else if (stdin_source.buffer == NULL) {
+            source_init_fd(&stdin_source, STDIN_FILENO);
+        }
+        input = &stdin_source;
+    }
+    return input;
+}
+
+/*
+ * @brief  Install the source that deserialization reads from.
+ * @param src  The new source, or NULL to revert to the input of the run.
+ */
+void source_set_input(struct source *src) {
+    input = src;
+}
+
+/*
+ * @brief  Forget the source that reads from the input stream, whose stream
+ * is closed at the end of a transplant run through libtransplant.h.
+ */
+void source_release(void) {
+    source_close(&stdin_source);
+    input = NULL;
+}
+
+/*
+ * @brief  Initialize a source that reads a serialized archive through a
+ * read-only memory mapping.
+ * @details  The whole archive is mapped and the kernel is told that it will
+ * be read sequentially.  The descriptor is not needed once the mapping
+ * exists, so it is closed again.
+ *
+ * @param src  The source to be initialized.
+ * @param path  Pathname of the archive.
+ * @return 0 on success, -1 if the archive cannot be opened or mapped.
+ */
+int source_open_map(struct source *src, char *path) {
+    source_init_stdio(src, NULL);
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to open archive '%s'.\n", path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "Error: Archive '%s' is not a non-empty regular file.\n", path);
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to map archive '%s'.\n", path);
+        return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    src->base = src->cur = src->advised = p;
+    src->end = src->base + st.st_size;
+    src->mapped = 1;
+    return 0;
+}
+
+/*
+ * @brief  Initialize a source that reads serialized data held in memory by
+ * the caller, which must stay there until the source is closed.
+ * @param src  The source to be initialized.
+ * @param data  The serialized data.
+ * @param len  The number of bytes of data.
+ */
+void source_open_memory(struct source *src, void *data, size_t len) {
+    source_init_stdio(src, NULL);
+    src->base = src->cur = data;
+    src->end = src->advised = src->base + len;
+}
+
+/*
+ * @brief  Release the resources held by a source.
+ * @details  A descriptor or a stdio stream is not closed, since it normally
+ * is stdin.
+ */
+void source_close(struct source *src) {
+    if (src->mapped) {
+        munmap(src->base, src->end - src->base);
+    }
+    if (src->buffer != NULL) {
+        munmap(src->buffer, SOURCE_BUFFER_SIZE);
+    }
+    source_init_stdio(src, NULL);
+}
+
+/*
+ * Ask the kernel to start reading the part of the mapping that lies just
+ * ahead of the cursor, once the cursor gets to within half a window of the
+ * end of the region that was last advised.
+ */
+static void advise_ahead(struct source *src) {
+    size_t window = READAHEAD_BLOCKS * copy_block_size;
+    if (!src->mapped || src->advised - src->cur > (ssize_t)(window / 2)) {
+        return;
+    }
+    size_t ps = sysconf(_SC_PAGESIZE);
+    unsigned char *from = src->base + (src->cur - src->base) / ps * ps;
+    unsigned char *to = src->cur + window;
+    if (to > src->end) {
+        to = src->end;
+    }
+    if (to > from) {
+        madvise(from, to - from, MADV_WILLNEED);
+    }
+    src->advised = to;
+}
+
+/*
+ * Read between need and len bytes of input into buf: as many as the
+ * descriptor has available, or exactly need from a stdio stream, so as not
+ * to wait for input that is not needed yet.  Returns the number of bytes
+ * read, which is less than need only at the end of the input or on an
+ * I/O error.
+ */
+static size_t read_input(struct source *src, unsigned char *buf, size_t need, size_t len) {
+    if (src->fd == -1) {
+        return STATS_TIME(STAT_STREAM_READ, fread(buf, 1, need, src->fp));
+    }
+    size_t got = 0;
+    while (got < need) {
+        ssize_t n = STATS_TIME(STAT_STREAM_READ, read(src->fd, buf + got, len - got));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/*
+ * @brief  Consume the next len bytes of input.
+ * @details  For a mapped archive, the returned pointer points directly into
+ * the mapping and len may be of any size.  Otherwise, the bytes are in the
+ * read buffer, where they may be overwritten by the next call, and len must
+ * not exceed SOURCE_BUFFER_SIZE.
+ *
+ * @param src  The source to read from.
+ * @param len  The number of bytes required.
+ * @return  Pointer to the bytes, or NULL if fewer than len bytes remain or an
+ * I/O error occurred.
+ */
+unsigned char *source_next(struct source *src, size_t len) {
+    if (src->base != NULL) {
+        if ((size_t)(src->end - src->cur) < len) {
+            return NULL;
+        }
+        unsigned char *p = src->cur;
+        src->cur += len;
+        advise_ahead(src);
+        source_consumed(src, p, len);
+        return p;
+    }
+
+    if (len > SOURCE_BUFFER_SIZE) {
+        return NULL;
+    }
+    if (src->buffer == NULL) {
+        void *p = mmap(NULL, SOURCE_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            return NULL;
+        }
+        src->buffer = src->pending = src->filled = p;
+    }
+    size_t have = src->filled - src->pending;
+    if (have < len) {
+        // Move what is left to the start of the buffer and read the rest after it
+        __builtin_memmove(src->buffer, src->pending, have);
+        src->pending = src->buffer;
+        src->filled = src->buffer + have;
+        src->filled += read_input(src, src->filled, len - have, SOURCE_BUFFER_SIZE - have);
+        if ((size_t)(src->filled - src->pending) < len) {
+            return NULL;
+        }
+    }
+    unsigned char *p = src->pending;
+    src->pending += len;
+    source_consumed(src, p, len);
+    return p;
+}
+
+/*
+ * @brief  Copy the next len bytes of input into a buffer.
+ * @details  Beyond what the source has buffered, a large request is read
+ * straight into buf.
+ * @return 0 on success, -1 if fewer than len bytes remain or an I/O error
+ * occurred.
+ */
+int source_read(struct source *src, void *buf, size_t len) {
+    unsigned char *dst = buf;
+    if (src->base != NULL || len <= SOURCE_BUFFER_SIZE) {
+        unsigned char *p = source_next(src, len);
+        if (p == NULL) {
+            return -1;
+        }
+        __builtin_memcpy(dst, p, len);
+        return 0;
+    }
+    size_t have = source_buffered(src);
+    if (have > 0) {
+        __builtin_memcpy(dst, src->pending, have);
+        src->pending += have;
+    }
+    if (read_input(src, dst + have, len - have, len - have) != len - have) {
+        return -1;
+    }
+    source_consumed(src, buf, len);
+    return 0;
+}
+
+/*
+ * @brief  Consume and discard the next len bytes of input.
+ * @details  Beyond what the source has buffered, a descriptor that can seek
+ * is moved past the bytes, which are never read, unless they have to be
+ * checked against a checksum.
+ * @return 0 on success, -1 if fewer than len bytes remain or an I/O error
+ * occurred.
+ */
+int source_skip(struct source *src, uint64_t len) {
+    if (src->base != NULL) {
+        return source_next(src, len) == NULL ? -1 : 0;
+    }
+    size_t have = source_buffered(src);
+    if (have > 0 && source_next(src, have < len ? have : len) == NULL) {
+        return -1;
+    }
+    len -= have < len ? have : len;
+    if (len > 0 && src->fd != -1 && !src->checksums && lseek(src->fd, len, SEEK_CUR) != -1) {
+        src->offset += len;
+        return 0;
+    }
+    while (len > 0) {
+        size_t n = len < SOURCE_BUFFER_SIZE ? len : SOURCE_BUFFER_SIZE;
+        if (source_next(src, n) == NULL) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Return the number of bytes that a source that is not mapped has
+ * read from its input but not handed out yet.  They have to be consumed
+ * before the descriptor of the source can be read from directly.
+ */
+size_t source_buffered(struct source *src) {
+    return src->filled - src->pending;
+}
+
+/*
+ * @brief  Account for bytes of input that have been consumed.
+ * @details  Called for the bytes handed out by this module and for those
+ * that the copy engine reads from the stream of a source.  Once the input
+ * has been found to carry CHECKSUM records, the bytes are added to the
+ * checksum of the payload being read.
+ *
+ * @param src  The source that the bytes were read from.
+ * @param buf  The bytes.
+ * @param len  The number of bytes.
+ */
+void source_consumed(struct source *src, void *buf, size_t len) {
+    src->offset += len;
+    if (src->checksums) {
+        src->crc = crc32c_update(src->crc, buf, len);
+    }
+}
+
+/*
+ * @brief  Move the read cursor of a mapped archive to a record.
+ * @details  The payload that precedes the record has not been read, so its
+ * checksum is not checked; that of the header of the record still is.
+ *
+ * @param src  A source that reads a mapped archive.
+ * @param offset  Offset of the record, or of the CHECKSUM record in front
+ * of it.
+ */
+void source_reposition(struct source *src, uint64_t offset) {
+    src->cur = src->advised = src->base + offset;
+    src->offset = offset;
+    src->crc_known = 0;
+    src->sum_pending = 0;
+}
@@ -0,0 +1,128 @@
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "sparse.h"
+#include "context.h"
+#include "copy.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/*
+ * @brief  Emit a SPARSE_DATA record for the file open on fd, if it has
+ * holes.
+ * @param fd  Descriptor of the file, which is left open.
+ * @param depth  The value of the depth field of the record.
+ * @param size  The size of the file.
+ * @return 0 if the record was emitted, 1 if the file has no holes (or the
+ * file system cannot tell) and nothing was emitted, -1 on an I/O error.
+ */
+int sparse_file(int fd, int depth, off_t size) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (off_t)st.st_blocks * 512 >= size) {
+        return 1;  // No room for a hole
+    }
+
+    // Map the extents first, since the record starts with its size
+    off_t pos = 0, start, end;
+    uint64_t nextents = 0, data = 0;
+    int found;
+    while ((found = copy_next_extent(fd, pos, size, &start, &end)) == 1) {
+        nextents++;
+        data += end - start;
+        pos = end;
+    }
+    if (found == -1 || (nextents == 1 && data == (uint64_t)size)) {
+        return 1;
+    }
+    debug("sparse: %lu extents, %lu of %lu bytes", (unsigned long)nextents,
+          (unsigned long)data, (unsigned long)size);
+
+    struct { uint64_t first, second; } words;  // Room for the encoded fields
+    unsigned char *meta = (unsigned char *)&words;
+    uint64_t record_size = HEADER_SIZE + SPARSE_SIZE_BYTES + nextents * SPARSE_EXTENT_BYTES + data;
+    FILE *out = context_out();
+    put_be(meta, size, SPARSE_SIZE_BYTES);
+    if (record_write(out, SPARSE_DATA, depth, record_size) == -1 ||
+        payload_write(out, meta, SPARSE_SIZE_BYTES) == -1) {
+        return -1;
+    }
+
+    // Emit the extents, which must still be those that were mapped
+    pos = 0;
+    while (nextents > 0 && copy_next_extent(fd, pos, size, &start, &end) == 1) {
+        if ((uint64_t)(end - start) > data) {
+            break;
+        }
+        put_be(meta, start, 8);
+        put_be(meta + 8, end - start, 8);
+        if (payload_write(out, meta, SPARSE_EXTENT_BYTES) == -1 ||
+            lseek(fd, start, SEEK_SET) == -1 || copy_to_stream(fd, out, end - start) == -1) {
+            return -1;
+        }
+        nextents--;
+        data -= end - start;
+        pos = end;
+    }
+    if (nextents != 0 || data != 0) {
+        fprintf(stderr, "Error: File changed while being serialized.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * @brief  Recreate a sparse file from a SPARSE_DATA record.
+ * @param in  The source, positioned after the header of the record.
+ * @param hdr  The header of the record.
+ * @param fd  Descriptor of the (empty) file to be written.
+ * @return 0 on success, -1 if the record is invalid or the file could not
+ * be written.
+ */
+int sparse_restore(struct source *in, struct record_header *hdr, int fd) {
+    if (hdr->size < HEADER_SIZE + SPARSE_SIZE_BYTES) {
+        fprintf(stderr, "Error: Invalid sparse data record.\n");
+        return -1;
+    }
+    uint64_t left = hdr->size - HEADER_SIZE - SPARSE_SIZE_BYTES;
+    unsigned char *p = source_next(in, SPARSE_SIZE_BYTES);
+    if (p == NULL) {
+        return -1;
+    }
+    uint64_t size = get_be(p, SPARSE_SIZE_BYTES);
+    uint64_t pos = 0;  // End of the last extent written
+    while (left > 0) {
+        if (left < SPARSE_EXTENT_BYTES || (p = source_next(in, SPARSE_EXTENT_BYTES)) == NULL) {
+            fprintf(stderr, "Error: Invalid sparse data record.\n");
+            return -1;
+        }
+        uint64_t start = get_be(p, 8);
+        uint64_t len = get_be(p + 8, 8);
+        left -= SPARSE_EXTENT_BYTES;
+        if (start < pos || len > left || start > size || len > size - start) {
+            fprintf(stderr, "Error: Invalid extent in sparse data record.\n");
+            return -1;
+        }
+        if (lseek(fd, start, SEEK_SET) == -1 || copy_from_stream(in, fd, len) == -1) {
+            return -1;
+        }
+        left -= len;
+        pos = start + len;
+    }
+    // The holes are left unwritten; the size covers a trailing one
+    if (ftruncate(fd, size) == -1) {
+        fprintf(stderr, "Error: Failed to set the size of a sparse file.\n");
+        return -1;
+    }
+    return 0;
+}
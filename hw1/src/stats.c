@@ -0,0 +1,334 @@
+#include <limits.h>
+#include <time.h>
+
+#include "stats.h"
+#include "arena.h"
+#include "relpath.h"
+#include "transplant.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+#ifdef STATS
+
+/* Number of files kept in each of the largest and slowest lists. */
+#define STATS_TOP 5
+
+/* A file of one of the lists. */
+struct stats_top {
+    uint64_t size;
+    uint64_t ns;
+    char *path;       /* PATH_MAX bytes */
+};
+
+/* The statistics of a run, allocated at the start of their own arena. */
+struct stats {
+    struct arena arena;
+    uint64_t *calls;             /* STAT_PHASES counters */
+    uint64_t *phase_ns;          /* STAT_PHASES counters */
+    struct stats_top *largest;
+    struct stats_top *slowest;
+    struct relpath dir;          /* directory being serialized */
+    int dir_overflow;            /* levels below dir whose names did not fit */
+    char *path;                  /* scratch pathname, PATH_MAX bytes */
+    uint64_t started;
+    uint64_t files, directories, removed, file_bytes, stream_bytes;
+};
+
+/* Phase of the calling thread, and the time it was last charged. */
+static __thread int current;
+static __thread uint64_t since;
+
+/* Name of a phase in the summary. */
+static char *phase_name(int phase) {
+    switch (phase) {
+        case STAT_SERIALIZE_DIRECTORY: return "serialize_directory";
+        case STAT_SERIALIZE_FILE: return "serialize_file";
+        case STAT_DESERIALIZE_DIRECTORY: return "deserialize_directory";
+        case STAT_DESERIALIZE_FILE: return "deserialize_file";
+        case STAT_HEADER_ENCODE: return "header_encode";
+        case STAT_HEADER_DECODE: return "header_decode";
+        case STAT_STAT: return "stat";
+        case STAT_OPEN: return "open";
+        case STAT_READ: return "read";
+        case STAT_WRITE: return "write";
+        case STAT_MKDIR: return "mkdir";
+        case STAT_CHMOD: return "chmod";
+        case STAT_STREAM_READ: return "stream_read";
+        case STAT_STREAM_WRITE: return "stream_write";
+        default: return "none";
+    }
+}
+
+/*
+ * @brief  Read the monotonic clock.
+ * @return The time in nanoseconds, from an arbitrary origin.
+ */
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Charge the time since the last switch to the phase of the thread. */
+static uint64_t charge(void) {
+    uint64_t now = stats_clock();
+    if (current != STAT_NONE) {
+        __atomic_fetch_add(ctx->stats->phase_ns + current, now - since, __ATOMIC_RELAXED);
+    }
+    since = now;
+    return now;
+}
+
+/*
+ * @brief  Start gathering statistics if --stats was given.
+ * @return 0 on success, -1 if the counters cannot be allocated.
+ */
+int stats_start(void) {
+    if (!(global_options & OPT_STATS)) {
+        return 0;
+    }
+    struct arena arena;
+    if (arena_init(&arena, ARENA_MIN_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate statistics.\n");
+        return -1;
+    }
+    struct stats *st = arena_alloc(&arena, sizeof(struct stats));
+    if (st == NULL ||
+        (st->calls = arena_alloc(&arena, 2 * STAT_PHASES * sizeof(uint64_t))) == NULL ||
+        (st->largest = arena_alloc(&arena, 2 * STATS_TOP * sizeof(struct stats_top))) == NULL ||
+        (st->path = arena_alloc(&arena, PATH_MAX)) == NULL ||
+        relpath_init(&st->dir, &arena) == -1) {
+        fprintf(stderr, "Error: Failed to allocate statistics.\n");
+        arena_free(&arena);
+        return -1;
+    }
+    st->phase_ns = st->calls + STAT_PHASES;
+    st->slowest = st->largest + STATS_TOP;
+    for (struct stats_top *t = st->largest; t < st->largest + 2 * STATS_TOP; t++) {
+        if ((t->path = arena_alloc(&arena, PATH_MAX)) == NULL) {
+            fprintf(stderr, "Error: Failed to allocate statistics.\n");
+            arena_free(&arena);
+            return -1;
+        }
+        *t->path = '\0';
+    }
+    st->arena = arena;
+    st->started = stats_clock();
+    ctx->stats = st;
+    return 0;
+}
+
+/*
+ * @brief  Enter a phase on the calling thread.
+ * @return The phase that was current, to be given to stats_end().
+ */
+int stats_begin(int phase) {
+    int outer = current;
+    charge();
+    current = phase;
+    __atomic_fetch_add(ctx->stats->calls + phase, 1, __ATOMIC_RELAXED);
+    return outer;
+}
+
+/*
+ * @brief  Leave the phase entered last and return to the one outside it.
+ */
+void stats_end(int outer) {
+    charge();
+    current = outer;
+}
+
+/*
+ * @brief  Descend into a subdirectory of the tree being serialized, for the
+ * pathnames of the files.  Below a pathname too long to be kept, files are
+ * named as if they were in the deepest directory that fits.
+ */
+void stats_enter(char *name) {
+    struct stats *st = ctx->stats;
+    if (st->dir_overflow > 0 || relpath_enter(&st->dir, name) == -1) {
+        st->dir_overflow++;
+    }
+}
+
+void stats_leave(void) {
+    struct stats *st = ctx->stats;
+    if (st->dir_overflow > 0) {
+        st->dir_overflow--;
+    } else {
+        relpath_leave(&st->dir);
+    }
+}
+
+/*
+ * @brief  Count an entry met by the main thread.
+ * @param type  STAT_ENTRY_FILE, STAT_ENTRY_DIRECTORY or STAT_ENTRY_REMOVED.
+ * @param size  The size of a file.
+ */
+void stats_entry(int type, uint64_t size) {
+    struct stats *st = ctx->stats;
+    if (type == STAT_ENTRY_DIRECTORY) {
+        st->directories++;
+    } else if (type == STAT_ENTRY_REMOVED) {
+        st->removed++;
+    } else {
+        st->files++;
+        st->file_bytes += size;
+    }
+}
+
+/* Insert a file in a list kept in decreasing order of key. */
+static void insert_top(struct stats_top *list, uint64_t key, int by_size, uint64_t size, uint64_t ns) {
+    struct stats_top *slot = list + STATS_TOP - 1;
+    if ((by_size ? slot->size : slot->ns) >= key && *slot->path != '\0') {
+        return;
+    }
+    // Shift the smaller ones down, reusing the buffer of the last one
+    char *buf = slot->path;
+    while (slot > list && (*(slot - 1)->path == '\0' ||
+                           (by_size ? (slot - 1)->size : (slot - 1)->ns) < key)) {
+        *slot = *(slot - 1);
+        slot--;
+    }
+    slot->size = size;
+    slot->ns = ns;
+    slot->path = buf;
+    char *dst = buf;
+    for (char *src = ctx->stats->path; *src != '\0'; ) {
+        *dst++ = *src++;
+    }
+    *dst = '\0';
+}
+
+/*
+ * @brief  Return the pathname, relative to the top, of an entry of the
+ * directory being serialized, for stats_file().
+ * @details  The pathname is built in a scratch buffer, overwritten by the
+ * next call, and cut short if it does not fit.
+ *
+ * @param name  Name of the entry in the directory being serialized.
+ */
+char *stats_path(char *name) {
+    struct stats *st = ctx->stats;
+    char *dst = st->path;
+    char *end = st->path + PATH_MAX - 1;
+    for (char *src = st->dir.buf; src < st->dir.buf + st->dir.len; ) {
+        *dst++ = *src++;
+    }
+    if (st->dir.len > 0 && dst < end) {
+        *dst++ = '/';
+    }
+    while (*name != '\0' && dst < end) {
+        *dst++ = *name++;
+    }
+    *dst = '\0';
+    return st->path;
+}
+
+/*
+ * @brief  Record the time and size of a file, for the lists of the largest
+ * and slowest files.
+ * @param path  Pathname of the file relative to the top (from stats_path()
+ * when serializing).
+ * @param size  The size of the file.
+ * @param start  The value of STATS_CLOCK() when work on the file began.
+ */
+void stats_file(char *path, uint64_t size, uint64_t start) {
+    struct stats *st = ctx->stats;
+    uint64_t ns = stats_clock() - start;
+    if (path != st->path) {
+        char *dst = st->path;
+        while (*path != '\0' && dst < st->path + PATH_MAX - 1) {
+            *dst++ = *path++;
+        }
+        *dst = '\0';
+    }
+    insert_top(st->largest, size, 1, size, ns);
+    insert_top(st->slowest, ns, 0, size, ns);
+}
+
+/*
+ * @brief  Record the number of bytes written to or read from the stream.
+ */
+void stats_stream(uint64_t bytes) {
+    ctx->stats->stream_bytes = bytes;
+}
+
+/* Print a string as a JSON string. */
+static void print_json_string(char *s) {
+    fputc('"', stderr);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', stderr);
+            fputc(c, stderr);
+        } else if (c < 0x20) {
+            fprintf(stderr, "\\u%04x", c);
+        } else {
+            fputc(c, stderr);
+        }
+    }
+    fputc('"', stderr);
+}
+
+static void print_top(char *label, struct stats_top *list) {
+    fprintf(stderr, "  \"%s\": [", label);
+    for (struct stats_top *t = list; t < list + STATS_TOP && *t->path != '\0'; t++) {
+        fprintf(stderr, "%s\n    {\"path\": ", t == list ? "" : ",");
+        print_json_string(t->path);
+        fprintf(stderr, ", \"size\": %lu, \"ns\": %lu}", (unsigned long)t->size, (unsigned long)t->ns);
+    }
+    fprintf(stderr, "%s]", *list->path != '\0' ? "\n  " : "");
+}
+
+/*
+ * @brief  Print the summary of the statistics to stderr as a JSON object,
+ * if they were gathered, and stop gathering them.
+ * @param ret  The result of the operation, 0 or -1.
+ */
+void stats_report(int ret) {
+    if (!stats_enabled) {
+        return;
+    }
+    struct stats *st = ctx->stats;
+    charge();
+    uint64_t wall = stats_clock() - st->started;
+    char *op = (global_options & OPT_SERIALIZE) ? "serialize" :
+               (global_options & OPT_CHECK) ? "verify" :
+               (global_options & OPT_LIST) ? "list" : "deserialize";
+
+    fprintf(stderr, "{\n  \"operation\": \"%s\",\n  \"status\": \"%s\",\n", op, ret == 0 ? "ok" : "error");
+    fprintf(stderr, "  \"wall_ns\": %lu,\n  \"workers\": %d,\n", (unsigned long)wall,
+            worker_count > 1 ? worker_count : 0);
+    fprintf(stderr, "  \"entries\": {\"files\": %lu, \"directories\": %lu, \"removed\": %lu},\n",
+            (unsigned long)st->files, (unsigned long)st->directories, (unsigned long)st->removed);
+    fprintf(stderr, "  \"bytes\": {\"files\": %lu, \"stream\": %lu},\n", (unsigned long)st->file_bytes,
+            (unsigned long)st->stream_bytes);
+    fprintf(stderr, "  \"phases\": {");
+    for (int phase = STAT_NONE + 1; phase < STAT_PHASES; phase++) {
+        fprintf(stderr, "%s\n    \"%s\": {\"calls\": %lu, \"ns\": %lu}", phase == STAT_NONE + 1 ? "" : ",",
+                phase_name(phase), (unsigned long)*(st->calls + phase), (unsigned long)*(st->phase_ns + phase));
+    }
+    fprintf(stderr, "\n  },\n");
+    print_top("largest_files", st->largest);
+    fprintf(stderr, ",\n");
+    print_top("slowest_files", st->slowest);
+    fprintf(stderr, "\n}\n");
+
+    struct arena arena = st->arena;
+    ctx->stats = NULL;
+    current = STAT_NONE;
+    arena_free(&arena);
+}
+
+#endif
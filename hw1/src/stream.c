@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "stream.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+/* Make room in buf for len more bytes.  Returns 0 on success, -1 if not. */
+static int buffer_reserve(struct transplant_buffer *buf, size_t len) {
+    if (buf->size - buf->len >= len) {
+        return 0;
+    }
+    size_t ps = sysconf(_SC_PAGESIZE);
+    size_t size = buf->size > 0 ? buf->size : STREAM_BUFFER_MIN;
+    while (size - buf->len < len) {
+        size *= 2;
+    }
+    size = (size + ps - 1) / ps * ps;
+    void *p = buf->data == NULL ?
+              mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+              mremap(buf->data, buf->size, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    buf->data = p;
+    buf->size = size;
+    return 0;
+}
+
+/* Write function of the stream of a buffer: append to it. */
+static ssize_t buffer_write(void *cookie, const char *data, size_t len) {
+    struct transplant_buffer *buf = ((struct transplant_stream *)cookie)->buffer;
+    if (buffer_reserve(buf, len) == -1) {
+        return 0;  // Reported by fopencookie() as an error
+    }
+    __builtin_memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    return len;
+}
+
+static ssize_t callback_read(void *cookie, char *data, size_t len) {
+    struct transplant_stream *s = cookie;
+    return s->read(s->arg, data, len);
+}
+
+static ssize_t callback_write(void *cookie, const char *data, size_t len) {
+    struct transplant_stream *s = cookie;
+    ssize_t n = s->write(s->arg, data, len);
+    return n < 0 ? 0 : n;
+}
+
+/*
+ * @brief  Release the memory of a buffer that was written to, and make it
+ * empty again.
+ * @param buf  The buffer.
+ */
+void transplant_buffer_free(struct transplant_buffer *buf) {
+    if (buf->size > 0) {
+        munmap(buf->data, buf->size);
+    }
+    buf->data = NULL;
+    buf->len = buf->size = 0;
+}
+
+/*
+ * @brief  Open a stdio stream on a backend of serialized data.
+ * @details  A buffer or a descriptor to be read is normally not opened this
+ * way, but read by a source (source_open_memory(), source_init_fd()).
+ *
+ * @param s  The backend.
+ * @param output  Nonzero to write to the backend, 0 to read from it.
+ * @return The stream, to be closed with stream_close(), or NULL if it
+ * cannot be opened.
+ */
+FILE *stream_open(struct transplant_stream *s, int output) {
+    char *mode = output ? "w" : "r";
+    cookie_io_functions_t io = {NULL, NULL, NULL, NULL};
+    switch (s->type) {
+        case TRANSPLANT_STREAM_FD: {
+            int fd = dup(s->fd);
+            FILE *fp = fd != -1 ? fdopen(fd, mode) : NULL;
+            if (fp == NULL && fd != -1) {
+                close(fd);
+            }
+            return fp;
+        }
+        case TRANSPLANT_STREAM_FILE:
+            return s->fp;
+        case TRANSPLANT_STREAM_BUFFER:
+            if (!output || (s->buffer->data != NULL && s->buffer->size == 0)) {
+                return NULL;
+            }
+            io.write = buffer_write;
+            break;
+        case TRANSPLANT_STREAM_CALLBACK:
+            if (output ? s->write == NULL : s->read == NULL) {
+                return NULL;
+            }
+            if (output) {
+                io.write = callback_write;
+            } else {
+                io.read = callback_read;
+            }
+            break;
+        default:
+            return NULL;
+    }
+    return fopencookie(s, mode, io);
+}
+
+/*
+ * @brief  Close the stream opened by stream_open() on a backend, or only
+ * flush it if it belongs to the caller.
+ * @return 0 on success, -1 if data could not be written.
+ */
+int stream_close(struct transplant_stream *s, FILE *fp) {
+    if (s->type == TRANSPLANT_STREAM_FILE) {
+        return fflush(fp) == EOF ? -1 : 0;
+    }
+    return fclose(fp) == EOF ? -1 : 0;
+}
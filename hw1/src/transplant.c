@@ -1,6 +1,35 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "global.h"
 #include "debug.h"
-// #include <unistd.h>
+#include "transplant.h"
+#include "copy.h"
+#include "record.h"
+#include "source.h"
+#include "arena.h"
+#include "prefetch.h"
+#include "materialize.h"
+#include "uring.h"
+#include "index.h"
+#include "filter.h"
+#include "compress.h"
+#include "dedup.h"
+#include "manifest.h"
+#include "sparse.h"
+#include "chunk.h"
+#include "stats.h"
+#include "server.h"
+#include "shard.h"
+#include "journal.h"
+#include "order.h"
 
 #ifdef _STRING_H
 #error "Do not #include <string.h>. You will get a ZERO."
@@ -32,6 +61,9 @@
  * YOU WILL GET A ZERO!
  */
 
+/* Number of worker threads to use, as set by -j. */
+__thread int worker_count = 1;
+
 /*
  * @brief  Initialize path_buf to a specified base path.
  * @details  This function copies its null-terminated argument string into
@@ -152,470 +184,1147 @@ int path_pop() {
 }
 
 int validheader(int req_record_type, int req_depth) {
-    // Validate the "magic" bytes
-    int m0 = fgetc(stdin);
-    int m1 = fgetc(stdin);
-    int m2 = fgetc(stdin);
-    if (m0 != 0x0C || m1 != 0x0D || m2 != 0xED) {
-        return -1;  // Invalid magic sequence
-    }
+    return record_expect(source_input(), req_record_type, req_depth);
+}
+
+/* Length of the pathname of the target directory at the start of path_buf. */
+static __thread int root_length;
+
+/*
+ * Return nonzero if mkdir() may fail with err for a directory being
+ * restored: when clobbering, or when the directory exists because another
+ * shard or an interrupted run (see journal.h) has created it.
+ */
+int mkdir_error_ok(int err) {
+    return (global_options & OPT_CLOBBER) || (err == EEXIST && (shard_index >= 0 || journal_resumed()));
+}
 
-    // Read and validate the record type
-    int record_type = fgetc(stdin);
-    if (record_type == EOF) {
+/*
+ * Read the header of the data of a file, a FILE_DATA, SPARSE_DATA or
+ * FILE_REFERENCE record or the first of its COMPRESSED_DATA or FILE_CHUNK
+ * records, and check its type and depth.
+ */
+static int read_file_header(int depth, struct record_header *hdr) {
+    if (record_read(source_input(), hdr) == -1) {
         return -1;
     }
-
-    // Read and validate the depth (4-byte value)
-    unsigned long depth = 0;
-    for (int i = 3; i >= 0; i--) {
-        int c = fgetc(stdin);
-        if (c == EOF) {
-            return -1;
-        }
-        depth |= (unsigned long)c << (i * 8);
+    if ((hdr->type != FILE_DATA && hdr->type != COMPRESSED_DATA && hdr->type != FILE_REFERENCE &&
+         hdr->type != SPARSE_DATA && hdr->type != FILE_CHUNK) || hdr->depth != (uint32_t)depth) {
+        return -1;
     }
+    return 0;
+}
 
-    // Read and validate the record size (8-byte value)
-    unsigned long record_size = 0;
-    for (int i = 7; i >= 0; i--) {
-        int c = fgetc(stdin);
-        if (c == EOF) {
-            return -1;
-        }
-        record_size |= (unsigned long)c << (i * 8);
+/*
+ * Create the file named by path_buf and write into it the data whose first
+ * record has the header hdr, copying the payload of a FILE_DATA record or
+ * the extents of a SPARSE_DATA record, decompressing a series of
+ * COMPRESSED_DATA records, writing a series of FILE_CHUNK records or
+ * copying the earlier file named by a FILE_REFERENCE record.
+ */
+static int write_file_data(struct record_header *hdr, int depth) {
+    // Open the file for writing
+    int fd = STATS_TIME(STAT_OPEN, open(path_buf, O_WRONLY | O_CREAT | O_TRUNC, 0666));
+    if (fd == -1) {
+        return -1;
     }
 
-    // Validate header fields
-    if (record_type == req_record_type && depth == (unsigned long)req_depth && record_size == 16) {
-        return 0;
+    // Write the file data
+    int ret;
+    if (hdr->type == COMPRESSED_DATA) {
+        ret = decompress_file(source_input(), hdr, depth, fd);
+    } else if (hdr->type == SPARSE_DATA) {
+        ret = sparse_restore(source_input(), hdr, fd);
+    } else if (hdr->type == FILE_CHUNK) {
+        ret = chunk_restore(source_input(), hdr, depth, fd);
+    } else if (hdr->type == FILE_REFERENCE) {
+        // The earlier file may still be being written by the pool
+        ret = pool_drain() == -1 ? -1 : dedup_restore(source_input(), hdr, path_buf, root_length, fd);
+    } else {
+        ret = copy_from_stream(source_input(), fd, hdr->size - HEADER_SIZE);
+    }
+    // A file whose data is damaged or incomplete is not left behind
+    if (ret == -1 || record_check(source_input()) == -1) {
+        close(fd);
+        unlink(path_buf);
+        return -1;
     }
 
-    return -1;
+    if (close(fd) == -1) {
+        return -1;
+    }
+    return 0;
 }
 
 /*
- * @brief Deserialize directory contents into an existing directory.
- * @details  This function assumes that path_buf contains the name of an existing
- * directory.  It reads (from the standard input) a sequence of DIRECTORY_ENTRY
- * records bracketed by a START_OF_DIRECTORY and END_OF_DIRECTORY record at the
- * same depth and it recreates the entries, leaving the deserialized files and
- * directories within the directory named by path_buf.
- *
- * @param depth  The value of the depth field that is expected to be found in
- * each of the records processed.
- * @return 0 in case of success, -1 in case of an error.  A variety of errors
- * can occur, including depth fields in the records read that do not match the
- * expected value, the records to be processed to not being with START_OF_DIRECTORY
- * or end with END_OF_DIRECTORY, or an I/O error occurs either while reading
- * the records from the standard input or in creating deserialized files and
- * directories.
+ * Read a FILE_DATA record and hand the file named by path_buf to the worker
+ * pool, which creates it, writes it and sets its permissions while parsing
+ * goes on.  A file too large to be staged in a pool slot is written here,
+ * as by deserialize_file().
  */
-int deserialize_directory(int depth) {
-    // To be implemented.
-    // abort();
-    // int byte_read;
-    unsigned char magic_byte1, magic_byte2, magic_byte3;  // Separate variables for magic bytes
-    unsigned char record_type;
-    unsigned long read_depth = 0;
-    unsigned long record_size = 0;
-
-    // Validate the header at the start of the directory
-    if (validheader(2, depth) == -1) {
-        fprintf(stderr, "Error: Invalid start of directory header.\n");
+static int deserialize_file_async(int depth, mode_t mode) {
+    struct record_header hdr;
+    if (read_file_header(depth, &hdr) == -1) {
         return -1;
     }
-
-    while(1){
-        // Read and validate magic bytes
-        magic_byte1 = fgetc(stdin);
-        magic_byte2 = fgetc(stdin);
-        magic_byte3 = fgetc(stdin);
-        if (magic_byte1 != 0x0C || magic_byte2 != 0x0D || magic_byte3 != 0xED) {
-            fprintf(stderr, "Error: Invalid magic bytes.\n");
-            return -1;  // Invalid magic sequence
+    // Compressed data is decoded block by block by decompress_file(),
+    // chunks are written by chunk_restore(), sparse files are written
+    // extent by extent and references wait for the earlier file to be
+    // complete
+    if (hdr.type == FILE_DATA) {
+        int ret = materialize_submit(source_input(), path_buf, hdr.size - HEADER_SIZE, mode);
+        if (ret != 1) {
+            return ret;
         }
+    }
+    // The directory of the file may still be being created in the ring
+    if (uring_active() && uring_wait_all() == -1) {
+        return -1;
+    }
+    if (write_file_data(&hdr, depth) == -1 || STATS_TIME(STAT_CHMOD, chmod(path_buf, mode & 0777)) == -1) {
+        return -1;
+    }
+    return 0;
+}
 
-        // Read record type
-        record_type = fgetc(stdin);
-
-        // If we encounter the END_OF_DIRECTORY record, break the loop
-        if(record_type == 3){
-            unsigned long header_depth = 0;
-            unsigned long header_size = 0;
-            for (int i = 0; i < 4; ++i) {
-                int byte=fgetc(stdin);
-                if (byte == EOF) {
-                    fprintf(stderr, "Error: Unexpected EOF while reading header depth.\n");
-                    return -1;
-                }
-                header_depth = (header_depth << 8) | (unsigned char)byte;
-            }
-            for (int i = 0; i < 8; ++i) {
-                int byte=fgetc(stdin);
-                if (byte == EOF) {
-                    fprintf(stderr, "Error: Unexpected EOF while reading header size.\n");
-                    return -1;
-                }
-                header_size = (header_size << 8) | (unsigned char)byte;
-            }
-            break;
-        }
+/* Nonzero while deserializing a subtree that was selected as a whole. */
+static __thread int subtree_selected;
 
-        // Ensure the record is a DIRECTORY_ENTRY
-        if (record_type != 4) {
-            fprintf(stderr, "Error: Unexpected record type.\n");
-            return -1;  // Unexpected record type, return error
-        }
+/*
+ * Decide whether the entry named by path_buf is to be extracted, according
+ * to the patterns given with -f.
+ */
+static int select_entry(mode_t mode) {
+    if (!filter_active() || subtree_selected) {
+        return FILTER_ALL;
+    }
+    char *rel = path_buf + root_length;
+    if (*rel == '/') {
+        rel++;
+    }
+    return filter_match(rel, S_ISDIR(mode));
+}
 
-        for (int i = 0; i < 4; ++i) {
-            int byte = fgetc(stdin);
-            if (byte == EOF) {
-                fprintf(stderr, "Error: Unexpected EOF while reading directory depth.\n");
-                return -1;
-            }
-            read_depth = (read_depth << 8) | (unsigned char)byte;
-        }
+/*
+ * Consume the records of a directory that is not extracted, from its
+ * START_OF_DIRECTORY record at the given depth to the matching
+ * END_OF_DIRECTORY, skipping the payloads without reading them where the
+ * input allows it.
+ */
+static int skip_directory(int depth) {
+    struct record_header hdr;
+    int level = 0;
 
-        for (int i = 0; i < 8; ++i) {
-            int byte = fgetc(stdin);
-            if (byte == EOF) {
-                fprintf(stderr, "Error: Unexpected EOF while reading record size.\n");
-                return -1;
-            }
-            record_size = (record_size << 8) | (unsigned char)byte;
+    if (validheader(START_OF_DIRECTORY, depth) == -1) {
+        return -1;
+    }
+    while (1) {
+        if (record_read(source_input(), &hdr) == -1) {
+            return -1;
         }
-
-
-
-        unsigned int mode = 0;
-        unsigned long long file_dir_size = 0;
-
-        // Read the mode (4-byte value)
-        for (int i = 0; i < 4; ++i) {
-            int byte = fgetc(stdin);
-            if (byte == EOF) {
-                fprintf(stderr, "Error: Unexpected EOF while reading file mode.\n");
-                return -1;
-            }
-            mode = (mode << 8) | (unsigned char)byte;
+        if (hdr.depth < (uint32_t)depth) {
+            return -1;
         }
-
-        // Read the file/directory size (8-byte value)
-        for (int i = 0; i < 8; ++i) {
-            int byte = fgetc(stdin);
-            if (byte == EOF) {
-                fprintf(stderr, "Error: Unexpected EOF while reading size.\n");
-                return -1;
+        if (hdr.type == START_OF_DIRECTORY) {
+            level++;
+        } else if (hdr.type == END_OF_DIRECTORY) {
+            if (level == 0) {
+                return hdr.depth == (uint32_t)depth ? 0 : -1;
             }
-            file_dir_size = (file_dir_size << 8) | (unsigned char)byte;
-        }
-
-        // Adjust the remaining size to accommodate the name length
-        record_size = record_size - 16 - 12;
-
-        // Read the name of the file or directory
-        char * name_ptr = name_buf;
-        if(record_size > NAME_MAX){
-            fprintf(stderr, "Error: File name size exceeds NAME_MAX.\n");
+            level--;
+        } else if (hdr.type != DIRECTORY_ENTRY && hdr.type != FILE_DATA &&
+                   hdr.type != COMPRESSED_DATA && hdr.type != FILE_REFERENCE &&
+                   hdr.type != ENTRY_REMOVED && hdr.type != SPARSE_DATA &&
+                   hdr.type != FILE_CHUNK) {
             return -1;
         }
-        while(record_size--){
-            int char_read = fgetc(stdin);
-            *name_ptr = char_read;
-            name_ptr++;
-        }
-        *name_ptr = '\0';
-
-        // Push the new name to the path buffer
-        if (path_push(name_buf) == -1) {
-            fprintf(stderr, "Error: Failed to push path.\n");
+        if (copy_skip_stream(source_input(), hdr.size - HEADER_SIZE) == -1) {
             return -1;
         }
-
-        if(mode & S_IFDIR){
-            // Handle directory deserialization
-            if (mkdir(path_buf, 0700) == -1 && !(global_options & 0x8)) {
-                // Clobber flag is not set
-                fprintf(stderr, "Error: Failed to create directory.\n");
-                return -1;
-            }
-
-            // Set the correct permissions for the directory
-            if(chmod(path_buf, mode & 0777) == -1){
-                fprintf(stderr, "Error: Failed to set permissions for directory.\n");
-                return -1;
-            }
-
-            // Recursively deserialize the contents of the subdirectory
-            if(deserialize_directory(depth + 1) == -1){
-                fprintf(stderr, "Error: Failed to deserialize subdirectory.\n");
-                return -1;
-            }
-        } else {
-            // Handle file deserialization
-            if(deserialize_file(depth) == -1){
-                fprintf(stderr, "Error: Failed to deserialize file.\n");
-                return -1;
-            }
-
-            // Set the correct permissions for the file
-            if(chmod(path_buf, mode & 0777) == -1){
-                fprintf(stderr, "Error: Failed to set permissions for file.\n");
-                return -1;
-            }
-
-        }
-        path_pop();
     }
-    return 0;
 }
 
 /*
- * @brief Deserialize the contents of a single file.
- * @details  This function assumes that path_buf contains the name of a file
- * to be deserialized.  The file must not already exist, unless the ``clobber''
- * bit is set in the global_options variable.  It reads (from the standard input)
- * a single FILE_DATA record containing the file content and it recreates the file
- * from the content.
- *
- * @param depth  The value of the depth field that is expected to be found in
- * the FILE_DATA record.
- * @return 0 in case of success, -1 in case of an error.  A variety of errors
- * can occur, including a depth field in the FILE_DATA record that does not match
- * the expected value, the record read is not a FILE_DATA record, the file to
- * be created already exists, or an I/O error occurs either while reading
- * the FILE_DATA record from the standard input or while re-creating the
- * deserialized file.
+ * Consume the data records of a file, whose first header hdr has been read.
  */
-int deserialize_file(int depth) {
-    // To be implemented.
-    // abort();
-    // Read and validate the "magic" bytes
-    int m0 = fgetc(stdin);
-    int m1 = fgetc(stdin);
-    int m2 = fgetc(stdin);
-    if (m0 != 0x0C || m1 != 0x0D || m2 != 0xED) {
-        return -1;  // Invalid magic sequence
+static int skip_file_data(struct record_header *hdr, int depth) {
+    if (hdr->type == COMPRESSED_DATA) {
+        return compress_skip(source_input(), hdr, depth);
     }
-
-    // Read and validate the record type
-    int record_type = fgetc(stdin);
-    if (record_type == EOF) {
-        return -1;
+    if (hdr->type == FILE_CHUNK) {
+        return chunk_skip(source_input(), hdr, depth);
+    }
+    if (hdr->type == FILE_REFERENCE) {
+        return dedup_skip(source_input(), hdr);
     }
+    return copy_skip_stream(source_input(), hdr->size - HEADER_SIZE);
+}
 
-    if (record_type != 5) {
+/*
+ * Consume the data records of a file that is not extracted.
+ */
+static int skip_file(int depth) {
+    struct record_header hdr;
+    if (read_file_header(depth, &hdr) == -1) {
         return -1;
     }
+    return skip_file_data(&hdr, depth);
+}
 
-    // Read and validate the depth (4-byte value)
-    unsigned long read_depth = 0;
-    for (int i = 3; i >= 0; i--) {
-        int c = fgetc(stdin);
-        if (c == EOF) {
-            return -1;
+/*
+ * Write the path of an entry to the listing for -T, escaping the
+ * backslashes, tabs and newlines it may contain.
+ */
+static void print_escaped(FILE *out, char *path) {
+    for (char *cp = path; *cp != '\0'; cp++) {
+        if (*cp == '\\' || *cp == '\t' || *cp == '\n') {
+            fputc('\\', out);
+            fputc(*cp == '\t' ? 't' : *cp == '\n' ? 'n' : '\\', out);
+        } else {
+            fputc(*cp, out);
         }
-        read_depth |= (unsigned long)c << (i * 8);
     }
+}
 
-    if (read_depth != (unsigned long)depth) {
-        return -1;
+/*
+ * Print the entry named by path_buf for -t, as its type and permissions,
+ * its size and its path relative to the target directory, or for -T as
+ * tab-separated fields: the mode in octal, the size, how the data is
+ * carried (dir, data, compressed, chunked, sparse, reference or removed) and the
+ * escaped path.  type is the type of the record that carries the data, or
+ * START_OF_DIRECTORY for a directory.
+ */
+static void list_entry(struct entry_meta *meta, unsigned char type) {
+    FILE *out = context_out();
+    char *rel = path_buf + root_length;
+    if (*rel == '/') {
+        rel++;
+    }
+    if (global_options & OPT_MACHINE) {
+        char *how = type == START_OF_DIRECTORY ? "dir" : type == COMPRESSED_DATA ? "compressed" :
+                    type == FILE_CHUNK ? "chunked" : type == SPARSE_DATA ? "sparse" :
+                    type == FILE_REFERENCE ? "reference" :
+                    type == ENTRY_REMOVED ? "removed" : "data";
+        fprintf(out, "%o\t%lu\t%s\t", (unsigned)meta->mode, (unsigned long)meta->size, how);
+        print_escaped(out, rel);
+        fputc('\n', out);
+        return;
+    }
+    char *perm = "rwxrwxrwx";
+    fputc(S_ISDIR(meta->mode) ? 'd' : S_ISREG(meta->mode) ? '-' : '?', out);
+    for (int i = 0; i < 9; i++) {
+        fputc((meta->mode & (0400 >> i)) ? *(perm + i) : '-', out);
     }
+    fprintf(out, " %12lu %s%s\n", (unsigned long)meta->size, rel, type == ENTRY_REMOVED ? " (removed)" : "");
+}
 
-    // Read the record size (8-byte value)
-    unsigned long record_size = 0;
-    for (int i = 7; i >= 0; i--) {
-        int c = fgetc(stdin);
-        if (c == EOF) {
-            return -1;
+/*
+ * With -t, list the entry named by path_buf, whose DIRECTORY_ENTRY record
+ * has been read, then consume its contents or its data without creating
+ * anything: the entries of a directory are listed in turn, and the data of
+ * a file is skipped (with lseek() where the input allows it).  A directory
+ * that is only entered to reach the entries selected by -f is not listed.
+ */
+static int list_directory_entry(int depth, struct entry_meta *meta, int verdict) {
+    if (S_ISDIR(meta->mode)) {
+        if (verdict == FILTER_ALL) {
+            list_entry(meta, START_OF_DIRECTORY);
         }
-        record_size |= (unsigned long)c << (i * 8);
+        return deserialize_directory(depth + 1);
     }
-
-    // Subtract the header size
-    record_size -= 16;
-    if (record_size < 0) {
+    struct record_header hdr;
+    if (read_file_header(depth, &hdr) == -1) {
         return -1;
     }
+    list_entry(meta, hdr.type);
+    return skip_file_data(&hdr, depth);
+}
 
-    // Open the file for writing
-    FILE *f = fopen(path_buf, "w");
-    if (f == NULL) {
+/* Remove one entry of a tree being removed, for nftw(). */
+static int remove_one(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/*
+ * Remove the entry named by path_buf, as requested by an ENTRY_REMOVED
+ * record, with everything below it if it is a directory.  An entry that
+ * does not exist is not an error.
+ */
+static int remove_entry(void) {
+    // Files of the tree may still be being written
+    if (pool_drain() == -1) {
         return -1;
     }
-
-    // Write the file data
-    while (record_size > 0) {
-        int i = fgetc(stdin);
-        if (i == EOF) {
-            fclose(f);
-            return -1;
-        }
-        fputc(i, f);
-        record_size--;
+    struct stat st;
+    if (lstat(path_buf, &st) == -1) {
+        return errno == ENOENT ? 0 : -1;
     }
-
-    fclose(f);
-    return 0;
+    if (!S_ISDIR(st.st_mode)) {
+        return unlink(path_buf);
+    }
+    return nftw(path_buf, remove_one, 16, FTW_DEPTH | FTW_PHYS);
 }
 
-
-// Write the magic sequence directly
-int write_magic() {
-    if (fputc(0x0C, stdout) == EOF ||
-        fputc(0x0D, stdout) == EOF ||
-        fputc(0xED, stdout) == EOF) {
+/*
+ * Queue the creation of the directory named by path_buf, with its final
+ * permissions, on the io_uring backend.  Since the request drains the ring,
+ * the entries of the directory can be queued right behind it.
+ */
+static int deserialize_directory_async(mode_t mode) {
+    struct pool_slot *slot = pool_acquire(1);
+    if (slot == NULL) {
         return -1;
     }
-    return 0;
-}
-
-// Helper function to write a header
-int write_header(unsigned char type, uint32_t depth, uint64_t size) {
-    if (write_magic() == -1) {
+    // Stop at the first directory that could not be created
+    if (pool_failed()) {
+        pool_release(slot);
         return -1;
     }
-    if (fputc(type, stdout) == EOF) {
+    pool_set_path(slot, path_buf);
+    slot->mode = mode;
+    if (uring_mkdir(slot) == -1) {
+        pool_release(slot);
         return -1;
     }
+    return 0;
+}
+
+/*
+ * Pathname of the directory named by path_buf, relative to the target
+ * directory.
+ */
+static char *relative_dir(void) {
+    char *rel = path_buf + root_length;
+    return *rel == '/' ? rel + 1 : rel;
+}
+
+/*
+ * Deserialize the entry of the directory named by path_buf whose first
+ * record, with header hdr, has just been read: a DIRECTORY_ENTRY record,
+ * followed by the data of a file or the records of a directory, or an
+ * ENTRY_REMOVED record.  restored is nonzero if an interrupted run has
+ * restored the entry already.
+ */
+static int deserialize_entry(int depth, struct record_header *hdr, int restored) {
+    struct entry_meta meta;
 
-    // Writing depth (big-endian)
-    for (int i = 3; i >= 0; --i) {
-        if (fputc((depth >> (i * 8)) & 0xFF, stdout) == EOF) {
+    // Remove an entry that no longer exists in an incremental stream
+    if (hdr->type == ENTRY_REMOVED) {
+        if (entry_read(source_input(), hdr, &meta, name_buf) == -1) {
             return -1;
         }
-    }
-
-    // Writing size (big-endian)
-    for (int i = 7; i >= 0; --i) {
-        if (fputc((size >> (i * 8)) & 0xFF, stdout) == EOF) {
+        if (path_push(name_buf) == -1) {
+            fprintf(stderr, "Error: Failed to push path.\n");
             return -1;
         }
-    }
-
-    return 0;
-}
-
-// Helper function to write a null-terminated string
-int write_string(const char *str) {
-    while (*str != '\0') {
-        if (fputc(*str++, stdout) == EOF) {
+        int selected = !restored && select_entry(meta.mode) != FILTER_SKIP;
+        if (selected) {
+            journal_entry();
+            STATS_DO(stats_entry(STAT_ENTRY_REMOVED, 0));
+        }
+        if (selected && (global_options & OPT_LIST)) {
+            list_entry(&meta, ENTRY_REMOVED);
+        } else if (selected && remove_entry() == -1) {
+            fprintf(stderr, "Error: Failed to remove entry.\n");
             return -1;
         }
+        path_pop();
+        return 0;
     }
-    return 0;
-}
 
-/*
- * @brief  Serialize the contents of a directory as a sequence of records written
- * to the standard output.
- * @details  This function assumes that path_buf contains the name of an existing
- * directory to be serialized.  It serializes the contents of that directory as a
- * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
- * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
- *
- * @param depth  The value of the depth field that is expected to occur in the
- * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
- * Note that this depth pertains only to the "top-level" records in the sequence:
- * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
- * records describing sub-directories at a greater depth.
- * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
- * including failure to open files, failure to traverse directories, and I/O errors
- * that occur while reading file content and writing to standard output.
- */
-int serialize_directory(int depth) {
-    // To be implemented.
-    // abort();
-    DIR *dir = opendir(path_buf);
-    if (!dir) {
-        fprintf(stderr, "Error: Failed to open directory.\n");
+    // Ensure the record is a DIRECTORY_ENTRY
+    if (hdr->type != DIRECTORY_ENTRY) {
+        fprintf(stderr, "Error: Unexpected record type.\n");
+        return -1;  // Unexpected record type, return error
+    }
+
+    // Read the mode, size and name of the file or directory
+    if (entry_read(source_input(), hdr, &meta, name_buf) == -1) {
         return -1;
     }
-    depth++;
 
-    // Write START_OF_DIRECTORY header
-    if (write_header(2, depth, 16) == -1) {
-        fprintf(stderr, "Error: Failed to write START_OF_DIRECTORY header at depth %d.\n", depth);
+    // Push the new name to the path buffer
+    if (path_push(name_buf) == -1) {
+        fprintf(stderr, "Error: Failed to push path.\n");
         return -1;
     }
 
-    struct dirent *de;
-    while ((de = readdir(dir)) != NULL) {
-        // Skip "." and ".."
-        if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' || *(de->d_name + 1) == '.')) {
-            continue;
+    // An entry passed over must still be there, or it is restored again
+    struct stat st;
+    if (restored && lstat(path_buf, &st) == -1 && errno == ENOENT) {
+        restored = 0;
+    }
+    if (restored) {
+        // Already on disk: go through a directory for the entries that
+        // may follow the checkpoint, and pass over the data of a file
+        if ((S_ISDIR(meta.mode) ? deserialize_directory(depth + 1) : skip_file(depth)) == -1) {
+            fprintf(stderr, "Error: Failed to skip entry.\n");
+            return -1;
         }
+        path_pop();
+        return 0;
+    }
 
-        if(path_push(de->d_name)==-1) {
-            fprintf(stderr, "Error: Failed to push path.\n");
+    int verdict = select_entry(meta.mode);
+    int outer = subtree_selected;
+    if (verdict == FILTER_SKIP) {
+        // Consume the entry without creating anything
+        if ((S_ISDIR(meta.mode) ? skip_directory(depth + 1) : skip_file(depth)) == -1) {
+            fprintf(stderr, "Error: Failed to skip entry.\n");
             return -1;
         }
-
-        struct stat stat_buf;
-        if (stat(path_buf, &stat_buf) == -1) {
-            fprintf(stderr, "Error: Failed to stat path.\n");
+        path_pop();
+        return 0;
+    }
+    if (verdict == FILTER_ALL) {
+        subtree_selected = 1;
+    }
+    journal_entry();
+    STATS_DO(stats_entry(S_ISDIR(meta.mode) ? STAT_ENTRY_DIRECTORY : STAT_ENTRY_FILE, meta.size));
+    uint64_t start = STATS_CLOCK();
+
+    if (global_options & OPT_LIST) {
+        // List the entry instead of creating it
+        if (list_directory_entry(depth, &meta, verdict) == -1) {
+            fprintf(stderr, "Error: Failed to list entry.\n");
             return -1;
         }
-
-        // Write DIRECTORY_ENTRY header
-        uint64_t record_size = 16 + 12;  // Basic size of DIRECTORY_ENTRY record
-        const char *name = de->d_name;
-        while (*name++) record_size++;  // Calculate full record size
-        if (write_header(4, depth, record_size) == -1) {
-            fprintf(stderr, "Error: Failed to write DIRECTORY_ENTRY header.\n");
+    } else if (S_ISDIR(meta.mode) && uring_active()) {
+        // Queue the creation of the directory ahead of its entries
+        if (deserialize_directory_async(meta.mode) == -1 ||
+            STATS_TIME(STAT_DESERIALIZE_DIRECTORY, deserialize_directory(depth + 1)) == -1) {
+            fprintf(stderr, "Error: Failed to deserialize subdirectory.\n");
             return -1;
         }
-
-        // Write metadata (file type/permissions and size)
-        for (int i = 3; i >= 0; --i) {
-            if (fputc((stat_buf.st_mode >> (i * 8)) & 0xFF, stdout) == EOF) {
-                fprintf(stderr, "Error: Failed to write file type/permissions.\n");
-                return -1;
-            }
+    } else if (S_ISDIR(meta.mode)) {
+        // Handle directory deserialization
+        if (STATS_TIME(STAT_MKDIR, mkdir(path_buf, 0700)) == -1 && !mkdir_error_ok(errno)) {
+            fprintf(stderr, "Error: Failed to create directory.\n");
+            return -1;
         }
 
-        for (int i = 7; i >= 0; --i) {
-            if (fputc((stat_buf.st_size >> (i * 8)) & 0xFF, stdout) == EOF) {
-                fprintf(stderr, "Error: Failed to write file size.\n");
-                return -1;
-            }
+        // Set the correct permissions for the directory
+        if(STATS_TIME(STAT_CHMOD, chmod(path_buf, meta.mode & 0777)) == -1){
+            fprintf(stderr, "Error: Failed to set permissions for directory.\n");
+            return -1;
         }
 
-        // Write file/directory name
-        if (write_string(de->d_name) == -1) {
-            fprintf(stderr, "Error: Failed to write name.\n");
+        // Recursively deserialize the contents of the subdirectory
+        if(STATS_TIME(STAT_DESERIALIZE_DIRECTORY, deserialize_directory(depth + 1)) == -1){
+            fprintf(stderr, "Error: Failed to deserialize subdirectory.\n");
+            return -1;
+        }
+    } else if (pool_running()) {
+        // Hand the file to the worker pool
+        if (STATS_TIME(STAT_DESERIALIZE_FILE, deserialize_file_async(depth, meta.mode)) == -1) {
+            fprintf(stderr, "Error: Failed to deserialize file.\n");
+            return -1;
+        }
+        STATS_DO(stats_file(relative_dir(), meta.size, start));
+    } else {
+        // Handle file deserialization
+        if(STATS_TIME(STAT_DESERIALIZE_FILE, deserialize_file(depth)) == -1){
+            fprintf(stderr, "Error: Failed to deserialize file.\n");
             return -1;
         }
 
-        if (S_ISDIR(stat_buf.st_mode)) {
-            // Recurse into the directory
-            if (serialize_directory(depth) == -1) {
-                fprintf(stderr, "Error: Failed to serialize directory.\n");
+        // Set the correct permissions for the file
+        if(STATS_TIME(STAT_CHMOD, chmod(path_buf, meta.mode & 0777)) == -1){
+            fprintf(stderr, "Error: Failed to set permissions for file.\n");
+            return -1;
+        }
+        STATS_DO(stats_file(relative_dir(), meta.size, start));
+    }
+    subtree_selected = outer;
+    path_pop();
+    return 0;
+}
+
+/*
+ * Deserialize the entries of the directory named by path_buf, from the
+ * record that follows its START_OF_DIRECTORY record, or any later record
+ * between two of its entries, through its END_OF_DIRECTORY record.
+ */
+static int deserialize_entries(int depth) {
+    struct record_header hdr;
+
+    while(1){
+        // Pass over the entries that an interrupted run has restored
+        int restored = journal_at(record_next(source_input()), depth, relative_dir());
+        if (restored == -1) {
+            return -1;
+        }
+
+        if (record_read(source_input(), &hdr) == -1) {
+            fprintf(stderr, "Error: Unexpected EOF while reading header.\n");
+            return -1;
+        }
+
+        if (hdr.depth != (uint32_t)depth) {
+            fprintf(stderr, "Error: Unexpected record depth.\n");
+            return -1;
+        }
+
+        // If we encounter the END_OF_DIRECTORY record, break the loop
+        if (hdr.type == END_OF_DIRECTORY) {
+            if (hdr.size != HEADER_SIZE) {
+                fprintf(stderr, "Error: Invalid end of directory header.\n");
                 return -1;
             }
+            break;
+        }
+
+        if (deserialize_entry(depth, &hdr, restored) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * @brief Deserialize directory contents into an existing directory.
+ * @details  This function assumes that path_buf contains the name of an existing
+ * directory.  It reads (from the standard input) a sequence of DIRECTORY_ENTRY
+ * records bracketed by a START_OF_DIRECTORY and END_OF_DIRECTORY record at the
+ * same depth and it recreates the entries, leaving the deserialized files and
+ * directories within the directory named by path_buf.
+ *
+ * @param depth  The value of the depth field that is expected to be found in
+ * each of the records processed.
+ * @return 0 in case of success, -1 in case of an error.  A variety of errors
+ * can occur, including depth fields in the records read that do not match the
+ * expected value, the records to be processed to not being with START_OF_DIRECTORY
+ * or end with END_OF_DIRECTORY, or an I/O error occurs either while reading
+ * the records from the standard input or in creating deserialized files and
+ * directories.
+ */
+int deserialize_directory(int depth) {
+    // Validate the header at the start of the directory
+    if (validheader(START_OF_DIRECTORY, depth) == -1) {
+        fprintf(stderr, "Error: Invalid start of directory header.\n");
+        return -1;
+    }
+    return deserialize_entries(depth);
+}
+
+/*
+ * @brief Deserialize the contents of a single file.
+ * @details  This function assumes that path_buf contains the name of a file
+ * to be deserialized.  The file must not already exist, unless the ``clobber''
+ * bit is set in the global_options variable.  It reads (from the standard input)
+ * a single FILE_DATA record containing the file content and it recreates the file
+ * from the content.
+ *
+ * @param depth  The value of the depth field that is expected to be found in
+ * the FILE_DATA record.
+ * @return 0 in case of success, -1 in case of an error.  A variety of errors
+ * can occur, including a depth field in the FILE_DATA record that does not match
+ * the expected value, the record read is not a FILE_DATA record, the file to
+ * be created already exists, or an I/O error occurs either while reading
+ * the FILE_DATA record from the standard input or while re-creating the
+ * deserialized file.
+ */
+int deserialize_file(int depth) {
+    struct record_header hdr;
+
+    // Read and validate the FILE_DATA header
+    if (read_file_header(depth, &hdr) == -1) {
+        return -1;
+    }
+    return write_file_data(&hdr, depth);
+}
+
+
+
+/*
+ * Entry of a directory being serialized, as listed before any of the
+ * entries are emitted.
+ */
+struct dir_item {
+    struct dir_item *next;
+    struct stat st;
+    struct pool_slot *slot;  // Non-NULL if the file is being read ahead
+    char *name;
+    unsigned char type;      // d_type reported by getdents64()
+    uint64_t ino;            // d_ino reported by getdents64()
+    uint64_t key;            // Place of the entry on disk, with -O
+    int stated;              // Nonzero once st has been filled in
+    void *stx;               // statx() buffer, with the io_uring backend
+    long stx_res;            // Result of the statx() request
+};
+
+/* Storage for the listings of the directories being serialized. */
+static __thread struct arena listing;
+
+/*
+ * Buffer for getdents64().  A directory, or a batch of its entries with
+ * -O, is listed completely before any of its subdirectories is entered,
+ * so one buffer serves every level.
+ */
+#define DENTS_BUFFER_SIZE (256 * 1024)
+static __thread char *dents_buf;
+
+/*
+ * @brief  Release the buffers kept from one run to the next by the calling
+ * thread, at the end of a transplant run through libtransplant.h.
+ */
+void transplant_release(void) {
+    if (listing.base != NULL) {
+        arena_free(&listing);
+    }
+    if (dents_buf != NULL) {
+        munmap(dents_buf, DENTS_BUFFER_SIZE);
+        dents_buf = NULL;
+    }
+    filter_clear();
+    copy_release();
+    record_release();
+    compress_release();
+    source_release();
+}
+
+/*
+ * Offer the regular files from item onward to the prefetch pool, in order,
+ * until the pool declines one.  Returns the first entry not yet offered.
+ * dirfd is the descriptor of the directory holding the entries.
+ */
+static struct dir_item *prefetch_ahead(int dirfd, struct dir_item *item) {
+    if (global_options & OPT_COMPRESS) {
+        return NULL;  // The pool compresses the blocks of one file instead
+    }
+    if (manifest_in != NULL) {
+        return NULL;  // Most files are not to be read at all
+    }
+    for (; item != NULL; item = item->next) {
+        if (!item->stated || !S_ISREG(item->st.st_mode) || item->st.st_size == 0) {
+            continue;
+        }
+        if ((global_options & OPT_SPARSE) && (off_t)item->st.st_blocks * 512 < item->st.st_size) {
+            continue;  // Possibly sparse: only its extents are to be read
+        }
+        item->slot = prefetch_submit(dirfd, item->name, item->st.st_size);
+        if (item->slot == NULL) {
+            break;
+        }
+    }
+    return item;
+}
+
+/*
+ * Read the entries of the directory open on dirfd into the listing arena,
+ * skipping "." and "..".  Entries that getdents64() reports as directories,
+ * or as regular files when no pool is going to read them ahead, are not
+ * stat'ed here: they are opened when they are emitted and the descriptor
+ * is stat'ed instead, which saves a lookup of the name.  The other entries
+ * are stat'ed relative to dirfd, in a batch on the ring with -u.  With -O,
+ * at most ORDER_BATCH entries are read, and *more is set if the listing
+ * stopped short of the end: the directory offset is then left after the
+ * last entry read, where the next call goes on.
+ */
+static int list_directory(int dirfd, struct dir_item **first, int *more) {
+    if (dents_buf == NULL) {
+        void *p = mmap(NULL, DENTS_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Error: Failed to allocate directory buffer.\n");
+            return -1;
+        }
+        dents_buf = p;
+    }
+
+    int ret = 0;
+    struct dir_item *last = NULL;
+    *first = NULL;
+    *more = 0;
+    size_t left = (global_options & OPT_ORDER) ? ORDER_BATCH : SIZE_MAX;
+    ssize_t n;
+    while (ret == 0 && !*more && (n = getdents64(dirfd, dents_buf, DENTS_BUFFER_SIZE)) > 0) {
+        for (char *cp = dents_buf; cp < dents_buf + n && !*more; ) {
+            struct dirent64 *de = (struct dirent64 *)cp;
+            cp += de->d_reclen;
+
+            // Skip "." and ".."
+            if (*(de->d_name) == '.' && (*(de->d_name + 1) == '\0' ||
+                (*(de->d_name + 1) == '.' && *(de->d_name + 2) == '\0'))) {
+                continue;
+            }
+
+            // Leave out the files of the other shards before anything is done with them
+            if (de->d_type == DT_REG && !shard_selected(de->d_ino)) {
+                continue;
+            }
+
+            struct dir_item *item = arena_alloc(&listing, sizeof(struct dir_item));
+            if (item == NULL || (item->name = arena_strdup(&listing, de->d_name)) == NULL) {
+                fprintf(stderr, "Error: Directory listing too large.\n");
+                ret = -1;
+                break;
+            }
+            item->type = de->d_type;
+            item->ino = de->d_ino;
+
+            if (item->type == DT_DIR || (item->type == DT_REG && !pool_running())) {
+                // Stat'ed through the descriptor when emitted
+            } else if (uring_active()) {
+                // Queue the stat of the entry; results are collected below
+                if ((item->stx = arena_alloc(&listing, URING_STATX_SIZE)) == NULL ||
+                    uring_statx(dirfd, item->name, item->stx, &item->stx_res) == -1) {
+                    fprintf(stderr, "Error: Failed to stat path.\n");
+                    ret = -1;
+                    break;
+                }
+            } else if (STATS_TIME(STAT_STAT, fstatat(dirfd, item->name, &item->st, 0)) == -1) {
+                fprintf(stderr, "Error: Failed to stat path.\n");
+                ret = -1;
+                break;
+            } else {
+                item->stated = 1;
+            }
+
+            if (last != NULL) {
+                last->next = item;
+            } else {
+                *first = item;
+            }
+            last = item;
+
+            // Stop at the end of a batch, with the directory offset after this entry
+            if (--left == 0) {
+                if (cp < dents_buf + n && lseek(dirfd, de->d_off, SEEK_SET) == -1) {
+                    fprintf(stderr, "Error: Failed to read directory.\n");
+                    ret = -1;
+                    break;
+                }
+                *more = 1;
+            }
+        }
+    }
+    if (ret == 0 && n == -1) {
+        fprintf(stderr, "Error: Failed to read directory.\n");
+        ret = -1;
+    }
+
+    // The names and buffers must stay put until the stat requests are done
+    if (uring_active() && uring_wait_all() == -1) {
+        ret = -1;
+    }
+    for (struct dir_item *item = *first; item != NULL && ret == 0; item = item->next) {
+        if (item->stx == NULL) {
+            continue;
+        }
+        if (item->stx_res < 0) {
+            fprintf(stderr, "Error: Failed to stat path.\n");
+            ret = -1;
+        } else {
+            uring_statx_decode(item->stx, &item->st);
+            item->stated = 1;
+        }
+    }
+    return ret;
+}
+
+/* Nonzero if item is to come before other in on-disk order. */
+static int order_before(struct dir_item *item, struct dir_item *other) {
+    int reg = item->type == DT_REG;
+    if (reg != (other->type == DT_REG)) {
+        return reg;  // The files first, then the subdirectories
+    }
+    return item->key <= other->key;
+}
+
+/* Merge sort the n entries of list into on-disk order. */
+static struct dir_item *sort_items(struct dir_item *list, uint64_t n) {
+    if (n < 2) {
+        return list;
+    }
+    struct dir_item *mid = list;
+    for (uint64_t i = 1; i < n / 2; i++) {
+        mid = mid->next;
+    }
+    struct dir_item *right = mid->next;
+    mid->next = NULL;
+    struct dir_item *left = sort_items(list, n / 2);
+    right = sort_items(right, n - n / 2);
+
+    struct dir_item *head = NULL;
+    struct dir_item **tail = &head;
+    while (left != NULL && right != NULL) {
+        struct dir_item **from = order_before(left, right) ? &left : &right;
+        *tail = *from;
+        tail = &(*from)->next;
+        *from = (*from)->next;
+    }
+    *tail = left != NULL ? left : right;
+    return head;
+}
+
+/*
+ * With -O, put the entries listed from the directory open on dirfd in the
+ * order of their place on disk: the regular files by their first extent,
+ * or by inode number if the file system does not report extents, then the
+ * other entries by inode number.  Returns the new first entry.
+ */
+static struct dir_item *order_items(int dirfd, struct dir_item *first) {
+    uint64_t n = 0;
+    int extents = 1;  // Until the file system turns FIEMAP down
+    for (struct dir_item *item = first; item != NULL; item = item->next) {
+        n++;
+        item->key = item->ino;
+        if (extents && item->type == DT_REG && order_extent(dirfd, item->name, &item->key) == 1) {
+            // Order all the files by inode number instead
+            extents = 0;
+            for (struct dir_item *done = first; done != item; done = done->next) {
+                done->key = done->ino;
+            }
+        }
+    }
+    return sort_items(first, n);
+}
+
+/*
+ * Emit the FILE_DATA record of the file open on fd, or its SPARSE_DATA
+ * record with -S, its COMPRESSED_DATA records with -z or its FILE_CHUNK
+ * records with -K, then close it.
+ */
+static int serialize_file_fd(int fd, int depth, off_t size) {
+    if ((global_options & OPT_SPARSE) && size > 0) {
+        int ret = sparse_file(fd, depth, size);
+        if (ret != 1) {
+            close(fd);
+            return ret;
+        }
+        // Probing the extents moved the offset
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            fprintf(stderr, "Error: Failed to rewind file.\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if ((global_options & OPT_COMPRESS) && size > 0) {
+        int ret = compress_file(fd, depth, size);
+        close(fd);
+        return ret;
+    }
+
+    if (global_options & OPT_CHUNK) {
+        int ret = chunk_file(fd, depth, NULL, 0);
+        close(fd);
+        return ret;
+    }
+
+    // Write FILE_DATA header
+    if (record_write(context_out(), FILE_DATA, depth, HEADER_SIZE + size) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    // Write exactly the number of bytes declared in the header
+    if (copy_to_stream(fd, context_out(), size) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * Emit the FILE_DATA record of a file that has been read ahead by the
+ * prefetch pool, or its FILE_CHUNK records with -K, then return the slot
+ * to the pool.  Whatever part of the file did not fit in the slot is copied
+ * from the descriptor left open by the worker.
+ */
+static int serialize_prefetched(int depth, off_t size, struct pool_slot *slot) {
+    FILE *out = context_out();
+    int ret = -1;
+    if (global_options & OPT_CHUNK) {
+        ret = pool_wait(slot) == 0 ? chunk_file(slot->fd, depth, slot->data, slot->filled) : -1;
+    } else if (pool_wait(slot) == 0 &&
+        record_write(out, FILE_DATA, depth, HEADER_SIZE + size) == 0 &&
+        payload_write(out, slot->data, slot->filled) == 0 &&
+        (slot->fd == -1 || copy_to_stream(slot->fd, out, size - slot->filled) == 0)) {
+        ret = 0;
+    }
+    pool_release(slot);
+    return ret;
+}
+
+/*
+ * With -D, look the regular file of a directory entry up among the files
+ * emitted earlier and, if one has the same content, emit a FILE_REFERENCE
+ * record to it instead of the data of the file.  The file is opened if *fd
+ * is -1, and left open for serialize_file_fd() unless the data has been
+ * read ahead.  Returns 1 if a reference was emitted, 0 if the data of the
+ * file is to be emitted, -1 on error.
+ */
+static int serialize_duplicate(int dirfd, struct dir_item *item, int *fd, int depth, uint64_t offset) {
+    struct dedup_ref ref;
+    if (*fd == -1 && (*fd = openat(dirfd, item->name, O_RDONLY)) == -1) {
+        return -1;
+    }
+    int ret = dedup_lookup(item->name, *fd, &item->st, offset, &ref);
+    if (ret == 0 && item->slot == NULL) {
+        return 0;
+    }
+    close(*fd);
+    *fd = -1;
+    if (ret != 1) {
+        return ret;
+    }
+    if (item->slot != NULL) {
+        pool_wait(item->slot);
+        pool_release(item->slot);
+        item->slot = NULL;
+    }
+    return dedup_write(context_out(), depth, &ref) == -1 ? -1 : 1;
+}
+
+/*
+ * Descend into the subdirectory name for the modules that record the
+ * entries of the tree by pathname, and go back up.
+ */
+static int enter_directory(char *name) {
+    if (((global_options & OPT_INDEX) && index_enter(name) == -1) ||
+        ((global_options & OPT_DEDUP) && dedup_enter(name) == -1) ||
+        (manifest_active() && manifest_enter(name) == -1)) {
+        return -1;
+    }
+    STATS_DO(stats_enter(name));
+    return 0;
+}
+
+static void leave_directory(void) {
+    STATS_DO(stats_leave());
+    if (global_options & OPT_INDEX) {
+        index_leave();
+    }
+    if (global_options & OPT_DEDUP) {
+        dedup_leave();
+    }
+    if (manifest_active()) {
+        manifest_leave();
+    }
+}
+
+static int serialize_directory_fd(int dirfd, int depth);
+
+/*
+ * Emit the entries of the directory open on dirfd that have been listed
+ * from first onward, recursing into the subdirectories, as part of the
+ * directory at the given depth.
+ */
+static int serialize_items(int dirfd, int depth, struct dir_item *first) {
+    int ret = 0;
+    struct dir_item *ahead = first;  // Next entry to be offered to the pool
+    for (struct dir_item *item = first; item != NULL && ret == 0; item = item->next) {
+        ahead = prefetch_ahead(dirfd, ahead);
+        if (ahead == item) {
+            ahead = item->next;  // Pool is busy; this one is read directly
+        }
+
+        // Open an entry that was not stat'ed when listed, and stat it
+        int fd = -1;
+        if (!item->stated) {
+            fd = STATS_TIME(STAT_OPEN, openat(dirfd, item->name, O_RDONLY | (item->type == DT_DIR ? O_DIRECTORY : 0)));
+            if (fd == -1 || STATS_TIME(STAT_STAT, fstat(fd, &item->st)) == -1) {
+                fprintf(stderr, "Error: Failed to stat path.\n");
+                if (fd != -1) {
+                    close(fd);
+                }
+                ret = -1;
+                break;
+            }
+        }
+
+        // Leave out the other entries of the other shards, now that they are known
+        if (!S_ISDIR(item->st.st_mode) && !shard_selected(item->ino)) {
+            if (fd != -1) {
+                close(fd);
+            }
+            continue;
+        }
+
+        // With a manifest, leave out the files unchanged since the previous
+        // run, and remove an entry that has changed type before sending it
+        if (manifest_active()) {
+            mode_t old_mode = 0;
+            int status = manifest_check(dirfd, item->name, &item->st, &old_mode);
+            struct entry_meta old = { old_mode, 0 };
+            if (status == -1 ||
+                (status == MANIFEST_RETYPED && removal_write(context_out(), depth, &old, item->name) == -1)) {
+                fprintf(stderr, "Error: Failed to compare entry with the manifest.\n");
+                if (fd != -1) {
+                    close(fd);
+                }
+                ret = -1;
+                break;
+            }
+            if (status == MANIFEST_SAME && !S_ISDIR(item->st.st_mode)) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                continue;
+            }
+        }
+
+        // Write the DIRECTORY_ENTRY record (header, metadata and name)
+        struct entry_meta meta = { item->st.st_mode, item->st.st_size };
+        STATS_DO(stats_entry(S_ISDIR(meta.mode) ? STAT_ENTRY_DIRECTORY : STAT_ENTRY_FILE, meta.size));
+        uint64_t start = STATS_CLOCK();
+        uint64_t offset = record_offset;
+        if (entry_write(context_out(), depth, &meta, item->name) == -1 ||
+            ((global_options & OPT_INDEX) && index_add(item->name, meta.mode, meta.size, offset) == -1)) {
+            fprintf(stderr, "Error: Failed to write DIRECTORY_ENTRY record.\n");
+            if (fd != -1) {
+                close(fd);
+            }
+            ret = -1;
+            break;
+        }
+
+        // Refer to an earlier file with the same content, if any
+        int dup = 0;
+        if ((global_options & OPT_DEDUP) && S_ISREG(item->st.st_mode) && item->st.st_size > 0 &&
+            (dup = serialize_duplicate(dirfd, item, &fd, depth, offset)) == -1) {
+            fprintf(stderr, "Error: Failed to serialize file.\n");
+            ret = -1;
+        }
+
+        if (dup != 0) {
+            // Emitted as a FILE_REFERENCE record, or failed
+        } else if (S_ISDIR(item->st.st_mode)) {
+            // Recurse into the directory
+            if (fd == -1 && (fd = STATS_TIME(STAT_OPEN, openat(dirfd, item->name, O_RDONLY | O_DIRECTORY))) == -1) {
+                fprintf(stderr, "Error: Failed to open directory.\n");
+                ret = -1;
+            } else if (enter_directory(item->name) == -1) {
+                close(fd);
+                ret = -1;
+            } else if (STATS_TIME(STAT_SERIALIZE_DIRECTORY, serialize_directory_fd(fd, depth)) == -1) {
+                fprintf(stderr, "Error: Failed to serialize directory.\n");
+                ret = -1;
+            } else {
+                leave_directory();
+            }
+        } else if (item->slot != NULL) {
+            // Serialize file that has been read ahead
+            ret = STATS_TIME(STAT_SERIALIZE_FILE, serialize_prefetched(depth, item->st.st_size, item->slot));
+            item->slot = NULL;
+            if (ret == -1) {
+                fprintf(stderr, "Error: Failed to serialize file.\n");
+            }
+            STATS_DO(stats_file(stats_path(item->name), item->st.st_size, start));
         } else {
             // Serialize file
-            if (serialize_file(depth, stat_buf.st_size) == -1) {
+            if ((fd == -1 && (fd = STATS_TIME(STAT_OPEN, openat(dirfd, item->name, O_RDONLY))) == -1) ||
+                STATS_TIME(STAT_SERIALIZE_FILE, serialize_file_fd(fd, depth, item->st.st_size)) == -1) {
                 fprintf(stderr, "Error: Failed to serialize file.\n");
-                return -1;
+                ret = -1;
             }
+            STATS_DO(stats_file(stats_path(item->name), item->st.st_size, start));
         }
+    }
 
-        path_pop();
+    // Give back the buffers of files that were read ahead but not emitted,
+    // which may still be being read relative to dirfd
+    for (struct dir_item *item = first; item != NULL; item = item->next) {
+        if (item->slot != NULL) {
+            pool_wait(item->slot);
+            pool_release(item->slot);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Serialize the directory open on dirfd, as serialize_directory() does,
+ * then close it.  Entries are opened and stat'ed relative to dirfd, so the
+ * cost of reaching an entry does not depend on its depth in the tree.
+ */
+static int serialize_directory_fd(int dirfd, int depth) {
+    depth++;
+
+    if (listing.base == NULL && arena_init(&listing, ARENA_DEFAULT_RESERVE) == -1) {
+        fprintf(stderr, "Error: Failed to allocate directory listing.\n");
+        close(dirfd);
+        return -1;
+    }
+    size_t mark = arena_mark(&listing);
+
+    // Write START_OF_DIRECTORY header
+    if (record_write(context_out(), START_OF_DIRECTORY, depth, HEADER_SIZE) == -1) {
+        fprintf(stderr, "Error: Failed to write START_OF_DIRECTORY header at depth %d.\n", depth);
+        close(dirfd);
+        return -1;
+    }
+
+    // List the whole directory first, so that the files in it can be
+    // handed to the prefetch pool before they are emitted.  With -O, it is
+    // listed and emitted in batches, each put in on-disk order.
+    int ret = 0;
+    int more = 0;
+    do {
+        struct dir_item *first = NULL;
+        if ((ret = list_directory(dirfd, &first, &more)) == 0) {
+            if (global_options & OPT_ORDER) {
+                first = order_items(dirfd, first);
+            }
+            ret = serialize_items(dirfd, depth, first);
+        }
+        arena_reset(&listing, mark);
+    } while (ret == 0 && more);
+
+    // Remove the entries of the previous run that no longer exist
+    if (ret == 0 && manifest_in != NULL && manifest_removed(context_out(), depth) == -1) {
+        fprintf(stderr, "Error: Failed to write ENTRY_REMOVED record.\n");
+        ret = -1;
+    }
+
+    close(dirfd);
+    if (ret == -1) {
+        return -1;
     }
 
     // Write END_OF_DIRECTORY header
-    if (write_header(3, depth, 16) == -1) {
+    if (record_write(context_out(), END_OF_DIRECTORY, depth, HEADER_SIZE) == -1) {
         fprintf(stderr, "Error: Failed to write END_OF_DIRECTORY header.\n");
         return -1;
     }
-    depth--;
 
-    closedir(dir);
     return 0;
 }
 
+/*
+ * @brief  Serialize the contents of a directory as a sequence of records written
+ * to the standard output.
+ * @details  This function assumes that path_buf contains the name of an existing
+ * directory to be serialized.  It serializes the contents of that directory as a
+ * sequence of records that begins with a START_OF_DIRECTORY record, ends with an
+ * END_OF_DIRECTORY record, and with the intervening records all of type DIRECTORY_ENTRY.
+ * The tree below the directory is traversed relative to directory descriptors,
+ * so path_buf is left unchanged.
+ *
+ * @param depth  The value of the depth field that is expected to occur in the
+ * START_OF_DIRECTORY, DIRECTORY_ENTRY, and END_OF_DIRECTORY records processed.
+ * Note that this depth pertains only to the "top-level" records in the sequence:
+ * DIRECTORY_ENTRY records may be recursively followed by similar sequence of
+ * records describing sub-directories at a greater depth.
+ * @return 0 in case of success, -1 otherwise.  A variety of errors can occur,
+ * including failure to open files, failure to traverse directories, and I/O errors
+ * that occur while reading file content and writing to standard output.
+ */
+int serialize_directory(int depth) {
+    // To be implemented.
+    // abort();
+    int fd = STATS_TIME(STAT_OPEN, open(path_buf, O_RDONLY | O_DIRECTORY));
+    if (fd == -1) {
+        fprintf(stderr, "Error: Failed to open directory.\n");
+        return -1;
+    }
+    return STATS_TIME(STAT_SERIALIZE_DIRECTORY, serialize_directory_fd(fd, depth));
+}
+
 /*
  * @brief  Serialize the contents of a file as a single record written to the
  * standard output.
@@ -632,27 +1341,47 @@ int serialize_directory(int depth) {
 int serialize_file(int depth, off_t size) {
     // To be implemented.
     // abort();
-    // Write FILE_DATA header
-    if (write_header(5, depth, 16 + size) == -1) {
+    // Open the file before committing to a header for it
+    int fd = STATS_TIME(STAT_OPEN, open(path_buf, O_RDONLY));  // path_buf already holds the file name
+    if (fd == -1) {
         return -1;
     }
+    return STATS_TIME(STAT_SERIALIZE_FILE, serialize_file_fd(fd, depth, size));
+}
 
-    // Open and write file contents
-    FILE *file = fopen(path_buf, "r");  // path_buf already holds the file name
-    if (!file) {
-        return -1;
+/*
+ * Set up the io_uring backend if it was requested with -u.  If it is not
+ * available, the blocking path is used instead.
+ */
+static void start_uring(void) {
+    if ((global_options & OPT_URING) && uring_init(URING_SLOTS) == -1) {
+        fprintf(stderr, "Warning: io_uring is not available; using blocking I/O.\n");
     }
+}
 
-    int c;
-    while ((c = fgetc(file)) != EOF) {
-        if (fputc(c, stdout) == EOF) {
-            fclose(file);
-            return -1;
-        }
+/*
+ * The umask is cleared while the ring creates files, and it belongs to the
+ * process: concurrent deserializations (libtransplant.h) share the cleared
+ * umask, and the last one to finish puts the original one back.
+ */
+static pthread_mutex_t umask_lock = PTHREAD_MUTEX_INITIALIZER;
+static int umask_users;
+static mode_t saved_umask;
+
+static void clear_umask(void) {
+    pthread_mutex_lock(&umask_lock);
+    if (umask_users++ == 0) {
+        saved_umask = umask(0);
     }
+    pthread_mutex_unlock(&umask_lock);
+}
 
-    fclose(file);
-    return 0;
+static void restore_umask(void) {
+    pthread_mutex_lock(&umask_lock);
+    if (--umask_users == 0) {
+        umask(saved_umask);
+    }
+    pthread_mutex_unlock(&umask_lock);
 }
 
 /**
@@ -671,25 +1400,354 @@ int serialize() {
     // To be implemented.
     // abort();
     uint32_t depth = 0;
-    uint64_t size = 16;
+    uint64_t size = HEADER_SIZE;
+
+    if (global_options & OPT_ZEROCOPY) {
+        copy_setup_pipe(fileno(context_out()));
+    }
+    record_reset();
+    if ((global_options & OPT_INDEX) && index_begin() == -1) {
+        return -1;
+    }
+    if (((global_options & OPT_DEDUP) && dedup_begin(path_buf) == -1) ||
+        (manifest_active() && manifest_begin() == -1)) {
+        index_end();
+        dedup_end();
+        manifest_end();
+        return -1;
+    }
 
     // Write the START_OF_TRANSMISSION header
-    if (write_header(0, depth, size) == -1) {
+    if (record_write(context_out(), START_OF_TRANSMISSION, depth, size) == -1) {
         fprintf(stderr, "Error: Failed to write START_OF_TRANSMISSION header.\n");
+        index_end();
+        dedup_end();
+        manifest_end();
         return -1;
     }
 
-    // Serialize the directory or file
-    if (serialize_directory(depth) == -1) {
+    // Start the ring or the threads that read files ahead of the output
+    start_uring();
+    size_t slot_size = copy_block_size;
+    if ((global_options & OPT_COMPRESS) && slot_size < COMPRESS_WORK_SIZE) {
+        slot_size = COMPRESS_WORK_SIZE;
+    }
+    if (pool_start(worker_count, PREFETCH_SLOTS_PER_WORKER, slot_size) == -1) {
+        uring_exit();
+        index_end();
+        dedup_end();
+        manifest_end();
         return -1;
     }
 
+    // Serialize the directory or file
+    int ret = serialize_directory(depth);
+    pool_stop();
+    uring_exit();
+    dedup_end();
+
+    // Write the index of the entries, if requested
+    if (ret == 0 && (global_options & OPT_INDEX) && index_write(context_out()) == -1) {
+        fprintf(stderr, "Error: Failed to write archive index.\n");
+        ret = -1;
+    }
+    index_end();
+
     // Write the END_OF_TRANSMISSION header
-    if (write_header(1, depth, size) == -1) {
+    if (ret == 0 && (record_write(context_out(), END_OF_TRANSMISSION, depth, size) == -1 ||
+                     fflush(context_out()) == EOF)) {
         fprintf(stderr, "Error: Failed to write END_OF_TRANSMISSION header.\n");
+        ret = -1;
+    }
+
+    // Replace the manifest only once the whole stream has been written out
+    if (ret == 0 && manifest_out != NULL && manifest_save() == -1) {
+        ret = -1;
+    }
+    manifest_end();
+    if (ret == -1) {
+        return -1;
+    }
+    STATS_DO(stats_stream(record_offset));
+
+    return 0;
+}
+
+/*
+ * Return nonzero if path names the entry whose pathname is the first len
+ * bytes of dir, or an entry below it.
+ */
+static int path_within(char *path, char *dir, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (*(path + i) != *(dir + i)) {
+            return 0;
+        }
+    }
+    return *(path + len) == '\0' || *(path + len) == '/';
+}
+
+static size_t path_len(char *path) {
+    size_t len = 0;
+    while (*(path + len) != '\0') {
+        len++;
+    }
+    return len;
+}
+
+/*
+ * Return nonzero if the entry named by pattern n of -f is restored along
+ * with another one: the same pattern given earlier, or a directory above
+ * it.
+ */
+static int pattern_covered(int n) {
+    char *path = filter_pattern(n);
+    char *other;
+    for (int k = 0; (other = filter_pattern(k)) != NULL; k++) {
+        size_t len = path_len(other);
+        if (k != n && path_within(path, other, len) && (len < path_len(path) || k < n)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return nonzero if the directory whose pathname is the first len bytes of
+ * dir has been created for an entry named by -f that comes before offset
+ * in the archive, and has therefore been restored already.
+ */
+static int created_before(struct index_view *view, uint64_t offset, char *dir, size_t len) {
+    struct index_entry entry;
+    char *path;
+    for (int k = 0; (path = filter_pattern(k)) != NULL; k++) {
+        if (!pattern_covered(k) && path_within(path, dir, len) &&
+            index_find(view, path, &entry) == 0 && entry.offset < offset) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Restore the entry named by pattern n of -f, located in the index view:
+ * create the directories above it with the modes recorded in the index,
+ * move to its DIRECTORY_ENTRY record and restore it as
+ * deserialize_entries() would.
+ */
+static int restore_indexed(struct index_view *view, int n, uint64_t offset) {
+    char *path = filter_pattern(n);
+    struct index_entry dir;
+    int depth = 1;
+    int ret = 0;
+    for (char *cp = path; ret == 0 && *cp != '\0'; cp++) {
+        if (*cp != '/') {
+            continue;
+        }
+        // Enter the directory named by path up to cp
+        char *name = name_buf;
+        char *from = cp;
+        while (from > path && *(from - 1) != '/') {
+            from--;
+        }
+        while (from < cp && name < name_buf + NAME_MAX - 1) {
+            *name++ = *from++;
+        }
+        *name = '\0';
+        if (path_push(name_buf) == -1 || index_find(view, relative_dir(), &dir) == -1) {
+            fprintf(stderr, "Error: Failed to find the directories above '%s'.\n", path);
+            return -1;
+        }
+        depth++;
+        if ((global_options & OPT_LIST) || created_before(view, offset, path, cp - path)) {
+            continue;
+        }
+        if ((STATS_TIME(STAT_MKDIR, mkdir(path_buf, 0700)) == -1 && !mkdir_error_ok(errno)) ||
+            STATS_TIME(STAT_CHMOD, chmod(path_buf, dir.mode & 0777)) == -1) {
+            fprintf(stderr, "Error: Failed to create directory.\n");
+            ret = -1;
+        }
+    }
+
+    struct record_header hdr;
+    source_reposition(source_input(), offset);
+    if (ret == 0 && (record_read(source_input(), &hdr) == -1 ||
+                     hdr.type != DIRECTORY_ENTRY || hdr.depth != (uint32_t)depth)) {
+        fprintf(stderr, "Error: The index does not match the serialized data.\n");
+        ret = -1;
+    }
+    if (ret == 0) {
+        ret = deserialize_entry(depth, &hdr, 0);
+    }
+    for (; depth > 1; depth--) {
+        path_pop();
+    }
+    return ret;
+}
+
+/*
+ * Restore the entries selected by -f from a mapped archive that ends with
+ * an index (-i), when every pattern names an entry literally: each entry
+ * is looked up in the index and restored from its record, in the order of
+ * the archive, without walking the records of the rest of the archive.
+ * The input is then left at the index, in front of END_OF_TRANSMISSION.
+ * Returns 1, having done nothing, if the entries must be found by walking
+ * the archive instead: it has no index, or a pattern is not in it (it may
+ * name an entry removed by an incremental stream, which is not indexed).
+ * Returns 0 once the entries are restored, or -1 on error.
+ */
+static int deserialize_indexed(void) {
+    struct source *in = source_input();
+    struct index_view view;
+    struct index_entry entry;
+    if (in->base == NULL || !filter_literal() || index_open(&view, in->base, in->end - in->base) == -1) {
+        return 1;
+    }
+    char *path;
+    for (int n = 0; (path = filter_pattern(n)) != NULL; n++) {
+        if (index_find(&view, path, &entry) == -1 || entry.offset >= view.record) {
+            return 1;
+        }
+    }
+    // Restore the entries in the order of the archive
+    uint64_t last = 0;
+    while (1) {
+        int next = -1;
+        uint64_t offset = 0;
+        for (int n = 0; (path = filter_pattern(n)) != NULL; n++) {
+            if (!pattern_covered(n) && index_find(&view, path, &entry) == 0 &&
+                entry.offset > last && (next == -1 || entry.offset < offset)) {
+                next = n;
+                offset = entry.offset;
+            }
+        }
+        if (next == -1) {
+            break;
+        }
+        if (restore_indexed(&view, next, offset) == -1) {
+            return -1;
+        }
+        last = offset;
+    }
+    source_reposition(in, view.record);
+    return 0;
+}
+
+/*
+ * Deserialize the top directory of the tree, from the record that follows
+ * START_OF_TRANSMISSION, through the index if deserialize_indexed() can use
+ * it.
+ */
+static int deserialize_tree(void) {
+    int ret = deserialize_indexed();
+    return ret == 1 ? deserialize_directory(1) : ret;
+}
+
+/*
+ * Read the END_OF_TRANSMISSION record, skipping the ARCHIVE_INDEX record
+ * that may precede it.
+ */
+static int read_end(int depth) {
+    struct record_header hdr;
+    if (record_read(source_input(), &hdr) == -1) {
+        return -1;
+    }
+    if (hdr.type == ARCHIVE_INDEX && hdr.depth == (uint32_t)depth) {
+        if (copy_skip_stream(source_input(), hdr.size - HEADER_SIZE) == -1 ||
+            record_read(source_input(), &hdr) == -1) {
+            return -1;
+        }
+    }
+    if (hdr.type != END_OF_TRANSMISSION || hdr.depth != (uint32_t)depth || hdr.size != HEADER_SIZE) {
         return -1;
     }
+    return 0;
+}
+
+/*
+ * With -v or -t, read the whole input through without creating anything.
+ * -v checks the types, depths and nesting of the records and, if the input
+ * carries them, its checksums; the payloads of a mapped archive are
+ * checksummed straight from the mapping.  -t lists the entries selected by
+ * -f as deserialize_directory() walks them.
+ */
+static int inspect_input(void) {
+    struct source archive;
+    int ret = -1;
+
+    if (archive_path != NULL) {
+        if (source_open_map(&archive, archive_path) == -1) {
+            return -1;
+        }
+        source_set_input(&archive);
+    }
+    root_length = path_length;
+    subtree_selected = 0;
+    int list = global_options & OPT_LIST;
+    if (validheader(START_OF_TRANSMISSION, 0) == -1 ||
+        (list ? STATS_TIME(STAT_DESERIALIZE_DIRECTORY, deserialize_tree()) : skip_directory(1)) == -1 ||
+        read_end(0) == -1) {
+        fprintf(stderr, "Error: Invalid serialized data.\n");
+    } else if (list && fflush(context_out()) == EOF) {
+        fprintf(stderr, "Error: Failed to write listing.\n");
+    } else {
+        if (!list && !source_input()->checksums) {
+            fprintf(stderr, "Warning: The serialized data carries no checksums; only its structure was checked.\n");
+        }
+        ret = 0;
+    }
+    STATS_DO(stats_stream(source_input()->offset));
+    if (archive_path != NULL) {
+        source_set_input(NULL);
+        source_close(&archive);
+    }
+    return ret;
+}
+
+/*
+ * Deserialize the top directory of the tree.  If the journal holds a
+ * checkpoint and the input is a mapped archive, resume at the checkpoint
+ * instead: enter the directory that was being restored, move to the record
+ * of the checkpoint, and finish that directory and each of the directories
+ * above it in turn.
+ */
+static int deserialize_top(void) {
+    uint64_t offset;
+    int depth;
+    char *dir;
 
+    if (archive_path == NULL || !journal_resume(&offset, &depth, &dir)) {
+        return deserialize_tree();
+    }
+    struct source *in = source_input();
+    int levels = 1;
+    while (*dir != '\0') {
+        char *name = name_buf;
+        while (*dir != '\0' && *dir != '/' && name < name_buf + NAME_MAX - 1) {
+            *name++ = *dir++;
+        }
+        *name = '\0';
+        if (*dir == '/') {
+            dir++;
+        }
+        if (path_push(name_buf) == -1) {
+            fprintf(stderr, "Error: Failed to push path.\n");
+            return -1;
+        }
+        levels++;
+    }
+    if (levels != depth || offset < (uint64_t)(in->cur - in->base) || offset >= (uint64_t)(in->end - in->base)) {
+        fprintf(stderr, "Error: The journal does not match the serialized data.\n");
+        return -1;
+    }
+    source_reposition(in, offset);
+    for (; depth >= 1; depth--) {
+        if (deserialize_entries(depth) == -1) {
+            return -1;
+        }
+        if (depth > 1) {
+            path_pop();
+        }
+    }
     return 0;
 }
 
@@ -709,20 +1767,76 @@ int serialize() {
 int deserialize() {
     // To be implemented.
     // abort();
-    mkdir(path_buf, 0700); // Create Directory if it doesn't exist
+    struct source archive;
     int depth = 0;
-    if (validheader(0, depth) == -1) {
-        fprintf(stderr, "Error: Invalid header.\n");
-        return -1;
+    int ret = -1;
+
+    if (global_options & (OPT_CHECK | OPT_LIST)) {
+        return inspect_input();
     }
-    if (deserialize_directory(depth + 1) == -1) {
+
+    // Start the ring or the threads that create files while the input is
+    // parsed.  Files and directories created in the ring get their final
+    // permissions straight away, which requires a zero umask.
+    start_uring();
+    // Slots must also hold the work area of a compressed block
+    size_t slot_size = copy_block_size < COMPRESS_WORK_SIZE ? COMPRESS_WORK_SIZE : copy_block_size;
+    if (pool_start(worker_count, MATERIALIZE_SLOTS_PER_WORKER, slot_size) == -1) {
+        uring_exit();
         return -1;
     }
-    if (validheader(1, depth) == -1) {
+    int ring = uring_active();
+    if (ring) {
+        clear_umask();
+    }
+
+    // Read from a mapped archive if one was given, otherwise from the input stream
+    if (archive_path != NULL) {
+        if (source_open_map(&archive, archive_path) == -1) {
+            pool_stop();
+            uring_exit();
+            if (ring) {
+                restore_umask();
+            }
+            return -1;
+        }
+        source_set_input(&archive);
+    } else if ((global_options & OPT_ZEROCOPY) && source_input()->fd != -1) {
+        copy_setup_pipe(source_input()->fd);
+    }
+
+    mkdir(path_buf, 0700); // Create Directory if it doesn't exist
+    root_length = path_length;
+    subtree_selected = 0;
+    if (journal_open() == -1) {
+        // The journal could not be read
+    } else if (validheader(START_OF_TRANSMISSION, depth) == -1) {
         fprintf(stderr, "Error: Invalid header.\n");
-        return -1;
+    } else if (STATS_TIME(STAT_DESERIALIZE_DIRECTORY, deserialize_top()) == 0) {
+        if (read_end(depth) == -1) {
+            fprintf(stderr, "Error: Invalid header.\n");
+        } else {
+            ret = 0;
+        }
     }
-    return 0;
+
+    // Wait for the files still being written before releasing the input
+    if (pool_drain() == -1) {
+        ret = -1;
+    }
+    ret = journal_close(ret);
+    pool_stop();
+    uring_exit();
+    if (ring) {
+        restore_umask();
+    }
+
+    STATS_DO(stats_stream(source_input()->offset));
+    if (archive_path != NULL) {
+        source_set_input(NULL);
+        source_close(&archive);
+    }
+    return ret;
 }
 
 /**
@@ -748,6 +1862,16 @@ int validargs(int argc, char **argv)
 
     // Set global_options to 0 initially
     global_options = 0;
+    archive_path = NULL;
+    manifest_in = NULL;
+    manifest_out = NULL;
+    worker_count = 1;
+    copy_block_size = COPY_BLOCK_DEFAULT;
+    listen_path = NULL;
+    remote_path = NULL;
+    journal_path = NULL;
+    filter_clear();
+    shard_clear();
 
     // If there are no command-line arguments passed, return an error
     if (argc == 1) {
@@ -760,7 +1884,7 @@ int validargs(int argc, char **argv)
 
     // Check if the first argument is "-h"
     if (*arg == '-' && *(arg + 1) == 'h') {
-        global_options = 0x1;  // Set help flag
+        global_options = OPT_HELP;  // Set help flag
         return 0;  // Success
     }
 
@@ -770,6 +1894,8 @@ int validargs(int argc, char **argv)
     int clobber = 0;
     int positional_done = 0;  // Track if positional arguments have been processed
     int path_provided = 0;  // Track if '-p' was provided
+    int workers_provided = 0;  // Track if '-j' was provided
+    int outputs = 0;  // Number of '-o' options
 
     // Loop through all the arguments using pointer arithmetic
     for (char **arg_ptr = argv + 1; arg_ptr < argv + argc; arg_ptr++) {
@@ -795,6 +1921,25 @@ int validargs(int argc, char **argv)
                 return -1;
             }
             deserialize = 1;
+        } else if (*arg == 'L' && *(arg + 1) == '\0') {
+            if (positional_done) {
+                fprintf(stderr, "Error: Positional argument '-L' not allowed after options.\n");
+                return -1;
+            }
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-L' option requires a socket path argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            listen_path = *arg_ptr;
+        } else if (*arg == 'R' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-R' option requires a socket path argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            remote_path = *arg_ptr;
         } else if (*arg == 'c' && *(arg + 1) == '\0') {
             positional_done = 1;  // Options have started, no more positional arguments
             clobber = 1;
@@ -808,12 +1953,154 @@ int validargs(int argc, char **argv)
                 fprintf(stderr, "Error: '-p' option requires a directory path argument.\n");
                 return -1;  // '-p' provided but no directory argument
             }
+        } else if (*arg == 'k' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_ZEROCOPY;
+        } else if (*arg == 'u' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_URING;
+        } else if (*arg == 'f' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-f' option requires a pattern argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            if (filter_add(*arg_ptr) == -1) {
+                return -1;
+            }
+        } else if (*arg == 'J' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-J' option requires a journal path argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            journal_path = *arg_ptr;
+        } else if (*arg == 'i' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_INDEX;
+        } else if (*arg == 'z' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_COMPRESS;
+        } else if ((*arg == 'm' || *arg == 'M') && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-%c' option requires a manifest path argument.\n", *arg);
+                return -1;
+            }
+            arg_ptr++;
+            if (*arg == 'm') {
+                manifest_in = *arg_ptr;
+            } else {
+                manifest_out = *arg_ptr;
+            }
+        } else if (*arg == 'S' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_SPARSE;
+        } else if (*arg == 'O' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_ORDER;
+        } else if (*arg == 'K' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_CHUNK;
+        } else if (*arg == 'D' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_DEDUP;
+        } else if (*arg == 'E' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_DEDUP | OPT_VERIFY;
+        } else if (*arg == 'C' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_CHECKSUM;
+        } else if (*arg == 'v' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_CHECK;
+        } else if ((*arg == 't' || *arg == 'T') && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            global_options |= OPT_LIST | (*arg == 'T' ? OPT_MACHINE : 0);
+        } else if (*arg == 'a' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-a' option requires an archive path argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            archive_path = *arg_ptr;
+            if (shard_add(*arg_ptr) == -1) {
+                return -1;
+            }
+        } else if (*arg == 'o' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-o' option requires a shard path argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            outputs++;
+            if (shard_add(*arg_ptr) == -1) {
+                return -1;
+            }
+        } else if (*arg == 'j' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-j' option requires a thread count argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            workers_provided = 1;
+            worker_count = 0;
+            for (char *cp = *arg_ptr; *cp != '\0'; cp++) {
+                if (*cp < '0' || *cp > '9' || worker_count > WORKERS_MAX) {
+                    worker_count = 0;
+                    break;
+                }
+                worker_count = worker_count * 10 + (*cp - '0');
+            }
+            if (worker_count < 1 || worker_count > WORKERS_MAX) {
+                fprintf(stderr, "Error: Invalid thread count '%s'.\n", *arg_ptr);
+                return -1;
+            }
+        } else if (*arg == '-' && *(arg + 1) == 's' && *(arg + 2) == 't' && *(arg + 3) == 'a' &&
+                   *(arg + 4) == 't' && *(arg + 5) == 's' && *(arg + 6) == '\0') {
+            positional_done = 1;  // Options have started
+#ifndef STATS
+            fprintf(stderr, "Error: This build of transplant does not support '--stats'.\n");
+            return -1;
+#endif
+            global_options |= OPT_STATS;
+        } else if (*arg == 'b' && *(arg + 1) == '\0') {
+            positional_done = 1;  // Options have started
+            if (arg_ptr + 1 >= argv + argc) {
+                fprintf(stderr, "Error: '-b' option requires a block size argument.\n");
+                return -1;
+            }
+            arg_ptr++;
+            if (copy_set_block_size(*arg_ptr) == -1) {
+                fprintf(stderr, "Error: Invalid block size '%s'.\n", *arg_ptr);
+                return -1;
+            }
         } else {
             fprintf(stderr, "Error: Unrecognized argument.\n");
             return -1;  // Unrecognized argument
         }
     }
 
+    // '-L' (listen) is a mode of its own, which only takes '-j'
+    if (listen_path != NULL) {
+        if (serialize || deserialize || clobber || path_provided || global_options != 0 ||
+            archive_path != NULL || remote_path != NULL || manifest_active() || filter_active() ||
+            journal_path != NULL || copy_block_size != COPY_BLOCK_DEFAULT) {
+            fprintf(stderr, "Error: The '-L' option can only be combined with '-j'.\n");
+            return -1;
+        }
+        if (!workers_provided) {
+            worker_count = 0;  // One per processor
+        }
+        global_options |= OPT_LISTEN;
+        return 0;
+    }
+
     // Enforce that either '-s' or '-d' must be provided, but not both
     if ((serialize && deserialize) || (!serialize && !deserialize)) {
         fprintf(stderr, "Error: Must specify either '-s' (serialize) or '-d' (deserialize), but not both.\n");
@@ -826,15 +2113,113 @@ int validargs(int argc, char **argv)
         return -1;
     }
 
+    // '-a' (archive) is only valid if '-d' (deserialize) is provided
+    if (archive_path != NULL && !deserialize) {
+        fprintf(stderr, "Error: The '-a' option can only be used with '-d' (deserialize).\n");
+        return -1;
+    }
+
+    // '-a' may only be repeated to restore shards, not to list or verify them
+    if (shard_count() > 1 && (global_options & (OPT_LIST | OPT_CHECK))) {
+        fprintf(stderr, "Error: The '-a' option can only be repeated without '-t', '-T' or '-v'.\n");
+        return -1;
+    }
+
+    // '-o' (shard) is only valid if '-s' (serialize) is provided, without '-m' or '-M'
+    if (outputs > 0 && (!serialize || manifest_active())) {
+        fprintf(stderr, "Error: The '-o' option can only be used with '-s' (serialize), without '-m' or '-M'.\n");
+        return -1;
+    }
+
+    // '-f' (filter) is only valid if '-d' (deserialize) is provided
+    if (filter_active() && !deserialize) {
+        fprintf(stderr, "Error: The '-f' option can only be used with '-d' (deserialize).\n");
+        return -1;
+    }
+
+    // '-J' (journal) is only valid if '-d' (deserialize) is provided, to create the tree
+    if (journal_path != NULL && (!deserialize || (global_options & (OPT_LIST | OPT_CHECK)) ||
+                                 filter_active() || shard_count() > 1)) {
+        fprintf(stderr, "Error: The '-J' option can only be used with '-d' (deserialize), "
+                "without '-t', '-T', '-v', '-f' or a repeated '-a'.\n");
+        return -1;
+    }
+
+    // '-v' (verify) is only valid if '-d' (deserialize) is provided
+    if ((global_options & OPT_CHECK) && !deserialize) {
+        fprintf(stderr, "Error: The '-v' option can only be used with '-d' (deserialize).\n");
+        return -1;
+    }
+
+    // '-t' and '-T' (list) are only valid if '-d' (deserialize) is provided, without '-v'
+    if ((global_options & OPT_LIST) && (!deserialize || (global_options & OPT_CHECK))) {
+        fprintf(stderr, "Error: The '-t' and '-T' options can only be used with '-d' (deserialize), without '-v'.\n");
+        return -1;
+    }
+
+    // '-i' (index) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_INDEX) && !serialize) {
+        fprintf(stderr, "Error: The '-i' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-z' (compress) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_COMPRESS) && !serialize) {
+        fprintf(stderr, "Error: The '-z' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-S' (sparse) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_SPARSE) && !serialize) {
+        fprintf(stderr, "Error: The '-S' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-O' (on-disk order) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_ORDER) && !serialize) {
+        fprintf(stderr, "Error: The '-O' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-K' (chunked) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_CHUNK) && !serialize) {
+        fprintf(stderr, "Error: The '-K' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-K' (chunked) and '-z' (compress) each replace the FILE_DATA record
+    if ((global_options & OPT_CHUNK) && (global_options & OPT_COMPRESS)) {
+        fprintf(stderr, "Error: The '-K' option cannot be used with '-z' (compress).\n");
+        return -1;
+    }
+
+    // '-C' (checksum) is only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_CHECKSUM) && !serialize) {
+        fprintf(stderr, "Error: The '-C' option can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-m' and '-M' (manifest) are only valid if '-s' (serialize) is provided
+    if (manifest_active() && !serialize) {
+        fprintf(stderr, "Error: The '-m' and '-M' options can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
+    // '-D' and '-E' (deduplicate) are only valid if '-s' (serialize) is provided
+    if ((global_options & OPT_DEDUP) && !serialize) {
+        fprintf(stderr, "Error: The '-D' and '-E' options can only be used with '-s' (serialize).\n");
+        return -1;
+    }
+
     // Set global_options based on the parsed arguments
     if (serialize) {
-        global_options |= 0x2;  // Set the serialize flag
+        global_options |= OPT_SERIALIZE;  // Set the serialize flag
     }
     if (deserialize) {
-        global_options |= 0x4;  // Set the deserialize flag
+        global_options |= OPT_DESERIALIZE;  // Set the deserialize flag
     }
     if (clobber) {
-        global_options |= 0x8;  // Set the clobber flag
+        global_options |= OPT_CLOBBER;  // Set the clobber flag
     }
 
     // If -p was not provided, initialize the path to the current directory
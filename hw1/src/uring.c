@@ -0,0 +1,503 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include "uring.h"
+#include "transplant.h"
+#include "debug.h"
+
+#ifdef _STRING_H
+#error "Do not #include <string.h>. You will get a ZERO."
+#endif
+
+#ifdef _STRINGS_H
+#error "Do not #include <strings.h>. You will get a ZERO."
+#endif
+
+#ifdef _CTYPE_H
+#error "Do not #include <ctype.h>. You will get a ZERO."
+#endif
+
+#ifdef URING
+
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+_Static_assert(sizeof(struct statx) <= URING_STATX_SIZE, "URING_STATX_SIZE too small");
+
+/*
+ * The ring is driven with the raw system calls, so that no library beyond
+ * the kernel headers is needed.  Each submission carries in its user_data
+ * either a pointer to a long that receives the result (tag 0), or a pointer
+ * to the pool slot whose chain it belongs to, tagged in the low bits with
+ * the role of the request within the chain.
+ */
+#define TAG_RESULT  0
+#define TAG_OPEN    1
+#define TAG_DATA    2
+#define TAG_CLOSE   3
+#define TAG_MKDIR   4
+#define TAG_MASK    7
+
+static __thread int ring_fd = -1;
+static __thread unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static __thread unsigned *cq_head, *cq_tail, *cq_mask;
+static __thread unsigned sq_entries, cq_entries;
+static __thread struct io_uring_sqe *sqes;
+static __thread struct io_uring_cqe *cqes;
+static __thread void *sq_ring, *cq_ring;
+static __thread size_t sq_ring_size, cq_ring_size, sqes_size;
+static __thread unsigned to_submit;  /* prepared but not yet submitted */
+static __thread unsigned inflight;   /* submitted but not yet completed */
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(unsigned opcode, void *arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr);
+}
+
+/*
+ * Register a table of nfiles empty fixed-file slots, into which the open
+ * requests install the files they open.
+ */
+static int register_files(int nfiles) {
+    struct io_uring_rsrc_register reg = { 0 };
+    reg.nr = nfiles;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (sys_register(IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0) {
+        return 0;
+    }
+    // Older kernels: register a table of -1 descriptors
+    size_t len = nfiles * sizeof(int);
+    int *fds = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fds == MAP_FAILED) {
+        return -1;
+    }
+    for (int i = 0; i < nfiles; i++) {
+        *(fds + i) = -1;
+    }
+    int ret = sys_register(IORING_REGISTER_FILES, fds, nfiles);
+    munmap(fds, len);
+    return ret;
+}
+
+/*
+ * @brief  Set up the ring.
+ * @param nfiles  Number of files that may be open in the ring at a time;
+ * each one may need a chain of three requests.
+ * @return 0 on success, -1 if io_uring is not available.
+ */
+int uring_init(int nfiles) {
+    if (ring_fd != -1) {
+        return 0;
+    }
+    struct io_uring_params p = { 0 };
+    ring_fd = sys_setup(nfiles * 4, &p);
+    if (ring_fd < 0) {
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size) {
+            sq_ring_size = cq_ring_size;
+        }
+        cq_ring_size = sq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+            goto fail;
+        }
+    }
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (cq_ring != sq_ring) {
+            munmap(cq_ring, cq_ring_size);
+        }
+        munmap(sq_ring, sq_ring_size);
+        goto fail;
+    }
+
+    sq_head = (unsigned *)((char *)sq_ring + p.sq_off.head);
+    sq_tail = (unsigned *)((char *)sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned *)((char *)sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned *)((char *)sq_ring + p.sq_off.array);
+    cq_head = (unsigned *)((char *)cq_ring + p.cq_off.head);
+    cq_tail = (unsigned *)((char *)cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned *)((char *)cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((char *)cq_ring + p.cq_off.cqes);
+    sq_entries = p.sq_entries;
+    cq_entries = p.cq_entries;
+    to_submit = inflight = 0;
+
+    if (register_files(nfiles) == -1) {
+        uring_exit();
+        return -1;
+    }
+    debug("io_uring: %u submission entries, %d fixed files", sq_entries, nfiles);
+    return 0;
+
+fail:
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+/*
+ * @brief  Tear down the ring.  Outstanding requests are waited for first.
+ */
+void uring_exit(void) {
+    if (ring_fd == -1) {
+        return;
+    }
+    uring_wait_all();
+    munmap(sqes, sqes_size);
+    if (cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    munmap(sq_ring, sq_ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+}
+
+/*
+ * @brief  Return nonzero if the ring has been set up.
+ */
+int uring_active(void) {
+    return ring_fd != -1;
+}
+
+/* Hand the prepared requests to the kernel, waiting for min_complete. */
+static int submit(unsigned min_complete) {
+    while (to_submit > 0 || min_complete > 0) {
+        int n = sys_enter(to_submit, min_complete,
+                          min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                if (min_complete == 0 && to_submit > 0 && errno != EINTR) {
+                    min_complete = 1;  // Make room by waiting for completions
+                }
+                continue;
+            }
+            fprintf(stderr, "Error: io_uring_enter failed.\n");
+            return -1;
+        }
+        to_submit -= n;
+        inflight += n;
+        if (min_complete > 0) {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Account for the completion of a request belonging to the chain of a slot. */
+static void complete_slot(struct pool_slot *slot, int tag, int res) {
+    switch (tag) {
+        case TAG_OPEN:
+            if (res < 0) {
+                slot->error = 1;
+            }
+            break;
+        case TAG_DATA:
+            if (res < 0 || (size_t)res != slot->filled) {
+                slot->error = 1;
+            }
+            break;
+        case TAG_CLOSE:
+            if (res < 0) {
+                slot->error = 1;
+            }
+            break;
+        case TAG_MKDIR:
+            if (res < 0 && (!mkdir_error_ok(-res) ||
+                            chmod(slot->path, slot->mode & 0777) == -1)) {
+                fprintf(stderr, "Error: Failed to create directory.\n");
+                slot->error = 1;
+            }
+            break;
+    }
+    if (--slot->pending > 0) {
+        return;
+    }
+    if (slot->detached && tag == TAG_CLOSE) {
+        if (slot->error) {
+            fprintf(stderr, "Error: Failed to create file '%s'.\n", slot->path);
+        } else if ((global_options & OPT_CLOBBER) && chmod(slot->path, slot->mode & 0777) == -1) {
+            // The file may have existed already, with other permissions
+            fprintf(stderr, "Error: Failed to set permissions for file.\n");
+            slot->error = 1;
+        }
+    }
+    pool_complete(slot);
+}
+
+/*
+ * @brief  Process completed requests.
+ * @param wait  If nonzero, and requests are outstanding, wait for at least
+ * one of them to complete first.
+ * @return The number of requests completed, or -1 on failure of the ring.
+ */
+int uring_reap(int wait) {
+    if (submit(wait && (inflight + to_submit) > 0 ? 1 : 0) == -1) {
+        return -1;
+    }
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+    while (head != tail) {
+        struct io_uring_cqe *cqe = cqes + (head & *cq_mask);
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        inflight--;
+        count++;
+
+        int tag = data & TAG_MASK;
+        if (tag == TAG_RESULT) {
+            *(long *)(uintptr_t)data = res;
+        } else {
+            complete_slot((struct pool_slot *)(uintptr_t)(data & ~(uint64_t)TAG_MASK), tag, res);
+        }
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+    return count;
+}
+
+/*
+ * @brief  Wait until every request has completed.
+ * @return 0 on success, -1 on failure of the ring.
+ */
+int uring_wait_all(void) {
+    while (inflight + to_submit > 0) {
+        if (uring_reap(1) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Get n consecutive submission entries, so that a whole chain goes to the
+ * kernel in the same batch.  Completions are reaped first if the requests
+ * in flight could otherwise overflow the completion ring.
+ */
+static struct io_uring_sqe *get_sqes(unsigned n) {
+    while (inflight + to_submit + n > cq_entries) {
+        if (uring_reap(1) == -1) {
+            return NULL;
+        }
+    }
+    unsigned tail = *sq_tail;
+    if (tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries) {
+        if (submit(0) == -1) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *first = NULL;
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (tail + i) & *sq_mask;
+        struct io_uring_sqe *sqe = sqes + idx;
+        char *cp = (char *)sqe;
+        while (cp < (char *)(sqe + 1)) {
+            *cp++ = 0;
+        }
+        *(sq_array + idx) = idx;
+        if (first == NULL) {
+            first = sqe;
+        }
+    }
+    return first;
+}
+
+/* Make the n entries obtained from get_sqes() visible to the kernel. */
+static void commit_sqes(unsigned n) {
+    __atomic_store_n(sq_tail, *sq_tail + n, __ATOMIC_RELEASE);
+    to_submit += n;
+}
+
+/* The entry that follows sqe in the ring. */
+static struct io_uring_sqe *next_sqe(struct io_uring_sqe *sqe) {
+    return sqe + 1 == sqes + sq_entries ? sqes : sqe + 1;
+}
+
+static uint64_t slot_data(struct pool_slot *slot, int tag) {
+    return (uint64_t)(uintptr_t)slot | tag;
+}
+
+/*
+ * Queue the chain open / read or write / close for the file of a slot,
+ * using the fixed-file slot of the same index.
+ */
+static int queue_chain(struct pool_slot *slot, int opcode, int flags, mode_t mode) {
+    struct io_uring_sqe *sqe = get_sqes(3);
+    if (sqe == NULL) {
+        return -1;
+    }
+    slot->state = SLOT_QUEUED;
+    slot->pending = 3;
+
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = slot->dirfd;
+    sqe->addr = (uintptr_t)slot->path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    sqe->file_index = slot->index + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = slot_data(slot, TAG_OPEN);
+
+    sqe = next_sqe(sqe);
+    sqe->opcode = opcode;
+    sqe->fd = slot->index;
+    sqe->addr = (uintptr_t)(opcode == IORING_OP_READ ? slot->data : slot->payload);
+    sqe->len = slot->filled;
+    sqe->off = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->user_data = slot_data(slot, TAG_DATA);
+
+    sqe = next_sqe(sqe);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot->index + 1;
+    sqe->user_data = slot_data(slot, TAG_CLOSE);
+
+    commit_sqes(3);
+    return 0;
+}
+
+/*
+ * @brief  Queue the reading of a whole file into the buffer of a slot.
+ * @details  slot->size bytes, which must fit in the slot buffer, are read.
+ * The slot becomes done (see pool_wait()) once the file has been closed.
+ * @return 0 on success, -1 on failure of the ring.
+ */
+int uring_read_slot(struct pool_slot *slot) {
+    slot->filled = slot->size;
+    return queue_chain(slot, IORING_OP_READ, O_RDONLY, 0);
+}
+
+/*
+ * @brief  Queue the creation of a file from the payload of a slot.
+ * @details  The file is created with the permissions in slot->mode (the
+ * caller is expected to have cleared the umask) and slot->filled bytes of
+ * slot->payload are written to it.  The slot is detached: it is released
+ * when done, and failures are reported by pool_drain().
+ * @return 0 on success, -1 on failure of the ring.
+ */
+int uring_write_slot(struct pool_slot *slot) {
+    slot->detached = 1;
+    return queue_chain(slot, IORING_OP_WRITE, O_WRONLY | O_CREAT | O_TRUNC, slot->mode & 0777);
+}
+
+/*
+ * @brief  Queue the creation of the directory named in a slot.
+ * @details  The request drains the ring: it only starts once everything
+ * queued before it has completed, and nothing queued after it starts
+ * before it has completed, so the entries of the directory can be queued
+ * right away.  The slot is detached.
+ * @return 0 on success, -1 on failure of the ring.
+ */
+int uring_mkdir(struct pool_slot *slot) {
+    struct io_uring_sqe *sqe = get_sqes(1);
+    if (sqe == NULL) {
+        return -1;
+    }
+    slot->state = SLOT_QUEUED;
+    slot->detached = 1;
+    slot->pending = 1;
+    sqe->opcode = IORING_OP_MKDIRAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)slot->path;
+    sqe->len = slot->mode & 0777;
+    sqe->flags = IOSQE_IO_DRAIN;
+    sqe->user_data = slot_data(slot, TAG_MKDIR);
+    commit_sqes(1);
+    return 0;
+}
+
+/*
+ * @brief  Queue a statx() of a directory entry.
+ * @details  name, statxbuf and res must remain valid until the request has
+ * completed (see uring_wait_all()), when res receives 0 or a negative
+ * errno value.
+ * @return 0 on success, -1 on failure of the ring.
+ */
+int uring_statx(int dirfd, char *name, void *statxbuf, long *res) {
+    struct io_uring_sqe *sqe = get_sqes(1);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)name;
+    sqe->len = STATX_BASIC_STATS;
+    sqe->off = (uintptr_t)statxbuf;
+    sqe->statx_flags = 0;
+    sqe->user_data = (uintptr_t)res;
+    commit_sqes(1);
+    return 0;
+}
+
+/*
+ * @brief  Fill in a struct stat, as fstatat() would, from the result of a
+ * statx() request for STATX_BASIC_STATS.
+ */
+void uring_statx_decode(void *statxbuf, struct stat *st) {
+    struct statx *stx = statxbuf;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_blksize = stx->stx_blksize;
+    st->st_blocks = stx->stx_blocks;
+    st->st_ino = stx->stx_ino;
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+#else /* !URING */
+
+int uring_init(int nfiles) { return -1; }
+void uring_exit(void) { }
+int uring_active(void) { return 0; }
+int uring_reap(int wait) { return 0; }
+int uring_wait_all(void) { return 0; }
+int uring_read_slot(struct pool_slot *slot) { return -1; }
+int uring_write_slot(struct pool_slot *slot) { return -1; }
+int uring_mkdir(struct pool_slot *slot) { return -1; }
+int uring_statx(int dirfd, char *name, void *statxbuf, long *res) { return -1; }
+void uring_statx_decode(void *statxbuf, struct stat *st) { }
+
+#endif /* URING */
@@ -1,6 +1,24 @@
 #include <criterion/criterion.h>
 #include <criterion/logging.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/stat.h>
+#include <linux/un.h>
 #include "global.h"
+#include "transplant.h"
+#include "copy.h"
+#include "record.h"
+#include "index.h"
+#include "filter.h"
+#include "lz.h"
+#include "crc32c.h"
+#include "uring.h"
+#include "shard.h"
+#include "journal.h"
+#include "libtransplant.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 Test(basecode_tests_suite, validargs_help_test) {
     int argc = 2;
@@ -48,3 +66,629 @@ Test(basecode_tests_suite, help_system_test) {
                  "Program exited with %d instead of EXIT_SUCCESS",
 		 return_code);
 }
+
+Test(basecode_tests_suite, validargs_block_size_test) {
+    int argc = 4;
+    char *argv[] = {"bin/transplant", "-s", "-b", "64k", NULL};
+    int ret = validargs(argc, argv);
+    int exp_ret = 0;
+    cr_assert_eq(ret, exp_ret, "Invalid return for validargs.  Got: %d | Expected: %d",
+		 ret, exp_ret);
+    cr_assert_eq(copy_block_size, 65536, "Block size not set. Got: %zu", copy_block_size);
+    char *bad_argv[] = {"bin/transplant", "-s", "-b", "12x", NULL};
+    ret = validargs(argc, bad_argv);
+    cr_assert_eq(ret, -1, "Invalid block size accepted.");
+}
+
+Test(basecode_tests_suite, record_codec_test) {
+    unsigned char buf[HEADER_SIZE + ENTRY_META_SIZE + NAME_MAX];
+    struct entry_meta meta = { 0100644, 0x123456789aULL };
+    struct entry_meta out_meta;
+    struct record_header hdr;
+    size_t len = entry_encode(buf, 7, &meta, "hello");
+    cr_assert_eq(len, HEADER_SIZE + ENTRY_META_SIZE + 5, "Wrong encoded length: %zu", len);
+    cr_assert_eq(record_decode(buf, &hdr), 0, "Encoded header did not decode");
+    cr_assert_eq(hdr.type, DIRECTORY_ENTRY, "Wrong type: %d", hdr.type);
+    cr_assert_eq(hdr.depth, 7, "Wrong depth: %u", hdr.depth);
+    cr_assert_eq(hdr.size, len, "Wrong size: %lu", (unsigned long)hdr.size);
+    entry_decode_meta(buf + HEADER_SIZE, &out_meta);
+    cr_assert_eq(out_meta.mode, meta.mode, "Wrong mode: %o", out_meta.mode);
+    cr_assert_eq(out_meta.size, meta.size, "Wrong size in metadata");
+    buf[0] = 0;
+    cr_assert_eq(record_decode(buf, &hdr), -1, "Bad magic was accepted");
+}
+
+Test(basecode_tests_suite, index_lookup_test) {
+    static unsigned char buf[4096];
+    FILE *f = tmpfile();
+    cr_assert_neq(f, NULL, "Could not create temporary file");
+    record_offset = 0;
+    cr_assert_eq(index_begin(), 0, "Could not start index");
+    index_add("zeta", 0100644, 3, 100);
+    index_add("alpha", 040755, 4096, 200);
+    index_enter("alpha");
+    index_add("beta", 0100600, 7, 300);
+    index_leave();
+    cr_assert_eq(index_write(f), 0, "Could not write index");
+    cr_assert_eq(record_write(f, END_OF_TRANSMISSION, 0, HEADER_SIZE), 0, "Could not write EOT");
+    index_end();
+    rewind(f);
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+
+    struct index_view view;
+    struct index_entry entry;
+    cr_assert_eq(index_open(&view, buf, len), 0, "Index not found");
+    cr_assert_eq(view.count, 3, "Wrong entry count: %lu", (unsigned long)view.count);
+    cr_assert_eq(index_find(&view, "alpha/beta", &entry), 0, "alpha/beta not found");
+    cr_assert_eq(entry.offset, 300, "Wrong offset: %lu", (unsigned long)entry.offset);
+    cr_assert_eq(entry.mode, 0100600, "Wrong mode: %o", entry.mode);
+    cr_assert_eq(index_find(&view, "zeta", &entry), 0, "zeta not found");
+    cr_assert_eq(entry.size, 3, "Wrong size");
+    cr_assert_eq(index_find(&view, "beta", &entry), -1, "Nonexistent path found");
+}
+
+Test(basecode_tests_suite, filter_match_test) {
+    filter_clear();
+    cr_assert_eq(filter_add("etc/*/*.conf"), 0, "Could not add pattern");
+    cr_assert_eq(filter_match("etc", 1), FILTER_DESCEND, "etc should be entered");
+    cr_assert_eq(filter_match("etc/app", 1), FILTER_DESCEND, "etc/app should be entered");
+    cr_assert_eq(filter_match("etc/app/x.conf", 0), FILTER_ALL, "etc/app/x.conf not selected");
+    cr_assert_eq(filter_match("etc/app/x.txt", 0), FILTER_SKIP, "etc/app/x.txt selected");
+    cr_assert_eq(filter_match("var", 1), FILTER_SKIP, "var should be skipped");
+    cr_assert_eq(filter_match("etc/top.conf", 0), FILTER_SKIP, "'*' matched '/'");
+    filter_clear();
+    cr_assert_eq(filter_active(), 0, "Patterns not cleared");
+}
+
+Test(basecode_tests_suite, lz_roundtrip_test) {
+    static unsigned char in[8192], packed[8192], out[8192];
+    static uint32_t table[LZ_TABLE_SIZE / sizeof(uint32_t)];
+    for (size_t i = 0; i < sizeof(in); i++) {
+        in[i] = "transplant "[i % 11];
+    }
+    size_t n = lz_compress(in, sizeof(in), packed, sizeof(packed), table);
+    cr_assert(n > 0 && n < sizeof(in), "Repetitive data did not shrink: %zu", n);
+    long m = lz_decompress(packed, n, out, sizeof(out));
+    cr_assert_eq(m, sizeof(in), "Wrong decompressed length: %ld", m);
+    for (size_t i = 0; i < sizeof(in); i++) {
+        cr_assert_eq(out[i], in[i], "Decompressed data differs at %zu", i);
+    }
+    cr_assert_eq(lz_decompress(packed, n - 1, out, sizeof(out)), -1, "Truncated input accepted");
+}
+
+Test(basecode_tests_suite, validargs_dedup_test) {
+    char *argv[] = {"bin/transplant", "-s", "-E", NULL};
+    int ret = validargs(3, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options & (OPT_DEDUP | OPT_VERIFY), OPT_DEDUP | OPT_VERIFY,
+                 "Dedup bits not set for -E. Got: %x", global_options);
+    char *bad_argv[] = {"bin/transplant", "-d", "-D", NULL};
+    ret = validargs(3, bad_argv);
+    cr_assert_eq(ret, -1, "-D accepted with -d");
+}
+
+Test(basecode_tests_suite, crc32c_test) {
+    static unsigned char buf[65536];
+    cr_assert_eq(crc32c_update(0, "123456789", 9), 0xE3069283, "Wrong CRC-32C of the check string");
+    cr_assert_eq(crc32c_update(0, buf, 0), 0, "Wrong CRC-32C of no bytes");
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 31 + (i >> 8);
+    }
+    uint32_t whole = crc32c_update(0, buf, sizeof(buf));
+    uint32_t crc = 0;
+    size_t off = 0, step = 1;
+    while (off < sizeof(buf)) {
+        size_t n = step < sizeof(buf) - off ? step : sizeof(buf) - off;
+        crc = crc32c_update(crc, buf + off, n);
+        off += n;
+        step = step * 2 + 3;
+    }
+    cr_assert_eq(crc, whole, "CRC-32C computed in pieces differs: %x vs %x", crc, whole);
+}
+
+Test(basecode_tests_suite, validargs_list_test) {
+    char *argv[] = {"bin/transplant", "-d", "-T", "-f", "etc/*", NULL};
+    int ret = validargs(5, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options & (OPT_LIST | OPT_MACHINE), OPT_LIST | OPT_MACHINE,
+                 "List bits not set for -T. Got: %x", global_options);
+    char *bad_argv[] = {"bin/transplant", "-s", "-t", NULL};
+    ret = validargs(3, bad_argv);
+    cr_assert_eq(ret, -1, "-t accepted with -s");
+}
+
+Test(basecode_tests_suite, validargs_chunk_test) {
+    char *argv[] = {"bin/transplant", "-s", "-K", "-b", "64K", NULL};
+    int ret = validargs(5, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options & OPT_CHUNK, OPT_CHUNK, "Chunk bit not set for -K. Got: %x", global_options);
+    char *bad_argv[] = {"bin/transplant", "-d", "-K", NULL};
+    ret = validargs(3, bad_argv);
+    cr_assert_eq(ret, -1, "-K accepted with -d");
+    char *both_argv[] = {"bin/transplant", "-s", "-K", "-z", NULL};
+    ret = validargs(4, both_argv);
+    cr_assert_eq(ret, -1, "-K accepted with -z");
+}
+
+Test(basecode_tests_suite, validargs_stats_test) {
+    char *argv[] = {"bin/transplant", "-d", "--stats", "-j", "2", NULL};
+    int ret = validargs(5, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options & OPT_STATS, OPT_STATS, "Stats bit not set for --stats. Got: %x", global_options);
+}
+
+Test(basecode_tests_suite, validargs_server_test) {
+    char *argv[] = {"bin/transplant", "-L", "/tmp/transplant.sock", "-j", "8", NULL};
+    int ret = validargs(5, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options, OPT_LISTEN, "Listen bit not set for -L. Got: %x", global_options);
+    char *bad_argv[] = {"bin/transplant", "-L", "/tmp/transplant.sock", "-c", NULL};
+    ret = validargs(4, bad_argv);
+    cr_assert_eq(ret, -1, "-L accepted with -c");
+    char *remote_argv[] = {"bin/transplant", "-d", "-c", "-R", "/tmp/transplant.sock", NULL};
+    ret = validargs(5, remote_argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options, OPT_DESERIALIZE | OPT_CLOBBER, "Invalid global_options for -R. Got: %x", global_options);
+}
+
+Test(basecode_tests_suite, validargs_shard_test) {
+    char *argv[] = {"bin/transplant", "-s", "-o", "shard0", "-o", "shard1", NULL};
+    int ret = validargs(6, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(shard_count(), 2, "Expected 2 shards. Got: %d", shard_count());
+    char *bad_argv[] = {"bin/transplant", "-s", "-o", "shard0", "-M", "manifest", NULL};
+    ret = validargs(6, bad_argv);
+    cr_assert_eq(ret, -1, "-o accepted with -M");
+    char *list_argv[] = {"bin/transplant", "-d", "-t", "-a", "shard0", "-a", "shard1", NULL};
+    ret = validargs(7, list_argv);
+    cr_assert_eq(ret, -1, "Repeated -a accepted with -t");
+}
+
+Test(basecode_tests_suite, validargs_journal_test) {
+    char *argv[] = {"bin/transplant", "-d", "-a", "archive", "-J", "journal", NULL};
+    int ret = validargs(6, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_str_eq(journal_path, "journal", "Wrong journal path. Got: %s", journal_path);
+    char *bad_argv[] = {"bin/transplant", "-s", "-J", "journal", NULL};
+    ret = validargs(4, bad_argv);
+    cr_assert_eq(ret, -1, "-J accepted with -s");
+    char *list_argv[] = {"bin/transplant", "-d", "-t", "-J", "journal", NULL};
+    ret = validargs(5, list_argv);
+    cr_assert_eq(ret, -1, "-J accepted with -t");
+}
+
+Test(basecode_tests_suite, validargs_order_test) {
+    char *argv[] = {"bin/transplant", "-s", "-O", "-j", "4", NULL};
+    int ret = validargs(5, argv);
+    cr_assert_eq(ret, 0, "Invalid return for validargs.  Got: %d | Expected: 0", ret);
+    cr_assert_eq(global_options & OPT_ORDER, OPT_ORDER, "Order bit not set for -O. Got: %x", global_options);
+    char *bad_argv[] = {"bin/transplant", "-d", "-O", NULL};
+    ret = validargs(3, bad_argv);
+    cr_assert_eq(ret, -1, "-O accepted with -d");
+}
+
+static void *serialize_thread(void *arg) {
+    return (void *)(long)transplant_serialize(arg);
+}
+
+Test(basecode_tests_suite, library_threads_test) {
+    char *options[] = {"-j", "2", NULL};
+    struct transplant runs[2];
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++) {
+        runs[i] = (struct transplant){options, "rsrc/testdir", -1, -1};
+        runs[i].out_fd = open(i == 0 ? "/tmp/transplant_lib0.bin" : "/tmp/transplant_lib1.bin",
+                              O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        cr_assert_neq(runs[i].out_fd, -1, "Failed to create the output");
+        pthread_create(&threads[i], NULL, serialize_thread, &runs[i]);
+    }
+    for (int i = 0; i < 2; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        cr_assert_eq((long)ret, 0, "Run %d failed", i);
+        close(runs[i].out_fd);
+    }
+    int ret = system("cmp -s /tmp/transplant_lib0.bin /tmp/transplant_lib1.bin");
+    cr_assert_eq(ret, 0, "Concurrent runs wrote different streams");
+    char *listen[] = {"-L", "/tmp/transplant.sock", NULL};
+    struct transplant server = {listen, NULL, -1, -1};
+    cr_assert_eq(transplant_run(&server), -1, "-L accepted by the library");
+}
+
+Test(basecode_tests_suite, library_memory_test) {
+    struct transplant_buffer buf = {NULL, 0, 0};
+    struct transplant_stream stream = {TRANSPLANT_STREAM_BUFFER, -1, NULL, &buf, NULL, NULL, NULL};
+    struct transplant out = {NULL, "rsrc/testdir", -1, -1, NULL, &stream};
+    cr_assert_eq(transplant_serialize(&out), 0, "Serialization into memory failed");
+    cr_assert_gt(buf.len, 0, "Nothing was serialized");
+    system("rm -rf /tmp/transplant_mem");
+    struct transplant in = {NULL, "/tmp/transplant_mem", -1, -1, &stream, NULL};
+    cr_assert_eq(transplant_deserialize(&in), 0, "Deserialization from memory failed");
+    int ret = system("diff -r rsrc/testdir /tmp/transplant_mem");
+    cr_assert_eq(ret, 0, "The tree restored from memory differs");
+    transplant_buffer_free(&buf);
+    cr_assert_null(buf.data, "Buffer not released");
+}
+
+#define RT_SRC "/tmp/transplant_rt_src"
+#define RT_DST "/tmp/transplant_rt_dst"
+#define RT_BIN "/tmp/transplant_rt.bin"
+
+/*
+ * Build a tree under RT_SRC with nested and empty directories, an empty
+ * file and files larger than a copy block.
+ */
+static void make_tree(void) {
+    int ret = system("rm -rf " RT_SRC " && mkdir -p " RT_SRC "/a/b/c " RT_SRC "/empty && "
+                     "cp -r rsrc/testdir " RT_SRC " && head -c 3000000 /dev/urandom > " RT_SRC "/big && "
+                     "head -c 100000 /dev/urandom > " RT_SRC "/a/b/mid && echo leaf > " RT_SRC "/a/b/c/leaf && "
+                     ": > " RT_SRC "/a/none && chmod 750 " RT_SRC "/a/b");
+    cr_assert_eq(ret, 0, "Failed to build the source tree");
+}
+
+/*
+ * Serialize RT_SRC with the options sflags and restore it into a new RT_DST
+ * with the options dflags, through a pipe if pipe is nonzero or else
+ * through the file RT_BIN.  Returns the status of diff -r of the two trees.
+ */
+static int round_trip(char *sflags, char *dflags, int pipe) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), pipe ?
+             "rm -rf " RT_DST " && bin/transplant -s -p " RT_SRC " %s | "
+             "bin/transplant -d -p " RT_DST " %s && diff -r " RT_SRC " " RT_DST :
+             "rm -rf " RT_DST " && bin/transplant -s -p " RT_SRC " %s > " RT_BIN " && "
+             "bin/transplant -d -p " RT_DST " %s < " RT_BIN " && diff -r " RT_SRC " " RT_DST,
+             sflags, dflags);
+    return system(cmd);
+}
+
+/*
+ * Extract the entries of RT_BIN below a/b and the directory testdir/dir,
+ * selected with two wildcard patterns, into a new RT_DST, reading RT_BIN
+ * through a pipe if pipe is nonzero or as the seekable stdin otherwise,
+ * and check that nothing else was created.
+ */
+static int glob_extract(int pipe) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf " RT_DST " && %s bin/transplant -d -p " RT_DST " -f 'a/b/*' -f 'testdir/d?r' %s && "
+             "diff -r " RT_SRC "/a/b " RT_DST "/a/b && diff -r " RT_SRC "/testdir/dir " RT_DST "/testdir/dir && "
+             "(cd " RT_DST " && find . | sort | tr '\\n' ' ') | "
+             "grep -qx '. ./a ./a/b ./a/b/c ./a/b/c/leaf ./a/b/mid ./testdir ./testdir/dir "
+             "./testdir/dir/goodbye ./testdir/dir/hello1 '",
+             pipe ? "cat " RT_BIN " |" : "", pipe ? "" : "< " RT_BIN);
+    return system(cmd);
+}
+
+Test(basecode_tests_suite, glob_extract_test) {
+    make_tree();
+    int ret = system("bin/transplant -s -p " RT_SRC " > " RT_BIN);
+    cr_assert_eq(ret, 0, "Could not serialize the tree");
+    cr_assert_eq(glob_extract(1), 0, "Wrong entries extracted through a pipe");
+    cr_assert_eq(glob_extract(0), 0, "Wrong entries extracted from a seekable input");
+    ret = system("bin/transplant -s -z -C -p " RT_SRC " > " RT_BIN);
+    cr_assert_eq(ret, 0, "Could not serialize the tree");
+    cr_assert_eq(glob_extract(1), 0, "Wrong entries extracted from a compressed stream through a pipe");
+    cr_assert_eq(glob_extract(0), 0, "Wrong entries extracted from a compressed seekable input");
+}
+
+Test(basecode_tests_suite, zerocopy_pipe_test) {
+    make_tree();
+    cr_assert_eq(round_trip("-k", "-k", 1), 0, "Tree spliced through a pipe differs");
+    cr_assert_eq(round_trip("-C", "-k", 1), 0, "Tree copied from a pipe through the buffer differs");
+    cr_assert_eq(round_trip("", "", 1), 0, "Tree read from a pipe differs");
+    cr_assert_eq(round_trip("-k", "-k", 0), 0, "Tree copied from a file by the kernel differs");
+}
+
+/*
+ * Restore RT_BIN, in which a byte of the data of a/b/c/victim has been
+ * changed, with the given options, and check that the damage is reported
+ * without a misleading error after it and that the file is not left
+ * behind.
+ */
+static int damaged_restore(const char *dflags) {
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd),
+             "rm -rf " RT_DST " && ! cat " RT_BIN " | bin/transplant -d -p " RT_DST " %s 2> " RT_DST ".err && "
+             "grep -q 'Checksum mismatch in the payload' " RT_DST ".err && "
+             "! grep -q 'Unexpected' " RT_DST ".err && test ! -e " RT_DST "/a/b/c/victim",
+             dflags);
+    return system(cmd);
+}
+
+Test(basecode_tests_suite, damaged_payload_test) {
+    make_tree();
+    int ret = system("(printf XYZZY && head -c 100000 /dev/urandom) > " RT_SRC "/a/b/c/victim && "
+                     "bin/transplant -s -C -p " RT_SRC " > " RT_BIN " && "
+                     "off=$(grep -obUa XYZZY " RT_BIN " | cut -d: -f1) && "
+                     "printf Q | dd of=" RT_BIN " bs=1 seek=$((off + 50000)) conv=notrunc 2>/dev/null");
+    cr_assert_eq(ret, 0, "Could not damage the stream");
+    cr_assert_eq(damaged_restore(""), 0, "Damaged file left behind");
+    cr_assert_eq(damaged_restore("-j 4"), 0, "Damaged file left behind by the workers");
+}
+
+Test(basecode_tests_suite, archive_map_test) {
+    make_tree();
+    cr_assert_eq(round_trip("", "-a " RT_BIN, 0), 0, "Tree restored from a mapped archive differs");
+    cr_assert_eq(round_trip("-z -C", "-a " RT_BIN, 0), 0, "Tree restored from a mapped compressed archive differs");
+    cr_assert_neq(system("bin/transplant -d -p " RT_DST " -c -a /dev/null 2>/dev/null"), 0,
+                  "Empty archive accepted");
+}
+
+Test(basecode_tests_suite, prefetch_order_test) {
+    make_tree();
+    cr_assert_eq(round_trip("-j 4 -b 64K", "", 1), 0, "Tree read ahead by the workers differs");
+    int ret = system("bin/transplant -s -p " RT_SRC " > " RT_BIN " && "
+                     "bin/transplant -s -p " RT_SRC " -j 4 -b 64K | cmp -s - " RT_BIN);
+    cr_assert_eq(ret, 0, "Read-ahead changed the order of the stream");
+}
+
+Test(basecode_tests_suite, materialize_pool_test) {
+    make_tree();
+    cr_assert_eq(round_trip("", "-j 4", 1), 0, "Tree created by the workers differs");
+    cr_assert_eq(round_trip("", "-j 4 -b 64K -a " RT_BIN, 0), 0, "Tree created by the workers from an archive differs");
+}
+
+Test(basecode_tests_suite, uring_round_trip_test) {
+    make_tree();
+    cr_assert_eq(round_trip("-u", "-u", 1), 0, "Tree copied on the ring differs");
+    cr_assert_eq(round_trip("-u -j 2", "-u -a " RT_BIN, 0), 0, "Tree copied on the ring from an archive differs");
+}
+
+Test(basecode_tests_suite, dirfd_traversal_test) {
+    make_tree();
+    int ret = system("mkdir -p " RT_SRC "/wide && cd " RT_SRC "/wide && seq -f 'entry-with-a-long-name-%g' 12000 | xargs touch && "
+                     "cd .. && d=deep && for i in $(seq 60); do d=$d/level$i; done && mkdir -p $d && echo bottom > $d/file");
+    cr_assert_eq(ret, 0, "Failed to build the source tree");
+    cr_assert_eq(round_trip("", "", 1), 0, "Wide and deep tree differs");
+    cr_assert_eq(round_trip("-j 4", "", 1), 0, "Wide and deep tree read ahead differs");
+}
+
+Test(basecode_tests_suite, index_extract_test) {
+    make_tree();
+    int ret = system("bin/transplant -s -i -p " RT_SRC " > " RT_BIN " && rm -rf " RT_DST " && "
+                     "bin/transplant -d -a " RT_BIN " -p " RT_DST " -f a/b/c/leaf -f testdir/dir && "
+                     "diff -r " RT_SRC "/a/b/c " RT_DST "/a/b/c && diff -r " RT_SRC "/testdir/dir " RT_DST "/testdir/dir && "
+                     "test ! -e " RT_DST "/big && test ! -e " RT_DST "/a/b/mid");
+    cr_assert_eq(ret, 0, "Entries extracted through the index differ");
+    // Damage an entry that is not extracted: the index leads around it
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "off=$(grep -boa goodbye " RT_BIN " | head -1 | cut -d: -f1) && "
+             "printf '\\177' | dd of=" RT_BIN " bs=1 seek=$((off - %d)) conv=notrunc 2>/dev/null && rm -rf " RT_DST " && "
+             "bin/transplant -d -a " RT_BIN " -p " RT_DST " -f a/b/c/leaf && diff " RT_SRC "/a/b/c/leaf " RT_DST "/a/b/c/leaf",
+             ENTRY_META_SIZE + HEADER_SIZE - 4);
+    cr_assert_eq(system(cmd), 0, "The archive was walked instead of looked up");
+}
+
+Test(basecode_tests_suite, dedup_round_trip_test) {
+    make_tree();
+    int ret = system("cp " RT_SRC "/big " RT_SRC "/a/copy && cp " RT_SRC "/a/b/mid " RT_SRC "/a/b/c/mid && "
+                     "ln " RT_SRC "/big " RT_SRC "/empty/link");
+    cr_assert_eq(ret, 0, "Could not add the duplicates");
+    cr_assert_eq(round_trip("-D", "", 1), 0, "Deduplicated tree differs");
+    cr_assert_eq(round_trip("-E -z", "-j 4", 1), 0, "Verified deduplicated tree differs");
+    cr_assert_eq(round_trip("-D", "-a " RT_BIN, 0), 0, "Deduplicated tree restored from an archive differs");
+    struct stat st;
+    cr_assert_eq(stat(RT_BIN, &st), 0, "No archive");
+    cr_assert_lt(st.st_size, 6000000, "Duplicates were not replaced by references: %ld bytes", (long)st.st_size);
+    // A referenced file that was not extracted is decoded again from the archive
+    ret = system("rm -rf " RT_DST " && bin/transplant -d -a " RT_BIN " -p " RT_DST " -f a/copy && "
+                 "cmp " RT_SRC "/big " RT_DST "/a/copy");
+    cr_assert_eq(ret, 0, "Referenced file not decoded from the archive");
+}
+
+Test(basecode_tests_suite, manifest_delta_test) {
+    make_tree();
+    int ret = system("rm -f /tmp/transplant_rt.mf* && rm -rf " RT_DST " && "
+                     "bin/transplant -s -p " RT_SRC " -M /tmp/transplant_rt.mf | bin/transplant -d -p " RT_DST " && "
+                     "echo changed >> " RT_SRC "/a/b/c/leaf && echo new > " RT_SRC "/a/new && "
+                     "rm " RT_SRC "/a/b/mid && rm -r " RT_SRC "/empty && "
+                     "bin/transplant -s -p " RT_SRC " -m /tmp/transplant_rt.mf -M /tmp/transplant_rt.mf2 > " RT_BIN " && "
+                     "bin/transplant -d -c -p " RT_DST " < " RT_BIN " && diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Tree updated from an incremental stream differs");
+    struct stat st;
+    cr_assert_eq(stat(RT_BIN, &st), 0, "No incremental stream");
+    cr_assert_lt(st.st_size, 1000000, "Unchanged files were sent again: %ld bytes", (long)st.st_size);
+    // A stream that cannot be written out leaves the manifest as it was
+    ret = system("cp /tmp/transplant_rt.mf2 /tmp/transplant_rt.mf && echo again >> " RT_SRC "/a/new && "
+                 "! bin/transplant -s -p " RT_SRC " -m /tmp/transplant_rt.mf2 -M /tmp/transplant_rt.mf2 > /dev/full 2>/dev/null && "
+                 "cmp -s /tmp/transplant_rt.mf /tmp/transplant_rt.mf2");
+    cr_assert_eq(ret, 0, "Manifest replaced by a run whose stream failed");
+    // With -u, a file rewritten in place with the same size is still sent,
+    // and the manifest serves a later run without -u
+    make_tree();
+    ret = system("rm -f /tmp/transplant_rt.mf* && rm -rf " RT_DST " && "
+                 "bin/transplant -s -u -p " RT_SRC " -M /tmp/transplant_rt.mf | bin/transplant -d -p " RT_DST " && "
+                 "head -c 100000 /dev/urandom | dd of=" RT_SRC "/a/b/mid conv=notrunc 2>/dev/null && "
+                 "bin/transplant -s -u -p " RT_SRC " -m /tmp/transplant_rt.mf -M /tmp/transplant_rt.mf2 > " RT_BIN " && "
+                 "bin/transplant -d -c -p " RT_DST " < " RT_BIN " && diff -r " RT_SRC " " RT_DST " && "
+                 "bin/transplant -s -p " RT_SRC " -m /tmp/transplant_rt.mf2 > " RT_BIN " && "
+                 "! bin/transplant -d -T < " RT_BIN " | grep -qv '\tdir\t'");
+    cr_assert_eq(ret, 0, "Incremental runs with -u missed or resent files");
+}
+
+Test(basecode_tests_suite, sparse_round_trip_test) {
+    make_tree();
+    int ret = system("truncate -s 8M " RT_SRC "/a/holes && "
+                     "head -c 65536 /dev/urandom | dd of=" RT_SRC "/a/holes bs=64K seek=16 conv=notrunc 2>/dev/null && "
+                     "head -c 4096 /dev/urandom | dd of=" RT_SRC "/a/holes bs=4K seek=1500 conv=notrunc 2>/dev/null && "
+                     "truncate -s 4M " RT_SRC "/a/b/c/hole");
+    cr_assert_eq(ret, 0, "Could not create the sparse files");
+    cr_assert_eq(round_trip("-S", "", 1), 0, "Tree with sparse files differs");
+    struct stat st;
+    cr_assert_eq(stat(RT_DST "/a/holes", &st), 0, "Sparse file not restored");
+    cr_assert_lt(st.st_blocks * 512, st.st_size, "Holes not restored: %ld blocks", (long)st.st_blocks);
+    cr_assert_eq(round_trip("-S -z -j 4", "-a " RT_BIN " -j 4", 0), 0, "Tree with sparse files restored from an archive differs");
+    cr_assert_eq(stat(RT_DST "/a/b/c/hole", &st), 0, "Empty sparse file not restored");
+    cr_assert_eq(st.st_blocks, 0, "Hole not restored: %ld blocks", (long)st.st_blocks);
+    cr_assert_eq(round_trip("-S -u -j 4", "", 0), 0, "Tree with sparse files read through io_uring differs");
+    ret = system("bin/transplant -d -T < " RT_BIN " | grep -q '^100644\t8388608\tsparse\ta/holes$'");
+    cr_assert_eq(ret, 0, "Sparse file read through io_uring not sent as SPARSE_DATA");
+}
+
+#ifdef URING
+Test(basecode_tests_suite, statx_decode_test) {
+    // The blocks decide whether a file may be sparse, the times whether it
+    // has changed since a manifest was written
+    struct statx stx = {0};
+    stx.stx_mode = S_IFREG | 0640;
+    stx.stx_size = 8 << 20;
+    stx.stx_blocks = 24;
+    stx.stx_nlink = 2;
+    stx.stx_mtime.tv_sec = 1700000000;
+    stx.stx_mtime.tv_nsec = 123456789;
+    stx.stx_ctime.tv_sec = 1700000001;
+    struct stat st = {0};
+    st.st_blocks = 1 << 20;  // Left over from an earlier entry
+    uring_statx_decode(&stx, &st);
+    cr_assert_eq(st.st_mode, S_IFREG | 0640, "Wrong mode: %o", st.st_mode);
+    cr_assert_eq(st.st_size, 8 << 20, "Wrong size: %ld", (long)st.st_size);
+    cr_assert_eq(st.st_blocks, 24, "Wrong blocks: %ld", (long)st.st_blocks);
+    cr_assert_eq(st.st_nlink, 2, "Wrong link count: %ld", (long)st.st_nlink);
+    cr_assert_eq(st.st_mtim.tv_sec, 1700000000, "Wrong mtime: %ld", (long)st.st_mtim.tv_sec);
+    cr_assert_eq(st.st_mtim.tv_nsec, 123456789, "Wrong mtime: %ld ns", (long)st.st_mtim.tv_nsec);
+    cr_assert_eq(st.st_ctim.tv_sec, 1700000001, "Wrong ctime: %ld", (long)st.st_ctim.tv_sec);
+}
+#endif
+
+Test(basecode_tests_suite, list_output_test) {
+    make_tree();
+    int ret = system("printf x > '" RT_SRC "/a/tab\there' && cd " RT_SRC " && find . -mindepth 1 | cut -c3- | "
+                     "sed 's/\t/\\\\t/' | sort > /tmp/transplant_rt.find && "
+                     "grep -v '^a/tab' /tmp/transplant_rt.find > /tmp/transplant_rt.find1");
+    cr_assert_eq(ret, 0, "Could not list the tree");
+    ret = system("bin/transplant -s -z -p " RT_SRC " > " RT_BIN " && rm -rf " RT_DST " && "
+                 "bin/transplant -d -t -p " RT_DST " < " RT_BIN " > /tmp/transplant_rt.list && ! test -e " RT_DST " && "
+                 "awk '{print $3}' /tmp/transplant_rt.list | grep -v '^a/tab' | sort | diff - /tmp/transplant_rt.find1 && "
+                 "grep -Eq '^drwxr-x--- +[0-9]+ a/b$' /tmp/transplant_rt.list && "
+                 "grep -Eq '^-rw-r--r-- +100000 a/b/mid$' /tmp/transplant_rt.list");
+    cr_assert_eq(ret, 0, "Wrong -t listing");
+    ret = system("bin/transplant -d -T -a " RT_BIN " > /tmp/transplant_rt.list && "
+                 "cut -f4 /tmp/transplant_rt.list | sort | diff - /tmp/transplant_rt.find && "
+                 "grep -q '^40750\t[0-9]*\tdir\ta/b$' /tmp/transplant_rt.list && "
+                 "grep -q '^100644\t3000000\tcompressed\tbig$' /tmp/transplant_rt.list && "
+                 "grep -q '^100644\t1\tcompressed\ta/tab\\\\there$' /tmp/transplant_rt.list && "
+                 "grep '^a/b' /tmp/transplant_rt.find > /tmp/transplant_rt.find1 && "
+                 "bin/transplant -d -T -a " RT_BIN " -f a/b | cut -f4 | sort | diff - /tmp/transplant_rt.find1");
+    cr_assert_eq(ret, 0, "Wrong -T listing");
+}
+
+Test(basecode_tests_suite, chunk_round_trip_test) {
+    make_tree();
+    cr_assert_eq(round_trip("-K -b 64K", "", 1), 0, "Chunked tree differs");
+    cr_assert_eq(round_trip("-K -b 64K", "-j 4 -b 64K", 1), 0, "Chunked tree written by the workers differs");
+    cr_assert_eq(round_trip("-K -b 4K -j 4", "-j 4 -a " RT_BIN, 0), 0, "Chunked tree restored from an archive differs");
+    int ret = system("bin/transplant -d -T -a " RT_BIN " | grep -q '^100644\t3000000\tchunked\tbig$'");
+    cr_assert_eq(ret, 0, "Files not sent in chunks");
+}
+
+Test(basecode_tests_suite, stats_report_test) {
+    make_tree();
+    int ret = system("bin/transplant -s -p " RT_SRC " --stats -j 2 > " RT_BIN " 2> /tmp/transplant_rt.stats && "
+                     "grep -q '\"operation\": \"serialize\"' /tmp/transplant_rt.stats && "
+                     "grep -q '\"entries\": {\"files\": 7, \"directories\": 6, \"removed\": 0}' /tmp/transplant_rt.stats && "
+                     "grep -q \"\\\"stream\\\": $(stat -c %s " RT_BIN ")}\" /tmp/transplant_rt.stats && "
+                     "grep -q '{\"path\": \"a/b/mid\", \"size\": 100000,' /tmp/transplant_rt.stats");
+    cr_assert_eq(ret, 0, "Wrong statistics of serialization");
+    ret = system("rm -rf " RT_DST " && bin/transplant -d -p " RT_DST " --stats -j 2 < " RT_BIN " 2> /tmp/transplant_rt.stats && "
+                 "grep -q '\"operation\": \"deserialize\"' /tmp/transplant_rt.stats && "
+                 "grep -q '\"entries\": {\"files\": 7, \"directories\": 6, \"removed\": 0}' /tmp/transplant_rt.stats && "
+                 "grep -q '\"bytes\": {\"files\": 3100027,' /tmp/transplant_rt.stats && "
+                 "grep -q '{\"path\": \"a/b/mid\", \"size\": 100000,' /tmp/transplant_rt.stats");
+    cr_assert_eq(ret, 0, "Wrong statistics of deserialization");
+}
+
+Test(basecode_tests_suite, server_round_trip_test) {
+    make_tree();
+    int ret = system("rm -f /tmp/transplant_rt.sock; bin/transplant -L /tmp/transplant_rt.sock -j 4 & server=$!; "
+                     "for i in $(seq 50); do test -S /tmp/transplant_rt.sock && break; sleep 0.1; done; "
+                     "rm -rf " RT_DST " && bin/transplant -s -p " RT_SRC " -R /tmp/transplant_rt.sock | "
+                     "bin/transplant -d -p " RT_DST " -j 2 -R /tmp/transplant_rt.sock && "
+                     "bin/transplant -s -p " RT_SRC " --stats -R /tmp/transplant_rt.sock 2>&1 >/dev/null | "
+                     "grep -q '{\"path\": \"a/b/mid\",' && diff -r " RT_SRC " " RT_DST "; "
+                     "status=$?; kill $server; wait $server; exit $status");
+    cr_assert_eq(ret, 0, "Tree transplanted through the server differs");
+}
+
+Test(basecode_tests_suite, server_idle_connection_test) {
+    make_tree();
+    int ret = system("rm -f /tmp/transplant_idle.sock; bin/transplant -L /tmp/transplant_idle.sock -j 4 & "
+                     "echo $! > /tmp/transplant_idle.pid; "
+                     "for i in $(seq 50); do test -S /tmp/transplant_idle.sock && break; sleep 0.1; done; "
+                     "test -S /tmp/transplant_idle.sock");
+    cr_assert_eq(ret, 0, "The server did not start");
+    // A client that never sends its request must not hold up the others, and
+    // sessions that each ask for all the workers must not wait on each other
+    struct sockaddr_un addr = {AF_UNIX, "/tmp/transplant_idle.sock"};
+    int idle = socket(AF_UNIX, SOCK_STREAM, 0);
+    cr_assert_eq(connect(idle, (struct sockaddr *)&addr, sizeof(addr)), 0, "Could not connect");
+    ret = system("rm -rf " RT_DST " && timeout 5 bin/transplant -s -p " RT_SRC " -j 4 -R /tmp/transplant_idle.sock | "
+                 "timeout 5 bin/transplant -d -p " RT_DST " -j 4 -R /tmp/transplant_idle.sock && "
+                 "diff -r " RT_SRC " " RT_DST);
+    close(idle);
+    system("kill $(cat /tmp/transplant_idle.pid); "
+           "for i in $(seq 50); do test -S /tmp/transplant_idle.sock || break; sleep 0.1; done");
+    cr_assert_eq(ret, 0, "A session was held up by an idle connection");
+}
+
+Test(basecode_tests_suite, shard_round_trip_test) {
+    make_tree();
+    int ret = system("rm -rf " RT_DST " && bin/transplant -s -p " RT_SRC " -o " RT_BIN "0 -o " RT_BIN "1 -o " RT_BIN "2 && "
+                     "bin/transplant -d -p " RT_DST " -a " RT_BIN "0 -a " RT_BIN "1 -a " RT_BIN "2 && "
+                     "diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Tree restored from three shards differs");
+    // Every file is in exactly one shard, and every directory in each
+    ret = system("for i in 0 1 2; do bin/transplant -d -T -a " RT_BIN "$i; done | "
+                 "grep -v '\tdir\t' | cut -f4 | sort > /tmp/transplant_rt.list && "
+                 "(cd " RT_SRC " && find . ! -type d) | cut -c3- | sort | diff - /tmp/transplant_rt.list && "
+                 "bin/transplant -d -T -a " RT_BIN "1 | grep '\tdir\t' | cut -f4 | sort > /tmp/transplant_rt.list && "
+                 "(cd " RT_SRC " && find . -mindepth 1 -type d) | cut -c3- | sort | diff - /tmp/transplant_rt.list");
+    cr_assert_eq(ret, 0, "Entries not split across the shards");
+    ret = system("rm -rf " RT_DST " /tmp/transplant_rt.fifo0 /tmp/transplant_rt.fifo1 && "
+                 "mkfifo /tmp/transplant_rt.fifo0 /tmp/transplant_rt.fifo1 && "
+                 "{ bin/transplant -s -p " RT_SRC " -j 2 -o /tmp/transplant_rt.fifo0 -o /tmp/transplant_rt.fifo1 & } && "
+                 "bin/transplant -d -p " RT_DST " -j 2 -a /tmp/transplant_rt.fifo0 -a /tmp/transplant_rt.fifo1 && "
+                 "wait $! && diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Tree restored from shards read through pipes differs");
+}
+
+Test(basecode_tests_suite, journal_resume_test) {
+    make_tree();
+    // Interrupted before the first checkpoint: resumed without -c
+    int ret = system("bin/transplant -s -p " RT_SRC " > " RT_BIN " && rm -rf " RT_DST " /tmp/transplant_rt.journal && "
+                     "! head -c 1500000 " RT_BIN " | bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal 2>/dev/null && "
+                     "test -e /tmp/transplant_rt.journal && "
+                     "bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal < " RT_BIN " && "
+                     "! test -e /tmp/transplant_rt.journal && diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Restore interrupted before its first checkpoint not resumed");
+    ret = system("rm -rf " RT_DST " && "
+                 "! head -c 1500000 " RT_BIN " | bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal -j 4 2>/dev/null && "
+                 "bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal -j 4 -a " RT_BIN " && "
+                 "! test -e /tmp/transplant_rt.journal && diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Restore from an archive interrupted before its first checkpoint not resumed");
+    // Past a checkpoint, entries removed since are restored again from a pipe
+    ret = system("mkdir " RT_SRC "/wide && cd " RT_SRC "/wide && seq 20000 | xargs touch && cd - >/dev/null && "
+                 "bin/transplant -s -p " RT_SRC " > " RT_BIN " && rm -rf " RT_DST " && "
+                 "! head -c $(($(stat -c %s " RT_BIN ") - 100)) " RT_BIN " | "
+                 "bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal 2>/dev/null && "
+                 "test -s /tmp/transplant_rt.journal && rm -r " RT_DST "/a " RT_DST "/wide/1 && "
+                 "bin/transplant -d -p " RT_DST " -J /tmp/transplant_rt.journal < " RT_BIN " && "
+                 "! test -e /tmp/transplant_rt.journal && diff -r " RT_SRC " " RT_DST);
+    cr_assert_eq(ret, 0, "Entries removed after a checkpoint not restored");
+}
+
+Test(basecode_tests_suite, order_round_trip_test) {
+    make_tree();
+    int ret = system("mkdir " RT_SRC "/many && cd " RT_SRC "/many && seq 20000 | xargs touch && "
+                     "for i in 1 2 3 4 5; do head -c $((i * 5000)) /dev/urandom > file$i; done");
+    cr_assert_eq(ret, 0, "Could not add the files");
+    cr_assert_eq(round_trip("-O", "", 1), 0, "Tree serialized in on-disk order differs");
+    cr_assert_eq(round_trip("-O -j 4 -z", "-a " RT_BIN, 0), 0, "Tree serialized in on-disk order by the workers differs");
+    // The same entries as in directory order, with the files of each directory first
+    ret = system("bin/transplant -s -p " RT_SRC " -O | bin/transplant -d -T > /tmp/transplant_rt.list && "
+                 "bin/transplant -s -p " RT_SRC " | bin/transplant -d -T | sort > /tmp/transplant_rt.find && "
+                 "sort /tmp/transplant_rt.list | cmp -s - /tmp/transplant_rt.find && "
+                 "grep -n '\ta/[^/]*$' /tmp/transplant_rt.list | cut -f3 | uniq | tr '\\n' ' ' | grep -qx 'data dir '");
+    cr_assert_eq(ret, 0, "On-disk order changed the entries");
+}